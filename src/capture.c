@@ -0,0 +1,131 @@
+#include "capture.h"
+
+#include <string.h>
+#include <time.h>
+
+#include <uv.h>
+
+// the loop writes through stdio, a large buffer keeps it to a write per this much traffic
+#define CAPTURE_BUFFER_SIZE (1024 * 1024)
+
+static size_t _varint(uint8_t *out, uint64_t value)
+{
+  size_t length = 0;
+  while (value >= 0x80)
+  {
+    out[length++] = (uint8_t)(value | 0x80);
+    value >>= 7;
+  }
+  out[length++] = (uint8_t)value;
+
+  return length;
+}
+
+size_t capture_varint_read(uint8_t const *data, uint8_t const *end, uint64_t *value)
+{
+  uint64_t result = 0;
+  for (size_t i = 0; i < 10 && data + i < end; i++)
+  {
+    result |= (uint64_t)(data[i] & 0x7f) << (7 * i);
+    if ((data[i] & 0x80) == 0)
+    {
+      *value = result;
+      return i + 1;
+    }
+  }
+
+  return 0;
+}
+
+void capture_init(capture_t *capture)
+{
+  memset(capture, 0, sizeof(capture_t));
+}
+
+void capture_close(capture_t *capture)
+{
+  if (capture->output != NULL)
+    fclose(capture->output);
+  capture->output = NULL;
+}
+
+bool capture_configure(capture_t *capture, FILE *output, uint64_t max_bytes)
+{
+  if (output == NULL)
+    return false;
+  setvbuf(output, NULL, _IOFBF, CAPTURE_BUFFER_SIZE);
+
+  // the wall clock lines up the files of several loops, the records themselves use the monotonic one
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  uint32_t version = CAPTURE_VERSION;
+  uint64_t started = (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+  if (fwrite(CAPTURE_MAGIC, 1, 4, output) != 4 || fwrite(&version, sizeof(uint32_t), 1, output) != 1 ||
+      fwrite(&started, sizeof(uint64_t), 1, output) != 1)
+  {
+    fclose(output);
+    return false;
+  }
+
+  capture->output = output;
+  capture->max_bytes = max_bytes;
+  capture->written = CAPTURE_HEADER_SIZE;
+  capture->last_at = uv_hrtime();
+  capture->next_connection = 0;
+
+  return true;
+}
+
+// past the limit the file ends there, connections recorded so far simply stop mid-stream
+static void _record(capture_t *capture, capture_record_t type, uint64_t connection, char const *data, size_t length)
+{
+  if (connection == 0 || capture->output == NULL)
+    return;
+
+  uint8_t head[CAPTURE_RECORD_MAX_HEAD];
+  uint64_t now = uv_hrtime();
+  size_t head_length = 0;
+  head[head_length++] = (uint8_t)type;
+  head_length += _varint(head + head_length, connection);
+  head_length += _varint(head + head_length, now - capture->last_at);
+  if (type == CAPTURE_DATA)
+    head_length += _varint(head + head_length, length);
+
+  if (capture->max_bytes != 0 && capture->written + head_length + length > capture->max_bytes)
+  {
+    capture_close(capture);
+    return;
+  }
+
+  fwrite(head, 1, head_length, capture->output);
+  if (length > 0)
+    fwrite(data, 1, length, capture->output);
+  capture->written += head_length + length;
+  capture->last_at = now;
+}
+
+uint64_t capture_accept(capture_t *capture)
+{
+  if (capture->output == NULL)
+    return 0;
+
+  uint64_t connection = ++capture->next_connection;
+  _record(capture, CAPTURE_ACCEPT, connection, NULL, 0);
+
+  return connection;
+}
+
+void capture_data(capture_t *capture, uint64_t connection, char const *data, size_t length)
+{
+  _record(capture, CAPTURE_DATA, connection, data, length);
+}
+
+void capture_eof(capture_t *capture, uint64_t connection)
+{
+  _record(capture, CAPTURE_EOF, connection, NULL, 0);
+}
+
+void capture_closed(capture_t *capture, uint64_t connection)
+{
+  _record(capture, CAPTURE_CLOSE, connection, NULL, 0);
+}
@@ -0,0 +1,51 @@
+#if !defined(_CAPTURE_H_)
+#define _CAPTURE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// a header of magic, version and the wall clock at the start in ns, then records of a type byte and
+// varints: the connection, ns since the previous record and, for data, the length before the bytes
+#define CAPTURE_MAGIC "HCAP"
+#define CAPTURE_VERSION 1
+#define CAPTURE_HEADER_SIZE 16
+// type, connection, time and length varints
+#define CAPTURE_RECORD_MAX_HEAD (1 + 3 * 10)
+
+typedef enum capture_record
+{
+  CAPTURE_ACCEPT = 1,
+  CAPTURE_DATA,
+  // the client finished sending, the connection may still be answered
+  CAPTURE_EOF,
+  CAPTURE_CLOSE
+} capture_record_t;
+
+typedef struct capture
+{
+  FILE *output;
+  // recording stops once this much has been written, 0 for no limit
+  uint64_t max_bytes;
+  uint64_t written, last_at, next_connection;
+} capture_t;
+
+void capture_init(capture_t *capture);
+void capture_close(capture_t *capture);
+// starts recording into output, which the capture owns from here on: capture_close closes it, and so
+// does a failure
+bool capture_configure(capture_t *capture, FILE *output, uint64_t max_bytes);
+
+#define capture_enabled(capture) ((capture)->output != NULL)
+
+// a connection's id for the records that follow, 0 when nothing is recorded
+uint64_t capture_accept(capture_t *capture);
+void capture_data(capture_t *capture, uint64_t connection, char const *data, size_t length);
+void capture_eof(capture_t *capture, uint64_t connection);
+void capture_closed(capture_t *capture, uint64_t connection);
+
+// for readers: a varint from data, the number of bytes it took, 0 when it runs past end
+size_t capture_varint_read(uint8_t const *data, uint8_t const *end, uint64_t *value);
+
+#endif // _CAPTURE_H_
@@ -0,0 +1,89 @@
+#include "dlist.h"
+
+void dl_init(dlist_t *list)
+{
+  list->head.prev = &list->head;
+  list->head.next = &list->head;
+  list->length = 0;
+}
+
+static void _dl_insert(dlist_node_t *node, dlist_node_t *prev, dlist_node_t *next)
+{
+  node->prev = prev;
+  node->next = next;
+  prev->next = node;
+  next->prev = node;
+}
+
+void dl_push_front(dlist_t *list, dlist_node_t *node)
+{
+  _dl_insert(node, &list->head, list->head.next);
+  list->length++;
+}
+
+void dl_push_back(dlist_t *list, dlist_node_t *node)
+{
+  _dl_insert(node, list->head.prev, &list->head);
+  list->length++;
+}
+
+void dl_remove(dlist_t *list, dlist_node_t *node)
+{
+  if (!dl_linked(node))
+    return;
+
+  node->prev->next = node->next;
+  node->next->prev = node->prev;
+  node->prev = NULL;
+  node->next = NULL;
+  list->length--;
+}
+
+void dl_move_back(dlist_t *list, dlist_node_t *node)
+{
+  if (!dl_linked(node) || node->next == &list->head)
+    return;
+
+  node->prev->next = node->next;
+  node->next->prev = node->prev;
+  _dl_insert(node, list->head.prev, &list->head);
+}
+
+dlist_node_t *dl_front(dlist_t *list)
+{
+  return list->length != 0 ? list->head.next : NULL;
+}
+
+dlist_node_t *dl_back(dlist_t *list)
+{
+  return list->length != 0 ? list->head.prev : NULL;
+}
+
+bool dl_linked(dlist_node_t const *node)
+{
+  return node->next != NULL;
+}
+
+dlist_it dl_iterator(dlist_t *list)
+{
+  dlist_it it;
+  it.head = &list->head;
+  it.current_node = NULL;
+  it.next_node = list->head.next;
+  return it;
+}
+
+bool dli_next(dlist_it *it)
+{
+  if (it->next_node == it->head)
+    return false;
+
+  it->current_node = it->next_node;
+  it->next_node = it->current_node->next;
+  return true;
+}
+
+dlist_node_t *dli_get(dlist_it it)
+{
+  return it.current_node;
+}
@@ -0,0 +1,44 @@
+#if !defined(_DLIST_H_)
+#define _DLIST_H_
+
+#include <stddef.h>
+#include <stdbool.h>
+
+// embedded in the object it links, so pushing never allocates and unlinking needs no search
+typedef struct dlist_node
+{
+  struct dlist_node *prev, *next;
+} dlist_node_t;
+
+// circular around head, an unlinked node has NULL links
+typedef struct dlist
+{
+  dlist_node_t head;
+  size_t length;
+} dlist_t;
+
+#define DLIST_ENTRY(node, type, member) ((type *)((char *)(node) - offsetof(type, member)))
+
+void dl_init(dlist_t *list);
+
+void dl_push_front(dlist_t *list, dlist_node_t *node);
+void dl_push_back(dlist_t *list, dlist_node_t *node);
+void dl_remove(dlist_t *list, dlist_node_t *node);
+// to the back of the list it's in, like a touch in an LRU order; unlinked nodes stay out
+void dl_move_back(dlist_t *list, dlist_node_t *node);
+
+dlist_node_t *dl_front(dlist_t *list);
+dlist_node_t *dl_back(dlist_t *list);
+bool dl_linked(dlist_node_t const *node);
+
+// the current node may be removed while iterating
+typedef struct dlist_it_s
+{
+  dlist_node_t *head, *current_node, *next_node;
+} dlist_it;
+
+dlist_it dl_iterator(dlist_t *list);
+bool dli_next(dlist_it *it);
+dlist_node_t *dli_get(dlist_it it);
+
+#endif // _DLIST_H_
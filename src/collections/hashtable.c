@@ -168,6 +168,84 @@ ht_entry_t *ht_get(hashtable_t *table, string_t *key)
   return &table->entries[index];
 }
 
+static bool _ht_in_range(size_t from, size_t index, size_t to)
+{
+  if (from <= to)
+    return from < index && index <= to;
+
+  return from < index || index <= to;
+}
+
+void *ht_remove(hashtable_t *table, string_t *key)
+{
+  size_t index = _ht_find(table, key);
+  if (index == NOT_FOUND_INDEX)
+  {
+    return NULL;
+  }
+
+  ht_entry_t *entry = &table->entries[index];
+  void *data = entry->data;
+  string_delete(entry->key);
+  entry->key = NULL;
+  entry->data = NULL;
+  table->length--;
+
+  // backward shift deletion: pull displaced entries into the hole so probing never needs tombstones
+  size_t hole = index;
+  size_t next = index;
+  for (;;)
+  {
+    if (++next >= table->capacity)
+    {
+      next = 0;
+    }
+
+    ht_entry_t *current_entry = &table->entries[next];
+    if (current_entry->key == NULL)
+    {
+      break;
+    }
+
+    size_t home = GET_INDEX(string_hash(current_entry->key), table->capacity);
+    if (_ht_in_range(hole, home, next))
+    {
+      continue;
+    }
+
+    table->entries[hole] = *current_entry;
+    current_entry->key = NULL;
+    current_entry->data = NULL;
+    hole = next;
+  }
+
+  return data;
+}
+
+void ht_clear(hashtable_t *table, ht_cleanup_f clean)
+{
+  if (table->length == 0)
+  {
+    return;
+  }
+
+  for (size_t i = 0; i < table->capacity; i++)
+  {
+    ht_entry_t *entry = &table->entries[i];
+    if (entry->key != NULL)
+    {
+      string_delete(entry->key);
+      if (clean != NULL)
+      {
+        clean(entry->data);
+      }
+      entry->key = NULL;
+      entry->data = NULL;
+    }
+  }
+  table->length = 0;
+}
+
 hashtable_it_t ht_iterator(hashtable_t *table)
 {
   hashtable_it_t it;
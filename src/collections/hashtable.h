@@ -29,6 +29,8 @@ void ht_delete(hashtable_t *table, ht_cleanup_f clean);
 bool ht_set(hashtable_t *table, string_t *key, void *data);
 bool ht_has(hashtable_t *table, string_t *key);
 ht_entry_t *ht_get(hashtable_t *table, string_t *key);
+void *ht_remove(hashtable_t *table, string_t *key);
+void ht_clear(hashtable_t *table, ht_cleanup_f clean);
 
 typedef struct hashtable_it
 {
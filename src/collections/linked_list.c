@@ -115,6 +115,7 @@ void *ll_remove(linked_list_t *list, size_t index)
     node = node->next;
   }
   old_node->next = node->next;
+  list->length--;
 
   void *data = node->data;
 
@@ -154,17 +155,23 @@ void *ll_remove_back(linked_list_t *list)
   REMOVE_GUARD(list)
 
   void *data = list->tail->data;
-  mi_free(list->tail);
   if (list->length == 1)
   {
+    mi_free(list->tail);
     list->head = NULL;
     list->tail = NULL;
+    list->length--;
+    return data;
   }
 
+  // singly linked, so the new tail has to be found from the front
   linked_list_node_t *node = list->head;
   while (node->next != list->tail)
     node = node->next;
+  mi_free(list->tail);
+  node->next = NULL;
   list->tail = node;
+  list->length--;
 
   return data;
 }
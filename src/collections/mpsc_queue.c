@@ -0,0 +1,91 @@
+#include "mpsc_queue.h"
+
+#include <stdint.h>
+
+#include <mimalloc.h>
+
+// bounded queue after Vyukov, with the dequeue side left unsynchronized for the single consumer
+
+mpsc_queue_t *mpsc_new(size_t capacity)
+{
+  size_t size = 2;
+  while (size < capacity)
+  {
+    size <<= 1;
+    if (size == 0)
+      return NULL;
+  }
+
+  mpsc_queue_t *queue = mi_malloc_aligned(sizeof(mpsc_queue_t) + size * sizeof(mpsc_cell_t), MPSC_CACHE_LINE);
+  if (queue == NULL)
+    return NULL;
+
+  queue->_mask = size - 1;
+  queue->_tail = 0;
+  queue->_head = 0;
+  for (size_t i = 0; i < size; i++)
+  {
+    queue->_cells[i].sequence = i;
+    queue->_cells[i].data = NULL;
+  }
+
+  return queue;
+}
+
+void mpsc_delete(mpsc_queue_t *queue)
+{
+  mi_free(queue);
+}
+
+bool mpsc_push(mpsc_queue_t *queue, void *data)
+{
+  mpsc_cell_t *cell;
+  size_t position = __atomic_load_n(&queue->_tail, __ATOMIC_RELAXED);
+  for (;;)
+  {
+    cell = &queue->_cells[position & queue->_mask];
+    size_t sequence = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+    intptr_t difference = (intptr_t)sequence - (intptr_t)position;
+    if (difference == 0)
+    {
+      // on failure position is reloaded with the current tail
+      if (__atomic_compare_exchange_n(&queue->_tail, &position, position + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break;
+    }
+    else if (difference < 0)
+    {
+      // the consumer hasn't freed this slot from the previous lap
+      return false;
+    }
+    else
+    {
+      position = __atomic_load_n(&queue->_tail, __ATOMIC_RELAXED);
+    }
+  }
+
+  cell->data = data;
+  __atomic_store_n(&cell->sequence, position + 1, __ATOMIC_RELEASE);
+
+  return true;
+}
+
+void *mpsc_pop(mpsc_queue_t *queue)
+{
+  size_t position = queue->_head;
+  mpsc_cell_t *cell = &queue->_cells[position & queue->_mask];
+  size_t sequence = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+  if ((intptr_t)sequence - (intptr_t)(position + 1) < 0)
+    return NULL;
+
+  void *data = cell->data;
+  // free for the push one lap ahead
+  __atomic_store_n(&cell->sequence, position + queue->_mask + 1, __ATOMIC_RELEASE);
+  queue->_head = position + 1;
+
+  return data;
+}
+
+size_t mpsc_capacity(mpsc_queue_t const *queue)
+{
+  return queue->_mask + 1;
+}
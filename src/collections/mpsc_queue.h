@@ -0,0 +1,38 @@
+#if !defined(_MPSC_QUEUE_H_)
+#define _MPSC_QUEUE_H_
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#define MPSC_CACHE_LINE 64
+
+// a slot's sequence tells whose turn it is: equal to a push position it's free for that producer,
+// one past it the data is ready for the consumer
+typedef struct mpsc_cell
+{
+  size_t sequence;
+  void *data;
+} mpsc_cell_t;
+
+// bounded and lock-free, any thread may push but only one pops; producers and the consumer
+// work on their own cache lines
+typedef struct mpsc_queue
+{
+  size_t _mask;
+  _Alignas(MPSC_CACHE_LINE) size_t _tail;
+  _Alignas(MPSC_CACHE_LINE) size_t _head;
+  _Alignas(MPSC_CACHE_LINE) mpsc_cell_t _cells[];
+} mpsc_queue_t;
+
+// capacity is rounded up to a power of two
+mpsc_queue_t *mpsc_new(size_t capacity);
+void mpsc_delete(mpsc_queue_t *queue);
+
+// from any thread, false when the queue is full; data must not be NULL
+bool mpsc_push(mpsc_queue_t *queue, void *data);
+// from the consumer, NULL when empty or the next push hasn't finished writing
+void *mpsc_pop(mpsc_queue_t *queue);
+
+size_t mpsc_capacity(mpsc_queue_t const *queue);
+
+#endif // _MPSC_QUEUE_H_
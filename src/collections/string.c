@@ -13,6 +13,24 @@ string_t string_from(char *data)
   str.data = data;
   str.length = strlen(data);
   str.hashcode = 0;
+  str.capacity = 0;
+  return str;
+}
+
+// one allocation holding the header and at least capacity bytes plus the terminator
+static string_t *_string_alloc(size_t capacity)
+{
+  size_t size = offsetof(string_t, _inline) + (capacity < STRING_INLINE_SIZE ? STRING_INLINE_SIZE : capacity + 1);
+  string_t *str = size <= MI_SMALL_SIZE_MAX ? mi_malloc_small(size) : mi_malloc(size);
+  if (str == NULL)
+    return NULL;
+
+  str->length = 0;
+  str->hashcode = 0;
+  str->data = str->_inline;
+  // whatever the size class rounds up to is usable too
+  str->capacity = mi_usable_size(str) - offsetof(string_t, _inline) - 1;
+
   return str;
 }
 
@@ -21,20 +39,13 @@ string_t *string_new(char const *data, size_t size)
   if (size == 0)
     return NULL;
 
-  string_t *str = mi_malloc_small(sizeof(string_t));
+  string_t *str = _string_alloc(size);
   if (str == NULL)
     return NULL;
 
-  char *string = mi_strndup(data, size);
-  if (string == NULL)
-  {
-    mi_free(str);
-    return NULL;
-  }
-
+  memcpy(str->data, data, size);
+  str->data[size] = 0;
   str->length = size;
-  str->hashcode = 0;
-  str->data = string;
 
   return str;
 }
@@ -49,24 +60,15 @@ string_t *string_new_format(char const *format, ...)
   if (length <= 0)
     return NULL;
 
-  string_t *string = mi_malloc_small(sizeof(string_t));
+  string_t *string = _string_alloc(length);
   if (string == NULL)
     return NULL;
 
-  char *data = mi_calloc(length + 1, sizeof(char));
-  if (data == NULL)
-  {
-    mi_free(string);
-    return NULL;
-  }
-
   va_start(args, format);
-  vsnprintf(data, length, format, args);
+  vsnprintf(string->data, length + 1, format, args);
   va_end(args);
 
-  string->data = data;
   string->length = length;
-  string->hashcode = 0;
 
   return string;
 }
@@ -76,7 +78,8 @@ void string_delete(string_t *str)
   if (str == NULL)
     return;
 
-  mi_free(str->data);
+  if (str->data != str->_inline)
+    mi_free(str->data);
   mi_free(str);
 }
 
@@ -85,19 +88,14 @@ string_t *string_copy(string_t const *src)
   if (src->length == 0)
     return NULL;
 
-  string_t *dest = mi_malloc_small(sizeof(string_t));
+  string_t *dest = _string_alloc(src->length);
   if (dest == NULL)
     return NULL;
 
-  char *copied_data = mi_strndup(src->data, src->length);
-  if (copied_data == NULL)
-  {
-    mi_free(dest);
-    return NULL;
-  }
-
-  *dest = *src;
-  dest->data = copied_data;
+  memcpy(dest->data, src->data, src->length);
+  dest->data[src->length] = 0;
+  dest->length = src->length;
+  dest->hashcode = src->hashcode;
 
   return dest;
 }
@@ -107,29 +105,31 @@ bool string_cstr_concatn(string_t *str, char const *src, size_t size)
   if (size == 0)
     return true;
 
-  size_t const new_size = str->length + size + 1;
-  if (str->data == src)
+  size_t const length = str->length + size;
+  if (length > str->capacity)
   {
-    char *new_data = mi_malloc(new_size);
-    if (new_data == NULL)
+    // the header can't move, so growing takes the data out of line; doubling keeps appends amortised O(1)
+    size_t capacity = str->capacity * 2 > length ? str->capacity * 2 : length;
+    size_t good_size = mi_good_size(capacity + 1);
+    char *data = mi_malloc(good_size);
+    if (data == NULL)
       return false;
 
-    memcpy(new_data, str->data, str->length);
-    memcpy(new_data + str->length, src, size);
-    str->data = new_data;
+    // src may point into the old data
+    memcpy(data, str->data, str->length);
+    memcpy(data + str->length, src, size);
+    if (str->data != str->_inline)
+      mi_free(str->data);
+    str->data = data;
+    str->capacity = good_size - 1;
   }
   else
   {
-    char *new_space = mi_realloc(str->data, new_size);
-    if (new_space == NULL)
-      return false;
-
-    str->data = new_space;
-    memcpy(str->data + str->length, src, size);
+    memmove(str->data + str->length, src, size);
   }
 
-  str->length += size;
-  str->data[str->length] = 0;
+  str->length = length;
+  str->data[length] = 0;
   str->hashcode = 0;
 
   return true;
@@ -137,23 +137,12 @@ bool string_cstr_concatn(string_t *str, char const *src, size_t size)
 
 bool string_concat(string_t *str, string_t const *src)
 {
-  char *src_data = src->data;
-
-  bool result = string_cstr_concatn(str, src_data, src->length);
-  if (result && str == src)
-    mi_free(src_data);
-
-  return result;
+  return string_cstr_concatn(str, src->data, src->length);
 }
 
 bool string_cstr_concat(string_t *str, char const *src)
 {
-  char *old_str_data = str->data;
-  bool result = string_cstr_concatn(str, src, strlen(src));
-  if (result && old_str_data == src)
-    mi_free(old_str_data);
-
-  return result;
+  return string_cstr_concatn(str, src, strlen(src));
 }
 
 uint64_t string_hash(string_t *str)
@@ -172,5 +161,5 @@ bool string_equal(string_t *a, string_t *b)
   if (a->length != b->length || string_hash(a) != string_hash(b))
     return false;
 
-  return strncmp(a->data, b->data, a->length) == 0;
+  return memcmp(a->data, b->data, a->length) == 0;
 }
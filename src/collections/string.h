@@ -6,15 +6,24 @@
 #include <stdint.h>
 #include <string.h>
 
+// bytes allocated behind a short string's header, its terminator included
+#define STRING_INLINE_SIZE 24
+
 typedef struct string
 {
   size_t length;
   uint64_t hashcode;
+  // the inline bytes, or a separate block once appends outgrew them
   char *data;
+  // bytes data can hold before its terminator, 0 for views
+  size_t capacity;
+  // STRING_INLINE_SIZE for short strings, the whole string when created longer
+  char _inline[];
 } string_t;
 
 #define STRING(ptr) ((string_t *)ptr)
 
+// a view of data for lookups, owns nothing and must not be deleted or appended to
 string_t string_from(char *data);
 string_t *string_new(char const *data, size_t size);
 #define string_new_(data) string_new(data, strlen(data))
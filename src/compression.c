@@ -0,0 +1,474 @@
+#include "compression.h"
+
+#include <ctype.h>
+#include <limits.h>
+#include <string.h>
+
+#include <mimalloc.h>
+
+static bool _token_equal(char const *token, size_t length, char const *name)
+{
+  size_t name_length = strlen(name);
+  if (length != name_length)
+    return false;
+
+  for (size_t i = 0; i < length; i++)
+  {
+    if (tolower((unsigned char)token[i]) != name[i])
+      return false;
+  }
+
+  return true;
+}
+
+static bool _is_zero_quality(char const *params, char const *end)
+{
+  // looks for "q=0", "q=0.0", ... among the parameters after the coding token
+  while (params < end)
+  {
+    char const *q = params;
+    while (q < end && (*q == ';' || *q == ' ' || *q == '\t'))
+      q++;
+
+    if (end - q >= 2 && (q[0] == 'q' || q[0] == 'Q') && q[1] == '=')
+    {
+      q += 2;
+      if (q >= end || *q != '0')
+        return false;
+
+      for (q++; q < end && *q != ';'; q++)
+      {
+        if (*q != '0' && *q != '.' && *q != ' ' && *q != '\t')
+          return false;
+      }
+
+      return true;
+    }
+
+    char const *next = memchr(q, ';', end - q);
+    if (next == NULL)
+      break;
+    params = next + 1;
+  }
+
+  return false;
+}
+
+unsigned compression_accepted(string_t const *accept_encoding)
+{
+  if (accept_encoding == NULL)
+    return 0;
+
+  unsigned accepted = 0, rejected = 0;
+  bool wildcard = false;
+
+  char const *cursor = accept_encoding->data;
+  char const *end = cursor + accept_encoding->length;
+  while (cursor < end)
+  {
+    char const *item_end = memchr(cursor, ',', end - cursor);
+    if (item_end == NULL)
+      item_end = end;
+
+    while (cursor < item_end && (*cursor == ' ' || *cursor == '\t'))
+      cursor++;
+
+    char const *token_end = cursor;
+    while (token_end < item_end && *token_end != ';' && *token_end != ' ' && *token_end != '\t')
+      token_end++;
+
+    size_t token_length = token_end - cursor;
+    bool zero = _is_zero_quality(token_end, item_end);
+
+    unsigned flag = 0;
+    if (_token_equal(cursor, token_length, "gzip") || _token_equal(cursor, token_length, "x-gzip"))
+      flag = ENCODING_FLAG(ENCODING_GZIP);
+    else if (_token_equal(cursor, token_length, "deflate"))
+      flag = ENCODING_FLAG(ENCODING_DEFLATE);
+    else if (_token_equal(cursor, token_length, "*"))
+      wildcard = !zero;
+
+    if (zero)
+      rejected |= flag;
+    else
+      accepted |= flag;
+
+    cursor = item_end + 1;
+  }
+
+  if (wildcard)
+    accepted |= ENCODING_FLAG(ENCODING_GZIP) | ENCODING_FLAG(ENCODING_DEFLATE);
+
+  return accepted & ~rejected;
+}
+
+encoding_t compression_choose(unsigned accepted)
+{
+  // gzip first: "deflate" has a long history of clients expecting raw streams
+  if (accepted & ENCODING_FLAG(ENCODING_GZIP))
+    return ENCODING_GZIP;
+  if (accepted & ENCODING_FLAG(ENCODING_DEFLATE))
+    return ENCODING_DEFLATE;
+
+  return ENCODING_IDENTITY;
+}
+
+char const *compression_name(encoding_t encoding)
+{
+  switch (encoding)
+  {
+  case ENCODING_GZIP:
+    return "gzip";
+  case ENCODING_DEFLATE:
+    return "deflate";
+  default:
+    return "identity";
+  }
+}
+
+char const *compression_header(encoding_t encoding, size_t *length)
+{
+  static char const gzip[] = "Content-Encoding: gzip\r\n";
+  static char const deflate[] = "Content-Encoding: deflate\r\n";
+
+  switch (encoding)
+  {
+  case ENCODING_GZIP:
+    *length = sizeof(gzip) - 1;
+    return gzip;
+  case ENCODING_DEFLATE:
+    *length = sizeof(deflate) - 1;
+    return deflate;
+  default:
+    *length = 0;
+    return NULL;
+  }
+}
+
+static bool _contains(char const *haystack, size_t length, char const *needle)
+{
+  size_t needle_length = strlen(needle);
+  for (size_t i = 0; i + needle_length <= length; i++)
+  {
+    if (memcmp(haystack + i, needle, needle_length) == 0)
+      return true;
+  }
+
+  return false;
+}
+
+bool compression_compressible(char const *content_type, size_t type_length, size_t body_length)
+{
+  if (content_type == NULL || body_length < COMPRESSION_MIN_SIZE)
+    return false;
+
+  return (type_length >= 5 && memcmp(content_type, "text/", 5) == 0) ||
+         _contains(content_type, type_length, "json") ||
+         _contains(content_type, type_length, "javascript") ||
+         _contains(content_type, type_length, "xml") ||
+         _contains(content_type, type_length, "svg") ||
+         _contains(content_type, type_length, "application/wasm");
+}
+
+static voidpf _zalloc(voidpf opaque, uInt items, uInt size)
+{
+  return mi_mallocn(items, size);
+}
+
+static void _zfree(voidpf opaque, voidpf address)
+{
+  mi_free(address);
+}
+
+compression_pool_t *compression_pool_new(size_t max_idle)
+{
+  compression_pool_t *pool = mi_zalloc_small(sizeof(compression_pool_t));
+  if (pool == NULL)
+    return NULL;
+
+  pool->max_idle = max_idle;
+  for (int i = 0; i < ENCODING_COUNT; i++)
+  {
+    pool->idle[i] = mi_calloc(max_idle, sizeof(z_stream *));
+    if (pool->idle[i] == NULL)
+    {
+      compression_pool_delete(pool);
+      return NULL;
+    }
+  }
+
+  return pool;
+}
+
+void compression_pool_delete(compression_pool_t *pool)
+{
+  if (pool == NULL)
+    return;
+
+  for (int i = 0; i < ENCODING_COUNT; i++)
+  {
+    for (size_t j = 0; j < pool->idle_count[i]; j++)
+    {
+      deflateEnd(pool->idle[i][j]);
+      mi_free(pool->idle[i][j]);
+    }
+    mi_free(pool->idle[i]);
+  }
+  mi_free(pool);
+}
+
+static z_stream *_pool_acquire(compression_pool_t *pool, encoding_t encoding)
+{
+  if (pool->idle_count[encoding] > 0)
+    return pool->idle[encoding][--pool->idle_count[encoding]];
+
+  z_stream *stream = mi_zalloc(sizeof(z_stream));
+  if (stream == NULL)
+    return NULL;
+
+  stream->zalloc = _zalloc;
+  stream->zfree = _zfree;
+
+  // 15 window bits plus 16 selects the gzip wrapper, plain 15 the zlib one
+  int window_bits = encoding == ENCODING_GZIP ? 15 + 16 : 15;
+  if (deflateInit2(stream, COMPRESSION_LEVEL, Z_DEFLATED, window_bits, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+  {
+    mi_free(stream);
+    return NULL;
+  }
+
+  return stream;
+}
+
+static void _pool_release(compression_pool_t *pool, encoding_t encoding, z_stream *stream)
+{
+  if (pool->idle_count[encoding] < pool->max_idle && deflateReset(stream) == Z_OK)
+  {
+    pool->idle[encoding][pool->idle_count[encoding]++] = stream;
+    return;
+  }
+
+  deflateEnd(stream);
+  mi_free(stream);
+}
+
+// NULL for a body that doesn't get smaller, and with failed set when deflate couldn't run at all
+static char *_compress(
+  compression_pool_t *pool,
+  encoding_t encoding,
+  char const *data,
+  size_t size,
+  size_t *compressed_size,
+  bool *failed)
+{
+  *failed = false;
+  if (encoding == ENCODING_IDENTITY || size == 0 || size > UINT_MAX)
+    return NULL;
+
+  z_stream *stream = _pool_acquire(pool, encoding);
+  if (stream == NULL)
+  {
+    *failed = true;
+    return NULL;
+  }
+
+  uLong bound = deflateBound(stream, size);
+  char *output = mi_malloc(bound);
+  if (output == NULL)
+  {
+    _pool_release(pool, encoding, stream);
+    *failed = true;
+    return NULL;
+  }
+
+  stream->next_in = (Bytef *)data;
+  stream->avail_in = (uInt)size;
+  stream->next_out = (Bytef *)output;
+  stream->avail_out = (uInt)bound;
+
+  int status = deflate(stream, Z_FINISH);
+  size_t total = stream->total_out;
+  _pool_release(pool, encoding, stream);
+
+  if (status != Z_STREAM_END || total >= size)
+  {
+    mi_free(output);
+    return NULL;
+  }
+
+  *compressed_size = total;
+
+  return output;
+}
+
+char *compression_compress(
+  compression_pool_t *pool,
+  encoding_t encoding,
+  char const *data,
+  size_t size,
+  size_t *compressed_size)
+{
+  bool failed;
+
+  return _compress(pool, encoding, data, size, compressed_size, &failed);
+}
+
+typedef struct cache_entry
+{
+  char *data;
+  size_t size;
+  // what was compressed, compared on every hit
+  char *source;
+  size_t source_size;
+  size_t hits;
+} cache_entry_t;
+
+// bookkeeping charged per cached body on top of the compressed and source bytes
+#define CACHE_ENTRY_OVERHEAD (sizeof(cache_entry_t) + sizeof(string_t) + 48)
+#define CACHE_ENTRY_CHARGE(entry) ((entry)->size + (entry)->source_size + CACHE_ENTRY_OVERHEAD)
+
+static void _cache_entry_delete(void *data)
+{
+  cache_entry_t *entry = data;
+  mi_free(entry->data);
+  mi_free(entry->source);
+  mi_free(entry);
+}
+
+compression_cache_t *compression_cache_new(size_t max_bytes, memory_t *memory)
+{
+  compression_cache_t *cache = mi_zalloc_small(sizeof(compression_cache_t));
+  if (cache == NULL)
+    return NULL;
+
+  cache->entries = ht_new(HT_DEFAULT_INITIAL_CAPACITY, HT_DEFAULT_FACTOR);
+  if (cache->entries == NULL)
+  {
+    mi_free(cache);
+    return NULL;
+  }
+  cache->max_bytes = max_bytes;
+  cache->memory = memory;
+
+  return cache;
+}
+
+void compression_cache_delete(compression_cache_t *cache)
+{
+  if (cache == NULL)
+    return;
+
+  memory_sub(cache->memory, MEMORY_CACHES, cache->bytes);
+  ht_delete(cache->entries, _cache_entry_delete);
+  mi_free(cache->overflow);
+  mi_free(cache);
+}
+
+static void _cache_evict(compression_cache_t *cache, size_t needed)
+{
+  while (cache->bytes + needed > cache->max_bytes && cache->entries->length > 0)
+  {
+    ht_entry_t const *coldest = NULL;
+    hashtable_it_t it = ht_iterator(cache->entries);
+    while (hti_next(&it))
+    {
+      ht_entry_t const *candidate = hti_get(&it);
+      if (coldest == NULL || ((cache_entry_t *)candidate->data)->hits < ((cache_entry_t *)coldest->data)->hits)
+        coldest = candidate;
+    }
+
+    cache_entry_t *entry = ht_remove(cache->entries, coldest->key);
+    cache->bytes -= CACHE_ENTRY_CHARGE(entry);
+    memory_sub(cache->memory, MEMORY_CACHES, CACHE_ENTRY_CHARGE(entry));
+    _cache_entry_delete(entry);
+  }
+
+  // age the survivors so yesterday's hot body doesn't stay pinned forever
+  hashtable_it_t it = ht_iterator(cache->entries);
+  while (hti_next(&it))
+    ((cache_entry_t *)hti_get(&it)->data)->hits >>= 1;
+}
+
+char const *compression_cache_compress(
+  compression_cache_t *cache,
+  compression_pool_t *pool,
+  encoding_t encoding,
+  char const *identity,
+  size_t identity_length,
+  char const *data,
+  size_t size,
+  size_t *compressed_size)
+{
+  mi_free(cache->overflow);
+  cache->overflow = NULL;
+
+  string_t *key = string_new_format("%d:%.*s", (int)encoding, (int)identity_length, identity);
+  if (key == NULL)
+    return NULL;
+
+  // a hit still has to be the same body, a changed one under an old identity is never served
+  ht_entry_t *found = ht_get(cache->entries, key);
+  if (found != NULL)
+  {
+    cache_entry_t *entry = found->data;
+    if (entry->source_size == size && memcmp(entry->source, data, size) == 0)
+    {
+      string_delete(key);
+      entry->hits++;
+      *compressed_size = entry->size;
+      return entry->data;
+    }
+
+    ht_remove(cache->entries, key);
+    cache->bytes -= CACHE_ENTRY_CHARGE(entry);
+    memory_sub(cache->memory, MEMORY_CACHES, CACHE_ENTRY_CHARGE(entry));
+    _cache_entry_delete(entry);
+  }
+
+  size_t output_size = 0;
+  bool failed;
+  char *output = _compress(pool, encoding, data, size, &output_size, &failed);
+  // out of memory says nothing about the body, it goes out as it is and is tried again next time
+  if (failed)
+  {
+    string_delete(key);
+    return NULL;
+  }
+
+  size_t charge = output_size + size + CACHE_ENTRY_OVERHEAD;
+  cache_entry_t *entry = charge <= cache->max_bytes / 8 ? mi_malloc_small(sizeof(cache_entry_t)) : NULL;
+  char *source = entry != NULL ? mi_malloc(size > 0 ? size : 1) : NULL;
+  if (source == NULL)
+  {
+    // too large to be worth a slot, or no room for one; hand it out until the next call
+    mi_free(entry);
+    string_delete(key);
+    cache->overflow = output;
+    *compressed_size = output_size;
+    return output;
+  }
+  memcpy(source, data, size);
+  entry->data = output;
+  entry->size = output_size;
+  entry->source = source;
+  entry->source_size = size;
+  entry->hits = 1;
+
+  _cache_evict(cache, charge);
+  bool stored = ht_set(cache->entries, key, entry);
+  string_delete(key);
+  if (!stored)
+  {
+    mi_free(source);
+    mi_free(entry);
+    cache->overflow = output;
+    *compressed_size = output_size;
+    return output;
+  }
+  cache->bytes += charge;
+  memory_add(cache->memory, MEMORY_CACHES, charge);
+
+  // incompressible bodies are cached too (as NULL) so they aren't retried
+  *compressed_size = output_size;
+  return output;
+}
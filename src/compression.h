@@ -0,0 +1,76 @@
+#if !defined(_COMPRESSION_H_)
+#define _COMPRESSION_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <zlib.h>
+
+#include "collections/string.h"
+#include "collections/hashtable.h"
+#include "memory.h"
+
+typedef enum encoding
+{
+  ENCODING_IDENTITY = 0,
+  ENCODING_GZIP,
+  ENCODING_DEFLATE,
+  ENCODING_COUNT
+} encoding_t;
+
+#define ENCODING_FLAG(encoding) (1u << (encoding))
+
+// bodies smaller than this are not worth the deflate header overhead
+#define COMPRESSION_MIN_SIZE 256
+#define COMPRESSION_LEVEL 6
+
+unsigned compression_accepted(string_t const *accept_encoding);
+encoding_t compression_choose(unsigned accepted);
+char const *compression_name(encoding_t encoding);
+// the whole "Content-Encoding: name\r\n" line, NULL for identity
+char const *compression_header(encoding_t encoding, size_t *length);
+bool compression_compressible(char const *content_type, size_t type_length, size_t body_length);
+
+typedef struct compression_pool
+{
+  size_t max_idle;
+  size_t idle_count[ENCODING_COUNT];
+  z_stream **idle[ENCODING_COUNT];
+} compression_pool_t;
+
+compression_pool_t *compression_pool_new(size_t max_idle);
+void compression_pool_delete(compression_pool_t *pool);
+
+char *compression_compress(
+  compression_pool_t *pool,
+  encoding_t encoding,
+  char const *data,
+  size_t size,
+  size_t *compressed_size);
+
+typedef struct compression_cache
+{
+  hashtable_t *entries;
+  size_t bytes, max_bytes;
+  char *overflow;
+  // charged with the cached bytes
+  memory_t *memory;
+} compression_cache_t;
+
+compression_cache_t *compression_cache_new(size_t max_bytes, memory_t *memory);
+void compression_cache_delete(compression_cache_t *cache);
+
+// identity names the body, a route and its version say; a body that no longer matches what was
+// cached under its identity is compressed again and replaces it. NULL serves the body as it is: one
+// that doesn't get smaller is remembered, running out of memory to compress it isn't
+char const *compression_cache_compress(
+  compression_cache_t *cache,
+  compression_pool_t *pool,
+  encoding_t encoding,
+  char const *identity,
+  size_t identity_length,
+  char const *data,
+  size_t size,
+  size_t *compressed_size);
+
+#endif // _COMPRESSION_H_
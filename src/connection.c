@@ -0,0 +1,472 @@
+#include "connection.h"
+
+#include <stdio.h>
+
+#include <mimalloc.h>
+
+#include "loop.h"
+
+static bool _coalesce = true;
+
+typedef struct stream_connection
+{
+  connection_t connection;
+  // writes held back until the loop's check phase, the first one's request carries them all
+  connection_write_t *pending, *pending_tail;
+  size_t pending_bytes;
+  unsigned pending_bufs;
+  // the error of a batch libuv refused, its writes fail from the check phase
+  int failed;
+  dlist_node_t flush_node;
+  union
+  {
+    uv_handle_t handle;
+    uv_stream_t stream;
+    uv_tcp_t tcp;
+    uv_pipe_t pipe;
+  };
+} stream_connection_t;
+
+#define STREAM_CONNECTION(connection) ((stream_connection_t *)(connection))
+
+static void _alloc_cb(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf)
+{
+  size_t good_size = mi_good_size(suggested_size);
+  char *buffer = mi_malloc(good_size);
+  if (buffer != NULL)
+  {
+    buf->base = buffer;
+    buf->len = good_size;
+  }
+}
+
+static void _read_cb(uv_stream_t *stream, ssize_t nread, uv_buf_t const *buf)
+{
+  connection_t *connection = stream->data;
+
+  if (nread != 0)
+    connection->_read_cb(connection, nread, buf->base);
+
+  mi_free(buf->base);
+}
+
+static int _stream_read_start(connection_t *connection)
+{
+  return uv_read_start(&STREAM_CONNECTION(connection)->stream, _alloc_cb, _read_cb);
+}
+
+static void _stream_read_stop(connection_t *connection)
+{
+  uv_read_stop(&STREAM_CONNECTION(connection)->stream);
+}
+
+// a batch's writes are chained from the one whose request went to libuv, a lone write has no next
+static void _write_cb(uv_write_t *req, int status)
+{
+  connection_write_t *write = (connection_write_t *)req;
+  while (write != NULL)
+  {
+    connection_write_t *next = write->_next;
+    write->_cb(write, status);
+    write = next;
+  }
+}
+
+static void _unlist(stream_connection_t *stream)
+{
+  if (!dl_linked(&stream->flush_node))
+    return;
+
+  loop_context_t *ctx = stream->connection.loop->data;
+  dl_remove(&ctx->flushing, &stream->flush_node);
+}
+
+static int _flush(stream_connection_t *stream)
+{
+  connection_write_t *first = stream->pending;
+  if (first == NULL || stream->failed)
+    return stream->failed;
+
+  // libuv copies the buffer list, only the bytes have to outlive the call
+  uv_buf_t bufs[CONNECTION_COALESCE_BUFS];
+  unsigned nbufs = 0;
+  for (connection_write_t *write = first; write != NULL; write = write->_next)
+  {
+    for (unsigned i = 0; i < write->_nbufs; i++)
+      bufs[nbufs++] = write->_bufs[i];
+  }
+
+  int err = uv_write(&first->_write, &stream->stream, bufs, nbufs, _write_cb);
+  if (err)
+  {
+    stream->failed = err;
+    return err;
+  }
+
+  stream->pending = NULL;
+  stream->pending_tail = NULL;
+  stream->pending_bytes = 0;
+  stream->pending_bufs = 0;
+  _unlist(stream);
+
+  return 0;
+}
+
+static void _fail(stream_connection_t *stream, int status)
+{
+  connection_write_t *write = stream->pending;
+  stream->pending = NULL;
+  stream->pending_tail = NULL;
+  stream->pending_bytes = 0;
+  stream->pending_bufs = 0;
+  _unlist(stream);
+
+  while (write != NULL)
+  {
+    connection_write_t *next = write->_next;
+    write->_cb(write, status);
+    write = next;
+  }
+}
+
+// after the loop's callbacks for this iteration, so everything they wrote leaves in one writev per connection
+static void _flush_cb(uv_check_t *check)
+{
+  loop_context_t *ctx = check->loop->data;
+
+  // write callbacks may close other connections on the list, take them one at a time
+  dlist_node_t *node;
+  while ((node = dl_front(&ctx->flushing)) != NULL)
+  {
+    stream_connection_t *stream = DLIST_ENTRY(node, stream_connection_t, flush_node);
+    _unlist(stream);
+    if (_flush(stream) != 0)
+      _fail(stream, stream->failed);
+  }
+
+  uv_check_stop(check);
+  uv_idle_stop(&ctx->flush_idle);
+}
+
+// only there to keep the poll from blocking while writes wait for the check phase
+static void _flush_idle_cb(uv_idle_t *idle)
+{
+}
+
+static void _enlist(stream_connection_t *stream)
+{
+  if (dl_linked(&stream->flush_node))
+    return;
+
+  loop_context_t *ctx = stream->connection.loop->data;
+  if (ctx->flushing.length == 0)
+  {
+    uv_check_start(&ctx->flush_check, _flush_cb);
+    uv_idle_start(&ctx->flush_idle, _flush_idle_cb);
+  }
+  dl_push_back(&ctx->flushing, &stream->flush_node);
+}
+
+static int _stream_write(connection_t *connection, connection_write_t *write, uv_buf_t const bufs[], unsigned nbufs)
+{
+  stream_connection_t *stream = STREAM_CONNECTION(connection);
+  if (stream->failed)
+    return stream->failed;
+
+  size_t bytes = 0;
+  for (unsigned i = 0; i < nbufs; i++)
+    bytes += bufs[i].len;
+
+  write->_next = NULL;
+
+  // large writes gain nothing from waiting, what's pending goes ahead of them to keep the order;
+  // loops without a context have no check phase to flush from
+  if (!_coalesce || bytes >= CONNECTION_COALESCE_MAX_WRITE || connection->loop->data == NULL)
+  {
+    int err = _flush(stream);
+    return err ? err : uv_write(&write->_write, &stream->stream, bufs, nbufs, _write_cb);
+  }
+
+  if (stream->pending_bufs + nbufs > CONNECTION_COALESCE_BUFS)
+  {
+    int err = _flush(stream);
+    if (err)
+      return err;
+  }
+
+  for (unsigned i = 0; i < nbufs; i++)
+    write->_bufs[i] = bufs[i];
+  write->_nbufs = nbufs;
+
+  if (stream->pending_tail != NULL)
+    stream->pending_tail->_next = write;
+  else
+    stream->pending = write;
+  stream->pending_tail = write;
+  stream->pending_bytes += bytes;
+  stream->pending_bufs += nbufs;
+  _enlist(stream);
+
+  // the write is queued either way, a refused batch fails from the check phase
+  if (stream->pending_bytes >= CONNECTION_COALESCE_BYTES)
+    _flush(stream);
+
+  return 0;
+}
+
+static void _close_cb(uv_handle_t *handle)
+{
+  stream_connection_t *stream = handle->data;
+
+  // like libuv does for writes it had, before the connection's own callback
+  if (stream->pending != NULL)
+    _fail(stream, UV_ECANCELED);
+
+  if (stream->connection._close_cb != NULL)
+    stream->connection._close_cb(&stream->connection);
+  mi_free(stream);
+}
+
+static void _stream_close(connection_t *connection)
+{
+  stream_connection_t *stream = STREAM_CONNECTION(connection);
+
+  // what's pending is handed to libuv, which sends what it can before the close cancels the rest
+  _flush(stream);
+  _unlist(stream);
+  uv_close(&stream->handle, _close_cb);
+}
+
+static int _stream_getpeername(connection_t *connection, struct sockaddr *name, int *namelen)
+{
+  stream_connection_t *client = STREAM_CONNECTION(connection);
+  if (client->handle.type != UV_TCP)
+    return UV_ENOTSUP;
+
+  return uv_tcp_getpeername(&client->tcp, name, namelen);
+}
+
+static int _stream_fileno(connection_t *connection, uv_os_sock_t *fd)
+{
+  uv_os_fd_t handle_fd;
+  int err = uv_fileno(&STREAM_CONNECTION(connection)->handle, &handle_fd);
+  if (err == 0)
+    *fd = handle_fd;
+
+  return err;
+}
+
+static connection_transport_t const _stream_transport = {
+  .read_start = _stream_read_start,
+  .read_stop = _stream_read_stop,
+  .write = _stream_write,
+  .close = _stream_close,
+  .getpeername = _stream_getpeername,
+  .fileno = _stream_fileno,
+};
+
+void connection_init(connection_t *connection, connection_transport_t const *transport, uv_loop_t *loop)
+{
+  connection->_transport = transport;
+  connection->loop = loop;
+  connection->data = NULL;
+  connection->_read_cb = NULL;
+  connection->_close_cb = NULL;
+  connection->node.prev = NULL;
+  connection->node.next = NULL;
+  connection->_closing = false;
+}
+
+static void _stream_init(stream_connection_t *stream, uv_loop_t *loop)
+{
+  connection_init(&stream->connection, &_stream_transport, loop);
+  stream->pending = NULL;
+  stream->pending_tail = NULL;
+  stream->pending_bytes = 0;
+  stream->pending_bufs = 0;
+  stream->failed = 0;
+  stream->flush_node.prev = NULL;
+  stream->flush_node.next = NULL;
+}
+
+static void _free_cb(uv_handle_t *handle)
+{
+  mi_free(handle->data);
+}
+
+connection_t *connection_accept(listener_t *listener)
+{
+  stream_connection_t *client = mi_malloc(sizeof(stream_connection_t));
+  if (client == NULL)
+    return NULL;
+
+  uv_loop_t *loop = listener->handle.loop;
+  int err = listener->type == LISTENER_PIPE
+              ? uv_pipe_init(loop, &client->pipe, 0)
+              : uv_tcp_init(loop, &client->tcp);
+  if (err)
+  {
+    fprintf(stderr, "error: %s\n", uv_strerror(err));
+    mi_free(client);
+    return NULL;
+  }
+
+  _stream_init(client, loop);
+  client->handle.data = client;
+
+  if (uv_accept(&listener->stream, &client->stream) != 0)
+  {
+    uv_close(&client->handle, _free_cb);
+    return NULL;
+  }
+
+  uv_os_fd_t fd;
+  if (uv_fileno(&client->handle, &fd) == 0)
+    listener_client_configure(listener, fd);
+
+  return &client->connection;
+}
+
+typedef struct connect_request
+{
+  uv_connect_t connect;
+  connection_connect_cb cb;
+} connect_request_t;
+
+static void _connect_cb(uv_connect_t *req, int status)
+{
+  connect_request_t *request = (connect_request_t *)req;
+  connection_t *connection = req->handle->data;
+
+  request->cb(connection, status);
+  mi_free(request);
+}
+
+static stream_connection_t *_connect_new(uv_loop_t *loop, void *data, connection_connect_cb connect_cb, connect_request_t **request)
+{
+  stream_connection_t *upstream = mi_malloc(sizeof(stream_connection_t));
+  if (upstream == NULL)
+    return NULL;
+
+  *request = mi_malloc(sizeof(connect_request_t));
+  if (*request == NULL)
+  {
+    mi_free(upstream);
+    return NULL;
+  }
+  (*request)->cb = connect_cb;
+
+  _stream_init(upstream, loop);
+  upstream->connection.data = data;
+
+  return upstream;
+}
+
+connection_t *connection_connect_tcp(uv_loop_t *loop, struct sockaddr const *addr, void *data, connection_connect_cb connect_cb)
+{
+  connect_request_t *request;
+  stream_connection_t *upstream = _connect_new(loop, data, connect_cb, &request);
+  if (upstream == NULL)
+    return NULL;
+
+  int err = uv_tcp_init(loop, &upstream->tcp);
+  if (err)
+  {
+    fprintf(stderr, "error: %s\n", uv_strerror(err));
+    mi_free(request);
+    mi_free(upstream);
+    return NULL;
+  }
+  upstream->handle.data = upstream;
+  uv_tcp_nodelay(&upstream->tcp, 1);
+
+  err = uv_tcp_connect(&request->connect, &upstream->tcp, addr, _connect_cb);
+  if (err)
+  {
+    mi_free(request);
+    uv_close(&upstream->handle, _free_cb);
+    return NULL;
+  }
+
+  return &upstream->connection;
+}
+
+connection_t *connection_connect_pipe(uv_loop_t *loop, char const *path, void *data, connection_connect_cb connect_cb)
+{
+  connect_request_t *request;
+  stream_connection_t *upstream = _connect_new(loop, data, connect_cb, &request);
+  if (upstream == NULL)
+    return NULL;
+
+  int err = uv_pipe_init(loop, &upstream->pipe, 0);
+  if (err)
+  {
+    fprintf(stderr, "error: %s\n", uv_strerror(err));
+    mi_free(request);
+    mi_free(upstream);
+    return NULL;
+  }
+  upstream->handle.data = upstream;
+
+  // failures, a missing socket included, arrive through the callback
+  uv_pipe_connect(&request->connect, &upstream->pipe, path, _connect_cb);
+
+  return &upstream->connection;
+}
+
+int connection_read_start(connection_t *connection, connection_read_cb read_cb)
+{
+  connection->_read_cb = read_cb;
+  return connection->_transport->read_start(connection);
+}
+
+void connection_read_stop(connection_t *connection)
+{
+  connection->_transport->read_stop(connection);
+}
+
+int connection_write(
+  connection_t *connection,
+  connection_write_t *write,
+  uv_buf_t const bufs[],
+  unsigned nbufs,
+  connection_write_cb write_cb)
+{
+  if (nbufs == 0 || nbufs > CONNECTION_WRITE_BUFS)
+    return UV_EINVAL;
+
+  write->_connection = connection;
+  write->_cb = write_cb;
+
+  return connection->_transport->write(connection, write, bufs, nbufs);
+}
+
+void connection_close(connection_t *connection, connection_close_cb close_cb)
+{
+  if (connection->_closing)
+    return;
+
+  connection->_closing = true;
+  connection->_close_cb = close_cb;
+  connection->_transport->close(connection);
+}
+
+int connection_getpeername(connection_t *connection, struct sockaddr *name, int *namelen)
+{
+  return connection->_transport->getpeername(connection, name, namelen);
+}
+
+int connection_fileno(connection_t *connection, uv_os_sock_t *fd)
+{
+  return connection->_transport->fileno(connection, fd);
+}
+
+void connection_set_coalescing(bool enabled)
+{
+  _coalesce = enabled;
+}
+
+bool connection_is_closing(connection_t const *connection)
+{
+  return connection->_closing;
+}
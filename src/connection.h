@@ -0,0 +1,90 @@
+#if !defined(_CONNECTION_H_)
+#define _CONNECTION_H_
+
+#include <stdbool.h>
+
+#include <uv.h>
+
+#include "collections/dlist.h"
+#include "listener.h"
+
+#define CONNECTION_WRITE_BUFS 8
+// small writes made during a loop iteration leave together from its check phase, in one writev per
+// connection; a connection flushes early once this much is pending or the buffers would not fit
+#define CONNECTION_COALESCE_BYTES (64 * 1024)
+#define CONNECTION_COALESCE_BUFS 64
+// larger writes go straight out, after whatever is pending
+#define CONNECTION_COALESCE_MAX_WRITE (16 * 1024)
+
+typedef struct connection connection_t;
+typedef struct connection_write connection_write_t;
+
+// data is only valid during the call, nread < 0 carries UV_EOF or an error
+typedef void (*connection_read_cb)(connection_t *connection, ssize_t nread, char const *data);
+typedef void (*connection_write_cb)(connection_write_t *write, int status);
+typedef void (*connection_close_cb)(connection_t *connection);
+// also called with UV_ECANCELED when the connection is closed before connecting
+typedef void (*connection_connect_cb)(connection_t *connection, int status);
+
+typedef struct connection_transport
+{
+  int (*read_start)(connection_t *connection);
+  void (*read_stop)(connection_t *connection);
+  int (*write)(connection_t *connection, connection_write_t *write, uv_buf_t const bufs[], unsigned nbufs);
+  // must call _close_cb from a later loop phase, never from inside close itself
+  void (*close)(connection_t *connection);
+  // UV_ENOTSUP for connections that have no peer address
+  int (*getpeername)(connection_t *connection, struct sockaddr *name, int *namelen);
+  int (*fileno)(connection_t *connection, uv_os_sock_t *fd);
+} connection_transport_t;
+
+struct connection
+{
+  connection_transport_t const *_transport;
+  uv_loop_t *loop;
+  void *data;
+  connection_read_cb _read_cb;
+  connection_close_cb _close_cb;
+  // links the connection into its owner's list, see the loop's registry
+  dlist_node_t node;
+  bool _closing;
+};
+
+// embedded by the caller like uv_write_t, stays owned by the transport until the callback
+struct connection_write
+{
+  uv_write_t _write;
+  connection_t *_connection;
+  connection_write_cb _cb;
+  struct connection_write *_next;
+  uv_buf_t _bufs[CONNECTION_WRITE_BUFS];
+  unsigned _nbufs, _index;
+};
+
+void connection_init(connection_t *connection, connection_transport_t const *transport, uv_loop_t *loop);
+
+// accepts a pending connection from a libuv listener
+connection_t *connection_accept(listener_t *listener);
+
+// outgoing libuv connections, data is set before connect_cb can run; NULL when the connect couldn't start
+connection_t *connection_connect_tcp(uv_loop_t *loop, struct sockaddr const *addr, void *data, connection_connect_cb connect_cb);
+connection_t *connection_connect_pipe(uv_loop_t *loop, char const *path, void *data, connection_connect_cb connect_cb);
+
+int connection_read_start(connection_t *connection, connection_read_cb read_cb);
+void connection_read_stop(connection_t *connection);
+int connection_write(
+  connection_t *connection,
+  connection_write_t *write,
+  uv_buf_t const bufs[],
+  unsigned nbufs,
+  connection_write_cb write_cb);
+void connection_close(connection_t *connection, connection_close_cb close_cb);
+// like uv_tcp_getpeername, namelen is the size of name on the way in
+int connection_getpeername(connection_t *connection, struct sockaddr *name, int *namelen);
+// the socket underneath, for options libuv doesn't cover
+int connection_fileno(connection_t *connection, uv_os_sock_t *fd);
+// on by default, for comparing behaviour; libuv connections only, io_uring already batches its sends
+void connection_set_coalescing(bool enabled);
+bool connection_is_closing(connection_t const *connection);
+
+#endif // _CONNECTION_H_
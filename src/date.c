@@ -0,0 +1,45 @@
+#include "date.h"
+
+#include <time.h>
+
+static void _timer_cb(uv_timer_t *timer);
+
+// formats the current second and wakes up again at the start of the next one
+static void _refresh(date_cache_t *cache)
+{
+  uv_timeval64_t now;
+  if (uv_gettimeofday(&now) != 0)
+  {
+    now.tv_sec = time(NULL);
+    now.tv_usec = 0;
+  }
+
+  time_t seconds = now.tv_sec;
+  struct tm tm;
+  gmtime_r(&seconds, &tm);
+  strftime(cache->header, sizeof(cache->header), "Date: %a, %d %b %Y %H:%M:%S GMT\r\n", &tm);
+
+  uv_timer_start(&cache->timer, _timer_cb, 1000 - now.tv_usec / 1000, 0);
+}
+
+static void _timer_cb(uv_timer_t *timer)
+{
+  _refresh(timer->data);
+}
+
+void date_cache_init(date_cache_t *cache, uv_loop_t *loop)
+{
+  uv_timer_init(loop, &cache->timer);
+  cache->timer.data = cache;
+  // a clock must never keep the loop alive
+  uv_unref((uv_handle_t *)&cache->timer);
+
+  _refresh(cache);
+}
+
+unsigned date_cache_close(date_cache_t *cache, uv_close_cb close_cb)
+{
+  uv_close((uv_handle_t *)&cache->timer, close_cb);
+
+  return 1;
+}
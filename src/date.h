@@ -0,0 +1,20 @@
+#if !defined(_DATE_H_)
+#define _DATE_H_
+
+#include <uv.h>
+
+// "Date: Sun, 06 Nov 1994 08:49:37 GMT\r\n"
+#define DATE_HEADER_LENGTH 37
+
+// the Date header line, formatted once per second instead of once per response
+typedef struct date_cache
+{
+  uv_timer_t timer;
+  char header[DATE_HEADER_LENGTH + 1];
+} date_cache_t;
+
+void date_cache_init(date_cache_t *cache, uv_loop_t *loop);
+// the number of handles closed, close_cb is called for each
+unsigned date_cache_close(date_cache_t *cache, uv_close_cb close_cb);
+
+#endif // _DATE_H_
@@ -0,0 +1,258 @@
+#include "fast_parser.h"
+
+#include <string.h>
+#include <strings.h>
+
+#include <llhttp.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define FAST_PARSER_X86 1
+#include <immintrin.h>
+#endif
+
+typedef char const *(*scan_f)(char const *p, char const *end);
+
+// request-target bytes llhttp accepts without question: visible ASCII
+static bool _target_char[256];
+// header value bytes: visible ASCII, space, tab and obs-text
+static bool _value_char[256];
+// field-name tchar
+static bool _token_char[256];
+
+static char const *_scan_target_scalar(char const *p, char const *end)
+{
+  while (p < end && _target_char[(unsigned char)*p])
+    p++;
+
+  return p;
+}
+
+static char const *_scan_value_scalar(char const *p, char const *end)
+{
+  while (p < end && _value_char[(unsigned char)*p])
+    p++;
+
+  return p;
+}
+
+#if defined(FAST_PARSER_X86)
+
+// the ranges name the bytes that stop a scan, pcmpestri returns the first one in 16
+static char const _target_ranges[16] = "\x00\x20\x7f\xff";
+static char const _value_ranges[16] = "\x00\x08\x0a\x1f\x7f\x7f";
+
+__attribute__((target("sse4.2"))) static char const *_scan_target_sse42(char const *p, char const *end)
+{
+  __m128i ranges = _mm_loadu_si128((__m128i const *)_target_ranges);
+  for (; end - p >= 16; p += 16)
+  {
+    __m128i v = _mm_loadu_si128((__m128i const *)p);
+    int index = _mm_cmpestri(ranges, 4, v, 16, _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES | _SIDD_LEAST_SIGNIFICANT);
+    if (index != 16)
+      return p + index;
+  }
+
+  return _scan_target_scalar(p, end);
+}
+
+__attribute__((target("sse4.2"))) static char const *_scan_value_sse42(char const *p, char const *end)
+{
+  __m128i ranges = _mm_loadu_si128((__m128i const *)_value_ranges);
+  for (; end - p >= 16; p += 16)
+  {
+    __m128i v = _mm_loadu_si128((__m128i const *)p);
+    int index = _mm_cmpestri(ranges, 6, v, 16, _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES | _SIDD_LEAST_SIGNIFICANT);
+    if (index != 16)
+      return p + index;
+  }
+
+  return _scan_value_scalar(p, end);
+}
+
+__attribute__((target("avx2"))) static char const *_scan_target_avx2(char const *p, char const *end)
+{
+  __m256i const first = _mm256_set1_epi8(0x21);
+  __m256i const del = _mm256_set1_epi8(0x7f);
+  for (; end - p >= 32; p += 32)
+  {
+    __m256i v = _mm256_loadu_si256((__m256i const *)p);
+    // signed compare: bytes from 0x80 up are negative and land below 0x21 as well
+    __m256i stop = _mm256_or_si256(_mm256_cmpgt_epi8(first, v), _mm256_cmpeq_epi8(v, del));
+    unsigned mask = _mm256_movemask_epi8(stop);
+    if (mask != 0)
+      return p + __builtin_ctz(mask);
+  }
+
+  return _scan_target_scalar(p, end);
+}
+
+__attribute__((target("avx2"))) static char const *_scan_value_avx2(char const *p, char const *end)
+{
+  __m256i const zero = _mm256_setzero_si256();
+  __m256i const space = _mm256_set1_epi8(0x20);
+  __m256i const tab = _mm256_set1_epi8('\t');
+  __m256i const del = _mm256_set1_epi8(0x7f);
+  for (; end - p >= 32; p += 32)
+  {
+    __m256i v = _mm256_loadu_si256((__m256i const *)p);
+    // controls are 0x00-0x1f except tab, obs-text is negative and excluded by the first compare
+    __m256i control = _mm256_andnot_si256(_mm256_cmpgt_epi8(zero, v), _mm256_cmpgt_epi8(space, v));
+    control = _mm256_andnot_si256(_mm256_cmpeq_epi8(v, tab), control);
+    __m256i stop = _mm256_or_si256(control, _mm256_cmpeq_epi8(v, del));
+    unsigned mask = _mm256_movemask_epi8(stop);
+    if (mask != 0)
+      return p + __builtin_ctz(mask);
+  }
+
+  return _scan_value_scalar(p, end);
+}
+
+#endif
+
+static scan_f _scan_target = _scan_target_scalar;
+static scan_f _scan_value = _scan_value_scalar;
+
+void fast_parser_init()
+{
+  for (int c = 0; c < 256; c++)
+  {
+    _target_char[c] = c > 0x20 && c < 0x7f;
+    _value_char[c] = c == '\t' || (c >= 0x20 && c != 0x7f);
+    _token_char[c] = (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+                     (c != 0 && strchr("!#$%&'*+-.^_`|~", c) != NULL);
+  }
+
+#if defined(FAST_PARSER_X86)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+  {
+    _scan_target = _scan_target_avx2;
+    _scan_value = _scan_value_avx2;
+  }
+  else if (__builtin_cpu_supports("sse4.2"))
+  {
+    _scan_target = _scan_target_sse42;
+    _scan_value = _scan_value_sse42;
+  }
+#endif
+}
+
+#define NAME_IS(name, length, literal) \
+  ((length) == sizeof(literal) - 1 && strncasecmp((name), (literal), sizeof(literal) - 1) == 0)
+
+// headers that change how llhttp frames the message are left to it
+static bool _header_allowed(fast_request_t *request, fast_header_t const *header)
+{
+  char const *name = header->name.at;
+  size_t length = header->name.length;
+
+  if (NAME_IS(name, length, "content-length") || NAME_IS(name, length, "transfer-encoding") ||
+      NAME_IS(name, length, "upgrade") || NAME_IS(name, length, "proxy-connection"))
+    return false;
+
+  if (NAME_IS(name, length, "connection"))
+  {
+    // only a single plain token, lists and upgrades go through llhttp's token parser
+    if (NAME_IS(header->value.at, header->value.length, "close"))
+      request->flags |= F_CONNECTION_CLOSE;
+    else if (NAME_IS(header->value.at, header->value.length, "keep-alive"))
+      request->flags |= F_CONNECTION_KEEP_ALIVE;
+    else
+      return false;
+  }
+
+  return true;
+}
+
+bool fast_parser_parse(char const *data, size_t length, fast_request_t *request)
+{
+  char const *p = data;
+  char const *end = data + length;
+
+  if (length >= 4 && memcmp(p, "GET ", 4) == 0)
+  {
+    request->method = HTTP_GET;
+    p += 4;
+  }
+  else if (length >= 5 && memcmp(p, "HEAD ", 5) == 0)
+  {
+    request->method = HTTP_HEAD;
+    p += 5;
+  }
+  else
+  {
+    return false;
+  }
+
+  // origin-form only, absolute and authority forms go through llhttp's URL states
+  if (p == end || *p != '/')
+    return false;
+
+  char const *target = p;
+  p = _scan_target(p, end);
+  if (p == end || *p != ' ')
+    return false;
+  request->target.at = target;
+  request->target.length = p - target;
+  p++;
+
+  if (end - p < 10 || memcmp(p, "HTTP/1.", 7) != 0 || (p[7] != '0' && p[7] != '1') || p[8] != '\r' || p[9] != '\n')
+    return false;
+  request->http_minor = p[7] - '0';
+  p += 10;
+
+  request->flags = 0;
+  request->header_count = 0;
+  for (;;)
+  {
+    if (end - p < 2)
+      return false;
+
+    if (p[0] == '\r')
+    {
+      if (p[1] != '\n')
+        return false;
+      p += 2;
+      break;
+    }
+
+    if (request->header_count == FAST_PARSER_MAX_HEADERS)
+      return false;
+
+    fast_header_t *header = &request->headers[request->header_count];
+
+    // a leading space or tab here would be obsolete line folding
+    char const *name = p;
+    while (p < end && _token_char[(unsigned char)*p])
+      p++;
+    if (p == name || p == end || *p != ':')
+      return false;
+    header->name.at = name;
+    header->name.length = p - name;
+    p++;
+
+    while (p < end && (*p == ' ' || *p == '\t'))
+      p++;
+
+    char const *value = p;
+    p = _scan_value(p, end);
+    if (end - p < 2 || p[0] != '\r' || p[1] != '\n')
+      return false;
+
+    // empty values and trailing whitespace are rare enough to leave to llhttp's own rules
+    size_t value_length = p - value;
+    if (value_length == 0 || value[value_length - 1] == ' ' || value[value_length - 1] == '\t')
+      return false;
+    header->value.at = value;
+    header->value.length = value_length;
+    p += 2;
+
+    if (!_header_allowed(request, header))
+      return false;
+    request->header_count++;
+  }
+
+  request->length = p - data;
+
+  return true;
+}
@@ -0,0 +1,42 @@
+#if !defined(_FAST_PARSER_H_)
+#define _FAST_PARSER_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// more headers than this is not a simple request, llhttp takes it
+#define FAST_PARSER_MAX_HEADERS 32
+
+typedef struct fast_span
+{
+  char const *at;
+  size_t length;
+} fast_span_t;
+
+typedef struct fast_header
+{
+  fast_span_t name, value;
+} fast_header_t;
+
+typedef struct fast_request
+{
+  // bytes of the head including the blank line, the request has no body
+  size_t length;
+  uint8_t method;
+  uint8_t http_minor;
+  // llhttp connection flags derived from a Connection header
+  uint16_t flags;
+  fast_span_t target;
+  size_t header_count;
+  fast_header_t headers[FAST_PARSER_MAX_HEADERS];
+} fast_request_t;
+
+// picks the widest scanner the CPU supports
+void fast_parser_init();
+
+// true only for a complete GET/HEAD head that llhttp would parse the same way without a body;
+// anything else (partial input, bodies, upgrades, folding, odd bytes) returns false untouched
+bool fast_parser_parse(char const *data, size_t length, fast_request_t *request);
+
+#endif // _FAST_PARSER_H_
@@ -0,0 +1,824 @@
+#include "form.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+#include <mimalloc.h>
+
+#include "query.h"
+
+#define URLENCODED "application/x-www-form-urlencoded"
+#define MULTIPART "multipart/form-data"
+
+typedef enum form_state
+{
+  URLENCODED_NAME,
+  URLENCODED_VALUE,
+  MULTIPART_DATA,
+  // after a delimiter: transport padding, then CRLF or the closing "--"
+  MULTIPART_DELIMITER,
+  MULTIPART_CLOSE,
+  MULTIPART_HEADER_LF,
+  MULTIPART_HEADERS,
+  MULTIPART_EPILOGUE
+} form_state_t;
+
+// matches a media type or parameter name followed by the end, ';', '=' or whitespace
+static bool _token_is(char const *at, size_t length, char const *token)
+{
+  size_t token_length = strlen(token);
+  if (length < token_length || strncasecmp(at, token, token_length) != 0)
+    return false;
+
+  return length == token_length || strchr("; \t=", at[token_length]) != NULL;
+}
+
+static char const *_skip_space(char const *p, char const *end)
+{
+  while (p < end && (*p == ' ' || *p == '\t'))
+    p++;
+
+  return p;
+}
+
+static size_t _trim_length(char const *at, char const *end)
+{
+  while (end > at && (end[-1] == ' ' || end[-1] == '\t'))
+    end--;
+
+  return end - at;
+}
+
+// walks "; key=value" parameters, quoted or not, starting after the first ';'
+static bool _next_parameter(
+  char const **p,
+  char const *end,
+  char const **key,
+  size_t *key_length,
+  char const **value,
+  size_t *value_length)
+{
+  char const *at = *p;
+  while (at < end)
+  {
+    at = _skip_space(at, end);
+    char const *name = at;
+    while (at < end && *at != '=' && *at != ';')
+      at++;
+    *key = name;
+    *key_length = _trim_length(name, at);
+
+    *value = at;
+    *value_length = 0;
+    if (at < end && *at == '=')
+    {
+      at = _skip_space(at + 1, end);
+      if (at < end && *at == '"')
+      {
+        char const *quote = memchr(at + 1, '"', end - at - 1);
+        char const *close = quote != NULL ? quote : end;
+        *value = at + 1;
+        *value_length = close - *value;
+        at = quote != NULL ? quote + 1 : end;
+      }
+      else
+      {
+        char const *separator = memchr(at, ';', end - at);
+        char const *stop = separator != NULL ? separator : end;
+        *value = at;
+        *value_length = _trim_length(at, stop);
+        at = stop;
+      }
+    }
+
+    char const *separator = memchr(at, ';', end - at);
+    at = separator != NULL ? separator + 1 : end;
+    if (*key_length > 0)
+    {
+      *p = at;
+      return true;
+    }
+  }
+
+  *p = end;
+  return false;
+}
+
+static bool _init_boundary(form_parser_t *form, char const *parameters, char const *end)
+{
+  char const *key, *value;
+  size_t key_length, value_length;
+  while (_next_parameter(&parameters, end, &key, &key_length, &value, &value_length))
+  {
+    if (!_token_is(key, key_length, "boundary"))
+      continue;
+
+    if (value_length == 0 || value_length > FORM_BOUNDARY_SIZE || memchr(value, '\r', value_length) != NULL)
+      return false;
+
+    memcpy(form->_delimiter, "\r\n--", 4);
+    memcpy(form->_delimiter + 4, value, value_length);
+    form->_delimiter_length = 4 + value_length;
+
+    return true;
+  }
+
+  return false;
+}
+
+form_parser_t *form_parser_new(
+  uv_loop_t *loop,
+  char const *content_type,
+  size_t length,
+  form_callbacks_t const *callbacks,
+  void *data)
+{
+  if (content_type == NULL)
+    return NULL;
+
+  bool urlencoded = _token_is(content_type, length, URLENCODED);
+  if (!urlencoded && !_token_is(content_type, length, MULTIPART))
+    return NULL;
+
+  form_parser_t *form = mi_malloc(sizeof(form_parser_t));
+  if (form == NULL)
+    return NULL;
+
+  form->data = data;
+  form->parts = 0;
+  form->_callbacks = *callbacks;
+  form->_in_part = false;
+  form->_failed = false;
+  form->_loop = loop;
+  form->_file = NULL;
+  form->_writing = 0;
+  form->_files = 0;
+  form->_congested = false;
+  form->_flushing = false;
+  form->_deleted = false;
+  form->_drain = NULL;
+  form->_drain_data = NULL;
+  form->_carried = 0;
+  form->_matched = 0;
+  form->_buffered = 0;
+  form->_delimiter_length = 0;
+
+  if (urlencoded)
+  {
+    form->type = FORM_URLENCODED;
+    form->_state = URLENCODED_NAME;
+    return form;
+  }
+
+  form->type = FORM_MULTIPART;
+  form->_state = MULTIPART_DATA;
+  char const *parameters = memchr(content_type, ';', length);
+  if (parameters == NULL || !_init_boundary(form, parameters + 1, content_type + length))
+  {
+    mi_free(form);
+    return NULL;
+  }
+  // the body opens with "--boundary", as if a CRLF had come before it
+  form->_matched = 2;
+
+  return form;
+}
+
+typedef struct form_write
+{
+  uv_fs_t req;
+  struct form_file *file;
+  // queued while the file is still opening
+  struct form_write *next;
+  int64_t offset;
+  size_t length, written;
+  char data[];
+} form_write_t;
+
+typedef struct form_file
+{
+  // opens the file, then closes it
+  uv_fs_t req;
+  form_parser_t *form;
+  uv_file fd;
+  int64_t offset;
+  // writes queued or running, the queued ones in order
+  unsigned writes;
+  form_write_t *waiting, *waiting_tail;
+  bool opening, ended;
+} form_file_t;
+
+static void _check_drain(form_parser_t *form)
+{
+  if (form->_deleted || form->_drain == NULL)
+    return;
+
+  if (form->_congested && form->_writing <= FORM_HIGH_WATER / 2)
+  {
+    form->_congested = false;
+    form->_drain(form, form->_drain_data);
+  }
+  else if (form->_flushing && form->_writing == 0 && form->_files == 0)
+  {
+    form->_flushing = false;
+    form->_drain(form, form->_drain_data);
+  }
+}
+
+static void _file_release(form_file_t *file)
+{
+  form_parser_t *form = file->form;
+  mi_free(file);
+
+  // a deleted parser waited for its last file
+  if (--form->_files == 0 && form->_deleted)
+  {
+    mi_free(form);
+    return;
+  }
+  _check_drain(form);
+}
+
+static void _file_close_cb(uv_fs_t *req)
+{
+  uv_fs_req_cleanup(req);
+  _file_release(req->data);
+}
+
+// once the part has ended and its last write is done
+static void _file_settle(form_file_t *file)
+{
+  if (!file->ended || file->opening || file->writes > 0)
+    return;
+
+  // one that never opened has nothing to close
+  if (file->fd < 0 || uv_fs_close(file->form->_loop, &file->req, file->fd, _file_close_cb) != 0)
+    _file_release(file);
+}
+
+static void _end_file(form_parser_t *form)
+{
+  form_file_t *file = form->_file;
+  if (file == NULL)
+    return;
+
+  form->_file = NULL;
+  file->ended = true;
+  _file_settle(file);
+}
+
+static bool _write_next(form_write_t *write);
+
+static void _write_cb(uv_fs_t *req)
+{
+  form_write_t *write = (form_write_t *)req;
+  form_file_t *file = write->file;
+  form_parser_t *form = file->form;
+  ssize_t result = req->result;
+  uv_fs_req_cleanup(req);
+
+  if (result < 0)
+  {
+    fprintf(stderr, "Form file error: %s\n", uv_strerror((int)result));
+    form->_failed = true;
+  }
+  else
+  {
+    // a short write goes on from where it stopped
+    write->written += result;
+    if (result > 0 && write->written < write->length && _write_next(write))
+      return;
+    if (write->written < write->length)
+      form->_failed = true;
+  }
+
+  form->_writing -= write->length;
+  file->writes--;
+  mi_free(write);
+
+  _file_settle(file);
+  _check_drain(form);
+}
+
+static bool _write_next(form_write_t *write)
+{
+  form_file_t *file = write->file;
+  uv_buf_t buf = uv_buf_init(write->data + write->written, write->length - write->written);
+
+  return uv_fs_write(file->form->_loop, &write->req, file->fd, &buf, 1, write->offset + write->written, _write_cb) == 0;
+}
+
+static void _file_open_cb(uv_fs_t *req)
+{
+  form_file_t *file = req->data;
+  form_parser_t *form = file->form;
+  if (req->result < 0)
+  {
+    fprintf(stderr, "Form file error %s: %s\n", req->path, uv_strerror((int)req->result));
+    form->_failed = true;
+  }
+  file->fd = req->result < 0 ? -1 : (uv_file)req->result;
+  file->opening = false;
+  uv_fs_req_cleanup(req);
+
+  // what arrived while it opened goes out now, or is dropped with the file
+  form_write_t *write;
+  while ((write = file->waiting) != NULL)
+  {
+    file->waiting = write->next;
+    if (file->fd >= 0 && _write_next(write))
+      continue;
+
+    form->_failed = true;
+    form->_writing -= write->length;
+    file->writes--;
+    mi_free(write);
+  }
+  file->waiting_tail = NULL;
+
+  _file_settle(file);
+  _check_drain(form);
+}
+
+void form_parser_delete(form_parser_t *form)
+{
+  if (form == NULL)
+    return;
+
+  _end_file(form);
+  if (form->_callbacks.on_close != NULL)
+    form->_callbacks.on_close(form);
+
+  // files still being written hold it until they are closed
+  form->_deleted = true;
+  if (form->_files == 0)
+    mi_free(form);
+}
+
+void form_parser_on_drain(form_parser_t *form, form_drain_f drain, void *data)
+{
+  form->_drain = drain;
+  form->_drain_data = data;
+}
+
+bool form_parser_save(form_parser_t *form, char const *path)
+{
+  if (!form->_in_part || form->_file != NULL || form->_loop == NULL)
+    return false;
+
+  form_file_t *file = mi_zalloc(sizeof(form_file_t));
+  if (file == NULL)
+    return false;
+
+  // truncating can take as long as writing, so the open runs off the loop too and the part's data
+  // queues until it's done
+  file->form = form;
+  file->fd = -1;
+  file->opening = true;
+  file->req.data = file;
+  int err = uv_fs_open(form->_loop, &file->req, path, UV_FS_O_WRONLY | UV_FS_O_CREAT | UV_FS_O_TRUNC, 0600,
+                       _file_open_cb);
+  if (err != 0)
+  {
+    fprintf(stderr, "Form file error %s: %s\n", path, uv_strerror(err));
+    mi_free(file);
+    return false;
+  }
+
+  form->_file = file;
+  form->_files++;
+
+  return true;
+}
+
+bool form_parser_congested(form_parser_t *form)
+{
+  form->_congested = form->_writing > FORM_HIGH_WATER;
+
+  return form->_congested;
+}
+
+bool form_parser_flushed(form_parser_t *form)
+{
+  form->_flushing = form->_writing > 0 || form->_files > 0;
+
+  return !form->_flushing;
+}
+
+// the read buffer is the caller's, what goes to the disk is copied
+static bool _write_file(form_parser_t *form, char const *at, size_t length)
+{
+  form_file_t *file = form->_file;
+  form_write_t *write = mi_malloc(sizeof(form_write_t) + length);
+  if (write == NULL)
+    return false;
+
+  memcpy(write->data, at, length);
+  write->file = file;
+  write->next = NULL;
+  write->length = length;
+  write->written = 0;
+  write->offset = file->offset;
+  file->offset += length;
+  if (file->opening)
+  {
+    if (file->waiting_tail != NULL)
+      file->waiting_tail->next = write;
+    else
+      file->waiting = write;
+    file->waiting_tail = write;
+  }
+  else if (!_write_next(write))
+  {
+    mi_free(write);
+    return false;
+  }
+
+  file->writes++;
+  form->_writing += length;
+
+  return true;
+}
+
+static bool _emit(form_parser_t *form, char const *at, size_t length)
+{
+  if (!form->_in_part || length == 0)
+    return true;
+
+  if (form->_file != NULL)
+    return !form->_failed && _write_file(form, at, length);
+
+  return form->_callbacks.on_data == NULL || form->_callbacks.on_data(form, at, length) == 0;
+}
+
+static bool _begin_part(form_parser_t *form, form_part_t const *part)
+{
+  form->_in_part = true;
+  form->parts++;
+
+  return form->_callbacks.on_part == NULL || form->_callbacks.on_part(form, part) == 0;
+}
+
+static bool _end_part(form_parser_t *form)
+{
+  if (!form->_in_part)
+    return true;
+
+  form->_in_part = false;
+  _end_file(form);
+
+  return form->_callbacks.on_part_end == NULL || form->_callbacks.on_part_end(form) == 0;
+}
+
+static bool _begin_field(form_parser_t *form)
+{
+  // the name is decoded in place, the buffer is free again once on_part returns
+  form_part_t part = {0};
+  part.name = form->_buffer;
+  part.name_length = query_unescape(form->_buffer, form->_buffered, form->_buffer);
+  part.headers = "";
+  form->_buffered = 0;
+
+  return _begin_part(form, &part);
+}
+
+static int _hex(char c)
+{
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+
+  return -1;
+}
+
+// decodes value bytes through the buffer, an escape cut by the end of a read waits in carry
+static bool _emit_value(form_parser_t *form, char const *p, char const *end, bool final)
+{
+  // finish an escape the last read cut off
+  while (form->_carried > 0 && p < end && _hex(*p) >= 0)
+  {
+    if (form->_carried == 1)
+    {
+      form->_carry[form->_carried++] = *p++;
+      continue;
+    }
+
+    char c = (char)(_hex(form->_carry[1]) << 4 | _hex(*p++));
+    form->_carried = 0;
+    if (!_emit(form, &c, 1))
+      return false;
+  }
+
+  if (form->_carried > 0)
+  {
+    if (p == end && !final)
+      return true;
+
+    // not an escape after all
+    unsigned carried = form->_carried;
+    form->_carried = 0;
+    if (!_emit(form, form->_carry, carried))
+      return false;
+  }
+
+  if (!final)
+  {
+    if (end - p >= 1 && end[-1] == '%')
+      form->_carried = 1;
+    else if (end - p >= 2 && end[-2] == '%' && _hex(end[-1]) >= 0)
+      form->_carried = 2;
+    end -= form->_carried;
+    memcpy(form->_carry, end, form->_carried);
+  }
+
+  while (p < end)
+  {
+    char const *stop = end - p > FORM_BUFFER_SIZE ? p + FORM_BUFFER_SIZE : end;
+    // keep escapes whole within a step
+    if (stop < end)
+    {
+      if (stop[-1] == '%')
+        stop -= 1;
+      else if (stop[-2] == '%')
+        stop -= 2;
+    }
+
+    size_t length = query_unescape(p, stop - p, form->_buffer);
+    if (!_emit(form, form->_buffer, length))
+      return false;
+    p = stop;
+  }
+
+  return true;
+}
+
+static bool _execute_urlencoded(form_parser_t *form, char const *p, char const *end)
+{
+  while (p < end)
+  {
+    if (form->_state == URLENCODED_NAME)
+    {
+      char const *stop = p;
+      while (stop < end && *stop != '=' && *stop != '&')
+        stop++;
+
+      if ((size_t)(stop - p) > FORM_BUFFER_SIZE - form->_buffered)
+        return false;
+      memcpy(form->_buffer + form->_buffered, p, stop - p);
+      form->_buffered += stop - p;
+      if (stop == end)
+        return true;
+
+      // "&&" and a trailing '&' are empty pairs, skipped like the query view does
+      if (*stop == '=')
+      {
+        if (!_begin_field(form))
+          return false;
+        form->_state = URLENCODED_VALUE;
+      }
+      else if (form->_buffered > 0 && (!_begin_field(form) || !_end_part(form)))
+      {
+        return false;
+      }
+      p = stop + 1;
+    }
+    else
+    {
+      char const *separator = memchr(p, '&', end - p);
+      char const *stop = separator != NULL ? separator : end;
+      if (!_emit_value(form, p, stop, separator != NULL))
+        return false;
+      if (separator == NULL)
+        return true;
+
+      if (!_end_part(form))
+        return false;
+      form->_state = URLENCODED_NAME;
+      p = separator + 1;
+    }
+  }
+
+  return true;
+}
+
+static bool _parse_part_headers(form_parser_t *form)
+{
+  form_part_t part = {0};
+  part.headers = form->_buffer;
+  // without the blank line
+  part.headers_length = form->_buffered - 2;
+
+  char const *p = form->_buffer;
+  char const *end = form->_buffer + part.headers_length;
+  while (p < end)
+  {
+    char const *line_end = memchr(p, '\r', end - p);
+    char const *colon = memchr(p, ':', end - p);
+    if (line_end == NULL || colon == NULL || colon > line_end)
+      return false;
+
+    size_t name_length = colon - p;
+    char const *value = _skip_space(colon + 1, line_end);
+    size_t value_length = _trim_length(value, line_end);
+
+    if (name_length == sizeof("content-disposition") - 1 && strncasecmp(p, "content-disposition", name_length) == 0)
+    {
+      char const *parameters = memchr(value, ';', value_length);
+      char const *key;
+      size_t key_length;
+      char const *at;
+      size_t length;
+      while (parameters != NULL && _next_parameter(&parameters, value + value_length, &key, &key_length, &at, &length))
+      {
+        if (key_length == 4 && strncasecmp(key, "name", 4) == 0)
+        {
+          part.name = at;
+          part.name_length = length;
+        }
+        else if (key_length == 8 && strncasecmp(key, "filename", 8) == 0)
+        {
+          part.filename = at;
+          part.filename_length = length;
+        }
+      }
+    }
+    else if (name_length == sizeof("content-type") - 1 && strncasecmp(p, "content-type", name_length) == 0)
+    {
+      part.content_type = value;
+      part.content_type_length = value_length;
+    }
+
+    p = line_end + 2;
+  }
+
+  if (part.name == NULL)
+    part.name = "";
+
+  return _begin_part(form, &part);
+}
+
+static bool _delimiter_found(form_parser_t *form)
+{
+  form->_state = MULTIPART_DELIMITER;
+
+  return _end_part(form);
+}
+
+// data up to a delimiter goes out unbuffered; a delimiter cut by the end of a read is held back
+static char const *_execute_data(form_parser_t *form, char const *p, char const *end)
+{
+  char const *delimiter = form->_delimiter;
+  size_t delimiter_length = form->_delimiter_length;
+
+  if (form->_matched > 0)
+  {
+    while (form->_matched < delimiter_length && p < end && *p == delimiter[form->_matched])
+    {
+      p++;
+      form->_matched++;
+    }
+    if (form->_matched == delimiter_length)
+    {
+      form->_matched = 0;
+      return _delimiter_found(form) ? p : NULL;
+    }
+    if (p == end)
+      return p;
+
+    // boundaries hold no CR, so a broken match can't hide another one: it was all data
+    size_t matched = form->_matched;
+    form->_matched = 0;
+    if (!_emit(form, delimiter, matched))
+      return NULL;
+  }
+
+  char const *start = p;
+  while (p < end)
+  {
+    char const *cr = memchr(p, '\r', end - p);
+    if (cr == NULL)
+    {
+      p = end;
+      break;
+    }
+
+    size_t available = end - cr;
+    size_t compare = available < delimiter_length ? available : delimiter_length;
+    if (memcmp(cr, delimiter, compare) != 0)
+    {
+      p = cr + 1;
+      continue;
+    }
+
+    if (!_emit(form, start, cr - start))
+      return NULL;
+    if (compare < delimiter_length)
+    {
+      form->_matched = compare;
+      return end;
+    }
+
+    return _delimiter_found(form) ? cr + delimiter_length : NULL;
+  }
+
+  return _emit(form, start, p - start) ? p : NULL;
+}
+
+static bool _execute_multipart(form_parser_t *form, char const *p, char const *end)
+{
+  while (p < end)
+  {
+    switch (form->_state)
+    {
+    case MULTIPART_DATA:
+      p = _execute_data(form, p, end);
+      if (p == NULL)
+        return false;
+      break;
+    case MULTIPART_DELIMITER:
+      if (*p == '-')
+        form->_state = MULTIPART_CLOSE;
+      else if (*p == '\r')
+        form->_state = MULTIPART_HEADER_LF;
+      else if (*p != ' ' && *p != '\t')
+        return false;
+      p++;
+      break;
+    case MULTIPART_CLOSE:
+      if (*p++ != '-')
+        return false;
+      form->_state = MULTIPART_EPILOGUE;
+      break;
+    case MULTIPART_HEADER_LF:
+      if (*p++ != '\n')
+        return false;
+      form->_state = MULTIPART_HEADERS;
+      form->_buffered = 0;
+      break;
+    case MULTIPART_HEADERS:
+    {
+      char const *lf = memchr(p, '\n', end - p);
+      char const *stop = lf != NULL ? lf + 1 : end;
+      if ((size_t)(stop - p) > FORM_BUFFER_SIZE - form->_buffered)
+        return false;
+      memcpy(form->_buffer + form->_buffered, p, stop - p);
+      form->_buffered += stop - p;
+      p = stop;
+
+      char const *buffer = form->_buffer;
+      size_t buffered = form->_buffered;
+      bool blank = (buffered == 2 && buffer[0] == '\r') ||
+                   (buffered >= 4 && memcmp(buffer + buffered - 4, "\r\n\r\n", 4) == 0);
+      if (lf != NULL && blank)
+      {
+        if (!_parse_part_headers(form))
+          return false;
+        form->_state = MULTIPART_DATA;
+      }
+      break;
+    }
+    case MULTIPART_EPILOGUE:
+      return true;
+    default:
+      return false;
+    }
+  }
+
+  return true;
+}
+
+bool form_parser_execute(form_parser_t *form, char const *data, size_t length)
+{
+  if (form->_failed)
+    return false;
+
+  bool ok = form->type == FORM_URLENCODED ? _execute_urlencoded(form, data, data + length)
+                                          : _execute_multipart(form, data, data + length);
+  form->_failed = !ok;
+
+  return ok;
+}
+
+bool form_parser_finish(form_parser_t *form)
+{
+  if (form->_failed)
+    return false;
+
+  if (form->type == FORM_MULTIPART)
+    return form->_state == MULTIPART_EPILOGUE;
+
+  bool ok = true;
+  if (form->_state == URLENCODED_VALUE)
+    ok = _emit_value(form, NULL, NULL, true) && _end_part(form);
+  else if (form->_buffered > 0)
+    ok = _begin_field(form) && _end_part(form);
+
+  form->_state = URLENCODED_NAME;
+  form->_failed = !ok;
+
+  return ok;
+}
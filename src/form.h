@@ -0,0 +1,98 @@
+#if !defined(_FORM_H_)
+#define _FORM_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <uv.h>
+
+// part headers and urlencoded names must fit, values and part data are never buffered
+#define FORM_BUFFER_SIZE 8192
+// RFC 2046 limit
+#define FORM_BOUNDARY_SIZE 70
+// saved bytes still on their way to the disk above which the body stops being read
+#define FORM_HIGH_WATER (1024 * 1024)
+
+typedef struct form_parser form_parser_t;
+struct form_file;
+
+// the disk caught up with a congested parser, or a flush it was asked for is done
+typedef void (*form_drain_f)(form_parser_t *form, void *data);
+
+typedef enum form_type
+{
+  FORM_URLENCODED,
+  FORM_MULTIPART
+} form_type_t;
+
+typedef struct form_part
+{
+  // urlencoded names are decoded; filename and content_type are NULL unless the part carries them
+  char const *name, *filename, *content_type;
+  size_t name_length, filename_length, content_type_length;
+  // raw multipart header block, empty for urlencoded fields
+  char const *headers;
+  size_t headers_length;
+} form_part_t;
+
+// nonzero from a callback fails the body; spans are only valid during the call
+typedef struct form_callbacks
+{
+  int (*on_part)(form_parser_t *form, form_part_t const *part);
+  // decoded for urlencoded values, raw for multipart parts, called any number of times
+  int (*on_data)(form_parser_t *form, char const *at, size_t length);
+  int (*on_part_end)(form_parser_t *form);
+  // the parser is going away, complete or not; the place to release data
+  void (*on_close)(form_parser_t *form);
+} form_callbacks_t;
+
+struct form_parser
+{
+  void *data;
+  form_type_t type;
+  // parts seen so far, the current one included
+  size_t parts;
+  form_callbacks_t _callbacks;
+  int _state;
+  bool _in_part, _failed;
+  // the current part's file; saved parts are written by the threadpool, not on the loop
+  uv_loop_t *_loop;
+  struct form_file *_file;
+  size_t _writing;
+  unsigned _files;
+  bool _congested, _flushing, _deleted;
+  form_drain_f _drain;
+  void *_drain_data;
+  char _carry[2];
+  unsigned _carried;
+  size_t _matched, _delimiter_length, _buffered;
+  char _delimiter[4 + FORM_BOUNDARY_SIZE];
+  char _buffer[FORM_BUFFER_SIZE];
+};
+
+// NULL when content_type is neither form type or a multipart boundary is missing
+form_parser_t *form_parser_new(
+  uv_loop_t *loop,
+  char const *content_type,
+  size_t length,
+  form_callbacks_t const *callbacks,
+  void *data);
+// files still being written finish in the background
+void form_parser_delete(form_parser_t *form);
+// called from the loop once the parser stops being congested or finishes a flush
+void form_parser_on_drain(form_parser_t *form, form_drain_f drain, void *data);
+
+bool form_parser_execute(form_parser_t *form, char const *data, size_t length);
+// false when the body ended inside a multipart body or a callback failed
+bool form_parser_finish(form_parser_t *form);
+
+// from on_part: the rest of this part is written to a new file at path instead of on_data, copied
+// out of the read buffer and opened and written off the loop; the file is closed once its writes are
+// done, and a failed open or write fails the form
+bool form_parser_save(form_parser_t *form, char const *path);
+// after execute: more than FORM_HIGH_WATER is waiting for the disk, reading should wait for drain
+bool form_parser_congested(form_parser_t *form);
+// every saved part is written and closed; when not, drain is called once they are
+bool form_parser_flushed(form_parser_t *form);
+
+#endif // _FORM_H_
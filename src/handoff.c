@@ -0,0 +1,405 @@
+#include "handoff.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <mimalloc.h>
+
+#define HANDOFF_SOCKET_MODE 0600
+// the first fd a supervisor passes, after stdin, stdout and stderr
+#define LISTEN_FDS_START 3
+
+typedef struct inherited
+{
+  uv_os_sock_t fd;
+  struct sockaddr_storage addr;
+  bool taken;
+} inherited_t;
+
+// filled before any loop starts; workers create their listeners one at a time, so takes never race
+static inherited_t _inherited[HANDOFF_MAX_FDS];
+static size_t _inherited_count;
+// the old process, waiting to hear the new one is accepting
+static int _predecessor = -1;
+
+static bool _adopt(uv_os_sock_t fd)
+{
+  // only listening stream sockets are of any use to a listener
+  int listening = 0;
+  socklen_t size = sizeof(listening);
+  if (_inherited_count == HANDOFF_MAX_FDS ||
+      getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &size) != 0 || !listening)
+  {
+    close(fd);
+    return false;
+  }
+
+  inherited_t *inherited = &_inherited[_inherited_count];
+  socklen_t length = sizeof(inherited->addr);
+  if (getsockname(fd, (struct sockaddr *)&inherited->addr, &length) != 0)
+  {
+    close(fd);
+    return false;
+  }
+
+  inherited->fd = fd;
+  inherited->taken = false;
+  _inherited_count++;
+
+  return true;
+}
+
+static void _release(void)
+{
+  for (size_t i = 0; i < _inherited_count; i++)
+  {
+    if (!_inherited[i].taken)
+      close(_inherited[i].fd);
+  }
+  _inherited_count = 0;
+}
+
+static bool _pipe_address(char const *path, struct sockaddr_un *addr)
+{
+  size_t length = strlen(path);
+  if (length >= sizeof(addr->sun_path))
+    return false;
+
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  memcpy(addr->sun_path, path, length);
+
+  return true;
+}
+
+// one message per batch of rights, its single byte says whether another follows
+static bool _receive_batch(int sock, bool *more)
+{
+  char byte;
+  struct iovec iov = {.iov_base = &byte, .iov_len = 1};
+  union
+  {
+    char buffer[CMSG_SPACE(sizeof(int) * HANDOFF_FDS_PER_MESSAGE)];
+    struct cmsghdr align;
+  } control;
+  struct msghdr message = {
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+    .msg_control = control.buffer,
+    .msg_controllen = sizeof(control.buffer),
+  };
+
+  ssize_t received;
+  do
+    received = recvmsg(sock, &message, MSG_CMSG_CLOEXEC);
+  while (received < 0 && errno == EINTR);
+  if (received <= 0)
+    return false;
+
+  for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message); cmsg != NULL; cmsg = CMSG_NXTHDR(&message, cmsg))
+  {
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+      continue;
+
+    size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    for (size_t i = 0; i < count; i++)
+    {
+      int fd;
+      memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+      _adopt(fd);
+    }
+  }
+
+  // truncated rights were closed by the kernel, the listeners they belonged to are lost
+  *more = byte != 0;
+  return !(message.msg_flags & MSG_CTRUNC);
+}
+
+bool handoff_receive(char const *path)
+{
+  struct sockaddr_un addr;
+  if (!_pipe_address(path, &addr))
+  {
+    fprintf(stderr, "Handoff socket path too long %s\n", path);
+    return false;
+  }
+
+  int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (sock < 0)
+    return false;
+
+  // nobody there is the first start, not an error
+  if (connect(sock, (struct sockaddr const *)&addr, sizeof(addr)) != 0)
+  {
+    if (errno != ENOENT && errno != ECONNREFUSED)
+      fprintf(stderr, "Handoff connect error %s %s\n", path, strerror(errno));
+    close(sock);
+    return false;
+  }
+
+  bool more = true;
+  while (more)
+  {
+    if (!_receive_batch(sock, &more))
+    {
+      fprintf(stderr, "Handoff receive error %s\n", path);
+      _release();
+      close(sock);
+      return false;
+    }
+  }
+
+  _predecessor = sock;
+  printf("Took over %zu listening sockets from %s\n", _inherited_count, path);
+
+  return true;
+}
+
+bool handoff_inherit_env(void)
+{
+  char const *pid = getenv("LISTEN_PID");
+  char const *fds = getenv("LISTEN_FDS");
+  if (pid == NULL || fds == NULL || atol(pid) != (long)getpid())
+    return false;
+
+  // not passed on to whatever this process starts
+  unsetenv("LISTEN_PID");
+  unsetenv("LISTEN_FDS");
+  unsetenv("LISTEN_FDNAMES");
+
+  int count = atoi(fds);
+  for (int fd = LISTEN_FDS_START; fd < LISTEN_FDS_START + count; fd++)
+  {
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    _adopt(fd);
+  }
+
+  return true;
+}
+
+static bool _same_address(struct sockaddr const *a, struct sockaddr const *b)
+{
+  if (a->sa_family != b->sa_family)
+    return false;
+
+  switch (a->sa_family)
+  {
+  case AF_INET:
+  {
+    struct sockaddr_in const *a4 = (struct sockaddr_in const *)a, *b4 = (struct sockaddr_in const *)b;
+    return a4->sin_port == b4->sin_port && a4->sin_addr.s_addr == b4->sin_addr.s_addr;
+  }
+  case AF_INET6:
+  {
+    struct sockaddr_in6 const *a6 = (struct sockaddr_in6 const *)a, *b6 = (struct sockaddr_in6 const *)b;
+    return a6->sin6_port == b6->sin6_port && memcmp(&a6->sin6_addr, &b6->sin6_addr, sizeof(a6->sin6_addr)) == 0;
+  }
+  case AF_UNIX:
+    return strncmp(((struct sockaddr_un const *)a)->sun_path, ((struct sockaddr_un const *)b)->sun_path,
+                   sizeof(((struct sockaddr_un const *)a)->sun_path)) == 0;
+  default:
+    return false;
+  }
+}
+
+uv_os_sock_t handoff_take(struct sockaddr const *addr)
+{
+  for (size_t i = 0; i < _inherited_count; i++)
+  {
+    inherited_t *inherited = &_inherited[i];
+    if (!inherited->taken && _same_address((struct sockaddr const *)&inherited->addr, addr))
+    {
+      inherited->taken = true;
+      return inherited->fd;
+    }
+  }
+
+  return -1;
+}
+
+void handoff_ready(void)
+{
+  _release();
+  if (_predecessor < 0)
+    return;
+
+  char const ready = 1;
+  ssize_t written;
+  do
+    written = write(_predecessor, &ready, 1);
+  while (written < 0 && errno == EINTR);
+  if (written != 1)
+    fprintf(stderr, "Handoff ready error %s\n", strerror(errno));
+
+  close(_predecessor);
+  _predecessor = -1;
+}
+
+static void _free_cb(uv_handle_t *handle)
+{
+  mi_free(handle);
+}
+
+static bool _send(handoff_t *handoff, uv_pipe_t *client)
+{
+  uv_os_fd_t sock;
+  if (uv_fileno((uv_handle_t *)client, &sock) != 0)
+    return false;
+
+  uv_os_sock_t fds[HANDOFF_MAX_FDS];
+  size_t count = handoff->collect(fds, HANDOFF_MAX_FDS, handoff->data);
+
+  size_t sent = 0;
+  do
+  {
+    size_t batch = count - sent < HANDOFF_FDS_PER_MESSAGE ? count - sent : HANDOFF_FDS_PER_MESSAGE;
+    char byte = sent + batch < count;
+    struct iovec iov = {.iov_base = &byte, .iov_len = 1};
+    union
+    {
+      char buffer[CMSG_SPACE(sizeof(int) * HANDOFF_FDS_PER_MESSAGE)];
+      struct cmsghdr align;
+    } control;
+    struct msghdr message = {.msg_iov = &iov, .msg_iovlen = 1};
+    if (batch > 0)
+    {
+      memset(&control, 0, sizeof(control));
+      message.msg_control = control.buffer;
+      message.msg_controllen = CMSG_SPACE(sizeof(int) * batch);
+
+      struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message);
+      cmsg->cmsg_level = SOL_SOCKET;
+      cmsg->cmsg_type = SCM_RIGHTS;
+      cmsg->cmsg_len = CMSG_LEN(sizeof(int) * batch);
+      memcpy(CMSG_DATA(cmsg), fds + sent, sizeof(int) * batch);
+    }
+
+    // a fresh local socket has room for a byte, the fds don't count against its buffer
+    ssize_t written;
+    do
+      written = sendmsg(sock, &message, MSG_NOSIGNAL);
+    while (written < 0 && errno == EINTR);
+    if (written != 1)
+    {
+      fprintf(stderr, "Handoff send error %s\n", strerror(errno));
+      return false;
+    }
+
+    sent += batch;
+  } while (sent < count);
+
+  return true;
+}
+
+static void _finish(handoff_t *handoff, bool handed_off)
+{
+  if (handoff->client != NULL)
+    uv_close((uv_handle_t *)handoff->client, _free_cb);
+
+  // the socket file is the successor's now
+  if (handed_off)
+    listener_release(handoff->listener);
+  else
+    listener_close(handoff->listener);
+
+  mi_free(handoff);
+}
+
+static void _alloc_cb(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf)
+{
+  static char byte;
+
+  *buf = uv_buf_init(&byte, 1);
+}
+
+static void _read_cb(uv_stream_t *stream, ssize_t nread, uv_buf_t const *buf)
+{
+  handoff_t *handoff = stream->data;
+
+  if (nread > 0)
+  {
+    handoff_done_f done = handoff->done;
+    void *data = handoff->data;
+
+    _finish(handoff, true);
+    done(data);
+    return;
+  }
+
+  // the new process went away before accepting, this one carries on
+  if (nread < 0)
+  {
+    fprintf(stderr, "Handoff abandoned\n");
+    uv_close((uv_handle_t *)stream, _free_cb);
+    handoff->client = NULL;
+  }
+}
+
+static void _connection_cb(uv_stream_t *stream, int status)
+{
+  handoff_t *handoff = stream->data;
+  if (status < 0)
+    return;
+
+  uv_pipe_t *client = mi_malloc(sizeof(uv_pipe_t));
+  if (client == NULL || uv_pipe_init(stream->loop, client, 0) != 0)
+  {
+    mi_free(client);
+    return;
+  }
+
+  // one successor at a time, another one has to try again once this one has finished
+  if (uv_accept(stream, (uv_stream_t *)client) != 0 || handoff->client != NULL || !_send(handoff, client))
+  {
+    uv_close((uv_handle_t *)client, _free_cb);
+    return;
+  }
+
+  client->data = handoff;
+  handoff->client = client;
+  uv_read_start((uv_stream_t *)client, _alloc_cb, _read_cb);
+}
+
+handoff_t *handoff_serve(uv_loop_t *loop, char const *path, handoff_collect_f collect, handoff_done_f done,
+                         void *data)
+{
+  handoff_t *handoff = mi_zalloc(sizeof(handoff_t));
+  if (handoff == NULL)
+    return NULL;
+
+  handoff->listener = listener_pipe(loop, path, HANDOFF_SOCKET_MODE);
+  if (handoff->listener == NULL)
+  {
+    mi_free(handoff);
+    return NULL;
+  }
+
+  handoff->collect = collect;
+  handoff->done = done;
+  handoff->data = data;
+  handoff->listener->handle.data = handoff;
+
+  int err = uv_listen(&handoff->listener->stream, 1, _connection_cb);
+  if (err)
+  {
+    fprintf(stderr, "Handoff listen error %s %s\n", path, uv_strerror(err));
+    listener_close(handoff->listener);
+    mi_free(handoff);
+    return NULL;
+  }
+
+  return handoff;
+}
+
+void handoff_close(handoff_t *handoff)
+{
+  if (handoff != NULL)
+    _finish(handoff, false);
+}
@@ -0,0 +1,49 @@
+#if !defined(_HANDOFF_H_)
+#define _HANDOFF_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <uv.h>
+
+#include "listener.h"
+
+// most listening sockets one process takes over from another
+#define HANDOFF_MAX_FDS 512
+// SCM_MAX_FD, the kernel refuses more rights than that in one message
+#define HANDOFF_FDS_PER_MESSAGE 253
+
+// the listening sockets to pass on, fds are only borrowed; the number written, at most max
+typedef size_t (*handoff_collect_f)(uv_os_sock_t *fds, size_t max, void *data);
+// the new process is accepting, the old one should drain and exit
+typedef void (*handoff_done_f)(void *data);
+
+// the old process's end, see handoff_serve
+typedef struct handoff
+{
+  listener_t *listener;
+  // the one new process being handed the sockets
+  uv_pipe_t *client;
+  handoff_collect_f collect;
+  handoff_done_f done;
+  void *data;
+} handoff_t;
+
+// the new process's end, before any listener is created: connects to the old process at path and takes
+// the listening sockets it passes. False when nothing answers there, the listeners are bound afresh
+bool handoff_receive(char const *path);
+// adopts the LISTEN_FDS sockets a supervisor passed from fd 3 on, the systemd way
+bool handoff_inherit_env(void);
+// called by the listeners: an inherited listening socket bound to addr, each only given out once;
+// -1 when there's none
+uv_os_sock_t handoff_take(struct sockaddr const *addr);
+// once listening: closes what no listener took and tells the old process to let go
+void handoff_ready(void);
+
+// listens at path for the next process; when one has taken the sockets and is accepting, done is called
+// and the handoff closes itself, leaving the socket file to its successor
+handoff_t *handoff_serve(uv_loop_t *loop, char const *path, handoff_collect_f collect, handoff_done_f done,
+                         void *data);
+void handoff_close(handoff_t *handoff);
+
+#endif // _HANDOFF_H_
@@ -0,0 +1,227 @@
+#include "listener.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <mimalloc.h>
+
+#include "handoff.h"
+
+static void _free_cb(uv_handle_t *handle)
+{
+  mi_free(handle);
+}
+
+listener_t *listener_tcp(uv_loop_t *loop, char const *host, int port, socket_options_t const *options)
+{
+  socket_options_t defaults;
+  if (options == NULL)
+  {
+    socket_options_default(&defaults);
+    options = &defaults;
+  }
+
+  char const *invalid = socket_options_validate(options);
+  if (invalid != NULL)
+  {
+    fprintf(stderr, "Invalid socket options for %s:%d: %s\n", host, port, invalid);
+    return NULL;
+  }
+
+  struct sockaddr_storage addr;
+  if (uv_ip4_addr(host, port, (struct sockaddr_in *)&addr) &&
+      uv_ip6_addr(host, port, (struct sockaddr_in6 *)&addr))
+  {
+    fprintf(stderr, "Invalid address %s\n", host);
+    return NULL;
+  }
+
+  listener_t *listener = mi_zalloc_small(sizeof(listener_t));
+  if (listener == NULL)
+    return NULL;
+
+  listener->type = LISTENER_TCP;
+  listener->options = *options;
+  if (uv_tcp_init(loop, &listener->tcp))
+  {
+    mi_free(listener);
+    return NULL;
+  }
+
+  int err;
+  uv_os_sock_t inherited = handoff_take((struct sockaddr const *)&addr);
+  if (inherited >= 0)
+  {
+    // already bound and listening, with whatever options the process before set on it
+    if ((err = uv_tcp_open(&listener->tcp, inherited)) != 0)
+      close(inherited);
+  }
+  else if (options->reuseport)
+  {
+    // libuv only learned UV_TCP_REUSEPORT in 1.49, so the socket is bound here and handed over
+    uv_os_sock_t fd;
+    err = socket_options_bind((struct sockaddr const *)&addr, options, &fd);
+    if (err == 0 && (err = uv_tcp_open(&listener->tcp, fd)) != 0)
+      close(fd);
+  }
+  else
+  {
+    err = uv_tcp_bind(&listener->tcp, (struct sockaddr const *)&addr,
+                      socket_options_bind_flags(options, (struct sockaddr const *)&addr));
+  }
+  if (err)
+  {
+    fprintf(stderr, "Bind error %s:%d %s\n", host, port, uv_strerror(err));
+    uv_close(&listener->handle, _free_cb);
+    return NULL;
+  }
+  socket_options_apply_listener(&listener->tcp, options);
+
+  return listener;
+}
+
+listener_t *listener_pipe(uv_loop_t *loop, char const *path, int mode)
+{
+  listener_t *listener = mi_zalloc_small(sizeof(listener_t));
+  if (listener == NULL)
+    return NULL;
+
+  listener->path = mi_strdup(path);
+  if (listener->path == NULL)
+  {
+    mi_free(listener);
+    return NULL;
+  }
+
+  listener->type = LISTENER_PIPE;
+  if (uv_pipe_init(loop, &listener->pipe, 0))
+  {
+    mi_free(listener->path);
+    mi_free(listener);
+    return NULL;
+  }
+
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  size_t path_length = strlen(path);
+  int err = path_length < sizeof(addr.sun_path) ? 0 : UV_ENAMETOOLONG;
+  if (err == 0)
+    memcpy(addr.sun_path, path, path_length);
+
+  uv_os_sock_t inherited = err == 0 ? handoff_take((struct sockaddr const *)&addr) : -1;
+  if (inherited >= 0)
+  {
+    if ((err = uv_pipe_open(&listener->pipe, inherited)) != 0)
+      close(inherited);
+  }
+  else if (err == 0)
+  {
+    // a socket file left by a previous run would fail the bind, anything else is not ours to remove
+    struct stat st;
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+      unlink(path);
+
+    // bound here rather than by uv_pipe_bind, which would unlink the file on close even once it's a
+    // successor's; the umask covers the window between bind and chmod
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    mode_t old_mask = umask(mode != 0 ? ~mode & 0777 : 0);
+    bool bound = sock >= 0 && bind(sock, (struct sockaddr const *)&addr, sizeof(addr)) == 0;
+    if (!bound)
+      err = uv_translate_sys_error(errno);
+    umask(old_mask);
+
+    if (err == 0 && mode != 0 && chmod(path, mode) != 0)
+      err = uv_translate_sys_error(errno);
+    if (err == 0)
+      err = uv_pipe_open(&listener->pipe, sock);
+
+    if (err && sock >= 0)
+      close(sock);
+    if (err && bound)
+      unlink(path);
+  }
+
+  if (err)
+  {
+    fprintf(stderr, "Bind error %s %s\n", path, uv_strerror(err));
+    mi_free(listener->path);
+    listener->path = NULL;
+    uv_close(&listener->handle, _free_cb);
+    return NULL;
+  }
+
+  return listener;
+}
+
+static void _close_cb(uv_handle_t *handle)
+{
+  listener_t *listener = LISTENER(handle);
+
+  if (listener->path != NULL)
+  {
+    unlink(listener->path);
+    mi_free(listener->path);
+  }
+  mi_free(listener);
+}
+
+void listener_close(listener_t *listener)
+{
+  if (listener == NULL || uv_is_closing(&listener->handle))
+    return;
+
+  uv_close(&listener->handle, _close_cb);
+}
+
+void listener_release(listener_t *listener)
+{
+  if (listener == NULL || uv_is_closing(&listener->handle))
+    return;
+
+  mi_free(listener->path);
+  listener->path = NULL;
+  listener_close(listener);
+}
+
+void listener_client_configure(listener_t *listener, uv_os_sock_t fd)
+{
+  if (listener->type == LISTENER_TCP)
+    socket_options_apply_client(fd, &listener->options);
+}
+
+void listener_report(listener_t *listener)
+{
+  if (listener->type == LISTENER_PIPE)
+  {
+    printf("Listening on unix:%s\n", listener->path);
+    return;
+  }
+
+  char name[INET6_ADDRSTRLEN + 8] = "?";
+  struct sockaddr_storage addr;
+  int length = sizeof(addr);
+  if (uv_tcp_getsockname(&listener->tcp, (struct sockaddr *)&addr, &length) == 0)
+  {
+    char host[INET6_ADDRSTRLEN] = "";
+    int port;
+    if (addr.ss_family == AF_INET6)
+    {
+      uv_ip6_name((struct sockaddr_in6 *)&addr, host, sizeof(host));
+      port = ntohs(((struct sockaddr_in6 *)&addr)->sin6_port);
+      snprintf(name, sizeof(name), "[%s]:%d", host, port);
+    }
+    else
+    {
+      uv_ip4_name((struct sockaddr_in *)&addr, host, sizeof(host));
+      port = ntohs(((struct sockaddr_in *)&addr)->sin_port);
+      snprintf(name, sizeof(name), "%s:%d", host, port);
+    }
+  }
+
+  socket_options_report(&listener->tcp, name, &listener->options);
+}
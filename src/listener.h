@@ -0,0 +1,44 @@
+#if !defined(_LISTENER_H_)
+#define _LISTENER_H_
+
+#include <stdbool.h>
+
+#include <uv.h>
+
+#include "socket_options.h"
+
+typedef enum listener_type
+{
+  LISTENER_TCP,
+  LISTENER_PIPE
+} listener_type_t;
+
+typedef struct listener
+{
+  // kept first so the handle and the listener share an address
+  union
+  {
+    uv_handle_t handle;
+    uv_stream_t stream;
+    uv_tcp_t tcp;
+    uv_pipe_t pipe;
+  };
+  listener_type_t type;
+  struct server *server;
+  char *path;
+  socket_options_t options;
+} listener_t;
+
+#define LISTENER(stream) ((listener_t *)(stream))
+
+listener_t *listener_tcp(uv_loop_t *loop, char const *host, int port, socket_options_t const *options);
+listener_t *listener_pipe(uv_loop_t *loop, char const *path, int mode);
+void listener_close(listener_t *listener);
+// closes this process's hold on the socket and leaves a unix socket's file for the one that took it over
+void listener_release(listener_t *listener);
+
+void listener_report(listener_t *listener);
+
+void listener_client_configure(listener_t *listener, uv_os_sock_t fd);
+
+#endif // _LISTENER_H_
@@ -0,0 +1,204 @@
+#include "loop.h"
+
+#include <mimalloc.h>
+
+#include "proxy.h"
+#include "sse.h"
+
+// runs what was posted, at most a mailbox worth per wakeup so steady producers can't hold the loop
+static void _mailbox_cb(uv_async_t *async)
+{
+  loop_context_t *ctx = async->loop->data;
+
+  size_t budget = mpsc_capacity(ctx->mailbox);
+  loop_message_t *message;
+  while (budget > 0 && (message = mpsc_pop(ctx->mailbox)) != NULL)
+  {
+    message->run(message, ctx);
+    budget--;
+  }
+
+  // the rest waits for the next iteration
+  if (budget == 0)
+    uv_async_send(async);
+}
+
+// a context that failed after its mailbox handle was set up goes once the loop has let go of it
+static void _abandoned_cb(uv_handle_t *handle)
+{
+  mi_free(handle->data);
+}
+
+loop_context_t *loop_context_get(uv_loop_t *loop)
+{
+  if (loop->data != NULL)
+    return loop->data;
+
+  loop_context_t *ctx = mi_zalloc_small(sizeof(loop_context_t));
+  if (ctx == NULL)
+    return NULL;
+
+  ctx->loop = loop;
+
+  if (!memory_init(&ctx->memory))
+  {
+    mi_free(ctx);
+    return NULL;
+  }
+
+  ctx->compression_pool = compression_pool_new(LOOP_COMPRESSION_POOL_SIZE);
+  if (ctx->compression_pool == NULL)
+  {
+    memory_close(&ctx->memory);
+    mi_free(ctx);
+    return NULL;
+  }
+
+  ctx->compression_cache = compression_cache_new(LOOP_COMPRESSION_CACHE_BYTES, &ctx->memory);
+  if (ctx->compression_cache == NULL)
+  {
+    compression_pool_delete(ctx->compression_pool);
+    memory_close(&ctx->memory);
+    mi_free(ctx);
+    return NULL;
+  }
+
+  ctx->mailbox = mpsc_new(LOOP_MAILBOX_CAPACITY);
+  if (ctx->mailbox == NULL)
+  {
+    compression_cache_delete(ctx->compression_cache);
+    compression_pool_delete(ctx->compression_pool);
+    memory_close(&ctx->memory);
+    mi_free(ctx);
+    return NULL;
+  }
+
+  if (!overload_init(&ctx->overload))
+  {
+    mpsc_delete(ctx->mailbox);
+    compression_cache_delete(ctx->compression_cache);
+    compression_pool_delete(ctx->compression_pool);
+    memory_close(&ctx->memory);
+    mi_free(ctx);
+    return NULL;
+  }
+
+  // only there for other threads, it doesn't keep the loop alive; it takes an eventfd, which can run out
+  if (uv_async_init(loop, &ctx->mailbox_async, _mailbox_cb) != 0)
+  {
+    overload_close(&ctx->overload);
+    mpsc_delete(ctx->mailbox);
+    compression_cache_delete(ctx->compression_cache);
+    compression_pool_delete(ctx->compression_pool);
+    memory_close(&ctx->memory);
+    mi_free(ctx);
+    return NULL;
+  }
+  uv_unref((uv_handle_t *)&ctx->mailbox_async);
+
+  if (!profiler_init(&ctx->profiler, loop, overload_tick, &ctx->overload))
+  {
+    overload_close(&ctx->overload);
+    mpsc_delete(ctx->mailbox);
+    compression_cache_delete(ctx->compression_cache);
+    compression_pool_delete(ctx->compression_pool);
+    memory_close(&ctx->memory);
+    ctx->mailbox_async.data = ctx;
+    uv_close((uv_handle_t *)&ctx->mailbox_async, _abandoned_cb);
+    return NULL;
+  }
+
+  ctx->overload.memory = &ctx->memory;
+  dl_init(&ctx->connections);
+  dl_init(&ctx->flushing);
+  dl_init(&ctx->deferred);
+  tracer_init(&ctx->tracer, TRACE_DEFAULT_CAPACITY);
+  capture_init(&ctx->capture);
+  date_cache_init(&ctx->date, loop);
+  // the connections it flushes keep the loop alive themselves
+  uv_check_init(loop, &ctx->flush_check);
+  uv_unref((uv_handle_t *)&ctx->flush_check);
+  uv_idle_init(loop, &ctx->flush_idle);
+  uv_unref((uv_handle_t *)&ctx->flush_idle);
+  uv_idle_init(loop, &ctx->deferred_idle);
+  uv_unref((uv_handle_t *)&ctx->deferred_idle);
+
+  loop->data = ctx;
+
+  return ctx;
+}
+
+static void _handle_close_cb(uv_handle_t *handle)
+{
+  loop_context_t *ctx = handle->loop->data;
+
+  if (--ctx->closing_handles > 0)
+    return;
+
+  uring_delete(ctx->uring);
+  // nothing posts anymore, but what already was still runs
+  loop_message_t *message;
+  while ((message = mpsc_pop(ctx->mailbox)) != NULL)
+    message->run(message, ctx);
+  mpsc_delete(ctx->mailbox);
+  sse_hub_delete(ctx->sse);
+  // flights end with their leader's request, the table is all that's left
+  if (ctx->flights != NULL)
+    ht_delete(ctx->flights, NULL);
+  tracer_close(&ctx->tracer);
+  capture_close(&ctx->capture);
+  overload_close(&ctx->overload);
+  compression_cache_delete(ctx->compression_cache);
+  compression_pool_delete(ctx->compression_pool);
+  memory_close(&ctx->memory);
+  handle->loop->data = NULL;
+  mi_free(ctx);
+}
+
+// counted as it's closed, so no tally elsewhere has to follow the handles the context gains
+static void _close(loop_context_t *ctx, uv_handle_t *handle)
+{
+  ctx->closing_handles++;
+  uv_close(handle, _handle_close_cb);
+}
+
+void loop_context_delete(uv_loop_t *loop)
+{
+  loop_context_t *ctx = loop->data;
+  if (ctx == NULL || ctx->closing_handles > 0)
+    return;
+
+  // the context goes away once its own handles have closed, so keep running the loop after this
+  ll_delete(ctx->proxy_pools, (ll_cleanup_f)proxy_pool_close);
+  ctx->proxy_pools = NULL;
+  ll_delete(ctx->rate_limits, (ll_cleanup_f)rate_limit_table_delete);
+  ctx->rate_limits = NULL;
+  ctx->closing_handles += profiler_close(&ctx->profiler, _handle_close_cb);
+  ctx->closing_handles += date_cache_close(&ctx->date, _handle_close_cb);
+  if (ctx->uring != NULL)
+    ctx->closing_handles += uring_close(ctx->uring, _handle_close_cb);
+  sse_hub_close(ctx->sse);
+  _close(ctx, (uv_handle_t *)&ctx->mailbox_async);
+  _close(ctx, (uv_handle_t *)&ctx->flush_check);
+  _close(ctx, (uv_handle_t *)&ctx->flush_idle);
+  _close(ctx, (uv_handle_t *)&ctx->deferred_idle);
+}
+
+uring_t *loop_context_uring(loop_context_t *ctx)
+{
+  if (ctx->uring == NULL)
+    ctx->uring = uring_new(ctx->loop);
+
+  return ctx->uring;
+}
+
+bool loop_post(loop_context_t *ctx, loop_message_t *message)
+{
+  if (!mpsc_push(ctx->mailbox, message))
+    return false;
+
+  // wakeups coalesce, the loop drains everything posted by the time it runs
+  uv_async_send(&ctx->mailbox_async);
+
+  return true;
+}
@@ -0,0 +1,82 @@
+#if !defined(_LOOP_H_)
+#define _LOOP_H_
+
+#include <uv.h>
+
+#include "collections/dlist.h"
+#include "collections/hashtable.h"
+#include "collections/linked_list.h"
+#include "collections/mpsc_queue.h"
+#include "capture.h"
+#include "compression.h"
+#include "date.h"
+#include "memory.h"
+#include "overload.h"
+#include "profiler.h"
+#include "rate_limit.h"
+#include "trace.h"
+#include "uring.h"
+
+struct loop_context;
+
+typedef struct loop_message loop_message_t;
+typedef void (*loop_message_cb)(loop_message_t *message, struct loop_context *ctx);
+
+// embedded in what another thread hands a loop, see loop_post
+struct loop_message
+{
+  loop_message_cb run;
+};
+
+typedef struct loop_context
+{
+  uv_loop_t *loop;
+  memory_t memory;
+  compression_pool_t *compression_pool;
+  compression_cache_t *compression_cache;
+  overload_t overload;
+  // served connections, least recently active first
+  dlist_t connections;
+  profiler_t profiler;
+  tracer_t tracer;
+  // raw inbound bytes of every connection, only while configured
+  capture_t capture;
+  date_cache_t date;
+  // messages from other threads, run in batches per wakeup
+  mpsc_queue_t *mailbox;
+  uv_async_t mailbox_async;
+  // connections with writes waiting for the end of the iteration, see connection_write
+  dlist_t flushing;
+  uv_check_t flush_check;
+  // active alongside it, so writes queued outside the poll phase don't wait for the next event
+  uv_idle_t flush_idle;
+  // connections that used up their turn, resumed in order from the next iteration's idle phase
+  dlist_t deferred;
+  uv_idle_t deferred_idle;
+  // only created for servers on the io_uring transport
+  uring_t *uring;
+  // upstream connections of each proxy used on the loop
+  linked_list_t *proxy_pools;
+  // token buckets of each rate limit used on the loop
+  linked_list_t *rate_limits;
+  // event stream topics, only created once something subscribes
+  struct sse_hub *sse;
+  // running single flights by key, only created once a route uses them
+  hashtable_t *flights;
+  int closing_handles;
+} loop_context_t;
+
+#define LOOP_COMPRESSION_POOL_SIZE 8
+#define LOOP_COMPRESSION_CACHE_BYTES (4 * 1024 * 1024)
+#define LOOP_MAILBOX_CAPACITY 4096
+
+loop_context_t *loop_context_get(uv_loop_t *loop);
+void loop_context_delete(uv_loop_t *loop);
+
+uring_t *loop_context_uring(loop_context_t *ctx);
+
+// from any thread until loop_context_delete: message->run is called on the loop;
+// false when its mailbox is full
+bool loop_post(loop_context_t *ctx, loop_message_t *message);
+
+#endif // _LOOP_H_
@@ -1,17 +1,176 @@
+#include <signal.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
 
 #include <mimalloc.h>
 #include <uv.h>
 
+#include "connection.h"
+#include "handoff.h"
+#include "loop.h"
+#include "proxy.h"
+#include "rate_limit.h"
 #include "server.h"
 #include "request.h"
+#include "response.h"
+#include "single_flight.h"
+#include "sse.h"
+#include "websocket.h"
+#include "workers.h"
 
 #define DEFAULT_PORT 3000
+#define MAX_CONNECTIONS 10000
+#define UNIX_SOCKET_MODE 0660
+#define STATIC_PREFIX "/static/"
+#define STATIC_ROOT "public"
+#define PROFILE_ROUTE "/_profile"
+#define TRACE_ROUTE "/_trace"
+#define MEMORY_ROUTE "/_memory"
+#define WORKERS_ROUTE "/_workers"
+#define TRACE_SLOW_FILE "slow-requests.json"
+// one per worker, the records of several tracers don't share a file
+#define TRACE_SLOW_WORKER_FILE "slow-requests.%u.json"
+#define CAPTURE_WORKER_FILE "%s.%u"
+// the status body never changes, one name covers it in the compression cache
+#define STATUS_IDENTITY "status"
+#define WEBSOCKET_ROUTE "/ws"
+#define EVENTS_ROUTE "/events"
+#define EVENTS_TOPIC "events"
+#define PROXY_DEFAULT_PREFIX "/api/"
+#define DRAIN_TIMEOUT_MS 30000
 
 static uv_loop_t *default_loop;
 
+static char const *upload_dir;
+
+typedef enum admin_routes
+{
+  ADMIN_OFF,
+  ADMIN_ALL,
+  ADMIN_UNIX
+} admin_routes_t;
+
+static admin_routes_t admin_routes;
+
+static proxy_t *proxy;
+
+static rate_limit_t *rate_limit;
+
+// read once in main, every loop's server is configured from them
+static socket_options_t socket_options;
+static overload_options_t overload;
+static char const *unix_path;
+static bool use_uring;
+static char const *trace_sample, *trace_slow;
+static char const *turn_requests, *turn_us;
+static char const *capture_file, *capture_max;
+
+static workers_t *workers;
+
+// the next process takes the listening sockets from here, see HANDOFF_SOCKET
+static handoff_t *handoff;
+static uv_signal_t terminate;
+static uint64_t drain_timeout_ms;
+
+typedef struct drain_message
+{
+  loop_message_t message;
+  worker_t *worker;
+} drain_message_t;
+
+static drain_message_t drain_messages[WORKERS_MAX];
+
+// identical static file requests arriving together read the file once
+static single_flight_options_t static_flight;
+
+static int _form_part(form_parser_t *form, form_part_t const *part)
+{
+  if (part->filename == NULL || upload_dir == NULL)
+    return 0;
+
+  // client file names are not trusted as paths
+  char path[1024];
+  snprintf(path, sizeof(path), "%s/%llu-%zu", upload_dir, (unsigned long long)uv_hrtime(), form->parts);
+
+  return form_parser_save(form, path) ? 0 : -1;
+}
+
+// the /_ routes show what every client sent and how long it took
+static bool _admin(request_t *req)
+{
+  if (admin_routes != ADMIN_UNIX)
+    return admin_routes == ADMIN_ALL;
+
+  uv_os_sock_t fd;
+  struct sockaddr_storage local;
+  socklen_t length = sizeof(local);
+
+  return req->_connection != NULL && connection_fileno(req->_connection, &fd) == 0 &&
+         getsockname(fd, (struct sockaddr *)&local, &length) == 0 && local.ss_family == AF_UNIX;
+}
+
+static void _ws_message(websocket_t *ws, websocket_opcode_t opcode, char const *data, size_t length)
+{
+  websocket_send(ws, opcode, data, length, NULL, NULL);
+}
+
+static int _static_file(request_t *req)
+{
+  char path[1024];
+  char const *file = req->url->data + sizeof(STATIC_PREFIX) - 2;
+  snprintf(path, sizeof(path), STATIC_ROOT "%.*s", (int)strcspn(file, "?#"), file);
+
+  response_t res;
+  response_init(&res, req, 200);
+
+  return response_send_file(&res, path) ? 0 : -1;
+}
+
+static int _body_handler(request_t *req)
+{
+  static form_callbacks_t const callbacks = {.on_part = _form_part};
+
+  if (proxy != NULL && proxy_match(proxy, req))
+    return proxy_handle(proxy, req);
+
+  // bodies that aren't forms are buffered into req->body as before
+  request_form(req, &callbacks, NULL);
+  return 0;
+}
+
 static int _request_handler(request_t *req)
 {
+  if (proxy != NULL && proxy_match(proxy, req))
+    return proxy_handle(proxy, req);
+
+  // echoes every message back
+  if (strcmp(req->url->data, WEBSOCKET_ROUTE) == 0 && websocket_requested(req))
+  {
+    static websocket_callbacks_t const callbacks = {.on_message = _ws_message};
+    websocket_accept(req, &callbacks, NULL);
+    return 0;
+  }
+
+  // GET streams the topic, anything else publishes its body to the subscribers of every loop
+  if (strcmp(req->url->data, EVENTS_ROUTE) == 0)
+  {
+    if (llhttp_get_method(req->_parser) == HTTP_GET)
+    {
+      if (sse_subscribe(req, EVENTS_TOPIC, 0))
+        return 0;
+      return response_send_status(req, 503) ? 0 : -1;
+    }
+
+    sse_event_t *event = sse_event_new(NULL, NULL, req->body, req->body_size);
+    bool published = event != NULL && sse_broadcast(EVENTS_TOPIC, event);
+    if (event != NULL)
+      sse_event_unref(event);
+
+    return response_send_status(req, published ? 204 : 503) ? 0 : -1;
+  }
+
   printf("Method: %s\n", llhttp_method_name(llhttp_get_method(req->_parser)));
   printf("URL: %s\n", req->url->data);
   printf("Headers:\n");
@@ -26,7 +185,281 @@ static int _request_handler(request_t *req)
 
   printf("Body (%zu): %.*s\n", req->body_size, (int)req->body_size, req->body);
 
-  return 0;
+  response_t res;
+  response_init(&res, req, 200);
+
+  bool admin = strncmp(req->url->data, "/_", 2) == 0 && _admin(req);
+
+  if (admin && strcmp(req->url->data, PROFILE_ROUTE) == 0)
+  {
+    char report[4096];
+    size_t length = profiler_format_json(&req->_loop_ctx->profiler, report, sizeof(report));
+    response_header(&res, "Content-Type", "application/json");
+
+    return response_send(&res, report, length < sizeof(report) ? length : sizeof(report) - 1) ? 0 : -1;
+  }
+
+  if (admin && strcmp(req->url->data, MEMORY_ROUTE) == 0)
+  {
+    char report[512];
+    size_t length = memory_format_json(&req->_loop_ctx->memory, report, sizeof(report));
+    response_header(&res, "Content-Type", "application/json");
+
+    return response_send(&res, report, length < sizeof(report) ? length : sizeof(report) - 1) ? 0 : -1;
+  }
+
+  if (admin && strcmp(req->url->data, WORKERS_ROUTE) == 0)
+  {
+    if (workers == NULL)
+      return response_send_status(req, 404) ? 0 : -1;
+
+    char report[16384];
+    size_t length = workers_format_json(workers, report, sizeof(report));
+    response_header(&res, "Content-Type", "application/json");
+
+    return response_send(&res, report, length < sizeof(report) ? length : sizeof(report) - 1) ? 0 : -1;
+  }
+
+  if (admin && strcmp(req->url->data, TRACE_ROUTE) == 0)
+  {
+    char *report = NULL;
+    size_t length = 0;
+    FILE *output = open_memstream(&report, &length);
+    if (output == NULL)
+      return -1;
+    tracer_dump(&req->_loop_ctx->tracer, output, TRACE_FORMAT_CHROME);
+    fclose(output);
+
+    response_header(&res, "Content-Type", "application/json");
+    bool sent = response_send(&res, report, length);
+    free(report);
+
+    return sent ? 0 : -1;
+  }
+
+  if (strncmp(req->url->data, STATIC_PREFIX, sizeof(STATIC_PREFIX) - 1) == 0 && strstr(req->url->data, "..") == NULL)
+    return single_flight_handle(req, &static_flight, _static_file);
+
+  static char const body[] = "{\"status\":\"ok\"}";
+  response_cache_as(&res, STATUS_IDENTITY, sizeof(STATUS_IDENTITY) - 1);
+  response_header(&res, "Content-Type", "application/json");
+
+  return response_send(&res, body, sizeof(body) - 1) ? 0 : -1;
+}
+
+// comma separated host:port or unix:/path entries
+static proxy_t *_configure_proxy(char const *prefix, char const *upstreams)
+{
+  proxy_t *configured = proxy_new(prefix != NULL ? prefix : PROXY_DEFAULT_PREFIX, NULL);
+  if (configured == NULL)
+    return NULL;
+
+  char entry[1024];
+  for (char const *cursor = upstreams; *cursor != '\0';)
+  {
+    size_t length = strcspn(cursor, ",");
+    snprintf(entry, sizeof(entry), "%.*s", (int)length, cursor);
+    cursor += cursor[length] == ',' ? length + 1 : length;
+
+    bool added;
+    char *port = strrchr(entry, ':');
+    if (strncmp(entry, "unix:", 5) == 0)
+    {
+      added = proxy_add_pipe(configured, entry + 5);
+    }
+    else if (port != NULL)
+    {
+      *port = '\0';
+      // [::1]:8080
+      char *host = entry;
+      if (*host == '[' && port[-1] == ']')
+      {
+        host++;
+        port[-1] = '\0';
+      }
+      added = proxy_add_tcp(configured, host, atoi(port + 1));
+    }
+    else
+    {
+      added = false;
+    }
+
+    if (!added)
+    {
+      fprintf(stderr, "Invalid proxy upstream %s\n", entry);
+      proxy_delete(configured);
+      return NULL;
+    }
+  }
+
+  return configured;
+}
+
+// comma separated prefix:rate:burst[:header] rules
+static rate_limit_t *_configure_rate_limit(char const *rules)
+{
+  rate_limit_t *configured = rate_limit_new(0);
+  if (configured == NULL)
+    return NULL;
+
+  char entry[1024];
+  for (char const *cursor = rules; *cursor != '\0';)
+  {
+    size_t length = strcspn(cursor, ",");
+    snprintf(entry, sizeof(entry), "%.*s", (int)length, cursor);
+    cursor += cursor[length] == ',' ? length + 1 : length;
+
+    char *rate = strchr(entry, ':');
+    char *burst = rate != NULL ? strchr(rate + 1, ':') : NULL;
+    char *header = burst != NULL ? strchr(burst + 1, ':') : NULL;
+    if (rate != NULL)
+      *rate++ = '\0';
+    if (burst != NULL)
+      *burst++ = '\0';
+    if (header != NULL)
+      *header++ = '\0';
+
+    if (burst == NULL || !rate_limit_add(configured, entry, atof(rate), atof(burst), header))
+    {
+      fprintf(stderr, "Invalid rate limit %s\n", entry);
+      rate_limit_delete(configured);
+      return NULL;
+    }
+  }
+
+  return configured;
+}
+
+// the unix socket only goes on the first loop, a second bind of the path would take it over
+static server_t *_configure_server(uv_loop_t *loop, bool first, char const *slow_path, char const *capture_path)
+{
+  server_t *server = server_configure("0.0.0.0", "::", DEFAULT_PORT, &socket_options, _request_handler, loop);
+  if (server == NULL)
+    return NULL;
+
+  if (first && unix_path != NULL && !server_add_pipe(server, unix_path, UNIX_SOCKET_MODE))
+  {
+    server_destroy(server);
+    return NULL;
+  }
+
+  server_set_body_handler(server, _body_handler);
+  if (rate_limit != NULL)
+    server_set_rate_limit(server, rate_limit);
+  if (use_uring)
+    server_set_transport(server, SERVER_TRANSPORT_URING);
+  server_set_overload(server, MAX_CONNECTIONS, &overload);
+  if (turn_requests != NULL || turn_us != NULL)
+    server_set_fairness(server, turn_requests != NULL ? (unsigned)atoi(turn_requests) : SERVER_DEFAULT_TURN_REQUESTS,
+                        turn_us != NULL ? (uint64_t)atol(turn_us) : SERVER_DEFAULT_TURN_US);
+
+  if (trace_sample != NULL)
+  {
+    FILE *slow_output = trace_slow != NULL ? fopen(slow_path, "w") : NULL;
+    tracer_configure(&loop_context_get(loop)->tracer, atoi(trace_sample),
+                     trace_slow != NULL ? atoi(trace_slow) : 0, slow_output, TRACE_FORMAT_CHROME);
+  }
+
+  if (capture_file != NULL)
+  {
+    FILE *capture_output = fopen(capture_path, "wb");
+    uint64_t max_bytes = capture_max != NULL ? (uint64_t)atol(capture_max) * 1024 * 1024 : 0;
+    if (!capture_configure(&loop_context_get(loop)->capture, capture_output, max_bytes))
+    {
+      fprintf(stderr, "Capture file %s could not be written\n", capture_path);
+      server_destroy(server);
+      return NULL;
+    }
+  }
+
+  return server;
+}
+
+static server_t *_setup_worker(worker_t *worker)
+{
+  char slow_path[64];
+  snprintf(slow_path, sizeof(slow_path), TRACE_SLOW_WORKER_FILE, worker->index);
+  char capture_path[1024];
+  snprintf(capture_path, sizeof(capture_path), CAPTURE_WORKER_FILE, capture_file != NULL ? capture_file : "",
+           worker->index);
+
+  return _configure_server(&worker->loop, worker->index == 0, slow_path, capture_path);
+}
+
+static size_t _collect_listeners(uv_os_sock_t *fds, size_t max, void *data)
+{
+  if (workers == NULL)
+    return server_listener_fds(data, fds, max);
+
+  // a worker's listeners only change once it drains, which waits for the handoff to finish
+  size_t count = 0;
+  for (unsigned i = 0; i < workers->count; i++)
+    count += server_listener_fds(workers->workers[i].server, fds + count, max - count);
+
+  return count;
+}
+
+static void _drained(server_t *server, void *data)
+{
+  uv_stop(server->loop);
+}
+
+static void _drain_worker(loop_message_t *message, loop_context_t *ctx)
+{
+  worker_t *worker = ((drain_message_t *)message)->worker;
+
+  server_drain(worker->server, drain_timeout_ms, _drained, NULL);
+}
+
+// the main loop has nothing left once these are closed, in workers mode main goes on to join them
+static void _drain(void *data)
+{
+  handoff_close(handoff);
+  handoff = NULL;
+  if (!uv_is_closing((uv_handle_t *)&terminate))
+    uv_close((uv_handle_t *)&terminate, NULL);
+
+  printf("Draining\n");
+  if (workers == NULL)
+  {
+    server_drain(data, drain_timeout_ms, _drained, NULL);
+    return;
+  }
+
+  for (unsigned i = 0; i < workers->count; i++)
+  {
+    drain_messages[i].message.run = _drain_worker;
+    drain_messages[i].worker = &workers->workers[i];
+    if (!loop_post(workers->workers[i].loop.data, &drain_messages[i].message))
+      fprintf(stderr, "Worker %u not drained\n", i);
+  }
+}
+
+static void _handed_off(void *data)
+{
+  // it has closed itself
+  handoff = NULL;
+  _drain(data);
+}
+
+static void _terminate_cb(uv_signal_t *signal, int signum)
+{
+  _drain(signal->data);
+}
+
+// once every listener accepts: lets the process before go, then waits to be replaced the same way
+static bool _serve_handoff(char const *path, server_t *server)
+{
+  handoff_ready();
+
+  uv_signal_init(default_loop, &terminate);
+  terminate.data = server;
+  uv_signal_start(&terminate, _terminate_cb, SIGTERM);
+
+  if (path != NULL && (handoff = handoff_serve(default_loop, path, _collect_listeners, _handed_off, server)) == NULL)
+    return false;
+
+  return true;
 }
 
 int main(int argc, char const *argv[])
@@ -36,11 +469,119 @@ int main(int argc, char const *argv[])
 
   init_request();
 
-  server_t *server = server_configure("0.0.0.0", "::", DEFAULT_PORT, _request_handler, default_loop);
-  if (server == NULL)
+  // FAST_PARSER=0 sends every request through llhttp, for comparing behaviour
+  char const *fast_parser = getenv("FAST_PARSER");
+  if (fast_parser != NULL && atoi(fast_parser) == 0)
+    request_set_fast_path(false);
+
+  // COALESCE_WRITES=0 hands every response to libuv as it's written instead of once per loop iteration
+  char const *coalesce_writes = getenv("COALESCE_WRITES");
+  if (coalesce_writes != NULL && atoi(coalesce_writes) == 0)
+    connection_set_coalescing(false);
+
+  single_flight_options_default(&static_flight);
+
+  socket_options_default(&socket_options);
+  socket_options.keepalive_idle = 60;
+  socket_options.defer_accept = 1;
+  socket_options.fastopen = 256;
+
+  // LISTEN_UNIX=/path adds a unix socket next to TCP, for a reverse proxy on the same host
+  unix_path = getenv("LISTEN_UNIX");
+
+  // ADMIN_ROUTES=1 serves /_profile, /_trace, /_memory and /_workers, ADMIN_ROUTES=unix only over
+  // LISTEN_UNIX; off by default
+  char const *admin = getenv("ADMIN_ROUTES");
+  if (admin != NULL)
+    admin_routes = strcmp(admin, "unix") == 0 ? ADMIN_UNIX : atoi(admin) != 0 ? ADMIN_ALL : ADMIN_OFF;
+
+  // forms are parsed as they arrive, UPLOAD_DIR=path streams their file parts there
+  upload_dir = getenv("UPLOAD_DIR");
+
+  // PROXY_UPSTREAMS=127.0.0.1:8080,unix:/run/app.sock forwards PROXY_PREFIX (/api/ by default) to them
+  char const *proxy_upstreams = getenv("PROXY_UPSTREAMS");
+  if (proxy_upstreams != NULL && (proxy = _configure_proxy(getenv("PROXY_PREFIX"), proxy_upstreams)) == NULL)
     return 1;
 
-  if (!server_listen(server, SOMAXCONN))
+  // RATE_LIMIT=/api/:10:20:x-api-key,/:100:200 refuses clients over 10 requests per second with bursts of 20
+  // on /api/, keyed by X-API-Key when sent and by peer address otherwise, and over 100 elsewhere
+  char const *rate_limit_rules = getenv("RATE_LIMIT");
+  if (rate_limit_rules != NULL && (rate_limit = _configure_rate_limit(rate_limit_rules)) == NULL)
+    return 1;
+
+  // IO_URING=1 moves sockets onto io_uring where the kernel supports it
+  char const *io_uring = getenv("IO_URING");
+  use_uring = io_uring != NULL && atoi(io_uring) != 0;
+
+  // MAX_MEMORY_MB=N sheds requests and pauses accepting while the loop accounts for more than N MiB
+  char const *max_memory = getenv("MAX_MEMORY_MB");
+  overload = (overload_options_t){
+    .max_lag_ms = OVERLOAD_DEFAULT_MAX_LAG_MS,
+    .max_connections = MAX_CONNECTIONS,
+    .max_inflight = 0,
+    .max_memory = max_memory != NULL ? (size_t)atol(max_memory) * 1024 * 1024 : 0,
+    .retry_after = OVERLOAD_DEFAULT_RETRY_AFTER,
+  };
+
+  // TURN_REQUESTS=N and TURN_US=N let a pipelining connection run N requests or N microseconds before
+  // the loop's other connections get a turn, 0 lifts the cap
+  turn_requests = getenv("TURN_REQUESTS");
+  turn_us = getenv("TURN_US");
+
+  // TRACE_SAMPLE=N traces one request in N, TRACE_SLOW_MS appends slower ones to TRACE_SLOW_FILE
+  trace_sample = getenv("TRACE_SAMPLE");
+  trace_slow = getenv("TRACE_SLOW_MS");
+
+  // CAPTURE_FILE=path records every byte clients send, with its timing, for tools/replay; workers
+  // record to path.N each. CAPTURE_MAX_MB=N stops recording once a file reaches N MiB
+  capture_file = getenv("CAPTURE_FILE");
+  capture_max = getenv("CAPTURE_MAX_MB");
+
+  // HANDOFF_SOCKET=/path takes the listening sockets over from the process listening there, then listens
+  // there for the next one; the process handing over stops accepting and gives its connections
+  // DRAIN_TIMEOUT_MS to finish before it exits. Run the same number of WORKERS on both sides, the
+  // reuseport sockets nobody takes are closed along with their backlogs. Sockets a supervisor passes in
+  // LISTEN_FDS are taken over the same way, and SIGTERM drains like a handoff does
+  char const *handoff_path = getenv("HANDOFF_SOCKET");
+  char const *drain_timeout = getenv("DRAIN_TIMEOUT_MS");
+  drain_timeout_ms = drain_timeout != NULL ? (uint64_t)atol(drain_timeout) : DRAIN_TIMEOUT_MS;
+  handoff_inherit_env();
+  if (handoff_path != NULL)
+    handoff_receive(handoff_path);
+
+  // WORKERS=N runs N loops on threads of their own sharing the port through SO_REUSEPORT, WORKER_CPUS=0-3,8
+  // pins one to each listed core and has the kernel hand a connection to the worker on the core it arrived on
+  char const *worker_count = getenv("WORKERS");
+  char const *worker_cpus = getenv("WORKER_CPUS");
+  int cpus[WORKERS_MAX];
+  unsigned pinned = 0;
+  if (worker_cpus != NULL && (pinned = workers_parse_cpus(worker_cpus, cpus, WORKERS_MAX)) == 0)
+  {
+    fprintf(stderr, "Invalid WORKER_CPUS %s\n", worker_cpus);
+    return 1;
+  }
+
+  unsigned count = worker_count != NULL ? (unsigned)atoi(worker_count) : pinned;
+  if (pinned > 0 && count != pinned)
+  {
+    fprintf(stderr, "WORKER_CPUS lists %u cores for %u workers\n", pinned, count);
+    return 1;
+  }
+
+  if (count > 0)
+  {
+    socket_options.reuseport = true;
+    if ((workers = workers_start(count, pinned > 0 ? cpus : NULL, SOMAXCONN, _setup_worker)) == NULL ||
+        !_serve_handoff(handoff_path, NULL))
+      return 1;
+
+    uv_run(default_loop, UV_RUN_DEFAULT);
+    workers_join(workers);
+    return 0;
+  }
+
+  server_t *server = _configure_server(default_loop, true, TRACE_SLOW_FILE, capture_file);
+  if (server == NULL || !server_listen(server, SOMAXCONN) || !_serve_handoff(handoff_path, server))
     return 1;
 
   return uv_run(default_loop, UV_RUN_DEFAULT);
@@ -0,0 +1,108 @@
+#include "memory.h"
+
+#include <stdio.h>
+
+static char const *const _kind_names[MEMORY_KINDS] = {
+  [MEMORY_CONNECTIONS] = "connections",
+  [MEMORY_HEADERS] = "headers",
+  [MEMORY_BODIES] = "bodies",
+  [MEMORY_BUFFERS] = "buffers",
+  [MEMORY_CACHES] = "caches",
+};
+
+bool memory_init(memory_t *memory)
+{
+  for (size_t i = 0; i < MEMORY_KINDS; i++)
+    memory->live[i] = 0;
+  memory->total = 0;
+  memory->peak = 0;
+  memory->heap = mi_heap_new();
+
+  return memory->heap != NULL;
+}
+
+void memory_close(memory_t *memory)
+{
+  if (memory->heap == NULL)
+    return;
+
+  mi_heap_delete(memory->heap);
+  memory->heap = NULL;
+}
+
+void memory_add(memory_t *memory, memory_kind_t kind, size_t bytes)
+{
+  memory->live[kind] += bytes;
+  memory->total += bytes;
+  if (memory->total > memory->peak)
+    memory->peak = memory->total;
+}
+
+void memory_sub(memory_t *memory, memory_kind_t kind, size_t bytes)
+{
+  memory->live[kind] -= bytes;
+  memory->total -= bytes;
+}
+
+// usable sizes so the counts match what the heap holds, and the same block always counts the same
+void *memory_alloc(memory_t *memory, memory_kind_t kind, size_t size)
+{
+  void *p = mi_heap_malloc(memory->heap, size);
+  if (p != NULL)
+    memory_add(memory, kind, mi_usable_size(p));
+
+  return p;
+}
+
+void *memory_zalloc(memory_t *memory, memory_kind_t kind, size_t size)
+{
+  void *p = mi_heap_zalloc(memory->heap, size);
+  if (p != NULL)
+    memory_add(memory, kind, mi_usable_size(p));
+
+  return p;
+}
+
+void *memory_realloc(memory_t *memory, memory_kind_t kind, void *p, size_t size)
+{
+  size_t old_size = p != NULL ? mi_usable_size(p) : 0;
+  void *resized = mi_heap_realloc(memory->heap, p, size);
+  if (resized == NULL)
+    return NULL;
+
+  memory_sub(memory, kind, old_size);
+  memory_add(memory, kind, mi_usable_size(resized));
+
+  return resized;
+}
+
+void memory_free(memory_t *memory, memory_kind_t kind, void *p)
+{
+  if (p == NULL)
+    return;
+
+  memory_sub(memory, kind, mi_usable_size(p));
+  mi_free(p);
+}
+
+char const *memory_kind_name(memory_kind_t kind)
+{
+  return kind < MEMORY_KINDS ? _kind_names[kind] : "unknown";
+}
+
+size_t memory_format_json(memory_t const *memory, char *buffer, size_t size)
+{
+  int length = snprintf(buffer, size, "{\"total\":%zu,\"peak\":%zu", memory->total, memory->peak);
+  for (size_t i = 0; i < MEMORY_KINDS && length >= 0 && (size_t)length < size; i++)
+  {
+    int written = snprintf(buffer + length, size - length, ",\"%s\":%zu", _kind_names[i], memory->live[i]);
+    length = written < 0 ? written : length + written;
+  }
+  if (length >= 0 && (size_t)length < size)
+  {
+    int written = snprintf(buffer + length, size - length, "}");
+    length = written < 0 ? written : length + written;
+  }
+
+  return length < 0 ? 0 : (size_t)length;
+}
@@ -0,0 +1,51 @@
+#if !defined(_MEMORY_H_)
+#define _MEMORY_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <mimalloc.h>
+
+typedef enum memory_kind
+{
+  // request and parser state kept for each connection
+  MEMORY_CONNECTIONS,
+  // urls and headers of the message being parsed, as received
+  MEMORY_HEADERS,
+  // buffered request bodies and bytes waiting on a paused parser
+  MEMORY_BODIES,
+  // responses queued on sockets
+  MEMORY_BUFFERS,
+  // compressed bodies kept for reuse
+  MEMORY_CACHES,
+  MEMORY_KINDS
+} memory_kind_t;
+
+// a loop's allocations; only the loop's thread allocates from the heap, any thread may free
+typedef struct memory
+{
+  mi_heap_t *heap;
+  size_t live[MEMORY_KINDS];
+  size_t total, peak;
+} memory_t;
+
+// on the thread that runs the loop
+bool memory_init(memory_t *memory);
+// blocks still live move to the thread's default heap and stay valid
+void memory_close(memory_t *memory);
+
+void *memory_alloc(memory_t *memory, memory_kind_t kind, size_t size);
+void *memory_zalloc(memory_t *memory, memory_kind_t kind, size_t size);
+void *memory_realloc(memory_t *memory, memory_kind_t kind, void *p, size_t size);
+// p must come from the same kind, NULL is ignored
+void memory_free(memory_t *memory, memory_kind_t kind, void *p);
+
+// bytes allocated elsewhere that still count against the loop
+void memory_add(memory_t *memory, memory_kind_t kind, size_t bytes);
+void memory_sub(memory_t *memory, memory_kind_t kind, size_t bytes);
+
+char const *memory_kind_name(memory_kind_t kind);
+size_t memory_format_json(memory_t const *memory, char *buffer, size_t size);
+
+#endif // _MEMORY_H_
@@ -0,0 +1,119 @@
+#include "overload.h"
+
+#include <mimalloc.h>
+
+#define NS_PER_MS 1000000ULL
+// a lag peak fades out linearly over this long once iterations get short again
+#define LAG_DECAY_NS (1000 * NS_PER_MS)
+
+void overload_tick(void *data, uint64_t busy, uint64_t elapsed)
+{
+  overload_t *overload = data;
+
+  // peak-hold rather than a per-iteration average: one long iteration among
+  // many idle ones is exactly what a waiting client feels
+  uint64_t decay = elapsed >= LAG_DECAY_NS ? overload->lag : overload->lag * elapsed / LAG_DECAY_NS;
+  overload->lag -= decay;
+  if (busy > overload->lag)
+    overload->lag = busy;
+
+  // a resumed listener may pause itself again on its own cap, so only visit each once
+  for (size_t pending = overload->paused->length; pending > 0 && overload_accepting(overload); pending--)
+  {
+    uv_stream_t *listener = ll_remove_front(overload->paused);
+    overload->resume(listener);
+  }
+}
+
+bool overload_init(overload_t *overload)
+{
+  overload->options.max_lag_ms = OVERLOAD_DEFAULT_MAX_LAG_MS;
+  overload->options.max_connections = 0;
+  overload->options.max_inflight = 0;
+  overload->options.max_memory = 0;
+  overload->options.retry_after = OVERLOAD_DEFAULT_RETRY_AFTER;
+  overload->random = uv_hrtime() | 1;
+
+  overload->paused = ll_new();
+
+  return overload->paused != NULL;
+}
+
+void overload_close(overload_t *overload)
+{
+  ll_delete(overload->paused, NULL);
+  overload->paused = NULL;
+}
+
+static bool _over_memory(overload_t const *overload)
+{
+  return overload->options.max_memory != 0 && overload->memory != NULL &&
+         overload->memory->total >= overload->options.max_memory;
+}
+
+bool overload_accepting(overload_t *overload)
+{
+  if (_over_memory(overload))
+    return false;
+
+  return overload->options.max_connections == 0 || overload->connections < overload->options.max_connections;
+}
+
+static uint64_t _next_random(overload_t *overload)
+{
+  uint64_t x = overload->random;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  overload->random = x;
+
+  return x;
+}
+
+bool overload_should_shed(overload_t *overload)
+{
+  if (overload->options.max_inflight != 0 && overload->inflight >= overload->options.max_inflight)
+    return true;
+
+  // unlike lag, memory past the ceiling doesn't drain any faster for letting some requests in
+  if (_over_memory(overload))
+    return true;
+
+  uint64_t max_lag = overload->options.max_lag_ms * NS_PER_MS;
+  if (max_lag == 0 || overload->lag <= max_lag)
+    return false;
+
+  // shed in proportion to the overshoot so a small spike drops a few requests, not all of them
+  uint64_t overshoot = overload->lag - max_lag;
+  if (overshoot >= max_lag)
+    return true;
+
+  return _next_random(overload) % max_lag < overshoot;
+}
+
+bool overload_pause(overload_t *overload, uv_stream_t *listener, overload_resume_f resume)
+{
+  // the listener stops polling until uv_accept is called, the kernel backlog holds the rest
+  if (!ll_push_back(overload->paused, listener))
+    return false;
+
+  overload->resume = resume;
+  overload->paused_accepts++;
+
+  return true;
+}
+
+void overload_forget(overload_t *overload, uv_stream_t *listener)
+{
+  size_t index = 0;
+  linked_list_it it = ll_iterator(overload->paused);
+  while (lli_next(&it))
+  {
+    if (lli_get(it) == listener)
+    {
+      ll_remove(overload->paused, index);
+      return;
+    }
+    index++;
+  }
+}
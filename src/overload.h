@@ -0,0 +1,56 @@
+#if !defined(_OVERLOAD_H_)
+#define _OVERLOAD_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <uv.h>
+
+#include "collections/linked_list.h"
+#include "memory.h"
+
+typedef struct overload_options
+{
+  // recent peak busy time of a loop iteration above which requests start being shed, 0 disables
+  uint64_t max_lag_ms;
+  // open connections on the loop above which accepting pauses, 0 disables
+  size_t max_connections;
+  // requests between headers and response above which new ones are shed, 0 disables
+  size_t max_inflight;
+  // bytes accounted on the loop above which requests are shed and accepting pauses, 0 disables
+  size_t max_memory;
+  // seconds advertised in Retry-After on 503
+  unsigned retry_after;
+} overload_options_t;
+
+#define OVERLOAD_DEFAULT_MAX_LAG_MS 250
+#define OVERLOAD_DEFAULT_RETRY_AFTER 1
+
+typedef void (*overload_resume_f)(uv_stream_t *listener);
+
+typedef struct overload
+{
+  overload_options_t options;
+  uint64_t lag;
+  size_t connections, inflight;
+  uint64_t shed, paused_accepts;
+  // idle keep-alive connections closed to make room for new ones at a cap
+  uint64_t evicted;
+  uint64_t random;
+  linked_list_t *paused;
+  overload_resume_f resume;
+  memory_t const *memory;
+} overload_t;
+
+bool overload_init(overload_t *overload);
+void overload_close(overload_t *overload);
+void overload_tick(void *data, uint64_t busy, uint64_t elapsed);
+
+bool overload_accepting(overload_t *overload);
+bool overload_should_shed(overload_t *overload);
+bool overload_pause(overload_t *overload, uv_stream_t *listener, overload_resume_f resume);
+// before a paused listener closes, so it isn't resumed afterwards
+void overload_forget(overload_t *overload, uv_stream_t *listener);
+
+#endif // _OVERLOAD_H_
@@ -0,0 +1,218 @@
+#include "profiler.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#define NS_PER_US 1000ULL
+#define NS_PER_MS 1000000ULL
+
+static void _check_cb(uv_check_t *check)
+{
+  profiler_t *profiler = check->data;
+
+  // poll returned: whatever poll spent not waiting was spent in I/O callbacks
+  uint64_t now = uv_hrtime();
+  uint64_t idle = uv_metrics_idle_time(check->loop);
+  uint64_t elapsed = now - profiler->prepare_time;
+  uint64_t waited = idle - profiler->idle_time;
+
+  profiler->poll_wait = waited;
+  profiler->poll_busy = elapsed > waited ? elapsed - waited : 0;
+  profiler->check_time = now;
+  profiler->idle_time = idle;
+}
+
+static void _prepare_cb(uv_prepare_t *prepare)
+{
+  profiler_t *profiler = prepare->data;
+
+  uint64_t now = uv_hrtime();
+  uv_metrics_t metrics;
+  uint64_t events = uv_metrics_info(prepare->loop, &metrics) == 0 ? metrics.events : 0;
+
+  if (profiler->check_time != 0)
+  {
+    // check -> prepare covers check callbacks, closes and timers of the next iteration
+    uint64_t other = now - profiler->check_time;
+    uint64_t elapsed = now - profiler->prepare_time;
+
+    histogram_record(&profiler->iteration, elapsed / NS_PER_US);
+    histogram_record(&profiler->wait, profiler->poll_wait / NS_PER_US);
+    histogram_record(&profiler->io, profiler->poll_busy / NS_PER_US);
+    histogram_record(&profiler->other, other / NS_PER_US);
+    histogram_record(&profiler->events_per_iteration, events - profiler->events);
+
+    if (profiler->tick != NULL)
+      profiler->tick(profiler->tick_data, profiler->poll_busy + other, elapsed);
+  }
+
+  profiler->events = events;
+  profiler->prepare_time = now;
+  profiler->idle_time = uv_metrics_idle_time(prepare->loop);
+}
+
+bool profiler_init(profiler_t *profiler, uv_loop_t *loop, profiler_tick_f tick, void *tick_data)
+{
+  memset(profiler, 0, sizeof(profiler_t));
+  profiler->slow_threshold = PROFILER_DEFAULT_SLOW_MS * NS_PER_MS;
+  profiler->tick = tick;
+  profiler->tick_data = tick_data;
+
+  // idle time is only tracked once asked for, and must be asked before uv_run
+  uv_loop_configure(loop, UV_METRICS_IDLE_TIME);
+
+  if (uv_prepare_init(loop, &profiler->prepare) || uv_check_init(loop, &profiler->check))
+    return false;
+
+  profiler->prepare.data = profiler;
+  profiler->check.data = profiler;
+  uv_prepare_start(&profiler->prepare, _prepare_cb);
+  uv_check_start(&profiler->check, _check_cb);
+
+  // measurement alone must never keep the loop alive
+  uv_unref((uv_handle_t *)&profiler->prepare);
+  uv_unref((uv_handle_t *)&profiler->check);
+
+  return true;
+}
+
+unsigned profiler_close(profiler_t *profiler, uv_close_cb close_cb)
+{
+  uv_close((uv_handle_t *)&profiler->prepare, close_cb);
+  uv_close((uv_handle_t *)&profiler->check, close_cb);
+
+  return 2;
+}
+
+void profiler_reset(profiler_t *profiler)
+{
+  histogram_reset(&profiler->iteration);
+  histogram_reset(&profiler->wait);
+  histogram_reset(&profiler->io);
+  histogram_reset(&profiler->other);
+  histogram_reset(&profiler->parser);
+  histogram_reset(&profiler->handler);
+  histogram_reset(&profiler->events_per_iteration);
+  histogram_reset(&profiler->deferred);
+  profiler->slow_total = 0;
+  profiler->slow_next = 0;
+  memset(profiler->slow, 0, sizeof(profiler->slow));
+}
+
+uint64_t profiler_read_begin(profiler_t *profiler)
+{
+  profiler->handler_time = 0;
+
+  return uv_hrtime();
+}
+
+void profiler_read_end(profiler_t *profiler, uint64_t start)
+{
+  // handlers run inside llhttp_execute, what's left of the read is parsing
+  uint64_t duration = uv_hrtime() - start;
+  uint64_t parsing = duration > profiler->handler_time ? duration - profiler->handler_time : 0;
+
+  histogram_record(&profiler->parser, parsing / NS_PER_US);
+}
+
+void profiler_deferred(profiler_t *profiler, uint64_t deferred_at)
+{
+  histogram_record(&profiler->deferred, (uv_hrtime() - deferred_at) / NS_PER_US);
+}
+
+void profiler_handler_end(profiler_t *profiler, uint64_t start, char const *route, size_t route_length)
+{
+  uint64_t now = uv_hrtime();
+  uint64_t duration = now - start;
+
+  profiler->handler_time += duration;
+  histogram_record(&profiler->handler, duration / NS_PER_US);
+  if (duration < profiler->slow_threshold)
+    return;
+
+  profiler_slow_t *slow = &profiler->slow[profiler->slow_next];
+  profiler->slow_next = (profiler->slow_next + 1) % PROFILER_SLOW_RING;
+  profiler->slow_total++;
+
+  if (route_length >= PROFILER_ROUTE_SIZE)
+    route_length = PROFILER_ROUTE_SIZE - 1;
+  memcpy(slow->route, route, route_length);
+  slow->route[route_length] = 0;
+  slow->timestamp = now;
+  slow->duration = duration;
+
+  fprintf(stderr, "Slow handler: %s took %llu ms\n", slow->route, (unsigned long long)(duration / NS_PER_MS));
+}
+
+static size_t _format_histogram(char *buffer, size_t size, char const *name, histogram_t const *histogram)
+{
+  int length = snprintf(
+    buffer, size,
+    "\"%s\":{\"count\":%llu,\"mean\":%llu,\"min\":%llu,\"p50\":%llu,\"p90\":%llu,\"p99\":%llu,\"p999\":%llu,\"max\":%llu}",
+    name,
+    (unsigned long long)histogram->count,
+    (unsigned long long)histogram_mean(histogram),
+    (unsigned long long)histogram->min,
+    (unsigned long long)histogram_percentile(histogram, 50),
+    (unsigned long long)histogram_percentile(histogram, 90),
+    (unsigned long long)histogram_percentile(histogram, 99),
+    (unsigned long long)histogram_percentile(histogram, 99.9),
+    (unsigned long long)histogram->max);
+
+  return length < 0 ? 0 : (size_t)length;
+}
+
+#define APPEND(expr)                        \
+  do                                        \
+  {                                         \
+    size_t written = (expr);                \
+    length += written;                      \
+    if (length >= size)                     \
+      return length;                        \
+  } while (0)
+
+size_t profiler_format_json(profiler_t const *profiler, char *buffer, size_t size)
+{
+  size_t length = 0;
+
+  APPEND(snprintf(buffer, size, "{\"unit\":\"us\","));
+  APPEND(_format_histogram(buffer + length, size - length, "iteration", &profiler->iteration));
+  APPEND(snprintf(buffer + length, size - length, ","));
+  APPEND(_format_histogram(buffer + length, size - length, "poll_wait", &profiler->wait));
+  APPEND(snprintf(buffer + length, size - length, ","));
+  APPEND(_format_histogram(buffer + length, size - length, "io_callbacks", &profiler->io));
+  APPEND(snprintf(buffer + length, size - length, ","));
+  APPEND(_format_histogram(buffer + length, size - length, "other_phases", &profiler->other));
+  APPEND(snprintf(buffer + length, size - length, ","));
+  APPEND(_format_histogram(buffer + length, size - length, "parser", &profiler->parser));
+  APPEND(snprintf(buffer + length, size - length, ","));
+  APPEND(_format_histogram(buffer + length, size - length, "handler", &profiler->handler));
+  APPEND(snprintf(buffer + length, size - length, ","));
+  APPEND(_format_histogram(buffer + length, size - length, "events_per_iteration", &profiler->events_per_iteration));
+  APPEND(snprintf(buffer + length, size - length, ","));
+  APPEND(_format_histogram(buffer + length, size - length, "deferred", &profiler->deferred));
+  APPEND(snprintf(buffer + length, size - length, ",\"slow_total\":%llu,\"slow\":[", (unsigned long long)profiler->slow_total));
+
+  bool first = true;
+  for (size_t i = 0; i < PROFILER_SLOW_RING; i++)
+  {
+    profiler_slow_t const *slow = &profiler->slow[(profiler->slow_next + i) % PROFILER_SLOW_RING];
+    if (slow->timestamp == 0)
+      continue;
+
+    APPEND(snprintf(buffer + length, size - length, "%s{\"route\":\"", first ? "" : ","));
+    for (char const *c = slow->route; *c != 0; c++)
+    {
+      // routes come from the request line, keep them from breaking out of the string
+      if (*c == '"' || *c == '\\' || (unsigned char)*c < 0x20)
+        APPEND(snprintf(buffer + length, size - length, "\\u%04x", (unsigned char)*c));
+      else
+        APPEND(snprintf(buffer + length, size - length, "%c", *c));
+    }
+    APPEND(snprintf(buffer + length, size - length, "\",\"duration\":%llu}", (unsigned long long)(slow->duration / NS_PER_US)));
+    first = false;
+  }
+  APPEND(snprintf(buffer + length, size - length, "]}"));
+
+  return length;
+}
@@ -0,0 +1,54 @@
+#if !defined(_PROFILER_H_)
+#define _PROFILER_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <uv.h>
+
+#include "utils/histogram.h"
+
+#define PROFILER_SLOW_RING 16
+#define PROFILER_ROUTE_SIZE 64
+#define PROFILER_DEFAULT_SLOW_MS 50
+
+typedef struct profiler_slow
+{
+  uint64_t timestamp, duration;
+  char route[PROFILER_ROUTE_SIZE];
+} profiler_slow_t;
+
+typedef void (*profiler_tick_f)(void *data, uint64_t busy, uint64_t elapsed);
+
+typedef struct profiler
+{
+  uv_prepare_t prepare;
+  uv_check_t check;
+  uint64_t prepare_time, check_time, idle_time, events;
+  uint64_t poll_busy, poll_wait, handler_time;
+  uint64_t slow_threshold, slow_total;
+  // times are recorded in microseconds
+  histogram_t iteration, wait, io, other, parser, handler;
+  histogram_t events_per_iteration;
+  // how long connections that gave way to others waited for their next turn
+  histogram_t deferred;
+  size_t slow_next;
+  profiler_slow_t slow[PROFILER_SLOW_RING];
+  profiler_tick_f tick;
+  void *tick_data;
+} profiler_t;
+
+bool profiler_init(profiler_t *profiler, uv_loop_t *loop, profiler_tick_f tick, void *tick_data);
+// the number of handles closed, close_cb is called for each
+unsigned profiler_close(profiler_t *profiler, uv_close_cb close_cb);
+void profiler_reset(profiler_t *profiler);
+
+uint64_t profiler_read_begin(profiler_t *profiler);
+void profiler_read_end(profiler_t *profiler, uint64_t start);
+void profiler_handler_end(profiler_t *profiler, uint64_t start, char const *route, size_t route_length);
+void profiler_deferred(profiler_t *profiler, uint64_t deferred_at);
+
+size_t profiler_format_json(profiler_t const *profiler, char *buffer, size_t size);
+
+#endif // _PROFILER_H_
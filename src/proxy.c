@@ -0,0 +1,1207 @@
+#include "proxy.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+#include <mimalloc.h>
+
+#include "collections/linked_list.h"
+#include "connection.h"
+#include "loop.h"
+#include "response.h"
+#include "server.h"
+
+#define PROXY_HOST "host: localhost\r\n"
+#define PROXY_CHUNKED "transfer-encoding: chunked\r\n"
+
+typedef struct proxy_link proxy_link_t;
+
+typedef struct proxy_backend
+{
+  unsigned failures;
+  // uv_now() until which the upstream is only tried when every other one is down too
+  uint64_t down_until;
+  size_t idle_count;
+  proxy_link_t **idle;
+} proxy_backend_t;
+
+// one per proxy and loop, upstream connections never cross loops
+struct proxy_pool
+{
+  proxy_t *proxy;
+  uv_loop_t *loop;
+  // idle and busy links, a closing pool is freed with the last one
+  size_t open;
+  unsigned next;
+  bool closing;
+  proxy_backend_t backends[PROXY_MAX_UPSTREAMS];
+  proxy_link_t *idle[];
+};
+
+// an upstream connection, kept alive across exchanges
+struct proxy_link
+{
+  connection_t *connection;
+  proxy_pool_t *pool;
+  unsigned upstream;
+  // NULL while idle
+  proxy_exchange_t *exchange;
+};
+
+typedef struct proxy_write
+{
+  connection_write_t write;
+  proxy_exchange_t *exchange;
+  // the upstream connection it went to, NULL towards the client
+  proxy_link_t *link;
+  struct proxy_write *next;
+  size_t length;
+  char data[];
+} proxy_write_t;
+
+struct proxy_exchange
+{
+  proxy_t *proxy;
+  proxy_pool_t *pool;
+  request_t *req;
+  proxy_link_t *link;
+  llhttp_t parser;
+  uv_timer_t timer;
+  // the request head is kept for failover to another upstream
+  char *head;
+  size_t head_length;
+  // body pieces waiting for the connection
+  proxy_write_t *queue, *queue_tail;
+  size_t upstream_pending, client_pending, body_written;
+  // the timer and writes in flight, the exchange is freed when they are all done
+  unsigned ops;
+  unsigned upstream;
+  uint32_t tried;
+  int status;
+  bool reused, connected, head_written, request_done, chunked_request;
+  bool responded, interim, head_sent, chunked_response, response_done, failed;
+  bool client_paused, upstream_paused, done;
+  size_t reason_length, line_start, head_used;
+  char reason[64];
+  char response_head[PROXY_HEAD_SIZE];
+};
+
+static llhttp_settings_t _response_settings;
+
+static void _upstream_read_cb(connection_t *connection, ssize_t nread, char const *data);
+static void _exchange_fail(proxy_exchange_t *exchange, int status, bool health);
+
+// RFC 9110 7.6.1, plus expect since 100-continue isn't relayed
+static bool _hop_by_hop(char const *name, size_t length)
+{
+  static char const *const names[] = {
+    "connection", "keep-alive", "proxy-connection", "te", "trailer", "transfer-encoding", "upgrade", "expect",
+  };
+
+  for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+  {
+    if (strlen(names[i]) == length && strncasecmp(name, names[i], length) == 0)
+      return true;
+  }
+
+  return false;
+}
+
+static proxy_write_t *_write_new(proxy_exchange_t *exchange, size_t length)
+{
+  proxy_write_t *write = mi_malloc(sizeof(proxy_write_t) + length);
+  if (write == NULL)
+    return NULL;
+
+  write->exchange = exchange;
+  write->link = NULL;
+  write->next = NULL;
+  write->length = length;
+
+  return write;
+}
+
+// a body piece outlives the read buffer it came in, so it is copied, framed as a chunk when chunked
+static proxy_write_t *_write_body(proxy_exchange_t *exchange, char const *at, size_t length, bool chunked)
+{
+  char size_line[24];
+  size_t prefix = chunked ? (size_t)snprintf(size_line, sizeof(size_line), "%zx\r\n", length) : 0;
+
+  proxy_write_t *write = _write_new(exchange, prefix + length + (chunked ? 2 : 0));
+  if (write == NULL)
+    return NULL;
+
+  memcpy(write->data, size_line, prefix);
+  memcpy(write->data + prefix, at, length);
+  if (chunked)
+    memcpy(write->data + prefix + length, "\r\n", 2);
+
+  return write;
+}
+
+static void _exchange_put(proxy_exchange_t *exchange)
+{
+  if (--exchange->ops > 0)
+    return;
+
+  request_unref(exchange->req);
+  mi_free(exchange->head);
+  mi_free(exchange);
+}
+
+static void _timer_close_cb(uv_handle_t *handle)
+{
+  _exchange_put(handle->data);
+}
+
+static void _timeout_cb(uv_timer_t *timer)
+{
+  _exchange_fail(timer->data, 504, true);
+}
+
+static void _timer_restart(proxy_exchange_t *exchange)
+{
+  proxy_options_t const *options = &exchange->proxy->options;
+  uv_timer_start(&exchange->timer, _timeout_cb, exchange->connected ? options->timeout_ms : options->connect_timeout_ms, 0);
+}
+
+static void _link_close_cb(connection_t *connection)
+{
+  proxy_link_t *link = connection->data;
+  proxy_pool_t *pool = link->pool;
+
+  mi_free(link);
+  if (--pool->open == 0 && pool->closing)
+    mi_free(pool);
+}
+
+static void _link_close(proxy_link_t *link)
+{
+  link->exchange = NULL;
+  connection_close(link->connection, _link_close_cb);
+}
+
+static void _connect_cb(connection_t *connection, int status);
+
+static proxy_link_t *_link_open(proxy_pool_t *pool, unsigned upstream, proxy_exchange_t *exchange)
+{
+  proxy_link_t *link = mi_malloc(sizeof(proxy_link_t));
+  if (link == NULL)
+    return NULL;
+
+  link->pool = pool;
+  link->upstream = upstream;
+  link->exchange = exchange;
+
+  proxy_upstream_t const *target = &pool->proxy->upstreams[upstream];
+  link->connection = target->path != NULL
+                       ? connection_connect_pipe(pool->loop, target->path, link, _connect_cb)
+                       : connection_connect_tcp(pool->loop, (struct sockaddr const *)&target->addr, link, _connect_cb);
+  if (link->connection == NULL)
+  {
+    mi_free(link);
+    return NULL;
+  }
+  pool->open++;
+
+  return link;
+}
+
+static void _link_park(proxy_link_t *link)
+{
+  proxy_pool_t *pool = link->pool;
+  proxy_backend_t *backend = &pool->backends[link->upstream];
+
+  if (pool->closing || backend->idle_count == pool->proxy->options.max_idle)
+  {
+    _link_close(link);
+    return;
+  }
+
+  // idle links keep reading so an upstream closing them is noticed before they're reused
+  link->exchange = NULL;
+  backend->idle[backend->idle_count++] = link;
+}
+
+static void _link_unpark(proxy_link_t *link)
+{
+  proxy_backend_t *backend = &link->pool->backends[link->upstream];
+
+  for (size_t i = 0; i < backend->idle_count; i++)
+  {
+    if (backend->idle[i] == link)
+    {
+      memmove(&backend->idle[i], &backend->idle[i + 1], (backend->idle_count - i - 1) * sizeof(proxy_link_t *));
+      backend->idle_count--;
+      return;
+    }
+  }
+}
+
+static void _backend_failed(proxy_pool_t *pool, unsigned upstream)
+{
+  proxy_backend_t *backend = &pool->backends[upstream];
+  proxy_options_t const *options = &pool->proxy->options;
+
+  if (++backend->failures < options->fail_threshold)
+    return;
+
+  uint64_t now = uv_now(pool->loop);
+  if (backend->down_until <= now)
+    fprintf(stderr, "Proxy upstream %u down for %llums\n", upstream, (unsigned long long)options->retry_ms);
+  backend->down_until = now + options->retry_ms;
+}
+
+static void _upstream_write_cb(connection_write_t *write, int status)
+{
+  proxy_write_t *upstream_write = (proxy_write_t *)write;
+  proxy_exchange_t *exchange = upstream_write->exchange;
+  // writes to a link that was dropped complete with ECANCELED
+  bool current = upstream_write->link == exchange->link;
+
+  exchange->upstream_pending -= upstream_write->length;
+  mi_free(upstream_write);
+
+  if (current && !exchange->done)
+  {
+    if (status < 0)
+    {
+      _exchange_fail(exchange, 502, !exchange->reused);
+    }
+    else
+    {
+      _timer_restart(exchange);
+      if (exchange->client_paused && exchange->upstream_pending <= exchange->proxy->options.high_water / 2)
+      {
+        exchange->client_paused = false;
+        server_connection_resume(exchange->req);
+      }
+    }
+  }
+
+  _exchange_put(exchange);
+}
+
+static bool _upstream_write(proxy_exchange_t *exchange, proxy_write_t *write)
+{
+  write->link = exchange->link;
+
+  uv_buf_t buf = uv_buf_init(write->data, write->length);
+  if (connection_write(exchange->link->connection, &write->write, &buf, 1, _upstream_write_cb))
+  {
+    exchange->upstream_pending -= write->length;
+    mi_free(write);
+    return false;
+  }
+  exchange->ops++;
+
+  return true;
+}
+
+// request body pieces go out as they come, or wait for the connection
+static void _upstream_send(proxy_exchange_t *exchange, proxy_write_t *write)
+{
+  exchange->upstream_pending += write->length;
+
+  if (!exchange->connected)
+  {
+    if (exchange->queue_tail != NULL)
+      exchange->queue_tail->next = write;
+    else
+      exchange->queue = write;
+    exchange->queue_tail = write;
+    return;
+  }
+
+  exchange->body_written += write->length;
+  if (!_upstream_write(exchange, write))
+    _exchange_fail(exchange, 502, !exchange->reused);
+}
+
+static void _client_write_cb(connection_write_t *write, int status)
+{
+  proxy_write_t *client_write = (proxy_write_t *)write;
+  proxy_exchange_t *exchange = client_write->exchange;
+  request_t *req = exchange->req;
+
+  exchange->client_pending -= client_write->length;
+  mi_free(client_write);
+  req->_writes--;
+
+  if (status < 0)
+  {
+    server_connection_close(req);
+    if (!exchange->done)
+      _exchange_fail(exchange, 502, false);
+  }
+  else if (exchange->done)
+  {
+    // until then closing is left to the exchange, a response that started before the body was in isn't async
+    if (req->_close && req->_writes == 0 && !req->_async)
+      server_connection_close(req);
+  }
+  else if (exchange->upstream_paused && exchange->client_pending <= exchange->proxy->options.high_water / 2)
+  {
+    exchange->upstream_paused = false;
+    connection_read_start(exchange->link->connection, _upstream_read_cb);
+    _timer_restart(exchange);
+  }
+
+  _exchange_put(exchange);
+}
+
+static bool _client_write(proxy_exchange_t *exchange, proxy_write_t *write)
+{
+  request_t *req = exchange->req;
+  if (req->_connection == NULL || connection_is_closing(req->_connection))
+  {
+    mi_free(write);
+    return false;
+  }
+
+  uv_buf_t buf = uv_buf_init(write->data, write->length);
+  if (connection_write(req->_connection, &write->write, &buf, 1, _client_write_cb))
+  {
+    mi_free(write);
+    return false;
+  }
+  req->_writes++;
+  exchange->ops++;
+  exchange->client_pending += write->length;
+
+  return true;
+}
+
+static void _exchange_drop_link(proxy_exchange_t *exchange)
+{
+  if (exchange->link == NULL)
+    return;
+
+  _link_close(exchange->link);
+  exchange->link = NULL;
+  exchange->connected = false;
+  exchange->upstream_paused = false;
+}
+
+static void _exchange_finish(proxy_exchange_t *exchange)
+{
+  _exchange_drop_link(exchange);
+  exchange->done = true;
+  if (exchange->req->_proxy == exchange)
+    exchange->req->_proxy = NULL;
+
+  while (exchange->queue != NULL)
+  {
+    proxy_write_t *write = exchange->queue;
+    exchange->queue = write->next;
+    exchange->upstream_pending -= write->length;
+    mi_free(write);
+  }
+  exchange->queue_tail = NULL;
+
+  uv_close((uv_handle_t *)&exchange->timer, _timer_close_cb);
+}
+
+static void _exchange_error(proxy_exchange_t *exchange, int status)
+{
+  request_t *req = exchange->req;
+  bool head_sent = exchange->head_sent;
+  bool request_done = exchange->request_done;
+  _exchange_finish(exchange);
+
+  bool async = req->_async;
+  if (async)
+    request_async_done(req);
+
+  if (req->_connection == NULL || connection_is_closing(req->_connection))
+    return;
+
+  // a response already underway can only be cut short
+  if (head_sent)
+  {
+    server_connection_close(req);
+    return;
+  }
+
+  // the rest of the body is still on its way and can't be skipped
+  if (!request_done)
+    req->_close = true;
+
+  if (!response_send_status(req, status))
+    server_connection_close(req);
+  else if (async)
+    server_connection_resume(req);
+}
+
+static void _exchange_ready(proxy_exchange_t *exchange)
+{
+  exchange->connected = true;
+  _timer_restart(exchange);
+
+  proxy_write_t *head = _write_new(exchange, exchange->head_length);
+  if (head == NULL)
+  {
+    _exchange_fail(exchange, 502, false);
+    return;
+  }
+  memcpy(head->data, exchange->head, exchange->head_length);
+  exchange->upstream_pending += head->length;
+  if (!_upstream_write(exchange, head))
+  {
+    _exchange_fail(exchange, 502, !exchange->reused);
+    return;
+  }
+  exchange->head_written = true;
+
+  while (exchange->queue != NULL)
+  {
+    proxy_write_t *write = exchange->queue;
+    exchange->queue = write->next;
+    if (exchange->queue == NULL)
+      exchange->queue_tail = NULL;
+
+    exchange->body_written += write->length;
+    if (!_upstream_write(exchange, write))
+    {
+      _exchange_fail(exchange, 502, !exchange->reused);
+      return;
+    }
+  }
+}
+
+// healthy upstreams in turn, or the one due back soonest when all untried ones are down
+static bool _pick(proxy_exchange_t *exchange, unsigned *upstream)
+{
+  proxy_pool_t *pool = exchange->pool;
+  unsigned count = exchange->proxy->count;
+  uint64_t now = uv_now(pool->loop);
+  bool found = false;
+
+  for (unsigned i = 0; i < count; i++)
+  {
+    unsigned candidate = (pool->next + i) % count;
+    if (exchange->tried & (1u << candidate))
+      continue;
+
+    uint64_t down_until = pool->backends[candidate].down_until;
+    if (down_until <= now)
+    {
+      *upstream = candidate;
+      pool->next = candidate + 1;
+      return true;
+    }
+
+    if (!found || down_until < pool->backends[*upstream].down_until)
+    {
+      *upstream = candidate;
+      found = true;
+    }
+  }
+
+  return found;
+}
+
+// false when no upstream is left to try; true may also mean the exchange already failed over and ended
+static bool _exchange_connect(proxy_exchange_t *exchange)
+{
+  unsigned upstream;
+  while (_pick(exchange, &upstream))
+  {
+    exchange->tried |= 1u << upstream;
+    exchange->upstream = upstream;
+    exchange->head_written = false;
+
+    proxy_backend_t *backend = &exchange->pool->backends[upstream];
+    if (backend->idle_count > 0)
+    {
+      proxy_link_t *link = backend->idle[--backend->idle_count];
+      link->exchange = exchange;
+      exchange->link = link;
+      exchange->reused = true;
+      _exchange_ready(exchange);
+      return true;
+    }
+
+    exchange->reused = false;
+    exchange->connected = false;
+    exchange->link = _link_open(exchange->pool, upstream, exchange);
+    if (exchange->link != NULL)
+    {
+      _timer_restart(exchange);
+      return true;
+    }
+    _backend_failed(exchange->pool, upstream);
+  }
+
+  return false;
+}
+
+static bool _retryable(proxy_exchange_t const *exchange)
+{
+  if (exchange->responded || exchange->body_written > 0 || exchange->pool->closing)
+    return false;
+
+  // once the head went out the upstream may have acted on it
+  if (!exchange->head_written)
+    return true;
+
+  switch (llhttp_get_method(exchange->req->_parser))
+  {
+  case HTTP_GET:
+  case HTTP_HEAD:
+  case HTTP_OPTIONS:
+  case HTTP_PUT:
+  case HTTP_DELETE:
+    return true;
+  default:
+    return false;
+  }
+}
+
+static void _exchange_fail(proxy_exchange_t *exchange, int status, bool health)
+{
+  bool reused = exchange->reused;
+  _exchange_drop_link(exchange);
+
+  if (health)
+    _backend_failed(exchange->pool, exchange->upstream);
+
+  if (_retryable(exchange))
+  {
+    // a pooled connection the upstream had already dropped says nothing about the upstream
+    if (reused && !health)
+      exchange->tried &= ~(1u << exchange->upstream);
+    if (_exchange_connect(exchange))
+      return;
+  }
+
+  _exchange_error(exchange, status);
+}
+
+static void _exchange_complete(proxy_exchange_t *exchange, bool reusable)
+{
+  request_t *req = exchange->req;
+  proxy_backend_t *backend = &exchange->pool->backends[exchange->upstream];
+  backend->failures = 0;
+  backend->down_until = 0;
+
+  if (exchange->chunked_response)
+  {
+    proxy_write_t *last = _write_body(exchange, "", 0, true);
+    if (last == NULL || !_client_write(exchange, last))
+      server_connection_close(req);
+  }
+
+  if (req->_trace != 0)
+  {
+    tracer_end(&req->_loop_ctx->tracer, req->_trace, exchange->status);
+    req->_trace = 0;
+  }
+
+  // only a connection both sides finished cleanly goes back to the pool
+  proxy_link_t *link = exchange->link;
+  if (reusable && exchange->request_done && exchange->upstream_pending == 0 &&
+      llhttp_should_keep_alive(&exchange->parser))
+  {
+    if (exchange->upstream_paused)
+      connection_read_start(link->connection, _upstream_read_cb);
+    exchange->upstream_paused = false;
+    exchange->link = NULL;
+    _link_park(link);
+  }
+
+  bool request_done = exchange->request_done;
+  _exchange_finish(exchange);
+
+  if (!request_done)
+  {
+    // answered before the body was in, which can't be skipped on a reused connection
+    req->_close = true;
+    if (req->_connection != NULL)
+    {
+      connection_read_stop(req->_connection);
+      if (req->_writes == 0)
+        server_connection_close(req);
+    }
+    return;
+  }
+
+  request_async_done(req);
+  server_connection_resume(req);
+}
+
+static void _connect_cb(connection_t *connection, int status)
+{
+  // the link was dropped while connecting, a timeout or the pool closing
+  if (connection_is_closing(connection))
+    return;
+
+  proxy_link_t *link = connection->data;
+  if (status < 0 || connection_read_start(connection, _upstream_read_cb) != 0)
+  {
+    _exchange_fail(link->exchange, 502, true);
+    return;
+  }
+
+  _exchange_ready(link->exchange);
+}
+
+static void _upstream_read_cb(connection_t *connection, ssize_t nread, char const *data)
+{
+  proxy_link_t *link = connection->data;
+  proxy_exchange_t *exchange = link->exchange;
+
+  if (exchange == NULL)
+  {
+    // idle: the upstream closed it, or sent something it shouldn't have
+    _link_unpark(link);
+    _link_close(link);
+    return;
+  }
+
+  if (nread < 0)
+  {
+    // a response framed by the end of the connection completes here
+    if (nread == UV_EOF && exchange->responded)
+    {
+      llhttp_finish(&exchange->parser);
+      if (exchange->response_done)
+      {
+        _exchange_complete(exchange, false);
+        return;
+      }
+    }
+
+    // a pooled connection closing under a new request is stale rather than a sick upstream
+    _exchange_fail(exchange, 502, !exchange->reused || exchange->responded);
+    return;
+  }
+
+  exchange->responded = true;
+  if (!exchange->upstream_paused)
+    _timer_restart(exchange);
+
+  enum llhttp_errno err = llhttp_execute(&exchange->parser, data, nread);
+  if (exchange->response_done)
+    _exchange_complete(exchange, err == HPE_PAUSED && llhttp_get_error_pos(&exchange->parser) == data + nread);
+  else if (exchange->failed || err != HPE_OK)
+    _exchange_fail(exchange, 502, !exchange->failed);
+}
+
+static bool _head_append(proxy_exchange_t *exchange, char const *at, size_t length)
+{
+  if (exchange->head_used + length > PROXY_HEAD_SIZE)
+    return false;
+
+  memcpy(exchange->response_head + exchange->head_used, at, length);
+  exchange->head_used += length;
+
+  return true;
+}
+
+static int _on_status(llhttp_t *parser, char const *at, size_t length)
+{
+  proxy_exchange_t *exchange = parser->data;
+
+  size_t room = sizeof(exchange->reason) - exchange->reason_length;
+  length = length < room ? length : room;
+  memcpy(exchange->reason + exchange->reason_length, at, length);
+  exchange->reason_length += length;
+
+  return 0;
+}
+
+static int _on_header_span(llhttp_t *parser, char const *at, size_t length)
+{
+  proxy_exchange_t *exchange = parser->data;
+
+  // trailers of a chunked response come after the head went out and are dropped
+  if (exchange->head_sent)
+    return 0;
+
+  return _head_append(exchange, at, length) ? 0 : -1;
+}
+
+static int _on_header_field_complete(llhttp_t *parser)
+{
+  proxy_exchange_t *exchange = parser->data;
+
+  if (exchange->head_sent)
+    return 0;
+
+  return _head_append(exchange, ": ", 2) ? 0 : -1;
+}
+
+static int _on_header_value_complete(llhttp_t *parser)
+{
+  proxy_exchange_t *exchange = parser->data;
+
+  if (exchange->head_sent)
+    return 0;
+
+  char const *name = exchange->response_head + exchange->line_start;
+  char const *colon = memchr(name, ':', exchange->head_used - exchange->line_start);
+  if (colon != NULL && _hop_by_hop(name, colon - name))
+    exchange->head_used = exchange->line_start;
+  else if (!_head_append(exchange, "\r\n", 2))
+    return -1;
+
+  exchange->line_start = exchange->head_used;
+
+  return 0;
+}
+
+static bool _send_head(proxy_exchange_t *exchange, bool no_body)
+{
+  request_t *req = exchange->req;
+  llhttp_t *parser = &exchange->parser;
+  bool http10 = llhttp_get_http_minor(req->_parser) == 0;
+  bool keep_alive = !req->_close && exchange->request_done && llhttp_should_keep_alive(req->_parser) &&
+                    (req->_server == NULL || !req->_server->draining);
+
+  // the upstream's chunking or close framing is redone for the client
+  char const *framing = "";
+  if (!no_body && !(parser->flags & F_CONTENT_LENGTH))
+  {
+    if (http10)
+    {
+      keep_alive = false;
+    }
+    else
+    {
+      exchange->chunked_response = true;
+      framing = "Transfer-Encoding: chunked\r\n";
+    }
+  }
+  char const *connection = !keep_alive ? "Connection: close\r\n" : http10 ? "Connection: keep-alive\r\n" : "";
+
+  char status_line[128];
+  int status_length = snprintf(status_line, sizeof(status_line), "HTTP/1.1 %d %.*s\r\n", parser->status_code,
+                               (int)exchange->reason_length, exchange->reason);
+  size_t framing_length = strlen(framing), connection_length = strlen(connection);
+
+  proxy_write_t *write = _write_new(exchange, status_length + exchange->head_used + framing_length + connection_length + 2);
+  if (write == NULL)
+    return false;
+
+  char *cursor = write->data;
+  memcpy(cursor, status_line, status_length);
+  cursor += status_length;
+  memcpy(cursor, exchange->response_head, exchange->head_used);
+  cursor += exchange->head_used;
+  memcpy(cursor, framing, framing_length);
+  cursor += framing_length;
+  memcpy(cursor, connection, connection_length);
+  cursor += connection_length;
+  memcpy(cursor, "\r\n", 2);
+
+  exchange->head_sent = true;
+  exchange->status = parser->status_code;
+  if (!_client_write(exchange, write))
+    return false;
+
+  if (!keep_alive)
+  {
+    req->_close = true;
+    connection_read_stop(req->_connection);
+  }
+
+  return true;
+}
+
+static int _on_headers_complete(llhttp_t *parser)
+{
+  proxy_exchange_t *exchange = parser->data;
+
+  // 100 Continue and other interim responses aren't relayed
+  if (parser->status_code < 200)
+  {
+    exchange->interim = true;
+    exchange->head_used = 0;
+    exchange->line_start = 0;
+    exchange->reason_length = 0;
+    return 0;
+  }
+
+  bool head = llhttp_get_method(exchange->req->_parser) == HTTP_HEAD;
+  bool no_body = head || parser->status_code == 204 || parser->status_code == 304;
+  if (!_send_head(exchange, no_body))
+  {
+    exchange->failed = true;
+    return -1;
+  }
+
+  // a response to HEAD describes a body that isn't there
+  return head ? 1 : 0;
+}
+
+static int _on_body(llhttp_t *parser, char const *at, size_t length)
+{
+  proxy_exchange_t *exchange = parser->data;
+
+  proxy_write_t *write = _write_body(exchange, at, length, exchange->chunked_response);
+  if (write == NULL || !_client_write(exchange, write))
+  {
+    exchange->failed = true;
+    return -1;
+  }
+
+  // the rest of this read still goes out, nothing more is read until the client catches up
+  if (exchange->client_pending > exchange->proxy->options.high_water && !exchange->upstream_paused)
+  {
+    exchange->upstream_paused = true;
+    connection_read_stop(exchange->link->connection);
+    uv_timer_stop(&exchange->timer);
+  }
+
+  return 0;
+}
+
+static int _on_message_complete(llhttp_t *parser)
+{
+  proxy_exchange_t *exchange = parser->data;
+
+  if (exchange->interim)
+  {
+    exchange->interim = false;
+    return 0;
+  }
+
+  // stops the parser so bytes after the response keep the connection out of the pool
+  exchange->response_done = true;
+  return HPE_PAUSED;
+}
+
+static bool _build_head(proxy_exchange_t *exchange)
+{
+  request_t *req = exchange->req;
+  char const *method = llhttp_method_name(llhttp_get_method(req->_parser));
+  char const *url = req->url != NULL ? req->url->data : "/";
+  bool host = request_header(req, "host") != NULL;
+  exchange->chunked_request = (req->_parser->flags & F_CHUNKED) != 0;
+
+  size_t method_length = strlen(method), url_length = strlen(url);
+  size_t length = method_length + url_length + sizeof("  HTTP/1.1\r\n\r\n") - 1;
+  if (!host)
+    length += sizeof(PROXY_HOST) - 1;
+  if (exchange->chunked_request)
+    length += sizeof(PROXY_CHUNKED) - 1;
+
+  hashtable_it_t it = ht_iterator(req->headers);
+  while (hti_next(&it))
+  {
+    ht_entry_t const *entry = hti_get(&it);
+    if (!_hop_by_hop(entry->key->data, entry->key->length))
+      length += entry->key->length + STRING(entry->data)->length + 4;
+  }
+
+  char *cursor = exchange->head = mi_malloc(length);
+  if (cursor == NULL)
+    return false;
+
+  memcpy(cursor, method, method_length);
+  cursor += method_length;
+  *cursor++ = ' ';
+  memcpy(cursor, url, url_length);
+  cursor += url_length;
+  memcpy(cursor, " HTTP/1.1\r\n", 11);
+  cursor += 11;
+
+  it = ht_iterator(req->headers);
+  while (hti_next(&it))
+  {
+    ht_entry_t const *entry = hti_get(&it);
+    if (_hop_by_hop(entry->key->data, entry->key->length))
+      continue;
+
+    string_t const *value = entry->data;
+    memcpy(cursor, entry->key->data, entry->key->length);
+    cursor += entry->key->length;
+    *cursor++ = ':';
+    *cursor++ = ' ';
+    memcpy(cursor, value->data, value->length);
+    cursor += value->length;
+    *cursor++ = '\r';
+    *cursor++ = '\n';
+  }
+
+  // HTTP/1.1 upstreams need a Host, HTTP/1.0 clients may not have sent one
+  if (!host)
+  {
+    memcpy(cursor, PROXY_HOST, sizeof(PROXY_HOST) - 1);
+    cursor += sizeof(PROXY_HOST) - 1;
+  }
+  if (exchange->chunked_request)
+  {
+    memcpy(cursor, PROXY_CHUNKED, sizeof(PROXY_CHUNKED) - 1);
+    cursor += sizeof(PROXY_CHUNKED) - 1;
+  }
+  *cursor++ = '\r';
+  *cursor++ = '\n';
+  exchange->head_length = cursor - exchange->head;
+
+  return true;
+}
+
+static proxy_pool_t *_pool_get(proxy_t *proxy, loop_context_t *ctx)
+{
+  if (ctx->proxy_pools == NULL && (ctx->proxy_pools = ll_new()) == NULL)
+    return NULL;
+
+  linked_list_it it = ll_iterator(ctx->proxy_pools);
+  while (lli_next(&it))
+  {
+    proxy_pool_t *pool = lli_get(it);
+    if (pool->proxy == proxy)
+      return pool;
+  }
+
+  size_t max_idle = proxy->options.max_idle;
+  proxy_pool_t *pool = mi_zalloc(sizeof(proxy_pool_t) + PROXY_MAX_UPSTREAMS * max_idle * sizeof(proxy_link_t *));
+  if (pool == NULL)
+    return NULL;
+
+  pool->proxy = proxy;
+  pool->loop = ctx->loop;
+  for (unsigned i = 0; i < PROXY_MAX_UPSTREAMS; i++)
+    pool->backends[i].idle = pool->idle + i * max_idle;
+
+  if (!ll_push_back(ctx->proxy_pools, pool))
+  {
+    mi_free(pool);
+    return NULL;
+  }
+
+  return pool;
+}
+
+static proxy_exchange_t *_exchange_new(proxy_t *proxy, request_t *req)
+{
+  proxy_pool_t *pool = _pool_get(proxy, req->_loop_ctx);
+  if (pool == NULL)
+    return NULL;
+
+  proxy_exchange_t *exchange = mi_zalloc(sizeof(proxy_exchange_t));
+  if (exchange == NULL)
+    return NULL;
+
+  exchange->proxy = proxy;
+  exchange->pool = pool;
+  exchange->req = req;
+  if (!_build_head(exchange))
+  {
+    mi_free(exchange);
+    return NULL;
+  }
+
+  llhttp_init(&exchange->parser, HTTP_RESPONSE, &_response_settings);
+  exchange->parser.data = exchange;
+  uv_timer_init(pool->loop, &exchange->timer);
+  exchange->timer.data = exchange;
+
+  // held by the timer until it is closed
+  exchange->ops = 1;
+  request_ref(req);
+
+  return exchange;
+}
+
+// the body is in: a buffered one goes out whole, a streamed one gets its last chunk
+static bool _exchange_request_end(proxy_exchange_t *exchange)
+{
+  request_t *req = exchange->req;
+  exchange->request_done = true;
+
+  if (req->body_size > 0)
+  {
+    proxy_write_t *write = _write_body(exchange, req->body, req->body_size, exchange->chunked_request);
+    if (write == NULL)
+      return false;
+    _upstream_send(exchange, write);
+  }
+
+  if (exchange->chunked_request && !exchange->done)
+  {
+    proxy_write_t *write = _write_body(exchange, "", 0, true);
+    if (write == NULL)
+      return false;
+    _upstream_send(exchange, write);
+  }
+
+  return true;
+}
+
+void proxy_options_default(proxy_options_t *options)
+{
+  options->fail_threshold = PROXY_DEFAULT_FAIL_THRESHOLD;
+  options->retry_ms = PROXY_DEFAULT_RETRY_MS;
+  options->connect_timeout_ms = PROXY_DEFAULT_CONNECT_TIMEOUT_MS;
+  options->timeout_ms = PROXY_DEFAULT_TIMEOUT_MS;
+  options->max_idle = PROXY_DEFAULT_MAX_IDLE;
+  options->high_water = PROXY_DEFAULT_HIGH_WATER;
+}
+
+proxy_t *proxy_new(char const *prefix, proxy_options_t const *options)
+{
+  proxy_t *proxy = mi_zalloc(sizeof(proxy_t));
+  if (proxy == NULL)
+    return NULL;
+
+  proxy->prefix = mi_strdup(prefix);
+  if (proxy->prefix == NULL)
+  {
+    mi_free(proxy);
+    return NULL;
+  }
+  proxy->prefix_length = strlen(prefix);
+
+  if (options != NULL)
+    proxy->options = *options;
+  else
+    proxy_options_default(&proxy->options);
+
+  llhttp_settings_init(&_response_settings);
+  _response_settings.on_status = _on_status;
+  _response_settings.on_header_field = _on_header_span;
+  _response_settings.on_header_field_complete = _on_header_field_complete;
+  _response_settings.on_header_value = _on_header_span;
+  _response_settings.on_header_value_complete = _on_header_value_complete;
+  _response_settings.on_headers_complete = _on_headers_complete;
+  _response_settings.on_body = _on_body;
+  _response_settings.on_message_complete = _on_message_complete;
+
+  return proxy;
+}
+
+void proxy_delete(proxy_t *proxy)
+{
+  if (proxy == NULL)
+    return;
+
+  for (unsigned i = 0; i < proxy->count; i++)
+    mi_free(proxy->upstreams[i].path);
+  mi_free(proxy->prefix);
+  mi_free(proxy);
+}
+
+bool proxy_add_tcp(proxy_t *proxy, char const *host, int port)
+{
+  if (proxy->count == PROXY_MAX_UPSTREAMS)
+    return false;
+
+  proxy_upstream_t *upstream = &proxy->upstreams[proxy->count];
+  if (uv_ip4_addr(host, port, (struct sockaddr_in *)&upstream->addr) &&
+      uv_ip6_addr(host, port, (struct sockaddr_in6 *)&upstream->addr))
+  {
+    fprintf(stderr, "Invalid upstream address %s\n", host);
+    return false;
+  }
+  upstream->path = NULL;
+  proxy->count++;
+
+  return true;
+}
+
+bool proxy_add_pipe(proxy_t *proxy, char const *path)
+{
+  if (proxy->count == PROXY_MAX_UPSTREAMS)
+    return false;
+
+  proxy_upstream_t *upstream = &proxy->upstreams[proxy->count];
+  upstream->path = mi_strdup(path);
+  if (upstream->path == NULL)
+    return false;
+  proxy->count++;
+
+  return true;
+}
+
+bool proxy_match(proxy_t const *proxy, request_t *req)
+{
+  return req->url != NULL && req->url->length >= proxy->prefix_length &&
+         memcmp(req->url->data, proxy->prefix, proxy->prefix_length) == 0;
+}
+
+int proxy_handle(proxy_t *proxy, request_t *req)
+{
+  proxy_exchange_t *exchange = req->_proxy;
+  if (exchange == NULL)
+  {
+    // an exchange that ended while the body came in has answered already
+    if (!req->_in_message && req->_close)
+      return 0;
+
+    exchange = proxy->count > 0 ? _exchange_new(proxy, req) : NULL;
+    if (exchange == NULL)
+    {
+      if (req->_in_message)
+        req->_close = true;
+      return response_send_status(req, 502) ? 0 : -1;
+    }
+    req->_proxy = exchange;
+
+    // from the body handler the body streams through proxy_body, the head goes ahead of it
+    if (!req->_in_message && !_exchange_request_end(exchange))
+    {
+      _exchange_error(exchange, 502);
+      return 0;
+    }
+
+    if (!_exchange_connect(exchange))
+    {
+      _exchange_error(exchange, 502);
+      return 0;
+    }
+  }
+  else if (!_exchange_request_end(exchange))
+  {
+    _exchange_fail(exchange, 502, false);
+    return 0;
+  }
+
+  // held until the response is through, unless it already failed here
+  if (req->_proxy == exchange && exchange->request_done)
+    req->_async = true;
+
+  return 0;
+}
+
+int proxy_body(proxy_exchange_t *exchange, char const *at, size_t length)
+{
+  proxy_write_t *write = _write_body(exchange, at, length, exchange->chunked_request);
+  if (write == NULL)
+    return -1;
+
+  _upstream_send(exchange, write);
+  if (exchange->done)
+    return -1;
+
+  // pausing on the last piece would hold message complete back until the client sends more
+  llhttp_t const *parser = exchange->req->_parser;
+  bool last = !(parser->flags & F_CHUNKED) && parser->content_length == 0;
+
+  // the client is read again once the upstream has taken half of it
+  if (exchange->upstream_pending > exchange->proxy->options.high_water && !last)
+  {
+    exchange->client_paused = true;
+    return HPE_PAUSED;
+  }
+
+  return 0;
+}
+
+void proxy_pool_close(proxy_pool_t *pool)
+{
+  pool->closing = true;
+
+  for (unsigned i = 0; i < PROXY_MAX_UPSTREAMS; i++)
+  {
+    proxy_backend_t *backend = &pool->backends[i];
+    while (backend->idle_count > 0)
+      _link_close(backend->idle[--backend->idle_count]);
+  }
+
+  if (pool->open == 0)
+    mi_free(pool);
+}
@@ -0,0 +1,79 @@
+#if !defined(_PROXY_H_)
+#define _PROXY_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <uv.h>
+
+#include "request.h"
+
+// upstreams tried for one request are kept in a bitmask
+#define PROXY_MAX_UPSTREAMS 16
+// status line and headers of an upstream response must fit
+#define PROXY_HEAD_SIZE 8192
+
+#define PROXY_DEFAULT_FAIL_THRESHOLD 3
+#define PROXY_DEFAULT_RETRY_MS 5000
+#define PROXY_DEFAULT_CONNECT_TIMEOUT_MS 2000
+#define PROXY_DEFAULT_TIMEOUT_MS 60000
+#define PROXY_DEFAULT_MAX_IDLE 32
+#define PROXY_DEFAULT_HIGH_WATER (64 * 1024)
+
+typedef struct proxy_options
+{
+  // failed connects or exchanges in a row before an upstream is skipped for retry_ms
+  unsigned fail_threshold;
+  uint64_t retry_ms;
+  uint64_t connect_timeout_ms;
+  // longest wait for the upstream to make progress once connected
+  uint64_t timeout_ms;
+  // idle keep-alive connections kept per upstream on each loop
+  size_t max_idle;
+  // bytes queued towards one side before the other side stops being read
+  size_t high_water;
+} proxy_options_t;
+
+typedef struct proxy_upstream
+{
+  // a unix socket when path is set
+  char *path;
+  struct sockaddr_storage addr;
+} proxy_upstream_t;
+
+typedef struct proxy
+{
+  char *prefix;
+  size_t prefix_length;
+  proxy_options_t options;
+  unsigned count;
+  proxy_upstream_t upstreams[PROXY_MAX_UPSTREAMS];
+} proxy_t;
+
+typedef struct proxy_exchange proxy_exchange_t;
+typedef struct proxy_pool proxy_pool_t;
+
+void proxy_options_default(proxy_options_t *options);
+
+// requests whose url starts with prefix are forwarded unchanged; options NULL takes the defaults
+proxy_t *proxy_new(char const *prefix, proxy_options_t const *options);
+// the loops' pools point at the proxy, only delete it once they are closed
+void proxy_delete(proxy_t *proxy);
+
+// host is a numeric address, upstreams are tried in turn
+bool proxy_add_tcp(proxy_t *proxy, char const *host, int port);
+bool proxy_add_pipe(proxy_t *proxy, char const *path);
+
+bool proxy_match(proxy_t const *proxy, request_t *req);
+// from the body handler to stream the body upstream as it arrives, and from the request handler;
+// the response is streamed back asynchronously
+int proxy_handle(proxy_t *proxy, request_t *req);
+
+// request body chunks, 0, -1 or HPE_PAUSED while the upstream is behind
+int proxy_body(proxy_exchange_t *exchange, char const *at, size_t length);
+
+// closes the idle connections of a loop's pool, it is freed once the busy ones are done
+void proxy_pool_close(proxy_pool_t *pool);
+
+#endif // _PROXY_H_
@@ -0,0 +1,252 @@
+#include "query.h"
+
+#include <string.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define QUERY_X86 1
+#include <immintrin.h>
+#endif
+
+typedef char const *(*scan_f)(char const *p, char const *end);
+
+static char const *_find_escape_scalar(char const *p, char const *end)
+{
+  while (p < end && *p != '%' && *p != '+')
+    p++;
+
+  return p;
+}
+
+#if defined(QUERY_X86)
+
+__attribute__((target("sse2"))) static char const *_find_escape_sse2(char const *p, char const *end)
+{
+  __m128i const percent = _mm_set1_epi8('%');
+  __m128i const plus = _mm_set1_epi8('+');
+  for (; end - p >= 16; p += 16)
+  {
+    __m128i v = _mm_loadu_si128((__m128i const *)p);
+    unsigned mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, percent), _mm_cmpeq_epi8(v, plus)));
+    if (mask != 0)
+      return p + __builtin_ctz(mask);
+  }
+
+  return _find_escape_scalar(p, end);
+}
+
+__attribute__((target("avx2"))) static char const *_find_escape_avx2(char const *p, char const *end)
+{
+  __m256i const percent = _mm256_set1_epi8('%');
+  __m256i const plus = _mm256_set1_epi8('+');
+  for (; end - p >= 32; p += 32)
+  {
+    __m256i v = _mm256_loadu_si256((__m256i const *)p);
+    unsigned mask = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, percent), _mm256_cmpeq_epi8(v, plus)));
+    if (mask != 0)
+      return p + __builtin_ctz(mask);
+  }
+
+  return _find_escape_scalar(p, end);
+}
+
+#endif
+
+static scan_f _find_escape = _find_escape_scalar;
+
+void query_init()
+{
+#if defined(QUERY_X86)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    _find_escape = _find_escape_avx2;
+  else if (__builtin_cpu_supports("sse2"))
+    _find_escape = _find_escape_sse2;
+#endif
+}
+
+static int _hex(char c)
+{
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+
+  return -1;
+}
+
+// decodes the escape at p, which is '%' or '+'
+static char const *_decode_one(char const *p, char const *end, char *c)
+{
+  if (*p == '+')
+  {
+    *c = ' ';
+    return p + 1;
+  }
+
+  if (*p == '%' && end - p >= 3)
+  {
+    int high = _hex(p[1]), low = _hex(p[2]);
+    if (high >= 0 && low >= 0)
+    {
+      *c = (char)(high << 4 | low);
+      return p + 3;
+    }
+  }
+
+  *c = *p;
+  return p + 1;
+}
+
+size_t query_unescape(char const *src, size_t length, char *dst)
+{
+  char const *p = src;
+  char const *end = src + length;
+  char *out = dst;
+
+  while (p < end)
+  {
+    // runs without escapes are copied whole, memmove since dst may be src
+    char const *escape = _find_escape(p, end);
+    memmove(out, p, escape - p);
+    out += escape - p;
+    if (escape == end)
+      break;
+
+    p = _decode_one(escape, end, out++);
+  }
+
+  return out - dst;
+}
+
+static bool _key_equal(char const *raw, size_t raw_length, char const *name, size_t length)
+{
+  // decoding never makes a key longer
+  if (length > raw_length)
+    return false;
+
+  char const *end = raw + raw_length;
+  char const *escape = _find_escape(raw, end);
+  size_t plain = escape - raw;
+  if (escape == end)
+    return plain == length && memcmp(raw, name, length) == 0;
+
+  // the plain run alone may already be longer than name
+  if (plain > length || memcmp(raw, name, plain) != 0)
+    return false;
+
+  size_t i = plain;
+  for (char const *p = escape; p < end;)
+  {
+    char c;
+    p = _decode_one(p, end, &c);
+    if (i == length || name[i++] != c)
+      return false;
+  }
+
+  return i == length;
+}
+
+// empty pairs from "&&" or a trailing '&' are skipped
+static bool _next_pair(char const *data, size_t length, size_t *position, query_span_t *span)
+{
+  while (*position < length)
+  {
+    size_t start = *position;
+    char const *separator = memchr(data + start, '&', length - start);
+    size_t end = separator != NULL ? (size_t)(separator - data) : length;
+    *position = separator != NULL ? end + 1 : length;
+    if (end == start)
+      continue;
+
+    char const *equals = memchr(data + start, '=', end - start);
+    size_t key_end = equals != NULL ? (size_t)(equals - data) : end;
+    span->key = start;
+    span->key_length = key_end - start;
+    span->value = equals != NULL ? key_end + 1 : end;
+    span->value_length = end - span->value;
+
+    return true;
+  }
+
+  return false;
+}
+
+void query_reset(query_t *query)
+{
+  query->_parsed = false;
+}
+
+void query_parse(query_t *query, char const *url, size_t length)
+{
+  if (query->_parsed)
+    return;
+
+  query->_parsed = true;
+  query->_data = NULL;
+  query->_length = 0;
+  query->_scanned = 0;
+  query->_indexed = 0;
+
+  char const *mark = url != NULL ? memchr(url, '?', length) : NULL;
+  if (mark == NULL)
+    return;
+
+  char const *data = mark + 1;
+  size_t rest = length - (data - url);
+  char const *fragment = memchr(data, '#', rest);
+  if (fragment != NULL)
+    rest = fragment - data;
+
+  query->_data = data;
+  // spans are 32-bit offsets, anything past that is not worth a view
+  query->_length = rest < UINT32_MAX ? rest : UINT32_MAX;
+
+  query_span_t span;
+  while (query->_indexed < QUERY_INDEX_SIZE && _next_pair(data, query->_length, &query->_scanned, &span))
+    query->_index[query->_indexed++] = span;
+}
+
+bool query_find(query_t *query, char const *name, size_t length, query_param_t *param)
+{
+  query_it_t it = query_iterator(query);
+  while (qi_next(&it))
+  {
+    if (_key_equal(it.param.key, it.param.key_length, name, length))
+    {
+      *param = it.param;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+query_it_t query_iterator(query_t *query)
+{
+  return (query_it_t){.query = query, .index = 0, .position = query->_scanned};
+}
+
+bool qi_next(query_it_t *it)
+{
+  query_t const *query = it->query;
+  query_span_t span;
+
+  if (it->index < query->_indexed)
+    span = query->_index[it->index++];
+  else if (!_next_pair(query->_data, query->_length, &it->position, &span))
+    return false;
+
+  it->param.key = query->_data + span.key;
+  it->param.key_length = span.key_length;
+  it->param.value = query->_data + span.value;
+  it->param.value_length = span.value_length;
+
+  return true;
+}
+
+query_param_t const *qi_get(query_it_t *it)
+{
+  return &it->param;
+}
@@ -0,0 +1,63 @@
+#if !defined(_QUERY_H_)
+#define _QUERY_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// pairs indexed on first access, later ones are parsed again on every walk
+#define QUERY_INDEX_SIZE 32
+
+// raw, still escaped spans into the url
+typedef struct query_param
+{
+  char const *key;
+  size_t key_length;
+  char const *value;
+  size_t value_length;
+} query_param_t;
+
+typedef struct query_span
+{
+  uint32_t key, key_length, value, value_length;
+} query_span_t;
+
+typedef struct query
+{
+  char const *_data;
+  size_t _length;
+  // offset just past the last indexed pair
+  size_t _scanned;
+  unsigned _indexed;
+  bool _parsed;
+  query_span_t _index[QUERY_INDEX_SIZE];
+} query_t;
+
+typedef struct query_it
+{
+  query_t *query;
+  unsigned index;
+  size_t position;
+  query_param_t param;
+} query_it_t;
+
+// picks the widest escape scanner the CPU supports
+void query_init();
+
+// forgets the view, the next access parses the url again
+void query_reset(query_t *query);
+// indexes the query part of url (between '?' and '#'), a no-op once parsed
+void query_parse(query_t *query, char const *url, size_t length);
+
+// name is compared decoded, the first matching pair wins
+bool query_find(query_t *query, char const *name, size_t length, query_param_t *param);
+
+query_it_t query_iterator(query_t *query);
+bool qi_next(query_it_t *it);
+query_param_t const *qi_get(query_it_t *it);
+
+// decodes '+' and %XX into dst, which must hold length bytes and may be src itself;
+// malformed escapes are kept as they are, returns the decoded length
+size_t query_unescape(char const *src, size_t length, char *dst);
+
+#endif // _QUERY_H_
@@ -0,0 +1,228 @@
+#include "rate_limit.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <mimalloc.h>
+#include <uv.h>
+
+#include "loop.h"
+
+#define MS_PER_SECOND 1000.0
+
+typedef struct bucket
+{
+  double tokens;
+  // loop time of the last refill, also what eviction goes by
+  uint64_t updated;
+} bucket_t;
+
+rate_limit_t *rate_limit_new(size_t max_clients)
+{
+  rate_limit_t *limit = mi_zalloc(sizeof(rate_limit_t));
+  if (limit == NULL)
+    return NULL;
+
+  limit->max_clients = max_clients != 0 ? max_clients : RATE_LIMIT_DEFAULT_MAX_CLIENTS;
+
+  return limit;
+}
+
+void rate_limit_delete(rate_limit_t *limit)
+{
+  if (limit == NULL)
+    return;
+
+  for (unsigned i = 0; i < limit->count; i++)
+  {
+    mi_free(limit->rules[i].prefix);
+    mi_free(limit->rules[i].header);
+  }
+  mi_free(limit);
+}
+
+bool rate_limit_add(rate_limit_t *limit, char const *prefix, double rate, double burst, char const *header)
+{
+  if (limit->count >= RATE_LIMIT_MAX_RULES || rate <= 0 || burst < 1)
+    return false;
+
+  rate_limit_rule_t *rule = &limit->rules[limit->count];
+  rule->prefix = mi_strdup(prefix);
+  rule->header = header != NULL ? mi_strdup(header) : NULL;
+  if (rule->prefix == NULL || (header != NULL && rule->header == NULL))
+  {
+    mi_free(rule->prefix);
+    mi_free(rule->header);
+    return false;
+  }
+  rule->prefix_length = strlen(prefix);
+  rule->rate = rate;
+  rule->burst = burst;
+
+  // stored header names are lowercased, see request.c
+  rule->header_length = header != NULL ? strlen(header) : 0;
+  for (size_t i = 0; i < rule->header_length; i++)
+  {
+    char c = rule->header[i];
+    if (c >= 'A' && c <= 'Z')
+      rule->header[i] = c + ('a' - 'A');
+  }
+
+  limit->count++;
+
+  return true;
+}
+
+rate_limit_rule_t const *rate_limit_match(rate_limit_t const *limit, char const *url, size_t length)
+{
+  rate_limit_rule_t const *match = NULL;
+
+  for (unsigned i = 0; i < limit->count; i++)
+  {
+    rate_limit_rule_t const *rule = &limit->rules[i];
+    if (length >= rule->prefix_length && memcmp(url, rule->prefix, rule->prefix_length) == 0 &&
+        (match == NULL || rule->prefix_length > match->prefix_length))
+      match = rule;
+  }
+
+  return match;
+}
+
+static rate_limit_table_t *_table_get(rate_limit_t const *limit, loop_context_t *ctx)
+{
+  if (ctx->rate_limits == NULL && (ctx->rate_limits = ll_new()) == NULL)
+    return NULL;
+
+  linked_list_it it = ll_iterator(ctx->rate_limits);
+  while (lli_next(&it))
+  {
+    rate_limit_table_t *table = lli_get(it);
+    if (table->limit == limit)
+      return table;
+  }
+
+  rate_limit_table_t *table = mi_zalloc(sizeof(rate_limit_table_t));
+  if (table == NULL)
+    return NULL;
+
+  table->limit = limit;
+  table->random = uv_hrtime() | 1;
+  table->buckets = ht_new(HT_DEFAULT_INITIAL_CAPACITY, HT_DEFAULT_FACTOR);
+  if (table->buckets == NULL)
+  {
+    mi_free(table);
+    return NULL;
+  }
+
+  if (!ll_push_back(ctx->rate_limits, table))
+  {
+    rate_limit_table_delete(table);
+    return NULL;
+  }
+
+  return table;
+}
+
+void rate_limit_table_delete(rate_limit_table_t *table)
+{
+  ht_delete(table->buckets, mi_free);
+  mi_free(table);
+}
+
+static uint64_t _next_random(rate_limit_table_t *table)
+{
+  uint64_t x = table->random;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  table->random = x;
+
+  return x;
+}
+
+// approximate LRU: the stalest of a few buckets from a random spot, without keeping any order
+static void _evict(rate_limit_table_t *table)
+{
+  hashtable_t *buckets = table->buckets;
+  ht_entry_t *victim = NULL;
+  size_t index = _next_random(table) % buckets->capacity;
+
+  for (size_t seen = 0, sampled = 0; seen < buckets->capacity && sampled < RATE_LIMIT_EVICTION_SAMPLES; seen++)
+  {
+    ht_entry_t *entry = &buckets->entries[index];
+    if (entry->key != NULL)
+    {
+      sampled++;
+      if (victim == NULL || ((bucket_t *)entry->data)->updated < ((bucket_t *)victim->data)->updated)
+        victim = entry;
+    }
+
+    if (++index >= buckets->capacity)
+      index = 0;
+  }
+
+  if (victim == NULL)
+    return;
+
+  mi_free(ht_remove(buckets, victim->key));
+  table->evicted++;
+}
+
+bool rate_limit_take(
+  rate_limit_t const *limit,
+  loop_context_t *ctx,
+  rate_limit_rule_t const *rule,
+  char const *client,
+  size_t length,
+  unsigned *retry_after)
+{
+  rate_limit_table_t *table = _table_get(limit, ctx);
+  if (table == NULL)
+    return true;
+
+  // one table serves every rule of the limit
+  char data[RATE_LIMIT_KEY_SIZE + 8];
+  length = length < RATE_LIMIT_KEY_SIZE ? length : RATE_LIMIT_KEY_SIZE;
+  int key_length = snprintf(data, sizeof(data), "%u %.*s", (unsigned)(rule - limit->rules), (int)length, client);
+  string_t key = {.length = key_length, .hashcode = 0, .data = data};
+
+  uint64_t now = uv_now(ctx->loop);
+  ht_entry_t *entry = ht_get(table->buckets, &key);
+  bucket_t *bucket;
+  if (entry != NULL)
+  {
+    bucket = entry->data;
+    bucket->tokens += (now - bucket->updated) * rule->rate / MS_PER_SECOND;
+    if (bucket->tokens > rule->burst)
+      bucket->tokens = rule->burst;
+  }
+  else
+  {
+    if (table->buckets->length >= limit->max_clients)
+      _evict(table);
+
+    // a failed allocation lets the request through rather than refusing everyone
+    bucket = mi_malloc_small(sizeof(bucket_t));
+    if (bucket == NULL)
+      return true;
+    if (!ht_set(table->buckets, &key, bucket))
+    {
+      mi_free(bucket);
+      return true;
+    }
+    bucket->tokens = rule->burst;
+  }
+  bucket->updated = now;
+
+  if (bucket->tokens >= 1)
+  {
+    bucket->tokens -= 1;
+    return true;
+  }
+
+  table->limited++;
+  unsigned seconds = (unsigned)((1 - bucket->tokens) / rule->rate + 0.999);
+  *retry_after = seconds > 0 ? seconds : 1;
+
+  return false;
+}
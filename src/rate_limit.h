@@ -0,0 +1,66 @@
+#if !defined(_RATE_LIMIT_H_)
+#define _RATE_LIMIT_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "collections/hashtable.h"
+
+#define RATE_LIMIT_MAX_RULES 32
+#define RATE_LIMIT_DEFAULT_MAX_CLIENTS 65536
+// buckets compared when one has to make room, the least recently used of them goes
+#define RATE_LIMIT_EVICTION_SAMPLES 5
+// longer header values are cut short in the bucket key
+#define RATE_LIMIT_KEY_SIZE 128
+
+struct loop_context;
+
+typedef struct rate_limit_rule
+{
+  char *prefix;
+  size_t prefix_length;
+  // requests per second refilled into a bucket of burst requests
+  double rate, burst;
+  // lowercased; requests carrying it are keyed by its value instead of the peer address
+  char *header;
+  size_t header_length;
+} rate_limit_rule_t;
+
+typedef struct rate_limit
+{
+  // buckets kept on each loop
+  size_t max_clients;
+  unsigned count;
+  rate_limit_rule_t rules[RATE_LIMIT_MAX_RULES];
+} rate_limit_t;
+
+typedef struct rate_limit_table
+{
+  rate_limit_t const *limit;
+  hashtable_t *buckets;
+  uint64_t random;
+  uint64_t limited, evicted;
+} rate_limit_table_t;
+
+// max_clients 0 takes the default
+rate_limit_t *rate_limit_new(size_t max_clients);
+// the loops' tables point at the limit, only delete it once they are gone
+void rate_limit_delete(rate_limit_t *limit);
+
+// applies to urls starting with prefix, the longest matching prefix wins; header may be NULL
+bool rate_limit_add(rate_limit_t *limit, char const *prefix, double rate, double burst, char const *header);
+rate_limit_rule_t const *rate_limit_match(rate_limit_t const *limit, char const *url, size_t length);
+
+// takes a token from the client's bucket on the loop, false with the seconds until the next one when empty
+bool rate_limit_take(
+  rate_limit_t const *limit,
+  struct loop_context *ctx,
+  rate_limit_rule_t const *rule,
+  char const *client,
+  size_t length,
+  unsigned *retry_after);
+
+void rate_limit_table_delete(rate_limit_table_t *table);
+
+#endif // _RATE_LIMIT_H_
@@ -6,11 +6,104 @@
 
 #include <mimalloc.h>
 
+#include "fast_parser.h"
+#include "loop.h"
+#include "proxy.h"
+#include "rate_limit.h"
+#include "response.h"
+#include "server.h"
+#include "single_flight.h"
+#include "websocket.h"
+
 static llhttp_settings_t _parser_settings;
+static bool _fast_path = true;
+
+static void _reset_message(request_t *req)
+{
+  memory_t *memory = &req->_loop_ctx->memory;
+  memory_free(memory, MEMORY_BODIES, req->body);
+  req->body = NULL;
+  req->body_size = 0;
+  form_parser_delete(req->_form);
+  req->_form = NULL;
+  string_delete(req->url);
+  req->url = NULL;
+  string_delete(req->_hk);
+  req->_hk = NULL;
+  string_delete(req->_hd);
+  req->_hd = NULL;
+  ht_clear(req->headers, (ht_cleanup_f)string_delete);
+  query_reset(&req->_query);
+  req->_rate_rule = NULL;
+  memory_sub(memory, MEMORY_HEADERS, req->_head_bytes);
+  req->_head_bytes = 0;
+}
+
+// the head is kept in strings of the shared heap, charged as received
+static void _count_head(request_t *req, size_t length)
+{
+  req->_head_bytes += length;
+  memory_add(&req->_loop_ctx->memory, MEMORY_HEADERS, length);
+}
+
+// the handler is done with the body, a keep-alive connection shouldn't hold it until its next message
+static void _release_body(request_t *req)
+{
+  memory_free(&req->_loop_ctx->memory, MEMORY_BODIES, req->body);
+  req->body = NULL;
+  req->body_size = 0;
+}
+
+static void _settle(request_t *req)
+{
+  if (!req->_inflight)
+    return;
+
+  req->_inflight = false;
+  req->_loop_ctx->overload.inflight--;
+}
+
+static bool _send_retry_after(request_t *req, int status, unsigned retry_after)
+{
+  char retry[16];
+  snprintf(retry, sizeof(retry), "%u", retry_after);
+
+  response_t res;
+  response_init(&res, req, status);
+  response_header(&res, "Retry-After", retry);
+
+  return response_send(&res, NULL, 0);
+}
+
+static int _message_begin_cb(llhttp_t *parser)
+{
+  request_t *req = parser->data;
+
+  // keep-alive connections reuse the request for every message
+  _reset_message(req);
+  req->_in_message = true;
+
+  tracer_t *tracer = &req->_loop_ctx->tracer;
+  if (tracer_enabled(tracer))
+  {
+    req->_trace = tracer_begin(tracer, req->_connection_id);
+    trace_record_t *record = tracer_get(tracer, req->_trace);
+    if (record != NULL)
+    {
+      // accept only belongs to the first request of a connection
+      record->at[TRACE_ACCEPT] = req->_accepted_at;
+      record->at[TRACE_FIRST_BYTE] = req->_read_at;
+    }
+    req->_accepted_at = 0;
+  }
+
+  return 0;
+}
 
 static int _url_cb(llhttp_t *parser, const char *at, size_t length)
 {
   request_t *req = parser->data;
+  _count_head(req, length);
 
   if (req->url == NULL)
   {
@@ -31,9 +124,44 @@ static int _url_cb(llhttp_t *parser, const char *at, size_t length)
   return 0;
 }
 
+// answers 429 before the rest of the head is parsed; the connection can't be reused past an unread body
+static int _rate_limit(request_t *req, rate_limit_rule_t const *rule, char const *client, size_t length)
+{
+  unsigned retry_after;
+  if (rate_limit_take(req->_server->rate_limit, req->_loop_ctx, rule, client, length, &retry_after))
+    return 0;
+
+  req->_close = true;
+  _send_retry_after(req, 429, retry_after);
+  return HPE_PAUSED;
+}
+
+static int _url_complete_cb(llhttp_t *parser)
+{
+  request_t *req = parser->data;
+
+  rate_limit_t const *limit = req->_server != NULL ? req->_server->rate_limit : NULL;
+  if (limit == NULL || req->url == NULL)
+    return 0;
+
+  rate_limit_rule_t const *rule = rate_limit_match(limit, req->url->data, req->url->length);
+  if (rule == NULL)
+    return 0;
+
+  // keyed by a header: wait for it, or for the end of the head without it
+  if (rule->header != NULL)
+  {
+    req->_rate_rule = rule;
+    return 0;
+  }
+
+  return _rate_limit(req, rule, req->_peer, strlen(req->_peer));
+}
+
 static int _header_field_cb(llhttp_t *parser, const char *at, size_t length)
 {
   request_t *req = parser->data;
+  _count_head(req, length);
 
   if (req->_hk == NULL)
   {
@@ -58,12 +186,21 @@ static int _header_field_complete_cb(llhttp_t *parser)
 {
   request_t *req = parser->data;
 
-  ht_entry_t *entry = ht_get(req->headers, req->_hk);
-  if (entry != NULL)
+  if (req->_hk == NULL)
   {
-    string_delete(req->_hk);
-    req->_hk = entry->key;
+    return -1;
+  }
+
+  // field names are case-insensitive, store them lowercased so lookups are plain compares
+  for (size_t i = 0; i < req->_hk->length; i++)
+  {
+    char c = req->_hk->data[i];
+    if (c >= 'A' && c <= 'Z')
+    {
+      req->_hk->data[i] = c + ('a' - 'A');
+    }
   }
+  req->_hk->hashcode = 0;
 
   return 0;
 }
@@ -71,6 +208,7 @@ static int _header_field_complete_cb(llhttp_t *parser)
 static int _header_value_cb(llhttp_t *parser, const char *at, size_t length)
 {
   request_t *req = parser->data;
+  _count_head(req, length);
 
   if (req->_hd == NULL)
   {
@@ -100,9 +238,20 @@ static int _header_value_complete_cb(llhttp_t *parser)
     return -1;
   }
 
+  rate_limit_rule_t const *rule = req->_rate_rule;
+  if (rule != NULL && req->_hk->length == rule->header_length && memcmp(req->_hk->data, rule->header, rule->header_length) == 0)
+  {
+    req->_rate_rule = NULL;
+    int result = _rate_limit(req, rule, req->_hd->data, req->_hd->length);
+    if (result != 0)
+      return result;
+  }
+
+  // _hk and _hd stay the request's until here, so a message that stops early frees them on reset
   ht_entry_t *entry = ht_get(req->headers, req->_hk);
   if (entry == NULL)
   {
+    // the table keeps a copy of the key and takes the value
     if (!ht_set(req->headers, req->_hk, req->_hd))
     {
       return -1;
@@ -110,13 +259,16 @@ static int _header_value_complete_cb(llhttp_t *parser)
   }
   else
   {
-    if (!string_concat(entry->data, req->_hd))
+    // a repeated field is one list, cookies have a separator of their own
+    bool cookie = req->_hk->length == sizeof("cookie") - 1 && memcmp(req->_hk->data, "cookie", req->_hk->length) == 0;
+    if (!string_cstr_concatn(entry->data, cookie ? "; " : ", ", 2) || !string_concat(entry->data, req->_hd))
     {
       return -1;
     }
     string_delete(req->_hd);
   }
 
+  string_delete(req->_hk);
   req->_hk = NULL;
   req->_hd = NULL;
 
@@ -125,23 +277,72 @@ static int _header_value_complete_cb(llhttp_t *parser)
 
 static int _headers_cb(llhttp_t *parser)
 {
-  switch (llhttp_get_method(parser))
+  request_t *req = parser->data;
+  overload_t *overload = &req->_loop_ctx->overload;
+
+  if (req->_rate_rule != NULL)
   {
-  case HTTP_HEAD:
-  case HTTP_GET:
-    return 1;
-  default:
-    return 0;
+    rate_limit_rule_t const *rule = req->_rate_rule;
+    req->_rate_rule = NULL;
+    if (_rate_limit(req, rule, req->_peer, strlen(req->_peer)) != 0)
+      return HPE_PAUSED;
+  }
+
+  if (overload_should_shed(overload))
+  {
+    // answer before the body is read; the connection can't be reused past an unread body
+    overload->shed++;
+    req->_close = true;
+    _send_retry_after(req, 503, overload->options.retry_after);
+    return HPE_PAUSED;
+  }
+
+  req->_inflight = true;
+  overload->inflight++;
+
+  if (req->_trace != 0)
+  {
+    trace_record_t *record = tracer_get(&req->_loop_ctx->tracer, req->_trace);
+    if (record != NULL)
+    {
+      record->at[TRACE_HEADERS] = uv_hrtime();
+      record->method = llhttp_get_method(parser);
+      if (req->url != NULL)
+      {
+        size_t length = strcspn(req->url->data, "?#");
+        length = length < TRACE_ROUTE_SIZE ? length : TRACE_ROUTE_SIZE - 1;
+        memcpy(record->route, req->url->data, length);
+      }
+    }
   }
+
+  // a body is framed whatever the method, skipping one on a GET would parse it as the next request;
+  // the fast path never sees one, it leaves Content-Length and Transfer-Encoding to llhttp
+  bool has_body = (parser->flags & F_CHUNKED) != 0 || parser->content_length > 0;
+  if (has_body && req->_handle_body != NULL && req->_handle_body(req) != 0)
+    return -1;
+
+  return 0;
 }
 
 static int _body_cb(llhttp_t *parser, const char *at, size_t length)
 {
   request_t *req = parser->data;
 
+  if (req->_form != NULL)
+  {
+    if (!form_parser_execute(req->_form, at, length))
+      return -1;
+    // parts going to disk faster than it takes them wait for the writes, like a slow upstream
+    return form_parser_congested(req->_form) ? HPE_PAUSED : 0;
+  }
+  if (req->_proxy != NULL)
+    return proxy_body(req->_proxy, at, length);
+
+  memory_t *memory = &req->_loop_ctx->memory;
   if (req->body == NULL)
   {
-    req->body = mi_malloc(length);
+    req->body = memory_alloc(memory, MEMORY_BODIES, length);
     if (req->body == NULL)
     {
       return -1;
@@ -149,7 +350,7 @@ static int _body_cb(llhttp_t *parser, const char *at, size_t length)
   }
   else
   {
-    char *new_body_space = mi_realloc(req->body, req->body_size + length);
+    char *new_body_space = memory_realloc(memory, MEMORY_BODIES, req->body, req->body_size + length);
     if (new_body_space == NULL)
     {
       return -1;
@@ -162,17 +363,118 @@ static int _body_cb(llhttp_t *parser, const char *at, size_t length)
   return 0;
 }
 
+static bool _turn_over(request_t *req)
+{
+  if (req->_turn_left > 0 && --req->_turn_left == 0)
+    return true;
+
+  return req->_turn_deadline != 0 && uv_hrtime() >= req->_turn_deadline;
+}
+
+static int _complete(request_t *req)
+{
+  if (req->_form != NULL && !form_parser_finish(req->_form))
+  {
+    // a truncated or malformed form never reaches the handler
+    req->_close = true;
+    _settle(req);
+    return response_send_status(req, 400) ? 0 : -1;
+  }
+
+  // the handler sees saved parts only once they are on disk
+  if (req->_form != NULL && !form_parser_flushed(req->_form))
+  {
+    req->_async = true;
+    return HPE_PAUSED;
+  }
+
+  uint64_t start = uv_hrtime();
+  // the response hands the trace over to its write, so keep the id for the handler mark
+  uint64_t trace = req->_trace;
+  if (trace != 0)
+    tracer_mark(&req->_loop_ctx->tracer, trace, TRACE_MESSAGE);
+
+  int result = req->_handle_request(req);
+  if (trace != 0)
+    tracer_mark(&req->_loop_ctx->tracer, trace, TRACE_HANDLER);
+
+  // the route is the path without query, so slow reports group per endpoint
+  char const *route = req->url != NULL ? req->url->data : "";
+  profiler_handler_end(&req->_loop_ctx->profiler, start, route, strcspn(route, "?#"));
+  if (!req->_async)
+  {
+    _settle(req);
+    _release_body(req);
+    single_flight_end(req);
+  }
+  if (result != 0)
+  {
+    return result;
+  }
+
+  // an asynchronous response holds the parser so pipelined replies stay in order, and an event
+  // stream never ends for anything after it to be answered
+  if (req->_async || req->_sse != NULL)
+    return HPE_PAUSED;
+
+  // a pipelining client gives way to the loop's other connections, see server_set_fairness
+  if (_turn_over(req))
+  {
+    req->_yielded = true;
+    return HPE_PAUSED;
+  }
+
+  return 0;
+}
+
 static int _complete_cb(llhttp_t *parser)
 {
   request_t *req = parser->data;
 
-  return req->_handle_request(req);
+  req->_in_message = false;
+
+  return _complete(req);
+}
+
+static void _form_drained(form_parser_t *form, void *data)
+{
+  (void)form;
+  request_t *req = data;
+
+  // the body paused for the writes to catch up
+  if (req->_in_message)
+  {
+    server_connection_resume(req);
+    return;
+  }
+
+  // or the message waited for its last writes
+  req->_async = false;
+  int result = _complete(req);
+  if (result < 0)
+  {
+    req->_close = true;
+    if (!response_send_status(req, 500))
+      server_connection_close(req);
+    return;
+  }
+  if (result == HPE_PAUSED && (req->_async || req->_sse != NULL))
+    return;
+
+  req->_yielded = false;
+  server_connection_resume(req);
 }
 
 void init_request()
 {
+  fast_parser_init();
+  query_init();
+  websocket_init();
+
   llhttp_settings_init(&_parser_settings);
+  _parser_settings.on_message_begin = _message_begin_cb;
   _parser_settings.on_url = _url_cb;
+  _parser_settings.on_url_complete = _url_complete_cb;
   _parser_settings.on_header_field = _header_field_cb;
   _parser_settings.on_header_field_complete = _header_field_complete_cb;
   _parser_settings.on_header_value = _header_value_cb;
@@ -182,16 +484,120 @@ void init_request()
   _parser_settings.on_message_complete = _complete_cb;
 }
 
-request_t *create_request_handler(uv_stream_t *stream, request_handler_f handler)
+void request_set_fast_path(bool enabled)
 {
-  request_t *req = mi_zalloc_small(sizeof(request_t));
+  _fast_path = enabled;
+}
+
+// replays the callbacks llhttp would make for the head, in the same order
+static enum llhttp_errno _execute_fast(request_t *req, fast_request_t const *head)
+{
+  llhttp_t *parser = req->_parser;
+  parser->method = head->method;
+  parser->http_major = 1;
+  parser->http_minor = head->http_minor;
+  parser->flags = head->flags;
+  parser->content_length = 0;
+  req->_fast = true;
+
+  _message_begin_cb(parser);
+  if (_url_cb(parser, head->target.at, head->target.length))
+    return HPE_USER;
+
+  // only a rate limit pauses before the end of the head
+  int result = _url_complete_cb(parser);
+  for (size_t i = 0; i < head->header_count && result == 0; i++)
+  {
+    fast_header_t const *header = &head->headers[i];
+    if (_header_field_cb(parser, header->name.at, header->name.length) ||
+        _header_field_complete_cb(parser) ||
+        _header_value_cb(parser, header->value.at, header->value.length))
+      return HPE_USER;
+    result = _header_value_complete_cb(parser);
+  }
+
+  if (result == 0)
+    result = _headers_cb(parser);
+  else if (result != HPE_PAUSED)
+    return HPE_USER;
+
+  if (result == HPE_PAUSED)
+  {
+    llhttp_pause(parser);
+    return HPE_PAUSED;
+  }
+  if (result < 0)
+    return HPE_CB_HEADERS_COMPLETE;
+
+  result = _complete_cb(parser);
+  if (result == HPE_PAUSED)
+  {
+    // llhttp_resume picks up after this message like it would after its own pause
+    llhttp_pause(parser);
+    return HPE_PAUSED;
+  }
+
+  return result == 0 ? HPE_OK : HPE_CB_MESSAGE_COMPLETE;
+}
+
+enum llhttp_errno request_execute(request_t *req, char const *data, size_t length, char const **stop)
+{
+  char const *end = data + length;
+
+  while (_fast_path && !req->_in_message && data < end)
+  {
+    // llhttp refuses anything after a message that closes the connection
+    if (req->_fast && !llhttp_should_keep_alive(req->_parser))
+    {
+      *stop = data;
+      return HPE_CLOSED_CONNECTION;
+    }
+
+    fast_request_t head;
+    if (!fast_parser_parse(data, end - data, &head))
+      break;
+
+    enum llhttp_errno err = _execute_fast(req, &head);
+    data += head.length;
+    if (err != HPE_OK)
+    {
+      *stop = data;
+      return err;
+    }
+  }
+
+  // a body paused on its last bytes still has the message to complete
+  if (data == end && !req->_in_message)
+  {
+    *stop = end;
+    return HPE_OK;
+  }
+
+  // llhttp only clears connection flags after messages it completed itself
+  if (req->_fast)
+  {
+    req->_parser->flags = 0;
+    req->_fast = false;
+  }
+
+  enum llhttp_errno err = llhttp_execute(req->_parser, data, end - data);
+  *stop = err == HPE_OK ? end : llhttp_get_error_pos(req->_parser);
+
+  return err;
+}
+
+request_t *create_request_handler(struct connection *connection, request_handler_f handler)
+{
+  loop_context_t *ctx = connection->loop->data;
+  request_t *req = memory_zalloc(&ctx->memory, MEMORY_CONNECTIONS, sizeof(request_t));
   if (req == NULL)
     return NULL;
+  req->_loop_ctx = ctx;
 
-  req->_parser = mi_malloc(sizeof(llhttp_t));
+  req->_parser = memory_alloc(&ctx->memory, MEMORY_CONNECTIONS, sizeof(llhttp_t));
   if (req->_parser == NULL)
   {
-    mi_free(req);
+    memory_free(&ctx->memory, MEMORY_CONNECTIONS, req);
     return NULL;
   }
   llhttp_init(req->_parser, HTTP_REQUEST, &_parser_settings);
@@ -200,13 +606,14 @@ request_t *create_request_handler(uv_stream_t *stream, request_handler_f handler
   req->headers = ht_new(30, .75f);
   if (req->headers == NULL)
   {
-    mi_free(req->_parser);
-    mi_free(req);
+    memory_free(&ctx->memory, MEMORY_CONNECTIONS, req->_parser);
+    memory_free(&ctx->memory, MEMORY_CONNECTIONS, req);
     return NULL;
   }
 
-  req->_stream = stream;
+  req->_connection = connection;
   req->_handle_request = handler;
+  req->_refs = 1;
 
   return req;
 }
@@ -216,11 +623,83 @@ void delete_request_handler(request_t *req)
   if (req == NULL)
     return;
 
-  mi_free(req->body);
+  memory_t *memory = &req->_loop_ctx->memory;
+  _settle(req);
+  memory_free(memory, MEMORY_BODIES, req->_pending);
+  memory_free(memory, MEMORY_BODIES, req->body);
+  memory_sub(memory, MEMORY_HEADERS, req->_head_bytes);
+  form_parser_delete(req->_form);
   string_delete(req->url);
   string_delete(req->_hk);
   string_delete(req->_hd);
   ht_delete(req->headers, (ht_cleanup_f)string_delete);
-  mi_free(req->_parser);
-  mi_free(req);
+  memory_free(memory, MEMORY_CONNECTIONS, req->_parser);
+  memory_free(memory, MEMORY_CONNECTIONS, req);
+}
+
+void request_async_done(request_t *req)
+{
+  req->_async = false;
+  _settle(req);
+  _release_body(req);
+  single_flight_end(req);
+}
+
+void request_ref(request_t *req)
+{
+  req->_refs++;
+}
+
+void request_unref(request_t *req)
+{
+  if (req == NULL)
+    return;
+
+  if (--req->_refs == 0)
+    delete_request_handler(req);
+}
+
+string_t *request_header(request_t *req, char const *name)
+{
+  string_t key = string_from((char *)name);
+  if (key.length == 0)
+    return NULL;
+
+  ht_entry_t *entry = ht_get(req->headers, &key);
+  if (entry == NULL)
+    return NULL;
+
+  return entry->data;
+}
+
+static query_t *_query(request_t *req)
+{
+  query_parse(&req->_query, req->url != NULL ? req->url->data : NULL, req->url != NULL ? req->url->length : 0);
+
+  return &req->_query;
+}
+
+bool request_query(request_t *req, char const *name, query_param_t *param)
+{
+  return query_find(_query(req), name, strlen(name), param);
+}
+
+query_it_t request_query_iterator(request_t *req)
+{
+  return query_iterator(_query(req));
+}
+
+bool request_form(request_t *req, form_callbacks_t const *callbacks, void *data)
+{
+  string_t *content_type = request_header(req, "content-type");
+  if (content_type == NULL || req->_form != NULL)
+    return false;
+
+  req->_form = form_parser_new(req->_connection->loop, content_type->data, content_type->length, callbacks, data);
+  if (req->_form == NULL)
+    return false;
+
+  form_parser_on_drain(req->_form, _form_drained, req);
+
+  return true;
 }
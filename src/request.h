@@ -1,28 +1,100 @@
 #if !defined(_REQUEST_H_)
 #define _REQUEST_H_
 
+#include <stdbool.h>
+
 #include <llhttp.h>
 #include <uv.h>
 
+#include "collections/dlist.h"
 #include "collections/string.h"
 #include "collections/hashtable.h"
+#include "form.h"
+#include "query.h"
+
+struct server;
+struct loop_context;
+struct connection;
+struct proxy_exchange;
+struct rate_limit_rule;
+struct websocket;
 
 typedef struct request
 {
-  uv_stream_t *_stream;
+  struct connection *_connection;
+  struct server *_server;
+  struct loop_context *_loop_ctx;
   int (*_handle_request)(struct request *req);
+  // headers of a message with a body are in, may take the body with request_form
+  int (*_handle_body)(struct request *req);
   llhttp_t *_parser;
   hashtable_t *headers;
   string_t *url, *_hk, *_hd;
   char *body;
   size_t body_size;
+  // streams the body instead of filling body
+  form_parser_t *_form;
+  // or forwards it upstream, see proxy_handle
+  struct proxy_exchange *_proxy;
+  // the connection switched protocols, see websocket_accept
+  struct websocket *_websocket;
+  // or streams events, see sse_subscribe
+  struct sse_subscriber *_sse;
+  // identical requests wait for this one's response, see single_flight_handle
+  struct single_flight *_flight;
+  // a rate limit rule still waiting for its key header
+  struct rate_limit_rule const *_rate_rule;
+  // numeric peer address, empty when unknown; only looked up for rate limited servers
+  char _peer[INET6_ADDRSTRLEN];
+  // bytes read past a pause, parsing resumes at the offset
+  char *_pending;
+  size_t _pending_size, _pending_offset;
+  // charged to the loop's headers
+  size_t _head_bytes;
+  unsigned _refs, _writes;
+  uint64_t _connection_id, _trace, _accepted_at, _read_at;
+  // the connection's records in the loop's capture, 0 when it isn't recorded
+  uint64_t _capture_id;
+  bool _async, _close, _inflight;
+  // closing to make room under a cap, no longer counted in it
+  bool _evicted;
+  // between message begin and complete; the fast path only starts at a message boundary
+  bool _in_message, _fast;
+  // requests the current turn may still complete, 0 for no cap, and when its time is up; past
+  // either the parser pauses with _yielded set and the connection waits in the loop's deferred list
+  unsigned _turn_left;
+  uint64_t _turn_deadline, _deferred_at;
+  dlist_node_t _defer_node;
+  bool _yielded;
+  // built from url on first query access
+  query_t _query;
 } request_t;
 
 typedef int (*request_handler_f)(request_t *req);
 
 void init_request();
+// simple GET/HEAD heads skip llhttp's callbacks unless disabled
+void request_set_fast_path(bool enabled);
 
-request_t *create_request_handler(uv_stream_t *stream, request_handler_f handler);
+request_t *create_request_handler(struct connection *connection, request_handler_f handler);
 void delete_request_handler(request_t *req);
 
+// llhttp_execute with the fast path in front, stop is where parsing paused or failed
+enum llhttp_errno request_execute(request_t *req, char const *data, size_t length, char const **stop);
+
+void request_async_done(request_t *req);
+
+void request_ref(request_t *req);
+void request_unref(request_t *req);
+
+string_t *request_header(request_t *req, char const *name);
+
+// spans point into req->url and stay valid until the next message, see query_unescape
+bool request_query(request_t *req, char const *name, query_param_t *param);
+query_it_t request_query_iterator(request_t *req);
+
+// from the body handler: the body goes through a form parser for its Content-Type instead of
+// into req->body, false when it isn't a form; the handler still runs once the body is complete
+bool request_form(request_t *req, form_callbacks_t const *callbacks, void *data);
+
 #endif // _REQUEST_H_
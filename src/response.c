@@ -0,0 +1,652 @@
+#include "response.h"
+
+#include <stdio.h>
+#include <strings.h>
+
+#include <mimalloc.h>
+
+#include "compression.h"
+#include "connection.h"
+#include "loop.h"
+#include "server.h"
+#include "single_flight.h"
+
+struct response_copy
+{
+  unsigned _refs;
+  memory_t *memory;
+  int status;
+  encoding_t encoding;
+  bool vary;
+  // size is what Content-Length says, only body_length of it is kept for HEAD
+  size_t headers_length, size, body_length;
+  // headers then body
+  char data[];
+};
+
+typedef struct response_write
+{
+  connection_write_t write;
+  request_t *req;
+  // the body is written from it instead of data
+  response_copy_t *copy;
+  uint64_t trace;
+  int status;
+  // the loop's date changes every second, so each write keeps the one it was sent with
+  char date[DATE_HEADER_LENGTH];
+  char content_length[RESPONSE_LENGTH_SIZE];
+  // only for codes missing from the status table
+  char status_line[32];
+  // user headers then the body
+  char data[];
+} response_write_t;
+
+#define STATUS_MIN 100
+#define STATUS_MAX 599
+
+typedef struct status_line
+{
+  char const *line, *reason;
+  size_t line_length, reason_length;
+} status_line_t;
+
+#define STATUS(code, text)                                                  \
+  [code - STATUS_MIN] = {"HTTP/1.1 " #code " " text "\r\n", text,             \
+                         sizeof("HTTP/1.1 " #code " " text "\r\n") - 1, sizeof(text) - 1}
+
+static status_line_t const _status_lines[STATUS_MAX - STATUS_MIN + 1] = {
+  STATUS(100, "Continue"),
+  STATUS(101, "Switching Protocols"),
+  STATUS(200, "OK"),
+  STATUS(201, "Created"),
+  STATUS(202, "Accepted"),
+  STATUS(204, "No Content"),
+  STATUS(206, "Partial Content"),
+  STATUS(301, "Moved Permanently"),
+  STATUS(302, "Found"),
+  STATUS(304, "Not Modified"),
+  STATUS(400, "Bad Request"),
+  STATUS(401, "Unauthorized"),
+  STATUS(403, "Forbidden"),
+  STATUS(404, "Not Found"),
+  STATUS(405, "Method Not Allowed"),
+  STATUS(413, "Payload Too Large"),
+  STATUS(426, "Upgrade Required"),
+  STATUS(429, "Too Many Requests"),
+  STATUS(500, "Internal Server Error"),
+  STATUS(502, "Bad Gateway"),
+  STATUS(503, "Service Unavailable"),
+  STATUS(504, "Gateway Timeout"),
+};
+
+static status_line_t const *_status_line(int status)
+{
+  if (status < STATUS_MIN || status > STATUS_MAX || _status_lines[status - STATUS_MIN].line == NULL)
+    return NULL;
+
+  return &_status_lines[status - STATUS_MIN];
+}
+
+static bool _has_body(int status)
+{
+  return status >= 200 && status != 204 && status != 304;
+}
+
+void response_init(response_t *res, request_t *req, int status)
+{
+  res->req = req;
+  res->status = status;
+  res->flags = 0;
+  // a draining server lets each connection go after its next response
+  res->keep_alive = !req->_close && llhttp_should_keep_alive(req->_parser) &&
+                    (req->_server == NULL || !req->_server->draining);
+  res->head = llhttp_get_method(req->_parser) == HTTP_HEAD;
+  res->has_content_encoding = false;
+  res->accepted_encodings = compression_accepted(request_header(req, "accept-encoding"));
+  res->cache_identity = NULL;
+  res->cache_identity_length = 0;
+  res->content_type_offset = 0;
+  res->content_type_length = 0;
+  res->headers_length = 0;
+}
+
+void response_cache_as(response_t *res, char const *identity, size_t length)
+{
+  res->flags |= RESPONSE_CACHEABLE;
+  res->cache_identity = identity;
+  res->cache_identity_length = length;
+}
+
+bool response_headern(response_t *res, char const *name, size_t name_length, char const *value, size_t value_length)
+{
+  size_t needed = name_length + value_length + 4;
+  if (res->headers_length + needed > RESPONSE_HEAD_SIZE)
+    return false;
+
+  char *cursor = res->headers + res->headers_length;
+  memcpy(cursor, name, name_length);
+  cursor += name_length;
+  *cursor++ = ':';
+  *cursor++ = ' ';
+  memcpy(cursor, value, value_length);
+
+  if (name_length == 12 && strncasecmp(name, "content-type", 12) == 0)
+  {
+    res->content_type_offset = cursor - res->headers;
+    res->content_type_length = value_length;
+  }
+  else if (name_length == 16 && strncasecmp(name, "content-encoding", 16) == 0)
+  {
+    res->has_content_encoding = true;
+  }
+
+  cursor += value_length;
+  *cursor++ = '\r';
+  *cursor++ = '\n';
+  res->headers_length += needed;
+
+  return true;
+}
+
+static void _write_cb(connection_write_t *write, int status)
+{
+  response_write_t *response_write = (response_write_t *)write;
+  request_t *req = response_write->req;
+
+  if (response_write->trace != 0)
+    tracer_end(&req->_loop_ctx->tracer, response_write->trace, response_write->status);
+
+  response_copy_unref(response_write->copy);
+  memory_free(&req->_loop_ctx->memory, MEMORY_BUFFERS, response_write);
+  req->_writes--;
+
+  if (status < 0)
+  {
+    server_connection_close(req);
+    return;
+  }
+
+  if (req->_close && req->_writes == 0 && !req->_async)
+    server_connection_close(req);
+}
+
+static size_t _format_content_length(char *out, size_t size)
+{
+  static char const name[] = "Content-Length: ";
+
+  char digits[20];
+  size_t count = 0;
+  do
+  {
+    digits[count++] = '0' + size % 10;
+    size /= 10;
+  } while (size > 0);
+
+  char *cursor = out;
+  memcpy(cursor, name, sizeof(name) - 1);
+  cursor += sizeof(name) - 1;
+  while (count > 0)
+    *cursor++ = digits[--count];
+  *cursor++ = '\r';
+  *cursor++ = '\n';
+
+  return cursor - out;
+}
+
+#define FRAGMENT(text) uv_buf_init((char *)(text), sizeof(text) - 1)
+
+void response_copy_unref(response_copy_t *copy)
+{
+  if (copy != NULL && --copy->_refs == 0)
+    memory_free(copy->memory, MEMORY_BUFFERS, copy);
+}
+
+static response_copy_t *_copy_new(response_t *res, char const *body, size_t size, encoding_t encoding, bool vary)
+{
+  size_t body_length = _has_body(res->status) && !res->head ? size : 0;
+  memory_t *memory = &res->req->_loop_ctx->memory;
+  response_copy_t *copy = memory_alloc(memory, MEMORY_BUFFERS, sizeof(response_copy_t) + res->headers_length + body_length);
+  if (copy == NULL)
+    return NULL;
+
+  copy->_refs = 1;
+  copy->memory = memory;
+  copy->status = res->status;
+  copy->encoding = encoding;
+  copy->vary = vary;
+  copy->headers_length = res->headers_length;
+  copy->size = size;
+  copy->body_length = body_length;
+  memcpy(copy->data, res->headers, res->headers_length);
+  if (body_length > 0)
+    memcpy(copy->data + res->headers_length, body, body_length);
+
+  return copy;
+}
+
+// copy non-NULL holds the body, the write keeps a reference instead of copying it
+static bool _write(response_t *res, char const *body, size_t size, encoding_t encoding, bool vary, response_copy_t *copy)
+{
+  request_t *req = res->req;
+  bool has_body = _has_body(res->status);
+  size_t body_length = has_body && !res->head ? size : 0;
+  if (copy != NULL && body_length > copy->body_length)
+    return false;
+
+  memory_t *memory = &req->_loop_ctx->memory;
+  response_write_t *response_write =
+    memory_alloc(memory, MEMORY_BUFFERS, sizeof(response_write_t) + res->headers_length + (copy == NULL ? body_length : 0));
+  if (response_write == NULL)
+    return false;
+
+  // fixed pieces come from static tables and the loop's date, only user headers and the body are copied
+  uv_buf_t bufs[CONNECTION_WRITE_BUFS];
+  unsigned nbufs = 0;
+
+  status_line_t const *status_line = _status_line(res->status);
+  if (status_line != NULL)
+  {
+    bufs[nbufs++] = uv_buf_init((char *)status_line->line, status_line->line_length);
+  }
+  else
+  {
+    int length = snprintf(response_write->status_line, sizeof(response_write->status_line), "HTTP/1.1 %d Unknown\r\n",
+                          res->status);
+    bufs[nbufs++] = uv_buf_init(response_write->status_line, length);
+  }
+
+  memcpy(response_write->date, req->_loop_ctx->date.header, DATE_HEADER_LENGTH);
+  bufs[nbufs++] = uv_buf_init(response_write->date, DATE_HEADER_LENGTH);
+
+  if (res->headers_length > 0)
+  {
+    memcpy(response_write->data, res->headers, res->headers_length);
+    bufs[nbufs++] = uv_buf_init(response_write->data, res->headers_length);
+  }
+
+  size_t encoding_length;
+  char const *encoding_header = compression_header(encoding, &encoding_length);
+  if (encoding_header != NULL)
+    bufs[nbufs++] = uv_buf_init((char *)encoding_header, encoding_length);
+  if (vary)
+    bufs[nbufs++] = FRAGMENT("Vary: Accept-Encoding\r\n");
+  if (has_body)
+    bufs[nbufs++] = uv_buf_init(response_write->content_length, _format_content_length(response_write->content_length, size));
+
+  if (!res->keep_alive)
+    bufs[nbufs++] = FRAGMENT("Connection: close\r\n\r\n");
+  else if (llhttp_get_http_minor(req->_parser) == 0)
+    bufs[nbufs++] = FRAGMENT("Connection: keep-alive\r\n\r\n");
+  else
+    bufs[nbufs++] = FRAGMENT("\r\n");
+
+  if (body_length > 0 && copy != NULL)
+  {
+    bufs[nbufs++] = uv_buf_init(copy->data + copy->headers_length, body_length);
+    copy->_refs++;
+  }
+  else if (body_length > 0)
+  {
+    memcpy(response_write->data + res->headers_length, body, body_length);
+    bufs[nbufs++] = uv_buf_init(response_write->data + res->headers_length, body_length);
+  }
+
+  response_write->req = req;
+  response_write->copy = body_length > 0 ? copy : NULL;
+  response_write->status = res->status;
+
+  // the write completing is the last point of the request's trace
+  response_write->trace = req->_trace;
+  req->_trace = 0;
+
+  if (connection_write(req->_connection, &response_write->write, bufs, nbufs, _write_cb))
+  {
+    response_copy_unref(response_write->copy);
+    memory_free(memory, MEMORY_BUFFERS, response_write);
+    return false;
+  }
+  req->_writes++;
+
+  if (!res->keep_alive)
+  {
+    req->_close = true;
+    connection_read_stop(req->_connection);
+  }
+
+  return true;
+}
+
+bool response_send(response_t *res, char const *body, size_t size)
+{
+  request_t *req = res->req;
+  if (req->_connection == NULL || connection_is_closing(req->_connection))
+    return false;
+
+  encoding_t encoding = ENCODING_IDENTITY;
+  char const *payload = body;
+  size_t payload_size = size;
+  char *owned = NULL;
+  bool vary = false;
+
+  char const *content_type = res->content_type_length > 0 ? res->headers + res->content_type_offset : NULL;
+  if (!(res->flags & RESPONSE_NO_COMPRESS) && !res->has_content_encoding && _has_body(res->status) &&
+      compression_compressible(content_type, res->content_type_length, size))
+  {
+    vary = true;
+    encoding = compression_choose(res->accepted_encodings);
+
+    loop_context_t *ctx = encoding != ENCODING_IDENTITY ? loop_context_get(req->_connection->loop) : NULL;
+    if (ctx != NULL)
+    {
+      size_t compressed_size = 0;
+      char const *compressed;
+      if (res->flags & RESPONSE_CACHEABLE)
+      {
+        compressed = compression_cache_compress(ctx->compression_cache, ctx->compression_pool, encoding,
+                                                res->cache_identity, res->cache_identity_length, body, size,
+                                                &compressed_size);
+      }
+      else
+      {
+        owned = compression_compress(ctx->compression_pool, encoding, body, size, &compressed_size);
+        compressed = owned;
+      }
+
+      if (compressed != NULL)
+      {
+        payload = compressed;
+        payload_size = compressed_size;
+      }
+      else
+      {
+        encoding = ENCODING_IDENTITY;
+      }
+    }
+    else
+    {
+      encoding = ENCODING_IDENTITY;
+    }
+  }
+
+  // a single flight's leader sends from the copy it shares with the waiters
+  response_copy_t *copy = req->_flight != NULL ? _copy_new(res, payload, payload_size, encoding, vary) : NULL;
+  bool result = _write(res, payload, payload_size, encoding, vary, copy);
+  mi_free(owned);
+
+  if (copy != NULL)
+  {
+    single_flight_share(req, copy);
+    response_copy_unref(copy);
+  }
+
+  return result;
+}
+
+bool response_send_copy(request_t *req, response_copy_t *copy)
+{
+  if (req->_connection == NULL || connection_is_closing(req->_connection))
+    return false;
+
+  response_t res;
+  response_init(&res, req, copy->status);
+  memcpy(res.headers, copy->data, copy->headers_length);
+  res.headers_length = copy->headers_length;
+
+  return _write(&res, copy->data + copy->headers_length, copy->size, copy->encoding, copy->vary, copy);
+}
+
+bool response_send_status(request_t *req, int status)
+{
+  response_t res;
+  response_init(&res, req, status);
+
+  if (!_has_body(status))
+    return response_send(&res, NULL, 0);
+
+  status_line_t const *line = _status_line(status);
+  response_header(&res, "Content-Type", "text/plain");
+  return line != NULL ? response_send(&res, line->reason, line->reason_length) : response_send(&res, "Unknown", 7);
+}
+
+typedef struct file_response
+{
+  uv_fs_t fs;
+  response_t res;
+  char *path;
+  // the path and the version stat saw, what the compressed body is cached under
+  string_t *identity;
+  bool sidecar;
+  uv_file file;
+  char *data;
+  size_t size, offset;
+} file_response_t;
+
+static char const *_mime_type(char const *path)
+{
+  static char const *const types[][2] = {
+    {".html", "text/html; charset=utf-8"},
+    {".htm", "text/html; charset=utf-8"},
+    {".css", "text/css; charset=utf-8"},
+    {".js", "text/javascript; charset=utf-8"},
+    {".mjs", "text/javascript; charset=utf-8"},
+    {".json", "application/json"},
+    {".txt", "text/plain; charset=utf-8"},
+    {".xml", "application/xml"},
+    {".svg", "image/svg+xml"},
+    {".wasm", "application/wasm"},
+    {".png", "image/png"},
+    {".jpg", "image/jpeg"},
+    {".jpeg", "image/jpeg"},
+    {".gif", "image/gif"},
+    {".webp", "image/webp"},
+    {".ico", "image/x-icon"},
+  };
+
+  char const *extension = strrchr(path, '.');
+  if (extension != NULL && strchr(extension, '/') == NULL)
+  {
+    for (size_t i = 0; i < sizeof(types) / sizeof(types[0]); i++)
+    {
+      if (strcasecmp(extension, types[i][0]) == 0)
+        return types[i][1];
+    }
+  }
+
+  return "application/octet-stream";
+}
+
+static void _file_finish(file_response_t *ctx, int status)
+{
+  request_t *req = ctx->res.req;
+
+  if (ctx->file >= 0)
+  {
+    uv_fs_t close_req;
+    uv_fs_close(NULL, &close_req, ctx->file, NULL);
+    uv_fs_req_cleanup(&close_req);
+  }
+
+  bool alive = req->_connection != NULL && !connection_is_closing(req->_connection);
+  bool sent = false;
+  if (alive)
+  {
+    if (status == 200)
+    {
+      response_t *res = &ctx->res;
+      response_header(res, "Content-Type", _mime_type(ctx->path));
+      if (ctx->sidecar)
+      {
+        // already gzip on disk: forward as-is and keep the cache out of it
+        response_header(res, "Content-Encoding", "gzip");
+        response_header(res, "Vary", "Accept-Encoding");
+      }
+      else if (ctx->identity != NULL)
+      {
+        response_cache_as(res, ctx->identity->data, ctx->identity->length);
+      }
+      sent = response_send(res, ctx->data, ctx->size);
+    }
+    else
+    {
+      sent = response_send_status(req, status);
+    }
+  }
+
+  // after the response, which a single flight's leader shares before its request ends
+  request_async_done(req);
+  if (alive)
+  {
+    if (sent)
+      server_connection_resume(req);
+    else
+      server_connection_close(req);
+  }
+
+  memory_free(&req->_loop_ctx->memory, MEMORY_BUFFERS, ctx->data);
+  string_delete(ctx->identity);
+  mi_free(ctx->path);
+  mi_free(ctx);
+  request_unref(req);
+}
+
+static void _file_read_cb(uv_fs_t *fs)
+{
+  file_response_t *ctx = fs->data;
+  ssize_t result = fs->result;
+  uv_fs_req_cleanup(fs);
+
+  if (result < 0)
+  {
+    _file_finish(ctx, 500);
+    return;
+  }
+
+  ctx->offset += result;
+  if (result == 0 || ctx->offset >= ctx->size)
+  {
+    // the file shrank underneath us, serve what was read
+    ctx->size = ctx->offset;
+    _file_finish(ctx, 200);
+    return;
+  }
+
+  uv_buf_t buf = uv_buf_init(ctx->data + ctx->offset, ctx->size - ctx->offset);
+  if (uv_fs_read(fs->loop, &ctx->fs, ctx->file, &buf, 1, ctx->offset, _file_read_cb))
+    _file_finish(ctx, 500);
+}
+
+static void _file_stat_cb(uv_fs_t *fs)
+{
+  file_response_t *ctx = fs->data;
+  ssize_t result = fs->result;
+  uv_stat_t statbuf = fs->statbuf;
+  uv_fs_req_cleanup(fs);
+
+  if (result < 0 || !S_ISREG(statbuf.st_mode))
+  {
+    _file_finish(ctx, 404);
+    return;
+  }
+
+  ctx->size = statbuf.st_size;
+  ctx->identity = string_new_format("%s:%llx.%lx:%zx", ctx->path, (unsigned long long)statbuf.st_mtim.tv_sec,
+                                    (long)statbuf.st_mtim.tv_nsec, ctx->size);
+  if (ctx->size == 0)
+  {
+    _file_finish(ctx, 200);
+    return;
+  }
+
+  ctx->data = memory_alloc(&ctx->res.req->_loop_ctx->memory, MEMORY_BUFFERS, ctx->size);
+  if (ctx->data == NULL)
+  {
+    _file_finish(ctx, 500);
+    return;
+  }
+
+  uv_buf_t buf = uv_buf_init(ctx->data, ctx->size);
+  if (uv_fs_read(fs->loop, &ctx->fs, ctx->file, &buf, 1, 0, _file_read_cb))
+    _file_finish(ctx, 500);
+}
+
+static void _file_open_cb(uv_fs_t *fs);
+
+static bool _file_open(file_response_t *ctx, uv_loop_t *loop)
+{
+  size_t length = strlen(ctx->path);
+  char sidecar_path[length + 4];
+  char const *path = ctx->path;
+
+  if (ctx->sidecar)
+  {
+    memcpy(sidecar_path, ctx->path, length);
+    memcpy(sidecar_path + length, ".gz", 4);
+    path = sidecar_path;
+  }
+
+  ctx->fs.data = ctx;
+
+  return uv_fs_open(loop, &ctx->fs, path, UV_FS_O_RDONLY, 0, _file_open_cb) == 0;
+}
+
+static void _file_open_cb(uv_fs_t *fs)
+{
+  file_response_t *ctx = fs->data;
+  ssize_t result = fs->result;
+  uv_loop_t *loop = fs->loop;
+  uv_fs_req_cleanup(fs);
+
+  if (result < 0)
+  {
+    if (ctx->sidecar)
+    {
+      ctx->sidecar = false;
+      if (_file_open(ctx, loop))
+        return;
+      _file_finish(ctx, 500);
+      return;
+    }
+
+    _file_finish(ctx, result == UV_ENOENT || result == UV_ENOTDIR ? 404 : 403);
+    return;
+  }
+
+  ctx->file = result;
+  if (uv_fs_fstat(loop, &ctx->fs, ctx->file, _file_stat_cb))
+    _file_finish(ctx, 500);
+}
+
+bool response_send_file(response_t *res, char const *path)
+{
+  request_t *req = res->req;
+  if (req->_connection == NULL || req->_async)
+    return false;
+
+  file_response_t *ctx = mi_zalloc_small(sizeof(file_response_t));
+  if (ctx == NULL)
+    return false;
+
+  ctx->path = mi_strdup(path);
+  if (ctx->path == NULL)
+  {
+    mi_free(ctx);
+    return false;
+  }
+  ctx->res = *res;
+  ctx->file = -1;
+  ctx->sidecar = !(res->flags & RESPONSE_NO_COMPRESS) &&
+                 (res->accepted_encodings & ENCODING_FLAG(ENCODING_GZIP)) &&
+                 compression_compressible(_mime_type(path), strlen(_mime_type(path)), COMPRESSION_MIN_SIZE);
+
+  if (!_file_open(ctx, req->_connection->loop))
+  {
+    mi_free(ctx->path);
+    mi_free(ctx);
+    return false;
+  }
+
+  req->_async = true;
+  request_ref(req);
+
+  return true;
+}
@@ -0,0 +1,54 @@
+#if !defined(_RESPONSE_H_)
+#define _RESPONSE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "request.h"
+
+#define RESPONSE_HEAD_SIZE 1024
+// "Content-Length: " with up to 20 digits and CRLF
+#define RESPONSE_LENGTH_SIZE 40
+
+enum response_flags
+{
+  // the body is named by cache_identity, see response_cache_as
+  RESPONSE_CACHEABLE = 1 << 0,
+  RESPONSE_NO_COMPRESS = 1 << 1,
+};
+
+typedef struct response
+{
+  request_t *req;
+  int status;
+  unsigned flags;
+  bool keep_alive, head, has_content_encoding;
+  unsigned accepted_encodings;
+  char const *cache_identity;
+  size_t cache_identity_length;
+  size_t content_type_offset, content_type_length;
+  size_t headers_length;
+  char headers[RESPONSE_HEAD_SIZE];
+} response_t;
+
+void response_init(response_t *res, request_t *req, int status);
+
+// identity names the body, like a route and its version, so its compressed form is cached under it;
+// kept by pointer until the response is sent
+void response_cache_as(response_t *res, char const *identity, size_t length);
+
+bool response_headern(response_t *res, char const *name, size_t name_length, char const *value, size_t value_length);
+#define response_header(res, name, value) response_headern(res, name, strlen(name), value, strlen(value))
+
+// a response as it was sent, for sending again to requests for the same thing; see single_flight
+typedef struct response_copy response_copy_t;
+
+void response_copy_unref(response_copy_t *copy);
+
+bool response_send(response_t *res, char const *body, size_t size);
+// the status, headers and body of copy framed for req's connection, the body is written from copy
+bool response_send_copy(request_t *req, response_copy_t *copy);
+bool response_send_file(response_t *res, char const *path);
+bool response_send_status(request_t *req, int status);
+
+#endif // _RESPONSE_H_
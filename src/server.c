@@ -1,185 +1,558 @@
 #include "server.h"
 
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
 #include <mimalloc.h>
 
-static void _alloc_cb(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf)
+#include "connection.h"
+#include "loop.h"
+#include "response.h"
+#include "sse.h"
+#include "uring.h"
+#include "websocket.h"
+
+// connections looked at from the least recently active end for one to evict
+#define EVICTION_SCAN 32
+
+static void _free_cb(uv_handle_t *handle)
+{
+  mi_free(handle);
+}
+
+static void _stop_listening(server_t *server, bool release)
 {
-  size_t good_size = mi_good_size(suggested_size);
-  char *buffer = mi_malloc(good_size);
-  if (buffer != NULL)
+  loop_context_t *ctx = server->loop->data;
+
+  listener_t *listener;
+  while ((listener = ll_remove_front(server->listeners)) != NULL)
   {
-    buf->base = buffer;
-    buf->len = good_size;
+    if (server->transport == SERVER_TRANSPORT_URING && ctx->uring != NULL)
+      uring_unlisten(ctx->uring, listener);
+    overload_forget(&ctx->overload, &listener->stream);
+
+    if (release)
+      listener_release(listener);
+    else
+      listener_close(listener);
   }
 }
 
-static void _close_cb(uv_handle_t *handle)
+static void _drain_check(server_t *server)
 {
-  delete_request_handler(handle->data);
-  mi_free(handle);
+  if (server->_drained == NULL || server->connections > 0)
+    return;
+
+  server_drained_f drained = server->_drained;
+  server->_drained = NULL;
+  _stop_listening(server, true);
+  if (server->_drain_timer != NULL)
+    uv_close((uv_handle_t *)server->_drain_timer, _free_cb);
+  server->_drain_timer = NULL;
+
+  drained(server, server->_drained_data);
 }
 
-static void _read_cb(uv_stream_t *stream, ssize_t nread, uv_buf_t const *buf)
+static void _close_cb(connection_t *connection)
 {
-  if (nread > 0)
+  request_t *req = connection->data;
+  server_t *server = req->_server;
+
+  // a destroyed server has already let go of its connections, and an evicted one was counted out
+  if (!req->_evicted)
+  {
+    if (server != NULL)
+      server->connections--;
+    req->_loop_ctx->overload.connections--;
+  }
+  capture_closed(&req->_loop_ctx->capture, req->_capture_id);
+  dl_remove(&req->_loop_ctx->connections, &connection->node);
+  if (dl_linked(&req->_defer_node))
+    dl_remove(&req->_loop_ctx->deferred, &req->_defer_node);
+  websocket_delete(req->_websocket);
+  req->_websocket = NULL;
+  sse_unsubscribe(req->_sse);
+
+  // async work still holding the request must see the connection is gone
+  req->_connection = NULL;
+  request_unref(req);
+
+  if (server != NULL)
+    _drain_check(server);
+}
+
+static void _turn_begin(request_t *req)
+{
+  server_t *server = req->_server;
+  req->_yielded = false;
+  req->_turn_left = server != NULL ? server->turn_requests : 0;
+  req->_turn_deadline = server != NULL && server->turn_ns != 0 ? uv_hrtime() + server->turn_ns : 0;
+}
+
+// one turn per iteration for each connection that gave way, in the order they did
+static void _deferred_cb(uv_idle_t *idle)
+{
+  loop_context_t *ctx = idle->loop->data;
+
+  // the ones yielding again now go behind the others, and wait for the next iteration
+  size_t count = ctx->deferred.length;
+  dlist_node_t *node;
+  while (count-- > 0 && (node = dl_front(&ctx->deferred)) != NULL)
+  {
+    request_t *req = DLIST_ENTRY(node, request_t, _defer_node);
+    dl_remove(&ctx->deferred, node);
+    profiler_deferred(&ctx->profiler, req->_deferred_at);
+    server_connection_resume(req);
+  }
+
+  if (ctx->deferred.length == 0)
+    uv_idle_stop(idle);
+}
+
+static void _defer(request_t *req)
+{
+  loop_context_t *ctx = req->_loop_ctx;
+
+  // an active idle handle also keeps the poll from blocking while connections wait
+  if (ctx->deferred.length == 0)
+    uv_idle_start(&ctx->deferred_idle, _deferred_cb);
+  dl_push_back(&ctx->deferred, &req->_defer_node);
+  req->_deferred_at = uv_hrtime();
+}
+
+typedef enum execute_result
+{
+  EXECUTE_CONTINUE,
+  EXECUTE_PAUSED,
+  EXECUTE_CLOSED
+} execute_result_t;
+
+static execute_result_t _execute(request_t *req, char const *data, size_t length)
+{
+  char const *position;
+  enum llhttp_errno err = request_execute(req, data, length, &position);
+  if (req->_close)
+  {
+    // a response asked to close: anything pipelined behind it is dropped
+    connection_read_stop(req->_connection);
+    if (req->_writes == 0 && !req->_async)
+      server_connection_close(req);
+    return EXECUTE_CLOSED;
+  }
+
+  if (err == HPE_OK)
+    return EXECUTE_CONTINUE;
+
+  if (err == HPE_PAUSED_UPGRADE)
+  {
+    size_t consumed = position - data;
+    if (req->_websocket != NULL)
+    {
+      // everything after the upgrade request is frames
+      websocket_read(req->_websocket, (char *)data + consumed, length - consumed);
+      return req->_close ? EXECUTE_CLOSED : EXECUTE_CONTINUE;
+    }
+
+    // the handler answered without switching protocols, carry on with HTTP
+    llhttp_resume_after_upgrade(req->_parser);
+    return _execute(req, data + consumed, length - consumed);
+  }
+
+  // the stream keeps reading only to notice the client leaving
+  if (err == HPE_PAUSED && req->_sse != NULL)
+    return EXECUTE_CONTINUE;
+
+  if (err == HPE_PAUSED)
   {
-    request_t *req = stream->data;
-    enum llhttp_errno err = llhttp_execute(req->_parser, buf->base, nread);
+    size_t consumed = position != NULL ? (size_t)(position - data) : length;
+    size_t remaining = length - consumed;
+
+    // nobody waits behind a turn that used up what was read
+    if (req->_yielded && remaining == 0)
+    {
+      req->_yielded = false;
+      llhttp_resume(req->_parser);
+      return EXECUTE_CONTINUE;
+    }
 
-    if (err == HPE_OK)
+    if (req->_pending != NULL && data >= req->_pending && data < req->_pending + req->_pending_size)
     {
-      printf("Parse success\n");
+      // paused again within the bytes it resumed with, they stay where they are
+      req->_pending_offset = (size_t)(data + consumed - req->_pending);
     }
     else
     {
-      fprintf(stderr, "Parser error: %s %s\n", llhttp_errno_name(err), req->_parser->reason);
+      char *pending = NULL;
+      if (remaining > 0)
+      {
+        pending = memory_alloc(&req->_loop_ctx->memory, MEMORY_BODIES, remaining);
+        if (pending == NULL)
+        {
+          server_connection_close(req);
+          return EXECUTE_CLOSED;
+        }
+        memcpy(pending, data + consumed, remaining);
+      }
+
+      memory_free(&req->_loop_ctx->memory, MEMORY_BODIES, req->_pending);
+      req->_pending = pending;
+      req->_pending_size = remaining;
+      req->_pending_offset = 0;
     }
+    connection_read_stop(req->_connection);
+
+    if (req->_yielded)
+      _defer(req);
+
+    return EXECUTE_PAUSED;
   }
 
-  // close connection anyways because it's a test yet
-  uv_close((uv_handle_t *)stream, _close_cb);
-  mi_free(buf->base);
+  fprintf(stderr, "Parser error: %s %s\n", llhttp_errno_name(err), req->_parser->reason);
+
+  req->_close = true;
+  connection_read_stop(req->_connection);
+  if (!response_send_status(req, err == HPE_CB_MESSAGE_COMPLETE ? 500 : 400))
+    server_connection_close(req);
+
+  return EXECUTE_CLOSED;
 }
 
-static void _conn_cb(uv_stream_t *server, int status)
+static void _read_cb(connection_t *connection, ssize_t nread, char const *data)
 {
-  if (status < 0)
+  request_t *req = connection->data;
+
+  if (nread > 0)
   {
-    fprintf(stderr, "Connection error %s\n", uv_strerror(status));
-    return;
-  }
+    dl_move_back(&req->_loop_ctx->connections, &connection->node);
+    capture_data(&req->_loop_ctx->capture, req->_capture_id, data, nread);
+
+    // read buffers are the transport's until the next read, so frames are unmasked in place
+    if (req->_websocket != NULL)
+    {
+      websocket_read(req->_websocket, (char *)data, nread);
+      return;
+    }
 
-  uv_tcp_t *client = mi_malloc(sizeof(uv_tcp_t));
-  if (client == NULL)
+    // an event stream client has nothing more to say
+    if (req->_sse != NULL)
+      return;
+
+    if (tracer_enabled(&req->_loop_ctx->tracer))
+      req->_read_at = uv_hrtime();
+
+    profiler_t *profiler = &req->_loop_ctx->profiler;
+    uint64_t start = profiler_read_begin(profiler);
+    _turn_begin(req);
+    _execute(req, data, nread);
+    profiler_read_end(profiler, start);
+  }
+  else if (nread < 0)
   {
-    fprintf(stderr, "Allocation error (tcp_client)\n");
-    return;
+    if (nread == UV_EOF)
+      capture_eof(&req->_loop_ctx->capture, req->_capture_id);
+
+    // let queued responses reach a half-closed client before closing
+    req->_close = true;
+    connection_read_stop(connection);
+    if ((req->_writes == 0 && !req->_async) || req->_sse != NULL)
+      server_connection_close(req);
   }
+}
 
-  server_t *app_server = server->data;
-  request_t *req = create_request_handler((uv_stream_t *)client, app_server->handler);
-  if (req == NULL)
-  {
-    mi_free(client);
+void server_connection_close(request_t *req)
+{
+  if (req->_connection == NULL || connection_is_closing(req->_connection))
     return;
+
+  connection_close(req->_connection, _close_cb);
+}
+
+void server_close_connections(server_t *server)
+{
+  loop_context_t *ctx = server->loop->data;
+
+  dlist_it it = dl_iterator(&ctx->connections);
+  while (dli_next(&it))
+  {
+    request_t *req = DLIST_ENTRY(dli_get(it), connection_t, node)->data;
+    if (req->_server == server)
+      server_connection_close(req);
   }
-  client->data = req;
+}
 
-  int err = uv_tcp_init(server->loop, client);
-  if (err != 0)
+void server_connection_resume(request_t *req)
+{
+  if (req->_connection == NULL || connection_is_closing(req->_connection) || req->_async)
+    return;
+
+  if (req->_close)
   {
-    delete_request_handler(req);
-    mi_free(client);
-    fprintf(stderr, "error: %s\n", uv_strerror(err));
+    if (req->_writes == 0)
+      server_connection_close(req);
     return;
   }
 
-  if (uv_accept(server, (uv_stream_t *)client) == 0)
+  llhttp_resume(req->_parser);
+  _turn_begin(req);
+
+  execute_result_t result = EXECUTE_CONTINUE;
+  char *pending = req->_pending;
+  if (pending != NULL)
   {
-    uv_read_start((uv_stream_t *)client, _alloc_cb, _read_cb);
+    result = _execute(req, pending + req->_pending_offset, req->_pending_size - req->_pending_offset);
+    // a pause leaves the rest where it is for the next resume
+    if (result != EXECUTE_PAUSED)
+    {
+      memory_free(&req->_loop_ctx->memory, MEMORY_BODIES, pending);
+      req->_pending = NULL;
+      req->_pending_size = 0;
+      req->_pending_offset = 0;
+    }
   }
-  else
+  else if (req->_in_message)
   {
-    uv_close((uv_handle_t *)client, _close_cb);
+    // a pause on the last bytes read leaves nothing to resume with but the message to complete
+    result = _execute(req, "", 0);
   }
+
+  if (result == EXECUTE_CONTINUE)
+    connection_read_start(req->_connection, _read_cb);
 }
 
-uv_tcp_t *_tcp_init(uv_loop_t *loop)
+static bool _server_full(server_t *server)
 {
-  uv_tcp_t *tcp = mi_malloc(sizeof(uv_tcp_t));
-  if (tcp == NULL)
-    return NULL;
+  return server->max_connections != 0 && server->connections >= server->max_connections;
+}
 
-  if (uv_tcp_init(loop, tcp))
+static bool _accepting(server_t *server, loop_context_t *ctx)
+{
+  return !_server_full(server) && overload_accepting(&ctx->overload);
+}
+
+// between messages with nothing queued, closing it loses nothing the client hasn't been told
+static bool _idle(request_t *req)
+{
+  return !req->_in_message && !req->_async && !req->_close && req->_writes == 0 && req->_pending == NULL &&
+         req->_websocket == NULL && req->_sse == NULL && !connection_is_closing(req->_connection);
+}
+
+// at a cap the least recently active idle connection makes way for a new one instead of the
+// listener pausing; it stops counting as its close starts, so a burst of accepts each finds room
+// in the caps rather than going past them until the closes finish
+static bool _evict_idle(server_t *server, loop_context_t *ctx)
+{
+  // only the server's own connections make room under its cap
+  bool own = _server_full(server);
+
+  unsigned scanned = 0;
+  dlist_it it = dl_iterator(&ctx->connections);
+  while (dli_next(&it) && scanned++ < EVICTION_SCAN)
   {
-    mi_free(tcp);
-    return NULL;
+    request_t *req = DLIST_ENTRY(dli_get(it), connection_t, node)->data;
+    if ((!own || req->_server == server) && _idle(req))
+    {
+      ctx->overload.evicted++;
+      req->_evicted = true;
+      if (req->_server != NULL)
+        req->_server->connections--;
+      ctx->overload.connections--;
+      server_connection_close(req);
+      return true;
+    }
   }
 
-  return tcp;
+  return false;
 }
 
-uv_tcp_t *_configure_tcp_ipv4(uv_loop_t *loop, char const *ipv4, int port)
+// single writer, so a plain add published with a relaxed store is enough for readers on other threads
+static void _count_accept(server_t *server, connection_t *connection)
 {
-  uv_tcp_t *tcp = _tcp_init(loop);
-  if (tcp == NULL)
-    return NULL;
+  __atomic_store_n(&server->accepted, server->accepted + 1, __ATOMIC_RELAXED);
+
+  uv_os_sock_t fd;
+  if (server->cpu >= 0 && connection_fileno(connection, &fd) == 0 && socket_options_incoming_cpu(fd) == server->cpu)
+    __atomic_store_n(&server->accepted_local, server->accepted_local + 1, __ATOMIC_RELAXED);
+}
+
+void server_connection_open(server_t *server, connection_t *connection)
+{
+  loop_context_t *ctx = connection->loop->data;
 
-  struct sockaddr_in addr;
-  if (uv_ip4_addr(ipv4, port, &addr))
+  request_t *req = create_request_handler(connection, server->handler);
+  if (req == NULL)
   {
-    mi_free(tcp);
-    return NULL;
+    connection_close(connection, NULL);
+    return;
   }
+  req->_server = server;
+  req->_handle_body = server->body_handler;
+  connection->data = req;
+  dl_push_back(&ctx->connections, &connection->node);
+
+  // kept as text so it can key the buckets as it is
+  struct sockaddr_storage peer;
+  int peer_length = sizeof(peer);
+  if (server->rate_limit != NULL && connection_getpeername(connection, (struct sockaddr *)&peer, &peer_length) == 0)
+    uv_ip_name((struct sockaddr *)&peer, req->_peer, sizeof(req->_peer));
+
+  if (tracer_enabled(&ctx->tracer))
+  {
+    req->_connection_id = ++ctx->tracer.next_connection;
+    req->_accepted_at = uv_hrtime();
+  }
+  if (capture_enabled(&ctx->capture))
+    req->_capture_id = capture_accept(&ctx->capture);
+
+  server->connections++;
+  ctx->overload.connections++;
+  _count_accept(server, connection);
+
+  connection_read_start(connection, _read_cb);
+}
+
+static void _resume_accept(uv_stream_t *stream);
 
-  if (uv_tcp_bind(tcp, (struct sockaddr const *)&addr, 0))
+static void _conn_cb(uv_stream_t *stream, int status)
+{
+  if (status < 0)
   {
-    mi_free(tcp);
-    return NULL;
+    fprintf(stderr, "Connection error %s\n", uv_strerror(status));
+    return;
   }
 
-  return tcp;
+  listener_t *listener = LISTENER(stream);
+  loop_context_t *ctx = stream->loop->data;
+
+  // not accepting leaves the connection in the kernel backlog until there's room again
+  if (!_accepting(listener->server, ctx) && !_evict_idle(listener->server, ctx) &&
+      overload_pause(&ctx->overload, stream, _resume_accept))
+    return;
+
+  connection_t *connection = connection_accept(listener);
+  if (connection == NULL)
+  {
+    fprintf(stderr, "Allocation error (client)\n");
+    return;
+  }
+
+  server_connection_open(listener->server, connection);
 }
 
-uv_tcp_t *_configure_tcp_ipv6(uv_loop_t *loop, char const *ipv6, int port)
+static void _uring_accept_cb(listener_t *listener, uv_os_sock_t fd)
 {
-  uv_tcp_t *tcp = _tcp_init(loop);
-  if (tcp == NULL)
-    return NULL;
+  loop_context_t *ctx = listener->handle.loop->data;
 
-  struct sockaddr_in6 addr;
-  if (uv_ip6_addr(ipv6, port, &addr))
+  connection_t *connection = uring_connection_new(ctx->uring, fd);
+  if (connection == NULL)
   {
-    mi_free(tcp);
-    return NULL;
+    fprintf(stderr, "Allocation error (client)\n");
+    close(fd);
+    return;
   }
 
-  if (uv_tcp_bind(tcp, (struct sockaddr const *)&addr, 0))
+  listener_client_configure(listener, fd);
+  if (!_accepting(listener->server, ctx))
+    _evict_idle(listener->server, ctx);
+  server_connection_open(listener->server, connection);
+
+  // the multishot accept has already taken this one, stop it taking more past the cap
+  if (!_accepting(listener->server, ctx) && overload_pause(&ctx->overload, &listener->stream, _resume_accept))
+    uring_accept_stop(ctx->uring, listener);
+}
+
+static void _resume_accept(uv_stream_t *stream)
+{
+  listener_t *listener = LISTENER(stream);
+  if (listener->server->draining)
+    return;
+
+  if (listener->server->transport != SERVER_TRANSPORT_URING)
   {
-    mi_free(tcp);
-    return NULL;
+    _conn_cb(stream, 0);
+    return;
   }
 
-  return tcp;
+  loop_context_t *ctx = stream->loop->data;
+  if (!_accepting(listener->server, ctx) && overload_pause(&ctx->overload, stream, _resume_accept))
+    return;
+
+  uring_accept_start(ctx->uring, listener);
 }
 
 #define USE_LOOP_OR_DEFAULT(loop) (loop != NULL ? loop : uv_default_loop())
 
-server_t *server_configure(char const *ipv4, char const *ipv6, int port, request_handler_f handler, uv_loop_t *loop)
+server_t *server_new(request_handler_f handler, uv_loop_t *loop)
 {
-  if (ipv4 == NULL && ipv6 == NULL)
+  // per-loop state (compressors, overload hooks) must exist before the first connection
+  if (loop_context_get(USE_LOOP_OR_DEFAULT(loop)) == NULL)
     return NULL;
 
   server_t *server = mi_zalloc_small(sizeof(server_t));
   if (server == NULL)
     return NULL;
 
-  if (ipv4 != NULL)
+  server->listeners = ll_new();
+  if (server->listeners == NULL)
   {
-    uv_tcp_t *tcp4 = _configure_tcp_ipv4(USE_LOOP_OR_DEFAULT(loop), ipv4, port);
-    if (tcp4 == NULL)
-    {
-      mi_free(server);
-      return NULL;
-    }
-    server->tcp4 = tcp4;
-    tcp4->data = server;
+    mi_free(server);
+    return NULL;
   }
 
-  if (ipv6 != NULL)
+  server->loop = USE_LOOP_OR_DEFAULT(loop);
+  server->handler = handler;
+  server->cpu = -1;
+  server_set_fairness(server, SERVER_DEFAULT_TURN_REQUESTS, SERVER_DEFAULT_TURN_US);
+
+  return server;
+}
+
+static bool _add_listener(server_t *server, listener_t *listener)
+{
+  if (listener == NULL)
+    return false;
+
+  listener->server = server;
+  if (!ll_push_back(server->listeners, listener))
   {
-    uv_tcp_t *tcp6 = _configure_tcp_ipv6(USE_LOOP_OR_DEFAULT(loop), ipv6, port);
-    if (tcp6 == NULL)
-    {
-      mi_free(server->tcp4);
-      mi_free(server);
-      return NULL;
-    }
-    server->tcp6 = tcp6;
-    tcp6->data = server;
+    listener_close(listener);
+    return false;
   }
 
-  server->handler = handler;
+  return true;
+}
+
+bool server_add_tcp(server_t *server, char const *host, int port, socket_options_t const *options)
+{
+  return _add_listener(server, listener_tcp(server->loop, host, port, options));
+}
+
+bool server_add_pipe(server_t *server, char const *path, int mode)
+{
+  return _add_listener(server, listener_pipe(server->loop, path, mode));
+}
+
+server_t *server_configure(
+  char const *ipv4,
+  char const *ipv6,
+  int port,
+  socket_options_t const *options,
+  request_handler_f handler,
+  uv_loop_t *loop)
+{
+  if (ipv4 == NULL && ipv6 == NULL)
+    return NULL;
+
+  server_t *server = server_new(handler, loop);
+  if (server == NULL)
+    return NULL;
+
+  if ((ipv4 != NULL && !server_add_tcp(server, ipv4, port, options)) ||
+      (ipv6 != NULL && !server_add_tcp(server, ipv6, port, options)))
+  {
+    server_destroy(server);
+    return NULL;
+  }
 
   return server;
 }
@@ -189,27 +562,166 @@ void server_destroy(server_t *server)
   if (server == NULL)
     return;
 
-  mi_free(server->tcp4);
-  mi_free(server->tcp6);
+  // connections still closing would count down a freed server
+  server_close_connections(server);
+
+  loop_context_t *ctx = server->loop->data;
+  dlist_it connections = dl_iterator(&ctx->connections);
+  while (dli_next(&connections))
+  {
+    request_t *req = DLIST_ENTRY(dli_get(connections), connection_t, node)->data;
+    if (req->_server == server)
+      req->_server = NULL;
+  }
+
+  if (server->_drain_timer != NULL)
+    uv_close((uv_handle_t *)server->_drain_timer, _free_cb);
+
+  _stop_listening(server, false);
+  ll_delete(server->listeners, NULL);
   mi_free(server);
 }
 
+static void _drain_timeout_cb(uv_timer_t *timer)
+{
+  server_t *server = timer->data;
+
+  server_close_connections(server);
+}
+
+void server_drain(server_t *server, uint64_t timeout_ms, server_drained_f drained, void *data)
+{
+  loop_context_t *ctx = server->loop->data;
+  if (server->draining)
+    return;
+
+  server->draining = true;
+  if (server->transport == SERVER_TRANSPORT_URING && ctx->uring != NULL)
+  {
+    // the ring may be in the middle of an accept, what it still takes is served; the listeners go once drained
+    linked_list_it listeners = ll_iterator(server->listeners);
+    while (lli_next(&listeners))
+    {
+      listener_t *listener = lli_get(listeners);
+      overload_forget(&ctx->overload, &listener->stream);
+      uring_accept_stop(ctx->uring, listener);
+    }
+  }
+  else
+  {
+    _stop_listening(server, true);
+  }
+
+  // a client whose next request is already on its way sees the close and retries it elsewhere
+  dlist_it it = dl_iterator(&ctx->connections);
+  while (dli_next(&it))
+  {
+    request_t *req = DLIST_ENTRY(dli_get(it), connection_t, node)->data;
+    if (req->_server == server && _idle(req))
+      server_connection_close(req);
+  }
+
+  server->_drained = drained;
+  server->_drained_data = data;
+  server->_drain_timer = mi_malloc(sizeof(uv_timer_t));
+  if (server->_drain_timer != NULL)
+  {
+    uv_timer_init(server->loop, server->_drain_timer);
+    server->_drain_timer->data = server;
+    uv_timer_start(server->_drain_timer, _drain_timeout_cb, timeout_ms, 0);
+  }
+  else
+  {
+    // without a deadline to wait for, they go now
+    server_close_connections(server);
+  }
+
+  _drain_check(server);
+}
+
+size_t server_listener_fds(server_t *server, uv_os_sock_t *fds, size_t max)
+{
+  size_t count = 0;
+  linked_list_it it = ll_iterator(server->listeners);
+  while (lli_next(&it) && count < max)
+  {
+    uv_os_fd_t fd;
+    if (uv_fileno(&LISTENER(lli_get(it))->handle, &fd) == 0)
+      fds[count++] = fd;
+  }
+
+  return count;
+}
+
 bool server_listen(server_t *server, int backlog)
 {
-  if (server->tcp4 == NULL && server->tcp6 == NULL)
+  if (server->listeners->length == 0)
     return false;
 
-  if (server->tcp4 != NULL)
+  loop_context_t *ctx = server->loop->data;
+  if (server->transport == SERVER_TRANSPORT_URING && loop_context_uring(ctx) == NULL)
   {
-    if (uv_listen((uv_stream_t *)server->tcp4, backlog, _conn_cb))
-      return false;
+    fprintf(stderr, "Falling back to the libuv transport\n");
+    server->transport = SERVER_TRANSPORT_LIBUV;
   }
 
-  if (server->tcp6 != NULL)
+  linked_list_it it = ll_iterator(server->listeners);
+  while (lli_next(&it))
   {
-    if (uv_listen((uv_stream_t *)server->tcp6, backlog, _conn_cb))
-      return false;
+    listener_t *listener = lli_get(it);
+    if (server->transport == SERVER_TRANSPORT_URING)
+    {
+      if (!uring_listen(ctx->uring, listener, backlog, _uring_accept_cb))
+        return false;
+    }
+    else
+    {
+      int err = uv_listen(&listener->stream, backlog, _conn_cb);
+      if (err)
+      {
+        fprintf(stderr, "Listen error %s\n", uv_strerror(err));
+        return false;
+      }
+    }
+    listener_report(listener);
   }
 
   return true;
 }
+
+void server_set_transport(server_t *server, server_transport_t transport)
+{
+  server->transport = transport;
+}
+
+void server_set_body_handler(server_t *server, request_handler_f handler)
+{
+  server->body_handler = handler;
+}
+
+void server_set_overload(server_t *server, size_t max_connections, overload_options_t const *options)
+{
+  server->max_connections = max_connections;
+
+  if (options == NULL)
+    return;
+
+  loop_context_t *ctx = server->loop->data;
+  ctx->overload.options = *options;
+}
+
+void server_set_rate_limit(server_t *server, rate_limit_t *limit)
+{
+  server->rate_limit = limit;
+}
+
+void server_set_fairness(server_t *server, unsigned max_requests, uint64_t max_us)
+{
+  server->turn_requests = max_requests;
+  server->turn_ns = max_us * 1000;
+}
+
+void server_set_cpu(server_t *server, int cpu)
+{
+  server->cpu = cpu;
+}
@@ -2,24 +2,94 @@
 #define _SERVER_H_
 
 #include <stdbool.h>
+#include <stdint.h>
 
 #include <uv.h>
 
+#include "collections/linked_list.h"
+#include "listener.h"
+#include "overload.h"
+#include "rate_limit.h"
 #include "request.h"
 
-typedef struct server
+// what one connection may run before the loop's other connections get theirs
+#define SERVER_DEFAULT_TURN_REQUESTS 16
+#define SERVER_DEFAULT_TURN_US 2000
+
+typedef enum server_transport
+{
+  SERVER_TRANSPORT_LIBUV,
+  // Linux io_uring with multishot accept/recv, falls back to libuv when the kernel lacks it
+  SERVER_TRANSPORT_URING
+} server_transport_t;
+
+typedef struct server server_t;
+
+// the last connection of a draining server has closed
+typedef void (*server_drained_f)(server_t *server, void *data);
+
+struct server
 {
-  uv_tcp_t *tcp4, *tcp6;
-  request_handler_f handler;
-} server_t;
+  uv_loop_t *loop;
+  linked_list_t *listeners;
+  request_handler_f handler, body_handler;
+  size_t connections, max_connections;
+  server_transport_t transport;
+  rate_limit_t *rate_limit;
+  // per connection per turn, 0 for no cap, see server_set_fairness
+  unsigned turn_requests;
+  uint64_t turn_ns;
+  // the core the loop is pinned to, -1 when it isn't
+  int cpu;
+  // only written by the loop, read from any thread with __atomic_load_n; local ones were
+  // received on the server's own core
+  uint64_t accepted, accepted_local;
+  // no longer accepting, responses close their connections, see server_drain
+  bool draining;
+  uv_timer_t *_drain_timer;
+  server_drained_f _drained;
+  void *_drained_data;
+};
+
+server_t *server_new(request_handler_f handler, uv_loop_t *loop);
+bool server_add_tcp(server_t *server, char const *host, int port, socket_options_t const *options);
+bool server_add_pipe(server_t *server, char const *path, int mode);
 
 server_t *server_configure(
   char const *ipv4,
   char const *ipv6,
   int port,
+  socket_options_t const *options,
   request_handler_f handler,
   uv_loop_t *loop);
 void server_destroy(server_t *server);
 bool server_listen(server_t *server, int backlog);
+// must be chosen before server_listen
+void server_set_transport(server_t *server, server_transport_t transport);
+// called when the headers of a message with a body are complete, see request_form
+void server_set_body_handler(server_t *server, request_handler_f handler);
+void server_set_overload(server_t *server, size_t max_connections, overload_options_t const *options);
+// requests over their route's rate get 429 as soon as the url, or the rule's header, is parsed
+void server_set_rate_limit(server_t *server, rate_limit_t *limit);
+// a turn is what one read, or one resume, gets to parse; past max_requests completed or max_us spent,
+// the connection yields and continues from the next loop iteration. 0 lifts either cap
+void server_set_fairness(server_t *server, unsigned max_requests, uint64_t max_us);
+// counts accepted connections against the core they were received on
+void server_set_cpu(server_t *server, int cpu);
+
+// stops accepting, leaving the listening sockets to whoever else holds them, and closes connections
+// between requests; the rest get Connection: close on their next response. Those still open after
+// timeout_ms are closed. drained may be called before this returns
+void server_drain(server_t *server, uint64_t timeout_ms, server_drained_f drained, void *data);
+// the listening sockets, for another process to take over; the number written, at most max
+size_t server_listener_fds(server_t *server, uv_os_sock_t *fds, size_t max);
+
+// serves a connection that didn't come from one of the server's listeners, such as one on a transport
+// of the caller's own
+void server_connection_open(server_t *server, struct connection *connection);
+void server_connection_close(request_t *req);
+// closes every connection of the server without waiting for responses, for shutdown
+void server_close_connections(server_t *server);
+void server_connection_resume(request_t *req);
 
 #endif // _SERVER_H_
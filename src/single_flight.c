@@ -0,0 +1,206 @@
+#include "single_flight.h"
+
+#include <mimalloc.h>
+
+#include "connection.h"
+#include "loop.h"
+#include "server.h"
+
+typedef struct single_flight_waiter
+{
+  dlist_node_t node;
+  request_t *req;
+} single_flight_waiter_t;
+
+void single_flight_options_default(single_flight_options_t *options)
+{
+  options->headers = NULL;
+  options->header_count = 0;
+  options->max_waiters = SINGLE_FLIGHT_DEFAULT_MAX_WAITERS;
+  options->timeout_ms = SINGLE_FLIGHT_DEFAULT_TIMEOUT_MS;
+}
+
+// header values never hold a newline, so the fields can't run into each other
+static string_t *_key(request_t *req, single_flight_options_t const *options)
+{
+  string_t *key = string_new_format("%s %s\n", llhttp_method_name(llhttp_get_method(req->_parser)), req->url->data);
+  if (key == NULL)
+    return NULL;
+
+  string_t *encoding = request_header(req, "accept-encoding");
+  bool built = encoding == NULL || string_concat(key, encoding);
+  for (size_t i = 0; built && i < options->header_count; i++)
+  {
+    string_t *value = request_header(req, options->headers[i]);
+    built = string_cstr_concatn(key, "\n", 1) && (value == NULL || string_concat(key, value));
+  }
+
+  if (!built)
+  {
+    string_delete(key);
+    return NULL;
+  }
+
+  return key;
+}
+
+static void _unlist(single_flight_t *flight)
+{
+  if (!flight->listed)
+    return;
+
+  flight->listed = false;
+  ht_remove(flight->ctx->flights, flight->key);
+}
+
+// copy NULL answers with status instead
+static void _answer(single_flight_t *flight, response_copy_t *copy, int status)
+{
+  dlist_node_t *node;
+  while ((node = dl_front(&flight->waiters)) != NULL)
+  {
+    dl_remove(&flight->waiters, node);
+    single_flight_waiter_t *waiter = DLIST_ENTRY(node, single_flight_waiter_t, node);
+    request_t *req = waiter->req;
+    mi_free(waiter);
+
+    request_async_done(req);
+    if (req->_connection != NULL && !connection_is_closing(req->_connection))
+    {
+      bool sent = copy != NULL ? response_send_copy(req, copy) : response_send_status(req, status);
+      if (sent)
+        server_connection_resume(req);
+      else
+        server_connection_close(req);
+    }
+    request_unref(req);
+  }
+}
+
+static void _timeout_cb(uv_timer_t *timer)
+{
+  single_flight_t *flight = timer->data;
+
+  // requests from now on start a flight of their own
+  _unlist(flight);
+  _answer(flight, NULL, 504);
+}
+
+static void _close_cb(uv_handle_t *handle)
+{
+  single_flight_t *flight = handle->data;
+
+  string_delete(flight->key);
+  mi_free(flight);
+}
+
+static bool _wait(single_flight_t *flight, request_t *req)
+{
+  if (flight->waiters.length >= flight->max_waiters)
+    return false;
+
+  single_flight_waiter_t *waiter = mi_malloc(sizeof(single_flight_waiter_t));
+  if (waiter == NULL)
+    return false;
+
+  waiter->req = req;
+  waiter->node.prev = NULL;
+  waiter->node.next = NULL;
+  dl_push_back(&flight->waiters, &waiter->node);
+
+  // held like an asynchronous response, so what's pipelined behind it waits too
+  req->_async = true;
+  request_ref(req);
+
+  return true;
+}
+
+static single_flight_t *_flight_new(loop_context_t *ctx, string_t *key, single_flight_options_t const *options)
+{
+  if (ctx->flights == NULL && (ctx->flights = ht_new(HT_DEFAULT_INITIAL_CAPACITY, HT_DEFAULT_FACTOR)) == NULL)
+    return NULL;
+
+  single_flight_t *flight = mi_zalloc(sizeof(single_flight_t));
+  if (flight == NULL)
+    return NULL;
+
+  if (!ht_set(ctx->flights, key, flight))
+  {
+    mi_free(flight);
+    return NULL;
+  }
+
+  flight->key = key;
+  flight->ctx = ctx;
+  flight->max_waiters = options->max_waiters;
+  flight->listed = true;
+  dl_init(&flight->waiters);
+  uv_timer_init(ctx->loop, &flight->timer);
+  flight->timer.data = flight;
+  uv_timer_start(&flight->timer, _timeout_cb, options->timeout_ms, 0);
+
+  return flight;
+}
+
+// only a safe request without a body is the same request as another with its key
+static bool _shareable(request_t *req)
+{
+  uint8_t method = llhttp_get_method(req->_parser);
+  if (method != HTTP_GET && method != HTTP_HEAD)
+    return false;
+
+  return req->body_size == 0 && req->_form == NULL && (req->_parser->flags & F_CHUNKED) == 0;
+}
+
+int single_flight_handle(request_t *req, single_flight_options_t const *options, request_handler_f handler)
+{
+  loop_context_t *ctx = req->_loop_ctx;
+  if (req->url == NULL || !_shareable(req))
+    return handler(req);
+
+  string_t *key = _key(req, options);
+  if (key == NULL)
+    return handler(req);
+
+  ht_entry_t *entry = ctx->flights != NULL ? ht_get(ctx->flights, key) : NULL;
+  if (entry != NULL)
+  {
+    string_delete(key);
+    // a full wait list lets the rest through rather than turning them away
+    return _wait(entry->data, req) ? 0 : handler(req);
+  }
+
+  single_flight_t *flight = _flight_new(ctx, key, options);
+  if (flight == NULL)
+  {
+    string_delete(key);
+    return handler(req);
+  }
+  req->_flight = flight;
+
+  return handler(req);
+}
+
+void single_flight_share(request_t *req, response_copy_t *copy)
+{
+  single_flight_t *flight = req->_flight;
+  if (flight == NULL || flight->shared)
+    return;
+
+  flight->shared = true;
+  _unlist(flight);
+  uv_timer_stop(&flight->timer);
+  _answer(flight, copy, 0);
+}
+
+void single_flight_end(request_t *req)
+{
+  single_flight_t *flight = req->_flight;
+  if (flight == NULL)
+    return;
+
+  req->_flight = NULL;
+  _unlist(flight);
+  _answer(flight, NULL, 502);
+  uv_close((uv_handle_t *)&flight->timer, _close_cb);
+}
@@ -0,0 +1,57 @@
+#if !defined(_SINGLE_FLIGHT_H_)
+#define _SINGLE_FLIGHT_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <uv.h>
+
+#include "collections/dlist.h"
+#include "collections/string.h"
+#include "request.h"
+#include "response.h"
+
+#define SINGLE_FLIGHT_DEFAULT_MAX_WAITERS 1024
+#define SINGLE_FLIGHT_DEFAULT_TIMEOUT_MS 10000
+
+struct loop_context;
+
+typedef struct single_flight_options
+{
+  // lowercase names of headers whose values belong in the key next to method and url;
+  // accept-encoding always does, the response is shared already compressed
+  char const *const *headers;
+  size_t header_count;
+  // requests that may wait on one flight, the ones after it run the handler themselves
+  size_t max_waiters;
+  // waiters still without a response by then get 504, the leader carries on
+  uint64_t timeout_ms;
+} single_flight_options_t;
+
+// one running request that identical ones on the same loop wait for
+typedef struct single_flight
+{
+  string_t *key;
+  struct loop_context *ctx;
+  dlist_t waiters;
+  size_t max_waiters;
+  uv_timer_t timer;
+  // waiters joining find it in the loop's table until it's answered or timed out
+  bool listed, shared;
+} single_flight_t;
+
+void single_flight_options_default(single_flight_options_t *options);
+
+// from the request handler in place of handler: runs it unless the same request is already running on
+// the loop, then req waits and gets that response in a write of its own. Only GET and HEAD without a
+// body wait, anything else just runs handler. Only responses sent with response_send or
+// response_send_file are shared, waiters on any other get 502
+int single_flight_handle(request_t *req, single_flight_options_t const *options, request_handler_f handler);
+
+// the leader's response, from response.c
+void single_flight_share(request_t *req, response_copy_t *copy);
+// the leader's request is over, waiters it didn't answer get 502
+void single_flight_end(request_t *req);
+
+#endif // _SINGLE_FLIGHT_H_
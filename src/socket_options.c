@@ -0,0 +1,219 @@
+#include "socket_options.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <linux/filter.h>
+#endif
+
+void socket_options_default(socket_options_t *options)
+{
+  memset(options, 0, sizeof(socket_options_t));
+  options->nodelay = true;
+  options->v6only = true;
+}
+
+char const *socket_options_validate(socket_options_t const *options)
+{
+  if (options->keepalive_idle < 0 || options->keepalive_interval < 0 || options->keepalive_probes < 0)
+    return "keepalive values must not be negative";
+  if (options->keepalive_idle == 0 && (options->keepalive_interval != 0 || options->keepalive_probes != 0))
+    return "keepalive interval and probes need keepalive_idle";
+  if (options->defer_accept < 0)
+    return "defer_accept must not be negative";
+  if (options->fastopen < 0)
+    return "fastopen queue length must not be negative";
+  if (options->recv_buffer < 0 || options->send_buffer < 0)
+    return "socket buffer sizes must not be negative";
+  if (options->busy_poll < 0)
+    return "busy_poll must not be negative";
+
+#if !defined(__linux__)
+  if (options->defer_accept != 0 || options->busy_poll != 0)
+    return "defer_accept and busy_poll are only available on Linux";
+#endif
+#if !defined(SO_REUSEPORT)
+  if (options->reuseport)
+    return "reuseport is not available on this platform";
+#endif
+
+  return NULL;
+}
+
+static void _set(uv_os_fd_t fd, int level, int name, int value, char const *label)
+{
+  if (setsockopt(fd, level, name, &value, sizeof(value)) != 0)
+    fprintf(stderr, "Socket option %s=%d not applied: %s\n", label, value, strerror(errno));
+}
+
+static int _get(uv_os_fd_t fd, int level, int name)
+{
+  int value = 0;
+  socklen_t length = sizeof(value);
+  if (getsockopt(fd, level, name, &value, &length) != 0)
+    return -1;
+
+  return value;
+}
+
+unsigned socket_options_bind_flags(socket_options_t const *options, struct sockaddr const *addr)
+{
+  // IPV6_V6ONLY only means something before bind, libuv sets it from this flag
+  return addr->sa_family == AF_INET6 && options->v6only ? UV_TCP_IPV6ONLY : 0;
+}
+
+void socket_options_apply_listener(uv_tcp_t *tcp, socket_options_t const *options)
+{
+  uv_os_fd_t fd;
+  if (uv_fileno((uv_handle_t *)tcp, &fd))
+    return;
+
+  // buffers set on the listener are inherited by accepted sockets and sized into the window scale
+  if (options->recv_buffer != 0)
+    _set(fd, SOL_SOCKET, SO_RCVBUF, options->recv_buffer, "SO_RCVBUF");
+  if (options->send_buffer != 0)
+    _set(fd, SOL_SOCKET, SO_SNDBUF, options->send_buffer, "SO_SNDBUF");
+
+#if defined(TCP_DEFER_ACCEPT)
+  if (options->defer_accept != 0)
+    _set(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, options->defer_accept, "TCP_DEFER_ACCEPT");
+#endif
+
+#if defined(TCP_FASTOPEN)
+  if (options->fastopen != 0)
+    _set(fd, IPPROTO_TCP, TCP_FASTOPEN, options->fastopen, "TCP_FASTOPEN");
+#endif
+}
+
+void socket_options_apply_client(uv_os_sock_t fd, socket_options_t const *options)
+{
+  // plain setsockopt since io_uring connections have no libuv handle
+  if (options->nodelay)
+    _set(fd, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY");
+
+  if (options->keepalive_idle != 0)
+  {
+    _set(fd, SOL_SOCKET, SO_KEEPALIVE, 1, "SO_KEEPALIVE");
+#if defined(TCP_KEEPIDLE)
+    _set(fd, IPPROTO_TCP, TCP_KEEPIDLE, options->keepalive_idle, "TCP_KEEPIDLE");
+#endif
+  }
+
+#if defined(TCP_KEEPINTVL) && defined(TCP_KEEPCNT)
+  if (options->keepalive_interval != 0)
+    _set(fd, IPPROTO_TCP, TCP_KEEPINTVL, options->keepalive_interval, "TCP_KEEPINTVL");
+  if (options->keepalive_probes != 0)
+    _set(fd, IPPROTO_TCP, TCP_KEEPCNT, options->keepalive_probes, "TCP_KEEPCNT");
+#endif
+
+#if defined(SO_BUSY_POLL)
+  if (options->busy_poll != 0)
+    _set(fd, SOL_SOCKET, SO_BUSY_POLL, options->busy_poll, "SO_BUSY_POLL");
+#endif
+}
+
+void socket_options_report(uv_tcp_t *tcp, char const *name, socket_options_t const *options)
+{
+  uv_os_fd_t fd;
+  if (uv_fileno((uv_handle_t *)tcp, &fd))
+    return;
+
+  // values are read back from the kernel, which may round or double what was asked for
+  printf("Listening on %s: nodelay=%s keepalive=%d/%d/%d rcvbuf=%d sndbuf=%d", name,
+         options->nodelay ? "on" : "off",
+         options->keepalive_idle, options->keepalive_interval, options->keepalive_probes,
+         _get(fd, SOL_SOCKET, SO_RCVBUF), _get(fd, SOL_SOCKET, SO_SNDBUF));
+
+#if defined(TCP_DEFER_ACCEPT)
+  printf(" defer_accept=%d", _get(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT));
+#endif
+#if defined(TCP_FASTOPEN)
+  printf(" fastopen=%d", _get(fd, IPPROTO_TCP, TCP_FASTOPEN));
+#endif
+  printf(" busy_poll=%d", options->busy_poll);
+
+  struct sockaddr_storage addr;
+  int length = sizeof(addr);
+  if (uv_tcp_getsockname(tcp, (struct sockaddr *)&addr, &length) == 0 && addr.ss_family == AF_INET6)
+    printf(" v6only=%d", _get(fd, IPPROTO_IPV6, IPV6_V6ONLY));
+#if defined(SO_REUSEPORT)
+  if (options->reuseport)
+    printf(" reuseport=%d", _get(fd, SOL_SOCKET, SO_REUSEPORT));
+#endif
+
+  printf("\n");
+}
+
+int socket_options_bind(struct sockaddr const *addr, socket_options_t const *options, uv_os_sock_t *fd)
+{
+  int sock = socket(addr->sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (sock < 0)
+    return uv_translate_sys_error(errno);
+
+  // what uv_tcp_bind would have set, plus what it can't
+  int on = 1;
+  socklen_t length = addr->sa_family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+  if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) != 0 ||
+#if defined(SO_REUSEPORT)
+      (options->reuseport && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) != 0) ||
+#endif
+      (addr->sa_family == AF_INET6 && options->v6only &&
+       setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, &on, sizeof(on)) != 0) ||
+      bind(sock, addr, length) != 0)
+  {
+    int err = uv_translate_sys_error(errno);
+    close(sock);
+    return err;
+  }
+
+  *fd = sock;
+  return 0;
+}
+
+bool socket_options_steer(uv_os_sock_t fd, int const *cpus, unsigned count)
+{
+#if defined(SO_ATTACH_REUSEPORT_CBPF) && defined(SKF_AD_CPU)
+  if (count == 0 || count > SOCKET_STEER_MAX)
+    return false;
+
+  // A = cpu; a match jumps over the remaining tests and the fallback to its own return, which is
+  // always count + 1 instructions ahead; cpus outside the list spread by modulo
+  struct sock_filter code[2 * SOCKET_STEER_MAX + 3];
+  unsigned length = 0;
+  code[length++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_CPU);
+  for (unsigned i = 0; i < count; i++)
+    code[length++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, (unsigned)cpus[i], count + 1, 0);
+  code[length++] = (struct sock_filter)BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, count);
+  code[length++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_A, 0);
+  for (unsigned i = 0; i < count; i++)
+    code[length++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, i);
+
+  struct sock_fprog program = {.len = length, .filter = code};
+  if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &program, sizeof(program)) != 0)
+  {
+    fprintf(stderr, "Accept steering not attached: %s\n", strerror(errno));
+    return false;
+  }
+
+  return true;
+#else
+  fprintf(stderr, "Accept steering not available on this platform\n");
+  return false;
+#endif
+}
+
+int socket_options_incoming_cpu(uv_os_sock_t fd)
+{
+#if defined(SO_INCOMING_CPU)
+  return _get(fd, SOL_SOCKET, SO_INCOMING_CPU);
+#else
+  return -1;
+#endif
+}
@@ -0,0 +1,48 @@
+#if !defined(_SOCKET_OPTIONS_H_)
+#define _SOCKET_OPTIONS_H_
+
+#include <stdbool.h>
+
+#include <uv.h>
+
+typedef struct socket_options
+{
+  // disable Nagle so small responses leave immediately
+  bool nodelay;
+  // seconds of idleness before the first probe, 0 leaves keepalive off
+  int keepalive_idle;
+  int keepalive_interval, keepalive_probes;
+  // seconds the kernel holds a connection until data arrives (TCP_DEFER_ACCEPT), 0 disables
+  int defer_accept;
+  // pending TCP Fast Open requests allowed, 0 disables
+  int fastopen;
+  // SO_RCVBUF / SO_SNDBUF in bytes, 0 keeps the kernel's autotuning
+  int recv_buffer, send_buffer;
+  // microseconds to busy-poll the device queue on blocking reads (SO_BUSY_POLL), 0 disables
+  int busy_poll;
+  // keep IPv6 listeners off IPv4 so "::" and "0.0.0.0" can share a port
+  bool v6only;
+  // SO_REUSEPORT, so every worker loop listens on the port with a socket of its own
+  bool reuseport;
+} socket_options_t;
+
+// listeners a steering program can tell apart
+#define SOCKET_STEER_MAX 128
+
+void socket_options_default(socket_options_t *options);
+char const *socket_options_validate(socket_options_t const *options);
+
+unsigned socket_options_bind_flags(socket_options_t const *options, struct sockaddr const *addr);
+void socket_options_apply_listener(uv_tcp_t *tcp, socket_options_t const *options);
+void socket_options_apply_client(uv_os_sock_t fd, socket_options_t const *options);
+void socket_options_report(uv_tcp_t *tcp, char const *name, socket_options_t const *options);
+
+// a bound socket for what libuv can't set before bind, like SO_REUSEPORT; 0 or a libuv error
+int socket_options_bind(struct sockaddr const *addr, socket_options_t const *options, uv_os_sock_t *fd);
+// on any listener of a reuseport group: connections go to the listener at the index of the cpu in cpus
+// that received them, listeners joined the group in that order; others keep the kernel's hash
+bool socket_options_steer(uv_os_sock_t fd, int const *cpus, unsigned count);
+// the cpu that received the connection's packets, -1 when unknown
+int socket_options_incoming_cpu(uv_os_sock_t fd);
+
+#endif // _SOCKET_OPTIONS_H_
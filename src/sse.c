@@ -0,0 +1,366 @@
+#include "sse.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <mimalloc.h>
+
+#include "connection.h"
+#include "loop.h"
+#include "server.h"
+
+typedef struct sse_write
+{
+  connection_write_t write;
+  sse_subscriber_t *subscriber;
+  // NULL for the response head, which carries its own date
+  sse_event_t *event;
+  char date[];
+} sse_write_t;
+
+typedef struct sse_message
+{
+  loop_message_t message;
+  sse_event_t *event;
+  char topic[];
+} sse_message_t;
+
+#define FRAGMENT(text) uv_buf_init((char *)(text), sizeof(text) - 1)
+
+static char const _status_line[] = "HTTP/1.1 200 OK\r\n";
+// the stream ends when the connection does
+static char const _head[] = "Content-Type: text/event-stream\r\n"
+                            "Cache-Control: no-cache\r\n"
+                            "Connection: close\r\n\r\n";
+
+// hubs of every loop, for broadcasts from any thread
+static uv_once_t _hubs_once = UV_ONCE_INIT;
+static uv_mutex_t _hubs_lock;
+static dlist_t _hubs;
+
+static void _hubs_init()
+{
+  uv_mutex_init(&_hubs_lock);
+  dl_init(&_hubs);
+}
+
+// a line break in a field would end it early and smuggle in fields of its own
+static bool _field_valid(char const *field)
+{
+  return field == NULL || strpbrk(field, "\r\n") == NULL;
+}
+
+sse_event_t *sse_event_new(char const *event, char const *id, char const *data, size_t length)
+{
+  if (!_field_valid(id) || !_field_valid(event))
+    return NULL;
+
+  size_t size = 1;
+  if (id != NULL)
+    size += sizeof("id: \n") - 1 + strlen(id);
+  if (event != NULL)
+    size += sizeof("event: \n") - 1 + strlen(event);
+  size += sizeof("data: \n") - 1;
+  for (size_t i = 0; i < length; i++)
+  {
+    if (data[i] == '\r' || data[i] == '\n')
+      size += sizeof("data: \n") - 1;
+    else
+      size++;
+  }
+
+  sse_event_t *sse_event = mi_malloc(sizeof(sse_event_t) + size + 1);
+  if (sse_event == NULL)
+    return NULL;
+
+  char *cursor = sse_event->data;
+  if (id != NULL)
+    cursor += sprintf(cursor, "id: %s\n", id);
+  if (event != NULL)
+    cursor += sprintf(cursor, "event: %s\n", event);
+
+  // CR, LF and CRLF all end a line for the client, each starts another data field it joins back
+  cursor += sprintf(cursor, "data: ");
+  for (size_t i = 0; i < length; i++)
+  {
+    if (data[i] == '\r' && i + 1 < length && data[i + 1] == '\n')
+      continue;
+    if (data[i] == '\r' || data[i] == '\n')
+      cursor += sprintf(cursor, "\ndata: ");
+    else
+      *cursor++ = data[i];
+  }
+  *cursor++ = '\n';
+  *cursor++ = '\n';
+
+  sse_event->_refs = 1;
+  sse_event->length = cursor - sse_event->data;
+
+  return sse_event;
+}
+
+void sse_event_ref(sse_event_t *event)
+{
+  __atomic_add_fetch(&event->_refs, 1, __ATOMIC_RELAXED);
+}
+
+void sse_event_unref(sse_event_t *event)
+{
+  if (__atomic_sub_fetch(&event->_refs, 1, __ATOMIC_ACQ_REL) == 0)
+    mi_free(event);
+}
+
+static void _deliver(loop_message_t *message, loop_context_t *ctx)
+{
+  sse_message_t *sse_message = (sse_message_t *)message;
+
+  sse_publish(ctx, sse_message->topic, sse_message->event);
+  sse_event_unref(sse_message->event);
+  mi_free(sse_message);
+}
+
+static sse_hub_t *_hub_get(loop_context_t *ctx)
+{
+  if (ctx->sse != NULL)
+    return ctx->sse;
+
+  sse_hub_t *hub = mi_zalloc(sizeof(sse_hub_t));
+  if (hub == NULL)
+    return NULL;
+
+  hub->topics = ht_new(HT_DEFAULT_INITIAL_CAPACITY, HT_DEFAULT_FACTOR);
+  if (hub->topics == NULL)
+  {
+    mi_free(hub);
+    return NULL;
+  }
+  hub->ctx = ctx;
+
+  uv_once(&_hubs_once, _hubs_init);
+  uv_mutex_lock(&_hubs_lock);
+  dl_push_back(&_hubs, &hub->node);
+  uv_mutex_unlock(&_hubs_lock);
+
+  ctx->sse = hub;
+
+  return hub;
+}
+
+static void _write_cb(connection_write_t *write, int status)
+{
+  sse_write_t *sse_write = (sse_write_t *)write;
+  sse_subscriber_t *subscriber = sse_write->subscriber;
+  request_t *req = subscriber->req;
+
+  if (sse_write->event != NULL)
+  {
+    subscriber->queued -= sse_write->event->length;
+    sse_event_unref(sse_write->event);
+  }
+  mi_free(sse_write);
+  req->_writes--;
+
+  if (status < 0 || (req->_close && req->_writes == 0))
+    server_connection_close(req);
+}
+
+static bool _write(sse_subscriber_t *subscriber, sse_event_t *event)
+{
+  request_t *req = subscriber->req;
+
+  size_t extra = event == NULL ? DATE_HEADER_LENGTH : 0;
+  sse_write_t *sse_write = mi_malloc(sizeof(sse_write_t) + extra);
+  if (sse_write == NULL)
+    return false;
+
+  sse_write->subscriber = subscriber;
+  sse_write->event = event;
+
+  uv_buf_t bufs[3];
+  unsigned nbufs = 0;
+  if (event != NULL)
+  {
+    // every subscriber's write points at the same bytes
+    bufs[nbufs++] = uv_buf_init(event->data, event->length);
+  }
+  else
+  {
+    memcpy(sse_write->date, req->_loop_ctx->date.header, DATE_HEADER_LENGTH);
+    bufs[nbufs++] = FRAGMENT(_status_line);
+    bufs[nbufs++] = uv_buf_init(sse_write->date, DATE_HEADER_LENGTH);
+    bufs[nbufs++] = FRAGMENT(_head);
+  }
+
+  if (connection_write(req->_connection, &sse_write->write, bufs, nbufs, _write_cb))
+  {
+    mi_free(sse_write);
+    return false;
+  }
+  req->_writes++;
+
+  if (event != NULL)
+  {
+    sse_event_ref(event);
+    subscriber->queued += event->length;
+  }
+
+  return true;
+}
+
+bool sse_subscribe(request_t *req, char const *topic, size_t max_backlog)
+{
+  if (req->_connection == NULL || connection_is_closing(req->_connection) || req->_sse != NULL)
+    return false;
+
+  sse_hub_t *hub = _hub_get(req->_loop_ctx);
+  if (hub == NULL)
+    return false;
+
+  sse_subscriber_t *subscriber = mi_zalloc_small(sizeof(sse_subscriber_t));
+  if (subscriber == NULL)
+    return false;
+
+  string_t key = string_from((char *)topic);
+  ht_entry_t *entry = ht_get(hub->topics, &key);
+  sse_topic_t *sse_topic = entry != NULL ? entry->data : NULL;
+  if (sse_topic == NULL)
+  {
+    sse_topic = mi_malloc_small(sizeof(sse_topic_t));
+    if (sse_topic == NULL || (sse_topic->name = string_new(topic, key.length)) == NULL ||
+        !ht_set(hub->topics, sse_topic->name, sse_topic))
+    {
+      if (sse_topic != NULL)
+        string_delete(sse_topic->name);
+      mi_free(sse_topic);
+      mi_free(subscriber);
+      return false;
+    }
+    dl_init(&sse_topic->subscribers);
+  }
+
+  subscriber->req = req;
+  subscriber->topic = sse_topic;
+  subscriber->max_backlog = max_backlog != 0 ? max_backlog : SSE_DEFAULT_MAX_BACKLOG;
+  dl_push_back(&sse_topic->subscribers, &subscriber->node);
+  req->_sse = subscriber;
+
+  if (!_write(subscriber, NULL))
+  {
+    server_connection_close(req);
+    return false;
+  }
+
+  // the head is all the request gets for a response
+  if (req->_trace != 0)
+  {
+    tracer_end(&req->_loop_ctx->tracer, req->_trace, 200);
+    req->_trace = 0;
+  }
+
+  return true;
+}
+
+void sse_unsubscribe(sse_subscriber_t *subscriber)
+{
+  if (subscriber == NULL)
+    return;
+
+  sse_topic_t *topic = subscriber->topic;
+  dl_remove(&topic->subscribers, &subscriber->node);
+  if (topic->subscribers.length == 0)
+  {
+    ht_remove(subscriber->req->_loop_ctx->sse->topics, topic->name);
+    string_delete(topic->name);
+    mi_free(topic);
+  }
+
+  subscriber->req->_sse = NULL;
+  mi_free(subscriber);
+}
+
+void sse_publish(loop_context_t *ctx, char const *topic, sse_event_t *event)
+{
+  sse_hub_t *hub = ctx->sse;
+  if (hub == NULL)
+    return;
+
+  string_t key = string_from((char *)topic);
+  ht_entry_t *entry = ht_get(hub->topics, &key);
+  if (entry == NULL)
+    return;
+
+  sse_topic_t *sse_topic = entry->data;
+  dlist_it it = dl_iterator(&sse_topic->subscribers);
+  while (dli_next(&it))
+  {
+    sse_subscriber_t *subscriber = DLIST_ENTRY(dli_get(it), sse_subscriber_t, node);
+    request_t *req = subscriber->req;
+    if (req->_connection == NULL || connection_is_closing(req->_connection))
+      continue;
+
+    // a subscriber that can't keep up would otherwise pin every event it hasn't taken
+    if (subscriber->queued + event->length > subscriber->max_backlog || !_write(subscriber, event))
+    {
+      hub->dropped++;
+      server_connection_close(req);
+    }
+  }
+}
+
+bool sse_broadcast(char const *topic, sse_event_t *event)
+{
+  size_t topic_size = strlen(topic) + 1;
+  bool queued = true;
+
+  uv_once(&_hubs_once, _hubs_init);
+  uv_mutex_lock(&_hubs_lock);
+
+  dlist_it it = dl_iterator(&_hubs);
+  while (dli_next(&it))
+  {
+    sse_hub_t *hub = DLIST_ENTRY(dli_get(it), sse_hub_t, node);
+
+    sse_message_t *message = mi_malloc(sizeof(sse_message_t) + topic_size);
+    if (message == NULL)
+    {
+      queued = false;
+      continue;
+    }
+    memcpy(message->topic, topic, topic_size);
+    message->message.run = _deliver;
+    message->event = event;
+    sse_event_ref(event);
+
+    // the loop's mailbox is full, it's too far behind to take more
+    if (!loop_post(hub->ctx, &message->message))
+    {
+      sse_event_unref(event);
+      mi_free(message);
+      queued = false;
+    }
+  }
+
+  uv_mutex_unlock(&_hubs_lock);
+
+  return queued;
+}
+
+void sse_hub_close(sse_hub_t *hub)
+{
+  if (hub == NULL)
+    return;
+
+  // broadcasts post under the lock, so none is still on its way to the loop's mailbox after this
+  uv_mutex_lock(&_hubs_lock);
+  dl_remove(&_hubs, &hub->node);
+  uv_mutex_unlock(&_hubs_lock);
+}
+
+void sse_hub_delete(sse_hub_t *hub)
+{
+  if (hub == NULL)
+    return;
+
+  ht_delete(hub->topics, NULL);
+  mi_free(hub);
+}
@@ -0,0 +1,70 @@
+#if !defined(_SSE_H_)
+#define _SSE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "collections/dlist.h"
+#include "collections/hashtable.h"
+#include "request.h"
+
+// bytes written to a subscriber but not yet taken by its socket before it's dropped
+#define SSE_DEFAULT_MAX_BACKLOG (256 * 1024)
+
+struct loop_context;
+
+// formatted once and written as is to every subscriber, on any loop; never changes once made
+typedef struct sse_event
+{
+  unsigned _refs;
+  size_t length;
+  char data[];
+} sse_event_t;
+
+typedef struct sse_topic
+{
+  string_t *name;
+  dlist_t subscribers;
+} sse_topic_t;
+
+typedef struct sse_subscriber
+{
+  dlist_node_t node;
+  request_t *req;
+  sse_topic_t *topic;
+  size_t queued, max_backlog;
+} sse_subscriber_t;
+
+// a loop's topics
+typedef struct sse_hub
+{
+  dlist_node_t node;
+  struct loop_context *ctx;
+  hashtable_t *topics;
+  // subscribers dropped for falling behind
+  uint64_t dropped;
+} sse_hub_t;
+
+// event and id may be NULL and must not hold CR or LF (NULL is returned); data lines, split on
+// CR, LF or CRLF, each become a data field
+sse_event_t *sse_event_new(char const *event, char const *id, char const *data, size_t length);
+void sse_event_ref(sse_event_t *event);
+void sse_event_unref(sse_event_t *event);
+
+// from the request handler: answers with an event stream and subscribes the connection to topic
+// until it closes; max_backlog 0 takes the default
+bool sse_subscribe(request_t *req, char const *topic, size_t max_backlog);
+// the connection closed
+void sse_unsubscribe(sse_subscriber_t *subscriber);
+
+// writes event to the topic's subscribers on the loop, subscribers over their backlog are dropped
+void sse_publish(struct loop_context *ctx, char const *topic, sse_event_t *event);
+// from any thread: every loop with subscribers delivers event itself
+bool sse_broadcast(char const *topic, sse_event_t *event);
+
+// no broadcast reaches the hub's loop after this; hub may be NULL
+void sse_hub_close(sse_hub_t *hub);
+void sse_hub_delete(sse_hub_t *hub);
+
+#endif // _SSE_H_
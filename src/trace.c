@@ -0,0 +1,204 @@
+#include "trace.h"
+
+#include <string.h>
+
+#include <mimalloc.h>
+#include <uv.h>
+
+#define TRACE_BINARY_MAGIC "HTRC"
+#define TRACE_BINARY_VERSION 1
+
+static char const *const _span_names[TRACE_POINTS] = {
+  [TRACE_FIRST_BYTE] = "connect",
+  [TRACE_HEADERS] = "headers",
+  [TRACE_MESSAGE] = "body",
+  [TRACE_HANDLER] = "handler",
+  [TRACE_WRITE] = "write",
+};
+
+void tracer_init(tracer_t *tracer, size_t capacity)
+{
+  memset(tracer, 0, sizeof(tracer_t));
+  tracer->capacity = capacity;
+}
+
+void tracer_close(tracer_t *tracer)
+{
+  if (tracer->slow_output != NULL)
+    fflush(tracer->slow_output);
+
+  mi_free(tracer->ring);
+  tracer->ring = NULL;
+}
+
+bool tracer_configure(tracer_t *tracer, unsigned sample_every, uint64_t threshold_ms, FILE *slow_output, trace_format_t format)
+{
+  if (sample_every != 0 && tracer->ring == NULL)
+  {
+    // the ring is allocated when tracing is switched on, tracing a request never allocates
+    tracer->ring = mi_calloc(tracer->capacity, sizeof(trace_record_t));
+    if (tracer->ring == NULL)
+      return false;
+  }
+
+  tracer->sample_every = sample_every;
+  tracer->sample_counter = 0;
+  tracer->threshold = threshold_ms * 1000000ULL;
+  tracer->slow_output = slow_output;
+  tracer->slow_format = format;
+  tracer->slow_started = false;
+
+  return true;
+}
+
+uint64_t tracer_begin(tracer_t *tracer, uint64_t connection)
+{
+  if (++tracer->sample_counter < tracer->sample_every)
+    return 0;
+  tracer->sample_counter = 0;
+
+  uint64_t id = ++tracer->next_id;
+  trace_record_t *record = &tracer->ring[id % tracer->capacity];
+  memset(record, 0, sizeof(trace_record_t));
+  record->id = id;
+  record->connection = connection;
+
+  return id;
+}
+
+trace_record_t *tracer_get(tracer_t *tracer, uint64_t id)
+{
+  if (id == 0)
+    return NULL;
+
+  // a request outlived by a full lap of the ring simply loses its record
+  trace_record_t *record = &tracer->ring[id % tracer->capacity];
+  return record->id == id ? record : NULL;
+}
+
+void tracer_mark(tracer_t *tracer, uint64_t id, trace_point_t point)
+{
+  trace_record_t *record = tracer_get(tracer, id);
+  if (record != NULL)
+    record->at[point] = uv_hrtime();
+}
+
+static void _write_escaped(FILE *output, char const *text)
+{
+  for (; *text != 0; text++)
+  {
+    if (*text == '"' || *text == '\\' || (unsigned char)*text < 0x20)
+      fprintf(output, "\\u%04x", (unsigned char)*text);
+    else
+      fputc(*text, output);
+  }
+}
+
+static void _write_chrome(FILE *output, trace_record_t const *record)
+{
+  uint64_t start = record->at[TRACE_FIRST_BYTE];
+
+  fprintf(output, "{\"name\":\"request\",\"cat\":\"http\",\"ph\":\"X\",\"pid\":1,\"tid\":%llu,\"ts\":%.3f,\"dur\":%.3f,"
+                  "\"args\":{\"id\":%llu,\"status\":%u,\"method\":%u,\"route\":\"",
+          (unsigned long long)record->connection,
+          start / 1000.0,
+          (record->at[TRACE_WRITE] - start) / 1000.0,
+          (unsigned long long)record->id,
+          record->status,
+          record->method);
+  _write_escaped(output, record->route);
+  fprintf(output, "\"}},\n");
+
+  // one child span per phase, skipping points the request never reached
+  int previous = TRACE_ACCEPT;
+  for (int point = TRACE_FIRST_BYTE; point < TRACE_POINTS; point++)
+  {
+    if (record->at[point] == 0)
+      continue;
+
+    if (record->at[previous] != 0)
+    {
+      fprintf(output, "{\"name\":\"%s\",\"cat\":\"http\",\"ph\":\"X\",\"pid\":1,\"tid\":%llu,\"ts\":%.3f,\"dur\":%.3f},\n",
+              _span_names[point],
+              (unsigned long long)record->connection,
+              record->at[previous] / 1000.0,
+              (record->at[point] - record->at[previous]) / 1000.0);
+    }
+    previous = point;
+  }
+}
+
+static void _write_binary_header(FILE *output)
+{
+  uint32_t header[2] = {TRACE_BINARY_VERSION, TRACE_POINTS};
+  fwrite(TRACE_BINARY_MAGIC, 1, 4, output);
+  fwrite(header, sizeof(uint32_t), 2, output);
+}
+
+static void _write_binary(FILE *output, trace_record_t const *record)
+{
+  // fixed 116-byte records in host byte order: id, connection, timestamps, status, method, route
+  uint8_t pad = 0;
+  fwrite(&record->id, sizeof(uint64_t), 1, output);
+  fwrite(&record->connection, sizeof(uint64_t), 1, output);
+  fwrite(record->at, sizeof(uint64_t), TRACE_POINTS, output);
+  fwrite(&record->status, sizeof(uint16_t), 1, output);
+  fwrite(&record->method, sizeof(uint8_t), 1, output);
+  fwrite(&pad, sizeof(uint8_t), 1, output);
+  fwrite(record->route, 1, TRACE_ROUTE_SIZE, output);
+}
+
+void tracer_end(tracer_t *tracer, uint64_t id, int status)
+{
+  trace_record_t *record = tracer_get(tracer, id);
+  if (record == NULL)
+    return;
+
+  record->at[TRACE_WRITE] = uv_hrtime();
+  record->status = status;
+  record->complete = 1;
+
+  if (tracer->slow_output == NULL || tracer->threshold == 0 ||
+      record->at[TRACE_WRITE] - record->at[TRACE_FIRST_BYTE] < tracer->threshold)
+    return;
+
+  if (!tracer->slow_started)
+  {
+    // the Chrome array format tolerates a missing closing bracket, so slow requests just append
+    if (tracer->slow_format == TRACE_FORMAT_CHROME)
+      fputs("[\n", tracer->slow_output);
+    else
+      _write_binary_header(tracer->slow_output);
+    tracer->slow_started = true;
+  }
+
+  if (tracer->slow_format == TRACE_FORMAT_CHROME)
+    _write_chrome(tracer->slow_output, record);
+  else
+    _write_binary(tracer->slow_output, record);
+  fflush(tracer->slow_output);
+}
+
+void tracer_dump(tracer_t const *tracer, FILE *output, trace_format_t format)
+{
+  if (format == TRACE_FORMAT_CHROME)
+    fputs("[\n", output);
+  else
+    _write_binary_header(output);
+
+  // oldest first: the slot after the newest id is the oldest one still in the ring
+  for (size_t i = 1; tracer->ring != NULL && i <= tracer->capacity; i++)
+  {
+    trace_record_t const *record = &tracer->ring[(tracer->next_id + i) % tracer->capacity];
+    if (record->id == 0 || !record->complete)
+      continue;
+
+    if (format == TRACE_FORMAT_CHROME)
+      _write_chrome(output, record);
+    else
+      _write_binary(output, record);
+  }
+
+  if (format == TRACE_FORMAT_CHROME)
+    fputs("{}]\n", output);
+}
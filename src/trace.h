@@ -0,0 +1,67 @@
+#if !defined(_TRACE_H_)
+#define _TRACE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+typedef enum trace_point
+{
+  TRACE_ACCEPT = 0,
+  TRACE_FIRST_BYTE,
+  TRACE_HEADERS,
+  TRACE_MESSAGE,
+  TRACE_HANDLER,
+  TRACE_WRITE,
+  TRACE_POINTS
+} trace_point_t;
+
+#define TRACE_ROUTE_SIZE 48
+#define TRACE_DEFAULT_CAPACITY 4096
+
+typedef struct trace_record
+{
+  // 0 marks a free slot, otherwise the sequence number the slot was handed out for
+  uint64_t id;
+  uint64_t connection;
+  uint64_t at[TRACE_POINTS];
+  uint16_t status;
+  uint8_t method, complete;
+  char route[TRACE_ROUTE_SIZE];
+} trace_record_t;
+
+typedef enum trace_format
+{
+  TRACE_FORMAT_CHROME = 0,
+  TRACE_FORMAT_BINARY
+} trace_format_t;
+
+typedef struct tracer
+{
+  // one request in sample_every is traced, 0 turns tracing off
+  unsigned sample_every;
+  unsigned sample_counter;
+  uint64_t threshold;
+  uint64_t next_id, next_connection;
+  size_t capacity;
+  trace_record_t *ring;
+  FILE *slow_output;
+  trace_format_t slow_format;
+  bool slow_started;
+} tracer_t;
+
+void tracer_init(tracer_t *tracer, size_t capacity);
+void tracer_close(tracer_t *tracer);
+bool tracer_configure(tracer_t *tracer, unsigned sample_every, uint64_t threshold_ms, FILE *slow_output, trace_format_t format);
+
+#define tracer_enabled(tracer) ((tracer)->sample_every != 0)
+
+uint64_t tracer_begin(tracer_t *tracer, uint64_t connection);
+trace_record_t *tracer_get(tracer_t *tracer, uint64_t id);
+void tracer_mark(tracer_t *tracer, uint64_t id, trace_point_t point);
+void tracer_end(tracer_t *tracer, uint64_t id, int status);
+
+void tracer_dump(tracer_t const *tracer, FILE *output, trace_format_t format);
+
+#endif // _TRACE_H_
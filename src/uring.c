@@ -0,0 +1,986 @@
+#include "uring.h"
+
+#include <stdio.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#if defined(IORING_RECV_MULTISHOT) && defined(IORING_ACCEPT_MULTISHOT)
+#define URING_SUPPORTED 1
+#endif
+#endif
+#endif
+
+#if defined(URING_SUPPORTED)
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <mimalloc.h>
+
+#include "collections/linked_list.h"
+
+// the low bits of user_data say what completed, the rest points at its owner
+typedef enum uring_op
+{
+  URING_OP_ACCEPT,
+  URING_OP_RECV,
+  URING_OP_SEND,
+  URING_OP_IGNORE
+} uring_op_t;
+
+#define URING_OP_MASK 3ULL
+#define URING_BUFFER_GROUP 0
+
+typedef struct uring_acceptor
+{
+  listener_t *listener;
+  uring_accept_cb accept_cb;
+  bool armed, stopped, removed;
+} uring_acceptor_t;
+
+typedef struct uring_connection
+{
+  connection_t connection;
+  uring_t *uring;
+  int fd;
+  // completions still to come that point at this connection
+  unsigned ops;
+  bool reading, receiving, sending, deferred, ended;
+  // EOF or error seen while the stash was still waiting
+  int end;
+  char *stash;
+  size_t stash_size, stash_capacity;
+  connection_write_t *writes, *writes_tail;
+  struct msghdr msg;
+  struct iovec iov[URING_SEND_IOVS];
+  struct uring_connection *next_deferred;
+} uring_connection_t;
+
+struct uring
+{
+  uv_loop_t *loop;
+  int fd, event_fd;
+  // completions are only posted when the loop thread enters the ring
+  bool defer_taskrun;
+  uv_poll_t poll;
+  uv_prepare_t prepare;
+
+  void *ring;
+  size_t ring_size;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_flags, *sq_array;
+  unsigned sq_entries, sq_local_tail;
+  struct io_uring_sqe *sqes;
+  size_t sqes_size;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_cqe *cqes;
+
+  struct io_uring_buf_ring *buffers;
+  char *buffer_memory;
+  uint16_t buffer_tail;
+
+  linked_list_t *acceptors;
+  // connections with stashed input, a blocked send or a pending close, handled before the next poll
+  uring_connection_t *deferred;
+};
+
+#define URING_CONNECTION(connection) ((uring_connection_t *)(connection))
+
+static inline uint64_t _user_data(void *owner, uring_op_t op)
+{
+  return (uint64_t)(uintptr_t)owner | op;
+}
+
+static int _enter(uring_t *uring, unsigned min_complete, unsigned flags)
+{
+  unsigned tail = uring->sq_local_tail;
+  __atomic_store_n(uring->sq_tail, tail, __ATOMIC_RELEASE);
+  unsigned pending = tail - __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE);
+
+  if (__atomic_load_n(uring->sq_flags, __ATOMIC_RELAXED) & IORING_SQ_CQ_OVERFLOW)
+    flags |= IORING_ENTER_GETEVENTS;
+  if (pending == 0 && !(flags & IORING_ENTER_GETEVENTS))
+    return 0;
+
+  int ret;
+  do
+    ret = syscall(__NR_io_uring_enter, uring->fd, pending, min_complete, flags, NULL, 0);
+  while (ret < 0 && errno == EINTR);
+
+  if (ret < 0 && errno != EAGAIN && errno != EBUSY)
+    fprintf(stderr, "io_uring_enter: %s\n", strerror(errno));
+
+  return ret;
+}
+
+static struct io_uring_sqe *_sqe(uring_t *uring)
+{
+  if (uring->sq_local_tail - __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE) >= uring->sq_entries)
+  {
+    _enter(uring, 0, 0);
+    if (uring->sq_local_tail - __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE) >= uring->sq_entries)
+      return NULL;
+  }
+
+  unsigned index = uring->sq_local_tail & *uring->sq_mask;
+  struct io_uring_sqe *sqe = &uring->sqes[index];
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  uring->sq_array[index] = index;
+  uring->sq_local_tail++;
+
+  return sqe;
+}
+
+static void _buffer_recycle(uring_t *uring, uint16_t id)
+{
+  struct io_uring_buf *buf = &uring->buffers->bufs[uring->buffer_tail & (URING_BUFFER_COUNT - 1)];
+  buf->addr = (uint64_t)(uintptr_t)(uring->buffer_memory + (size_t)id * URING_BUFFER_SIZE);
+  buf->len = URING_BUFFER_SIZE;
+  buf->bid = id;
+  uring->buffer_tail++;
+  __atomic_store_n(&uring->buffers->tail, uring->buffer_tail, __ATOMIC_RELEASE);
+}
+
+static void _prep_recv(struct io_uring_sqe *sqe, int fd, uint64_t user_data)
+{
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = fd;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = URING_BUFFER_GROUP;
+  sqe->user_data = user_data;
+}
+
+static bool _cancel(uring_t *uring, uint64_t target)
+{
+  struct io_uring_sqe *sqe = _sqe(uring);
+  if (sqe == NULL)
+    return false;
+
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = -1;
+  sqe->addr = target;
+  sqe->user_data = _user_data(NULL, URING_OP_IGNORE);
+
+  return true;
+}
+
+static void _defer(uring_connection_t *conn)
+{
+  if (conn->deferred)
+    return;
+
+  conn->deferred = true;
+  conn->next_deferred = conn->uring->deferred;
+  conn->uring->deferred = conn;
+}
+
+// accept
+
+static void _accept_arm(uring_t *uring, uring_acceptor_t *acceptor)
+{
+  if (acceptor->armed || acceptor->stopped)
+    return;
+
+  uv_os_fd_t fd;
+  struct io_uring_sqe *sqe;
+  if (uv_fileno(&acceptor->listener->handle, &fd) != 0 || (sqe = _sqe(uring)) == NULL)
+  {
+    fprintf(stderr, "io_uring accept could not be armed\n");
+    return;
+  }
+
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = fd;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+  sqe->user_data = _user_data(acceptor, URING_OP_ACCEPT);
+  acceptor->armed = true;
+}
+
+static void _acceptor_delete(uring_t *uring, uring_acceptor_t *acceptor)
+{
+  size_t index = 0;
+  linked_list_it it = ll_iterator(uring->acceptors);
+  while (lli_next(&it) && lli_get(it) != acceptor)
+    index++;
+
+  ll_remove(uring->acceptors, index);
+  mi_free(acceptor);
+}
+
+static void _accept_complete(uring_t *uring, uring_acceptor_t *acceptor, struct io_uring_cqe const *cqe)
+{
+  if (cqe->res >= 0)
+  {
+    if (acceptor->removed)
+      close(cqe->res);
+    else
+      acceptor->accept_cb(acceptor->listener, cqe->res);
+  }
+  else if (cqe->res != -ECANCELED)
+  {
+    fprintf(stderr, "Connection error %s\n", uv_strerror(cqe->res));
+  }
+
+  if (cqe->flags & IORING_CQE_F_MORE)
+    return;
+
+  acceptor->armed = false;
+  if (acceptor->removed)
+    _acceptor_delete(uring, acceptor);
+  else
+    _accept_arm(uring, acceptor);
+}
+
+static uring_acceptor_t *_acceptor_find(uring_t *uring, listener_t *listener, size_t *index)
+{
+  size_t position = 0;
+  linked_list_it it = ll_iterator(uring->acceptors);
+  while (lli_next(&it))
+  {
+    uring_acceptor_t *acceptor = lli_get(it);
+    if (acceptor->listener == listener && !acceptor->removed)
+    {
+      if (index != NULL)
+        *index = position;
+      return acceptor;
+    }
+    position++;
+  }
+
+  return NULL;
+}
+
+// connections
+
+static void _finish(uring_connection_t *conn);
+
+static void _stash(uring_connection_t *conn, char const *data, size_t size)
+{
+  if (conn->stash_size + size > conn->stash_capacity)
+  {
+    size_t capacity = conn->stash_capacity > 0 ? conn->stash_capacity * 2 : URING_BUFFER_SIZE;
+    while (capacity < conn->stash_size + size)
+      capacity *= 2;
+
+    char *stash = mi_realloc(conn->stash, capacity);
+    if (stash == NULL)
+    {
+      conn->end = UV_ENOMEM;
+      return;
+    }
+    conn->stash = stash;
+    conn->stash_capacity = capacity;
+  }
+
+  memcpy(conn->stash + conn->stash_size, data, size);
+  conn->stash_size += size;
+
+  // a peer that keeps sending while we are paused waits in the socket buffer instead
+  if (conn->stash_size >= URING_STASH_LIMIT && conn->receiving)
+    _cancel(conn->uring, _user_data(conn, URING_OP_RECV));
+}
+
+static void _receive(uring_connection_t *conn)
+{
+  if (conn->receiving || conn->ended || conn->end != 0 || conn->connection._closing)
+    return;
+
+  struct io_uring_sqe *sqe = _sqe(conn->uring);
+  if (sqe == NULL)
+  {
+    // retried from the prepare phase once the ring has drained
+    _defer(conn);
+    return;
+  }
+
+  _prep_recv(sqe, conn->fd, _user_data(conn, URING_OP_RECV));
+  conn->receiving = true;
+  conn->ops++;
+}
+
+static void _deliver_end(uring_connection_t *conn, int status)
+{
+  if (conn->connection._closing || conn->ended)
+    return;
+
+  if (conn->reading && conn->stash_size == 0 && conn->end == 0)
+  {
+    conn->ended = true;
+    conn->connection._read_cb(&conn->connection, status, NULL);
+  }
+  else if (conn->end == 0)
+  {
+    conn->end = status;
+  }
+}
+
+static void _recv_complete(uring_t *uring, uring_connection_t *conn, struct io_uring_cqe const *cqe)
+{
+  if (!(cqe->flags & IORING_CQE_F_MORE))
+  {
+    conn->receiving = false;
+    conn->ops--;
+  }
+
+  if (cqe->res > 0)
+  {
+    uint16_t id = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    char const *data = uring->buffer_memory + (size_t)id * URING_BUFFER_SIZE;
+
+    // data goes straight to the parser unless earlier bytes are still waiting
+    if (conn->connection._closing || conn->ended)
+      ;
+    else if (conn->reading && conn->stash_size == 0 && conn->end == 0)
+      conn->connection._read_cb(&conn->connection, cqe->res, data);
+    else
+      _stash(conn, data, cqe->res);
+
+    _buffer_recycle(uring, id);
+  }
+  else if (cqe->res == 0)
+  {
+    _deliver_end(conn, UV_EOF);
+  }
+  else if (cqe->res != -ECANCELED && cqe->res != -ENOBUFS)
+  {
+    _deliver_end(conn, cqe->res);
+  }
+
+  // multishot ends on an empty buffer ring or a cancel, both just need re-arming
+  if (!conn->receiving && conn->reading && conn->stash_size == 0)
+    _receive(conn);
+
+  _finish(conn);
+}
+
+static void _send(uring_connection_t *conn)
+{
+  if (conn->sending || conn->writes == NULL)
+    return;
+
+  unsigned count = 0;
+  for (connection_write_t *write = conn->writes; write != NULL && count < URING_SEND_IOVS; write = write->_next)
+  {
+    for (unsigned i = write->_index; i < write->_nbufs && count < URING_SEND_IOVS; i++)
+    {
+      if (write->_bufs[i].len == 0)
+        continue;
+      conn->iov[count].iov_base = write->_bufs[i].base;
+      conn->iov[count].iov_len = write->_bufs[i].len;
+      count++;
+    }
+  }
+
+  struct io_uring_sqe *sqe = _sqe(conn->uring);
+  if (sqe == NULL)
+  {
+    _defer(conn);
+    return;
+  }
+
+  // sends of every connection touched this iteration go to the kernel in one io_uring_enter
+  sqe->fd = conn->fd;
+  sqe->msg_flags = MSG_NOSIGNAL;
+  sqe->user_data = _user_data(conn, URING_OP_SEND);
+  if (count == 1)
+  {
+    sqe->opcode = IORING_OP_SEND;
+    sqe->addr = (uint64_t)(uintptr_t)conn->iov[0].iov_base;
+    sqe->len = conn->iov[0].iov_len;
+  }
+  else
+  {
+    memset(&conn->msg, 0, sizeof(conn->msg));
+    conn->msg.msg_iov = conn->iov;
+    conn->msg.msg_iovlen = count;
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->addr = (uint64_t)(uintptr_t)&conn->msg;
+    sqe->len = 1;
+  }
+
+  conn->sending = true;
+  conn->ops++;
+}
+
+static void _fail_writes(uring_connection_t *conn, int status)
+{
+  connection_write_t *write;
+  while ((write = conn->writes) != NULL)
+  {
+    conn->writes = write->_next;
+    write->_cb(write, status);
+  }
+  conn->writes_tail = NULL;
+}
+
+static void _send_complete(uring_connection_t *conn, struct io_uring_cqe const *cqe)
+{
+  conn->sending = false;
+  conn->ops--;
+
+  if (cqe->res < 0)
+  {
+    _fail_writes(conn, cqe->res);
+    _finish(conn);
+    return;
+  }
+
+  size_t sent = cqe->res;
+  connection_write_t *write;
+  while ((write = conn->writes) != NULL)
+  {
+    while (write->_index < write->_nbufs && sent >= write->_bufs[write->_index].len)
+      sent -= write->_bufs[write->_index++].len;
+
+    if (write->_index < write->_nbufs)
+    {
+      // a short send leaves the rest of this buffer for the next round
+      write->_bufs[write->_index].base += sent;
+      write->_bufs[write->_index].len -= sent;
+      break;
+    }
+
+    conn->writes = write->_next;
+    if (conn->writes == NULL)
+      conn->writes_tail = NULL;
+    write->_cb(write, 0);
+  }
+
+  if (!conn->connection._closing)
+    _send(conn);
+
+  _finish(conn);
+}
+
+static void _flush(uring_connection_t *conn)
+{
+  if (conn->connection._closing)
+    return;
+
+  if (conn->reading && conn->stash_size > 0)
+  {
+    char *stash = conn->stash;
+    size_t size = conn->stash_size;
+    conn->stash = NULL;
+    conn->stash_size = conn->stash_capacity = 0;
+
+    conn->connection._read_cb(&conn->connection, size, stash);
+    mi_free(stash);
+  }
+
+  if (conn->reading && conn->end != 0 && conn->stash_size == 0 && !conn->connection._closing)
+  {
+    int status = conn->end;
+    conn->end = 0;
+    conn->ended = true;
+    conn->connection._read_cb(&conn->connection, status, NULL);
+  }
+
+  if (conn->reading && conn->stash_size == 0)
+    _receive(conn);
+  if (!conn->connection._closing)
+    _send(conn);
+}
+
+static void _finish(uring_connection_t *conn)
+{
+  if (!conn->connection._closing || conn->ops > 0 || conn->deferred)
+    return;
+
+  _fail_writes(conn, UV_ECANCELED);
+  close(conn->fd);
+  mi_free(conn->stash);
+
+  if (conn->connection._close_cb != NULL)
+    conn->connection._close_cb(&conn->connection);
+  mi_free(conn);
+}
+
+static int _uring_read_start(connection_t *connection)
+{
+  uring_connection_t *conn = URING_CONNECTION(connection);
+
+  conn->reading = true;
+  // stashed input is delivered from the prepare phase, like libuv never reads from inside uv_read_start
+  if (conn->stash_size > 0 || conn->end != 0)
+    _defer(conn);
+  else
+    _receive(conn);
+
+  return 0;
+}
+
+static void _uring_read_stop(connection_t *connection)
+{
+  // the multishot receive stays armed, input lands in the stash until reading resumes
+  URING_CONNECTION(connection)->reading = false;
+}
+
+static int _uring_write(connection_t *connection, connection_write_t *write, uv_buf_t const bufs[], unsigned nbufs)
+{
+  uring_connection_t *conn = URING_CONNECTION(connection);
+  if (connection->_closing)
+    return UV_EPIPE;
+
+  memcpy(write->_bufs, bufs, nbufs * sizeof(uv_buf_t));
+  write->_nbufs = nbufs;
+  write->_index = 0;
+  write->_next = NULL;
+
+  if (conn->writes_tail != NULL)
+    conn->writes_tail->_next = write;
+  else
+    conn->writes = write;
+  conn->writes_tail = write;
+
+  _send(conn);
+
+  return 0;
+}
+
+static void _uring_close(connection_t *connection)
+{
+  uring_connection_t *conn = URING_CONNECTION(connection);
+
+  if (conn->receiving)
+    _cancel(conn->uring, _user_data(conn, URING_OP_RECV));
+  // a send stuck on a full socket buffer fails now instead of holding the connection open
+  shutdown(conn->fd, SHUT_RDWR);
+
+  _defer(conn);
+}
+
+static int _uring_getpeername(connection_t *connection, struct sockaddr *name, int *namelen)
+{
+  socklen_t length = *namelen;
+  if (getpeername(URING_CONNECTION(connection)->fd, name, &length) < 0)
+    return -errno;
+
+  *namelen = length;
+  return 0;
+}
+
+static int _uring_fileno(connection_t *connection, uv_os_sock_t *fd)
+{
+  *fd = URING_CONNECTION(connection)->fd;
+  return 0;
+}
+
+static connection_transport_t const _uring_transport = {
+  .read_start = _uring_read_start,
+  .read_stop = _uring_read_stop,
+  .write = _uring_write,
+  .close = _uring_close,
+  .getpeername = _uring_getpeername,
+  .fileno = _uring_fileno,
+};
+
+connection_t *uring_connection_new(uring_t *uring, uv_os_sock_t fd)
+{
+  uring_connection_t *conn = mi_zalloc(sizeof(uring_connection_t));
+  if (conn == NULL)
+    return NULL;
+
+  connection_init(&conn->connection, &_uring_transport, uring->loop);
+  conn->uring = uring;
+  conn->fd = fd;
+
+  return &conn->connection;
+}
+
+// loop integration
+
+static void _complete(uring_t *uring, struct io_uring_cqe const *cqe)
+{
+  void *owner = (void *)(uintptr_t)(cqe->user_data & ~URING_OP_MASK);
+
+  switch (cqe->user_data & URING_OP_MASK)
+  {
+  case URING_OP_ACCEPT:
+    _accept_complete(uring, owner, cqe);
+    break;
+  case URING_OP_RECV:
+    _recv_complete(uring, owner, cqe);
+    break;
+  case URING_OP_SEND:
+    _send_complete(owner, cqe);
+    break;
+  default:
+    break;
+  }
+}
+
+static void _poll_cb(uv_poll_t *poll, int status, int events)
+{
+  uring_t *uring = poll->data;
+
+  uint64_t count;
+  if (read(uring->event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+    fprintf(stderr, "io_uring eventfd: %s\n", strerror(errno));
+
+  for (;;)
+  {
+    // deferred task work, and completions the kernel could not fit, are only flushed by entering the ring
+    if (uring->defer_taskrun || (__atomic_load_n(uring->sq_flags, __ATOMIC_RELAXED) & IORING_SQ_CQ_OVERFLOW))
+      _enter(uring, 0, IORING_ENTER_GETEVENTS);
+
+    unsigned head = *uring->cq_head;
+    unsigned tail = __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE);
+    if (head == tail)
+      break;
+
+    for (; head != tail; head++)
+    {
+      // copied out so the slot can be released before callbacks enter the ring again
+      struct io_uring_cqe cqe = uring->cqes[head & *uring->cq_mask];
+      __atomic_store_n(uring->cq_head, head + 1, __ATOMIC_RELEASE);
+      _complete(uring, &cqe);
+    }
+  }
+}
+
+static void _prepare_cb(uv_prepare_t *prepare)
+{
+  uring_t *uring = prepare->data;
+
+  while (uring->deferred != NULL)
+  {
+    uring_connection_t *conn = uring->deferred;
+    uring->deferred = conn->next_deferred;
+    conn->deferred = false;
+
+    if (conn->connection._closing)
+      _finish(conn);
+    else
+      _flush(conn);
+  }
+
+  _enter(uring, 0, 0);
+
+  // sends that completed inline during submit are picked up by the next poll
+  if (*uring->cq_head != __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE))
+    eventfd_write(uring->event_fd, 1);
+}
+
+static bool _map(uring_t *uring, struct io_uring_params const *params)
+{
+  size_t sq_size = params->sq_off.array + params->sq_entries * sizeof(unsigned);
+  size_t cq_size = params->cq_off.cqes + params->cq_entries * sizeof(struct io_uring_cqe);
+  uring->ring_size = sq_size > cq_size ? sq_size : cq_size;
+
+  uring->ring = mmap(NULL, uring->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQ_RING);
+  if (uring->ring == MAP_FAILED)
+  {
+    uring->ring = NULL;
+    return false;
+  }
+
+  uring->sqes_size = params->sq_entries * sizeof(struct io_uring_sqe);
+  uring->sqes = mmap(NULL, uring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQES);
+  if (uring->sqes == MAP_FAILED)
+  {
+    uring->sqes = NULL;
+    return false;
+  }
+
+  char *ring = uring->ring;
+  uring->sq_head = (unsigned *)(ring + params->sq_off.head);
+  uring->sq_tail = (unsigned *)(ring + params->sq_off.tail);
+  uring->sq_mask = (unsigned *)(ring + params->sq_off.ring_mask);
+  uring->sq_flags = (unsigned *)(ring + params->sq_off.flags);
+  uring->sq_array = (unsigned *)(ring + params->sq_off.array);
+  uring->sq_entries = params->sq_entries;
+  uring->sq_local_tail = *uring->sq_tail;
+  uring->cq_head = (unsigned *)(ring + params->cq_off.head);
+  uring->cq_tail = (unsigned *)(ring + params->cq_off.tail);
+  uring->cq_mask = (unsigned *)(ring + params->cq_off.ring_mask);
+  uring->cqes = (struct io_uring_cqe *)(ring + params->cq_off.cqes);
+
+  return true;
+}
+
+static bool _register_buffers(uring_t *uring)
+{
+  size_t ring_bytes = URING_BUFFER_COUNT * sizeof(struct io_uring_buf);
+  void *buffers = mmap(NULL, ring_bytes, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+  if (buffers == MAP_FAILED)
+    return false;
+  uring->buffers = buffers;
+
+  uring->buffer_memory = mi_malloc_aligned((size_t)URING_BUFFER_COUNT * URING_BUFFER_SIZE, 4096);
+  if (uring->buffer_memory == NULL)
+    return false;
+
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uint64_t)(uintptr_t)uring->buffers;
+  reg.ring_entries = URING_BUFFER_COUNT;
+  reg.bgid = URING_BUFFER_GROUP;
+  if (syscall(__NR_io_uring_register, uring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+    return false;
+
+  for (uint16_t id = 0; id < URING_BUFFER_COUNT; id++)
+    _buffer_recycle(uring, id);
+
+  return true;
+}
+
+// a kernel without multishot receive completes the first recv once and drops the MORE flag
+static bool _probe(uring_t *uring)
+{
+  int pair[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) != 0)
+    return false;
+
+  bool supported = false;
+  struct io_uring_sqe *sqe = _sqe(uring);
+  if (sqe != NULL)
+  {
+    _prep_recv(sqe, pair[0], _user_data(NULL, URING_OP_IGNORE));
+    if (write(pair[1], "x", 1) == 1 && _enter(uring, 1, IORING_ENTER_GETEVENTS) >= 0)
+    {
+      unsigned head = *uring->cq_head;
+      if (head != __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE))
+      {
+        struct io_uring_cqe const *cqe = &uring->cqes[head & *uring->cq_mask];
+        supported = cqe->res == 1 && (cqe->flags & IORING_CQE_F_MORE) && (cqe->flags & IORING_CQE_F_BUFFER);
+        if (cqe->flags & IORING_CQE_F_BUFFER)
+          _buffer_recycle(uring, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+        __atomic_store_n(uring->cq_head, head + 1, __ATOMIC_RELEASE);
+      }
+    }
+  }
+
+  // the peer closing ends a still armed receive, wait for that so nothing of the probe is left behind
+  close(pair[1]);
+  if (supported && _enter(uring, 1, IORING_ENTER_GETEVENTS) >= 0)
+    __atomic_store_n(uring->cq_head, __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+  close(pair[0]);
+
+  return supported;
+}
+
+static void _release(uring_t *uring)
+{
+  if (uring->acceptors != NULL)
+    ll_delete(uring->acceptors, mi_free);
+  mi_free(uring->buffer_memory);
+  if (uring->buffers != NULL)
+    munmap(uring->buffers, URING_BUFFER_COUNT * sizeof(struct io_uring_buf));
+  if (uring->sqes != NULL)
+    munmap(uring->sqes, uring->sqes_size);
+  if (uring->ring != NULL)
+    munmap(uring->ring, uring->ring_size);
+  if (uring->event_fd >= 0)
+    close(uring->event_fd);
+  if (uring->fd >= 0)
+    close(uring->fd);
+  mi_free(uring);
+}
+
+uring_t *uring_new(uv_loop_t *loop)
+{
+  uring_t *uring = mi_zalloc(sizeof(uring_t));
+  if (uring == NULL)
+    return NULL;
+
+  uring->loop = loop;
+  uring->event_fd = -1;
+
+  // without deferred task work every completion interrupts epoll_wait with EINTR,
+  // which libuv does not count as idle time and the overload lag would see as busy
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  params.cq_entries = URING_CQ_ENTRIES;
+#if defined(IORING_SETUP_DEFER_TASKRUN)
+  params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+  uring->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+  uring->defer_taskrun = uring->fd >= 0;
+  if (uring->fd < 0 && errno == EINVAL)
+#endif
+  {
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = URING_CQ_ENTRIES;
+    uring->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+  }
+  if (uring->fd < 0)
+  {
+    fprintf(stderr, "io_uring unavailable: %s\n", strerror(errno));
+    mi_free(uring);
+    return NULL;
+  }
+
+  // libuv polls an eventfd the ring signals, the ring fd itself is not woken for deferred work
+  uring->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  uring->acceptors = ll_new();
+  bool features = (params.features & IORING_FEAT_SINGLE_MMAP) && (params.features & IORING_FEAT_NODROP);
+  if (!features || uring->event_fd < 0 || uring->acceptors == NULL || !_map(uring, &params) ||
+      syscall(__NR_io_uring_register, uring->fd, IORING_REGISTER_EVENTFD, &uring->event_fd, 1) < 0 ||
+      !_register_buffers(uring) || !_probe(uring))
+  {
+    fprintf(stderr, "io_uring unavailable: kernel lacks multishot receive or provided buffer rings\n");
+    _release(uring);
+    return NULL;
+  }
+
+  uv_poll_init(loop, &uring->poll, uring->event_fd);
+  uring->poll.data = uring;
+  uv_poll_start(&uring->poll, UV_READABLE, _poll_cb);
+
+  // submissions queued during an iteration go out together right before libuv polls
+  uv_prepare_init(loop, &uring->prepare);
+  uring->prepare.data = uring;
+  uv_prepare_start(&uring->prepare, _prepare_cb);
+  uv_unref((uv_handle_t *)&uring->prepare);
+
+  return uring;
+}
+
+unsigned uring_close(uring_t *uring, uv_close_cb close_cb)
+{
+  uv_close((uv_handle_t *)&uring->poll, close_cb);
+  uv_close((uv_handle_t *)&uring->prepare, close_cb);
+
+  return 2;
+}
+
+void uring_delete(uring_t *uring)
+{
+  if (uring != NULL)
+    _release(uring);
+}
+
+bool uring_listen(uring_t *uring, listener_t *listener, int backlog, uring_accept_cb accept_cb)
+{
+  uv_os_fd_t fd;
+  if (uv_fileno(&listener->handle, &fd) != 0)
+    return false;
+
+  // libuv defers a failed TCP bind to uv_listen, an unbound socket would listen on a random port
+  struct sockaddr_storage addr;
+  socklen_t length = sizeof(addr);
+  if (listener->type == LISTENER_TCP &&
+      (getsockname(fd, (struct sockaddr *)&addr, &length) != 0 ||
+       (addr.ss_family == AF_INET ? ((struct sockaddr_in *)&addr)->sin_port
+                                  : ((struct sockaddr_in6 *)&addr)->sin6_port) == 0))
+  {
+    fprintf(stderr, "Listen error %s\n", uv_strerror(UV_EADDRINUSE));
+    return false;
+  }
+
+  if (listen(fd, backlog) != 0)
+  {
+    fprintf(stderr, "Listen error %s\n", strerror(errno));
+    return false;
+  }
+
+  uring_acceptor_t *acceptor = mi_zalloc_small(sizeof(uring_acceptor_t));
+  if (acceptor == NULL)
+    return false;
+  acceptor->listener = listener;
+  acceptor->accept_cb = accept_cb;
+
+  if (!ll_push_back(uring->acceptors, acceptor))
+  {
+    mi_free(acceptor);
+    return false;
+  }
+
+  _accept_arm(uring, acceptor);
+
+  return true;
+}
+
+void uring_unlisten(uring_t *uring, listener_t *listener)
+{
+  size_t index;
+  uring_acceptor_t *acceptor = _acceptor_find(uring, listener, &index);
+  if (acceptor == NULL)
+    return;
+
+  acceptor->removed = true;
+  acceptor->stopped = true;
+
+  // an armed accept stays listed until its final completion, or until the ring goes with it
+  if (acceptor->armed)
+  {
+    _cancel(uring, _user_data(acceptor, URING_OP_ACCEPT));
+    return;
+  }
+
+  ll_remove(uring->acceptors, index);
+  mi_free(acceptor);
+}
+
+void uring_accept_stop(uring_t *uring, listener_t *listener)
+{
+  uring_acceptor_t *acceptor = _acceptor_find(uring, listener, NULL);
+  if (acceptor == NULL || acceptor->stopped)
+    return;
+
+  acceptor->stopped = true;
+  if (acceptor->armed)
+    _cancel(uring, _user_data(acceptor, URING_OP_ACCEPT));
+}
+
+void uring_accept_start(uring_t *uring, listener_t *listener)
+{
+  uring_acceptor_t *acceptor = _acceptor_find(uring, listener, NULL);
+  if (acceptor == NULL)
+    return;
+
+  acceptor->stopped = false;
+  _accept_arm(uring, acceptor);
+}
+
+#else
+
+uring_t *uring_new(uv_loop_t *loop)
+{
+  fprintf(stderr, "io_uring unavailable: not built for this platform\n");
+  return NULL;
+}
+
+unsigned uring_close(uring_t *uring, uv_close_cb close_cb)
+{
+  return 0;
+}
+
+void uring_delete(uring_t *uring)
+{
+}
+
+bool uring_listen(uring_t *uring, listener_t *listener, int backlog, uring_accept_cb accept_cb)
+{
+  return false;
+}
+
+void uring_unlisten(uring_t *uring, listener_t *listener)
+{
+}
+
+void uring_accept_stop(uring_t *uring, listener_t *listener)
+{
+}
+
+void uring_accept_start(uring_t *uring, listener_t *listener)
+{
+}
+
+connection_t *uring_connection_new(uring_t *uring, uv_os_sock_t fd)
+{
+  return NULL;
+}
+
+#endif
@@ -0,0 +1,41 @@
+#if !defined(_URING_H_)
+#define _URING_H_
+
+#include <stdbool.h>
+
+#include <uv.h>
+
+#include "connection.h"
+#include "listener.h"
+
+// submission queue size, sends and re-arms beyond it force an early submit
+#define URING_ENTRIES 1024
+#define URING_CQ_ENTRIES 8192
+// provided receive buffers shared by every connection on the loop
+#define URING_BUFFER_COUNT 512
+#define URING_BUFFER_SIZE 4096
+// iovecs gathered from queued writes into one send
+#define URING_SEND_IOVS 64
+// bytes held for a connection that stopped reading before its receive is cancelled
+#define URING_STASH_LIMIT (64 * 1024)
+
+typedef struct uring uring_t;
+
+typedef void (*uring_accept_cb)(listener_t *listener, uv_os_sock_t fd);
+
+// NULL when the kernel lacks multishot receive or provided buffer rings,
+// the ring belongs to the thread running the loop and must only be used from it
+uring_t *uring_new(uv_loop_t *loop);
+// closes the loop handles and returns how many, uring_delete once all their callbacks ran
+unsigned uring_close(uring_t *uring, uv_close_cb close_cb);
+void uring_delete(uring_t *uring);
+
+bool uring_listen(uring_t *uring, listener_t *listener, int backlog, uring_accept_cb accept_cb);
+void uring_unlisten(uring_t *uring, listener_t *listener);
+// accepts already in flight may still complete after a stop
+void uring_accept_stop(uring_t *uring, listener_t *listener);
+void uring_accept_start(uring_t *uring, listener_t *listener);
+
+connection_t *uring_connection_new(uring_t *uring, uv_os_sock_t fd);
+
+#endif // _URING_H_
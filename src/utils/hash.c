@@ -1,5 +1,7 @@
 #include "hash.h"
 
+#include <string.h>
+
 #define FNV_OFFSET 14695981039346656037UL
 #define FNV_PRIME 1099511628211UL
 
@@ -13,3 +15,90 @@ uint64_t fnv_hash(char const *string, size_t length)
   }
   return hash;
 }
+
+#define SHA1_BLOCK_SIZE 64
+
+static uint32_t _rotl(uint32_t x, unsigned n)
+{
+  return (x << n) | (x >> (32 - n));
+}
+
+static void _sha1_block(uint32_t state[5], uint8_t const block[SHA1_BLOCK_SIZE])
+{
+  uint32_t w[80];
+  for (unsigned i = 0; i < 16; i++)
+    w[i] = (uint32_t)block[i * 4] << 24 | (uint32_t)block[i * 4 + 1] << 16 | (uint32_t)block[i * 4 + 2] << 8 |
+           block[i * 4 + 3];
+  for (unsigned i = 16; i < 80; i++)
+    w[i] = _rotl(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+  uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+  for (unsigned i = 0; i < 80; i++)
+  {
+    uint32_t f, k;
+    if (i < 20)
+    {
+      f = (b & c) | (~b & d);
+      k = 0x5a827999;
+    }
+    else if (i < 40)
+    {
+      f = b ^ c ^ d;
+      k = 0x6ed9eba1;
+    }
+    else if (i < 60)
+    {
+      f = (b & c) | (b & d) | (c & d);
+      k = 0x8f1bbcdc;
+    }
+    else
+    {
+      f = b ^ c ^ d;
+      k = 0xca62c1d6;
+    }
+
+    uint32_t t = _rotl(a, 5) + f + e + k + w[i];
+    e = d;
+    d = c;
+    c = _rotl(b, 30);
+    b = a;
+    a = t;
+  }
+
+  state[0] += a;
+  state[1] += b;
+  state[2] += c;
+  state[3] += d;
+  state[4] += e;
+}
+
+void sha1_hash(void const *data, size_t length, uint8_t digest[SHA1_DIGEST_SIZE])
+{
+  uint32_t state[5] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0};
+  uint8_t const *bytes = data;
+
+  size_t full = length - length % SHA1_BLOCK_SIZE;
+  for (size_t i = 0; i < full; i += SHA1_BLOCK_SIZE)
+    _sha1_block(state, bytes + i);
+
+  // the tail, a 1 bit, zeros and the length in bits end the last one or two blocks
+  uint8_t tail[SHA1_BLOCK_SIZE * 2] = {0};
+  size_t rest = length - full;
+  memcpy(tail, bytes + full, rest);
+  tail[rest] = 0x80;
+  size_t tail_length = rest + 9 <= SHA1_BLOCK_SIZE ? SHA1_BLOCK_SIZE : SHA1_BLOCK_SIZE * 2;
+  uint64_t bits = (uint64_t)length * 8;
+  for (unsigned i = 0; i < 8; i++)
+    tail[tail_length - 1 - i] = (uint8_t)(bits >> (i * 8));
+
+  for (size_t i = 0; i < tail_length; i += SHA1_BLOCK_SIZE)
+    _sha1_block(state, tail + i);
+
+  for (unsigned i = 0; i < 5; i++)
+  {
+    digest[i * 4] = (uint8_t)(state[i] >> 24);
+    digest[i * 4 + 1] = (uint8_t)(state[i] >> 16);
+    digest[i * 4 + 2] = (uint8_t)(state[i] >> 8);
+    digest[i * 4 + 3] = (uint8_t)state[i];
+  }
+}
@@ -4,6 +4,10 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#define SHA1_DIGEST_SIZE 20
+
 uint64_t fnv_hash(char const *string, size_t length);
+// for protocol handshakes like the WebSocket accept key, not for anything secret
+void sha1_hash(void const *data, size_t length, uint8_t digest[SHA1_DIGEST_SIZE]);
 
 #endif // _HASH_H_
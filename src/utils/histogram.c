@@ -0,0 +1,72 @@
+#include "histogram.h"
+
+#include <string.h>
+
+static size_t _bucket_index(uint64_t value)
+{
+  if (value < HISTOGRAM_SUB_BUCKETS)
+    return value;
+
+  int magnitude = 63 - __builtin_clzll(value);
+  int shift = magnitude - HISTOGRAM_SUB_BITS;
+  size_t sub = (value >> shift) & (HISTOGRAM_SUB_BUCKETS - 1);
+
+  return (size_t)(shift + 1) * HISTOGRAM_SUB_BUCKETS + sub;
+}
+
+static uint64_t _bucket_upper_bound(size_t index)
+{
+  if (index < HISTOGRAM_SUB_BUCKETS)
+    return index;
+
+  int shift = (int)(index / HISTOGRAM_SUB_BUCKETS) - 1;
+  uint64_t sub = index % HISTOGRAM_SUB_BUCKETS;
+  uint64_t base = (HISTOGRAM_SUB_BUCKETS + sub) << shift;
+
+  return base + ((1ULL << shift) - 1);
+}
+
+void histogram_reset(histogram_t *histogram)
+{
+  memset(histogram, 0, sizeof(histogram_t));
+}
+
+void histogram_record(histogram_t *histogram, uint64_t value)
+{
+  if (histogram->count == 0 || value < histogram->min)
+    histogram->min = value;
+  if (value > histogram->max)
+    histogram->max = value;
+
+  histogram->count++;
+  histogram->sum += value;
+  histogram->buckets[_bucket_index(value)]++;
+}
+
+uint64_t histogram_percentile(histogram_t const *histogram, double percentile)
+{
+  if (histogram->count == 0)
+    return 0;
+
+  uint64_t rank = (uint64_t)(percentile / 100.0 * histogram->count + 0.5);
+  if (rank == 0)
+    rank = 1;
+
+  uint64_t seen = 0;
+  for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++)
+  {
+    seen += histogram->buckets[i];
+    if (seen >= rank)
+    {
+      uint64_t bound = _bucket_upper_bound(i);
+      return bound < histogram->max ? bound : histogram->max;
+    }
+  }
+
+  return histogram->max;
+}
+
+uint64_t histogram_mean(histogram_t const *histogram)
+{
+  return histogram->count == 0 ? 0 : histogram->sum / histogram->count;
+}
@@ -0,0 +1,24 @@
+#if !defined(_HISTOGRAM_H_)
+#define _HISTOGRAM_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// log-linear buckets: every power of two is split in HISTOGRAM_SUB_BUCKETS, so the
+// relative error of a reported percentile stays under 1 / HISTOGRAM_SUB_BUCKETS
+#define HISTOGRAM_SUB_BITS 3
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+typedef struct histogram
+{
+  uint64_t count, sum, min, max;
+  uint64_t buckets[HISTOGRAM_BUCKETS];
+} histogram_t;
+
+void histogram_reset(histogram_t *histogram);
+void histogram_record(histogram_t *histogram, uint64_t value);
+uint64_t histogram_percentile(histogram_t const *histogram, double percentile);
+uint64_t histogram_mean(histogram_t const *histogram);
+
+#endif // _HISTOGRAM_H_
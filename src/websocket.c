@@ -0,0 +1,693 @@
+#include "websocket.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+#include <mimalloc.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define WEBSOCKET_X86 1
+#include <immintrin.h>
+#endif
+
+#include "connection.h"
+#include "response.h"
+#include "server.h"
+#include "utils/hash.h"
+
+#define WEBSOCKET_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+// base64 of the 16 byte client nonce
+#define WEBSOCKET_KEY_LENGTH 24
+#define WEBSOCKET_ACCEPT_LENGTH 28
+
+typedef void (*unmask_f)(char *data, size_t length, uint8_t const pattern[4]);
+
+typedef struct websocket_write
+{
+  connection_write_t write;
+  websocket_t *ws;
+  websocket_sent_cb cb;
+  void *cb_data;
+  uint8_t header[10];
+  // the payload when it's copied
+  char data[];
+} websocket_write_t;
+
+// pattern is the mask already rotated to the first byte, so every 4 byte step lines up with it
+static void _unmask_scalar(char *data, size_t length, uint8_t const pattern[4])
+{
+  uint32_t word;
+  memcpy(&word, pattern, 4);
+  uint64_t wide = (uint64_t)word << 32 | word;
+
+  size_t i = 0;
+  for (; i + 8 <= length; i += 8)
+  {
+    uint64_t chunk;
+    memcpy(&chunk, data + i, 8);
+    chunk ^= wide;
+    memcpy(data + i, &chunk, 8);
+  }
+  for (; i < length; i++)
+    data[i] ^= pattern[i & 3];
+}
+
+#if defined(WEBSOCKET_X86)
+
+__attribute__((target("sse2"))) static void _unmask_sse2(char *data, size_t length, uint8_t const pattern[4])
+{
+  int word;
+  memcpy(&word, pattern, 4);
+  __m128i const mask = _mm_set1_epi32(word);
+
+  size_t i = 0;
+  for (; i + 16 <= length; i += 16)
+  {
+    __m128i v = _mm_loadu_si128((__m128i const *)(data + i));
+    _mm_storeu_si128((__m128i *)(data + i), _mm_xor_si128(v, mask));
+  }
+
+  _unmask_scalar(data + i, length - i, pattern);
+}
+
+__attribute__((target("avx2"))) static void _unmask_avx2(char *data, size_t length, uint8_t const pattern[4])
+{
+  int word;
+  memcpy(&word, pattern, 4);
+  __m256i const mask = _mm256_set1_epi32(word);
+
+  size_t i = 0;
+  for (; i + 64 <= length; i += 64)
+  {
+    __m256i a = _mm256_loadu_si256((__m256i const *)(data + i));
+    __m256i b = _mm256_loadu_si256((__m256i const *)(data + i + 32));
+    _mm256_storeu_si256((__m256i *)(data + i), _mm256_xor_si256(a, mask));
+    _mm256_storeu_si256((__m256i *)(data + i + 32), _mm256_xor_si256(b, mask));
+  }
+  for (; i + 32 <= length; i += 32)
+  {
+    __m256i v = _mm256_loadu_si256((__m256i const *)(data + i));
+    _mm256_storeu_si256((__m256i *)(data + i), _mm256_xor_si256(v, mask));
+  }
+
+  _unmask_scalar(data + i, length - i, pattern);
+}
+
+#endif
+
+static unmask_f _unmask = _unmask_scalar;
+
+void websocket_init()
+{
+#if defined(WEBSOCKET_X86)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    _unmask = _unmask_avx2;
+  else if (__builtin_cpu_supports("sse2"))
+    _unmask = _unmask_sse2;
+#endif
+}
+
+void websocket_unmask(char *data, size_t length, uint8_t const mask[4], unsigned offset)
+{
+  uint8_t pattern[4];
+  for (unsigned i = 0; i < 4; i++)
+    pattern[i] = mask[(offset + i) & 3];
+
+  _unmask(data, length, pattern);
+}
+
+static bool _valid_utf8(char const *data, size_t length)
+{
+  unsigned char const *p = (unsigned char const *)data;
+  unsigned char const *end = p + length;
+
+  while (p < end)
+  {
+    // ASCII runs are the common case, skip them a word at a time
+    uint64_t chunk;
+    if (end - p >= 8 && (memcpy(&chunk, p, 8), (chunk & 0x8080808080808080ULL) == 0))
+    {
+      p += 8;
+      continue;
+    }
+
+    unsigned char c = *p;
+    if (c < 0x80)
+    {
+      p++;
+      continue;
+    }
+
+    size_t count;
+    unsigned char min = 0x80, max = 0xbf;
+    if (c >= 0xc2 && c <= 0xdf)
+      count = 1;
+    else if (c >= 0xe0 && c <= 0xef)
+    {
+      count = 2;
+      // no overlong forms or UTF-16 surrogates
+      if (c == 0xe0)
+        min = 0xa0;
+      else if (c == 0xed)
+        max = 0x9f;
+    }
+    else if (c >= 0xf0 && c <= 0xf4)
+    {
+      count = 3;
+      if (c == 0xf0)
+        min = 0x90;
+      else if (c == 0xf4)
+        max = 0x8f;
+    }
+    else
+      return false;
+
+    if ((size_t)(end - p) <= count || p[1] < min || p[1] > max)
+      return false;
+    for (size_t i = 2; i <= count; i++)
+    {
+      if ((p[i] & 0xc0) != 0x80)
+        return false;
+    }
+    p += count + 1;
+  }
+
+  return true;
+}
+
+// Upgrade lists protocols separated by commas, with optional versions
+static bool _has_websocket(char const *value)
+{
+  static char const name[] = "websocket";
+
+  while (*value != '\0')
+  {
+    value += strspn(value, " \t,");
+    size_t length = strcspn(value, " \t,/");
+    if (length == sizeof(name) - 1 && strncasecmp(value, name, length) == 0)
+      return true;
+    value += length;
+    value += strcspn(value, ",");
+  }
+
+  return false;
+}
+
+bool websocket_requested(request_t *req)
+{
+  if (llhttp_get_method(req->_parser) != HTTP_GET || !req->_parser->upgrade)
+    return false;
+
+  string_t *upgrade = request_header(req, "upgrade");
+  return upgrade != NULL && _has_websocket(upgrade->data);
+}
+
+static void _base64(uint8_t const *data, size_t length, char *out)
+{
+  static char const alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+  for (size_t i = 0; i < length; i += 3)
+  {
+    uint32_t group = (uint32_t)data[i] << 16;
+    if (i + 1 < length)
+      group |= (uint32_t)data[i + 1] << 8;
+    if (i + 2 < length)
+      group |= data[i + 2];
+
+    *out++ = alphabet[group >> 18 & 0x3f];
+    *out++ = alphabet[group >> 12 & 0x3f];
+    *out++ = i + 1 < length ? alphabet[group >> 6 & 0x3f] : '=';
+    *out++ = i + 2 < length ? alphabet[group & 0x3f] : '=';
+  }
+  *out = '\0';
+}
+
+websocket_t *websocket_accept(request_t *req, websocket_callbacks_t const *callbacks, void *data)
+{
+  string_t *key = request_header(req, "sec-websocket-key");
+  if (!websocket_requested(req) || llhttp_get_http_minor(req->_parser) == 0 || key == NULL ||
+      key->length != WEBSOCKET_KEY_LENGTH)
+  {
+    req->_close = true;
+    response_send_status(req, 400);
+    return NULL;
+  }
+
+  string_t *version = request_header(req, "sec-websocket-version");
+  if (version == NULL || strcmp(version->data, "13") != 0)
+  {
+    response_t res;
+    response_init(&res, req, 426);
+    response_header(&res, "Sec-WebSocket-Version", "13");
+    response_send(&res, NULL, 0);
+    return NULL;
+  }
+
+  websocket_t *ws = mi_zalloc_small(sizeof(websocket_t));
+  if (ws == NULL)
+    return NULL;
+
+  char concatenated[WEBSOCKET_KEY_LENGTH + sizeof(WEBSOCKET_GUID) - 1];
+  memcpy(concatenated, key->data, WEBSOCKET_KEY_LENGTH);
+  memcpy(concatenated + WEBSOCKET_KEY_LENGTH, WEBSOCKET_GUID, sizeof(WEBSOCKET_GUID) - 1);
+  uint8_t digest[SHA1_DIGEST_SIZE];
+  sha1_hash(concatenated, sizeof(concatenated), digest);
+  char accept[WEBSOCKET_ACCEPT_LENGTH + 1];
+  _base64(digest, sizeof(digest), accept);
+
+  response_t res;
+  response_init(&res, req, 101);
+  // the connection outlives this message whatever llhttp thinks of an Upgrade request
+  res.keep_alive = true;
+  response_header(&res, "Upgrade", "websocket");
+  response_header(&res, "Connection", "Upgrade");
+  response_header(&res, "Sec-WebSocket-Accept", accept);
+  if (!response_send(&res, NULL, 0))
+  {
+    mi_free(ws);
+    return NULL;
+  }
+
+  ws->data = data;
+  ws->max_message = WEBSOCKET_DEFAULT_MAX_MESSAGE;
+  ws->_req = req;
+  ws->_callbacks = callbacks;
+  req->_websocket = ws;
+
+  if (callbacks->on_open != NULL)
+    callbacks->on_open(ws);
+
+  return ws;
+}
+
+static void _write_cb(connection_write_t *write, int status)
+{
+  websocket_write_t *ws_write = (websocket_write_t *)write;
+  websocket_t *ws = ws_write->ws;
+  request_t *req = ws->_req;
+
+  if (ws_write->cb != NULL)
+    ws_write->cb(ws, ws_write->cb_data, status);
+  mi_free(ws_write);
+  req->_writes--;
+
+  if (status < 0 || (req->_close && req->_writes == 0))
+    server_connection_close(req);
+}
+
+static bool _send(
+  websocket_t *ws,
+  websocket_opcode_t opcode,
+  char const *data,
+  size_t length,
+  websocket_sent_cb sent_cb,
+  void *cb_data)
+{
+  request_t *req = ws->_req;
+  if (req->_connection == NULL || connection_is_closing(req->_connection))
+    return false;
+
+  size_t copied = sent_cb == NULL ? length : 0;
+  websocket_write_t *ws_write = mi_malloc(sizeof(websocket_write_t) + copied);
+  if (ws_write == NULL)
+    return false;
+
+  ws_write->ws = ws;
+  ws_write->cb = sent_cb;
+  ws_write->cb_data = cb_data;
+
+  // server frames are never masked
+  uint8_t *header = ws_write->header;
+  size_t header_length = 2;
+  header[0] = 0x80 | opcode;
+  if (length < 126)
+  {
+    header[1] = (uint8_t)length;
+  }
+  else if (length <= 0xffff)
+  {
+    header[1] = 126;
+    header[2] = (uint8_t)(length >> 8);
+    header[3] = (uint8_t)length;
+    header_length = 4;
+  }
+  else
+  {
+    header[1] = 127;
+    for (unsigned i = 0; i < 8; i++)
+      header[2 + i] = (uint8_t)((uint64_t)length >> (56 - i * 8));
+    header_length = 10;
+  }
+
+  uv_buf_t bufs[2];
+  unsigned nbufs = 0;
+  bufs[nbufs++] = uv_buf_init((char *)header, header_length);
+  if (length > 0)
+  {
+    if (copied > 0)
+    {
+      memcpy(ws_write->data, data, copied);
+      data = ws_write->data;
+    }
+    bufs[nbufs++] = uv_buf_init((char *)data, length);
+  }
+
+  if (connection_write(req->_connection, &ws_write->write, bufs, nbufs, _write_cb))
+  {
+    mi_free(ws_write);
+    return false;
+  }
+  req->_writes++;
+
+  return true;
+}
+
+bool websocket_send(
+  websocket_t *ws,
+  websocket_opcode_t opcode,
+  char const *data,
+  size_t length,
+  websocket_sent_cb sent_cb,
+  void *cb_data)
+{
+  // nothing may follow a close frame
+  if (ws->_close_sent || opcode == WEBSOCKET_CLOSE)
+    return false;
+
+  return _send(ws, opcode, data, length, sent_cb, cb_data);
+}
+
+static bool _send_close(websocket_t *ws, unsigned code, char const *reason, size_t reason_length)
+{
+  if (ws->_close_sent)
+    return true;
+
+  char payload[WEBSOCKET_CONTROL_SIZE];
+  size_t length = 0;
+  if (code != WEBSOCKET_NO_STATUS)
+  {
+    payload[0] = (char)(code >> 8);
+    payload[1] = (char)code;
+    reason_length = reason_length < sizeof(payload) - 2 ? reason_length : sizeof(payload) - 2;
+    if (reason_length > 0)
+      memcpy(payload + 2, reason, reason_length);
+    length = 2 + reason_length;
+  }
+
+  ws->_close_sent = true;
+  return _send(ws, WEBSOCKET_CLOSE, payload, length, NULL, NULL);
+}
+
+bool websocket_close(websocket_t *ws, unsigned code, char const *reason)
+{
+  if (ws->_close_sent)
+    return false;
+
+  return _send_close(ws, code, reason, reason != NULL ? strlen(reason) : 0);
+}
+
+static void _notify_close(websocket_t *ws, unsigned code)
+{
+  if (ws->_closed)
+    return;
+
+  ws->_closed = true;
+  if (ws->_callbacks->on_close != NULL)
+    ws->_callbacks->on_close(ws, code);
+}
+
+// stops reading and closes once the close frame and anything before it are written
+static void _finish(websocket_t *ws, unsigned code)
+{
+  request_t *req = ws->_req;
+
+  _notify_close(ws, code);
+  req->_close = true;
+  if (req->_connection != NULL)
+    connection_read_stop(req->_connection);
+  if (req->_writes == 0)
+    server_connection_close(req);
+}
+
+static void _fail(websocket_t *ws, unsigned code)
+{
+  _send_close(ws, code, NULL, 0);
+  _finish(ws, code);
+}
+
+static bool _valid_close_code(unsigned code)
+{
+  return (code >= 1000 && code <= 1003) || (code >= 1007 && code <= 1014) || (code >= 3000 && code <= 4999);
+}
+
+static void _control(websocket_t *ws, char const *payload, size_t length)
+{
+  switch (ws->_opcode)
+  {
+  case WEBSOCKET_PING:
+    // nothing may follow our close frame, not even a pong
+    if (!ws->_close_sent)
+      _send(ws, WEBSOCKET_PONG, payload, length, NULL, NULL);
+    break;
+  case WEBSOCKET_CLOSE:
+  {
+    unsigned code = WEBSOCKET_NO_STATUS;
+    if (length >= 2)
+    {
+      code = (uint8_t)payload[0] << 8 | (uint8_t)payload[1];
+      if (!_valid_close_code(code))
+      {
+        _fail(ws, WEBSOCKET_PROTOCOL_ERROR);
+        return;
+      }
+      if (!_valid_utf8(payload + 2, length - 2))
+      {
+        _fail(ws, WEBSOCKET_INVALID_DATA);
+        return;
+      }
+    }
+    else if (length == 1)
+    {
+      _fail(ws, WEBSOCKET_PROTOCOL_ERROR);
+      return;
+    }
+
+    // echo the code back, unless this answers our own close
+    _send_close(ws, code, NULL, 0);
+    _finish(ws, code);
+    break;
+  }
+  default:
+    break;
+  }
+}
+
+static void _message(websocket_t *ws, char const *data, size_t length)
+{
+  websocket_opcode_t opcode = ws->_message_opcode;
+  ws->_message_opcode = WEBSOCKET_CONTINUATION;
+
+  if (opcode == WEBSOCKET_TEXT && !_valid_utf8(data, length))
+  {
+    _fail(ws, WEBSOCKET_INVALID_DATA);
+    return;
+  }
+
+  if (ws->_callbacks->on_message != NULL)
+    ws->_callbacks->on_message(ws, opcode, data, length);
+}
+
+static bool _append(websocket_t *ws, char const *data, size_t length)
+{
+  size_t needed = ws->_message_length + length;
+  if (needed > ws->_message_capacity)
+  {
+    size_t capacity = ws->_message_capacity * 2 > needed ? ws->_message_capacity * 2 : needed;
+    if (capacity > ws->max_message)
+      capacity = ws->max_message;
+    char *message = mi_realloc(ws->_message, capacity);
+    if (message == NULL)
+      return false;
+    ws->_message = message;
+    ws->_message_capacity = capacity;
+  }
+
+  memcpy(ws->_message + ws->_message_length, data, length);
+  ws->_message_length = needed;
+
+  return true;
+}
+
+// idle connections hold no buffers
+static void _release(websocket_t *ws)
+{
+  mi_free(ws->_message);
+  ws->_message = NULL;
+  ws->_message_length = 0;
+  ws->_message_capacity = 0;
+}
+
+// bytes the header takes once its first two are in
+static size_t _header_size(uint8_t const *header)
+{
+  uint8_t length = header[1] & 0x7f;
+  return 2 + (length == 126 ? 2 : length == 127 ? 8 : 0) + (header[1] & 0x80 ? 4 : 0);
+}
+
+// false when the frame broke the protocol and the connection is being failed
+static bool _frame_begin(websocket_t *ws)
+{
+  uint8_t const *header = ws->_header;
+  uint8_t opcode = header[0] & 0x0f;
+  bool control = opcode & 0x8;
+
+  uint64_t length = header[1] & 0x7f;
+  size_t offset = 2;
+  if (length == 126)
+  {
+    length = (uint64_t)header[2] << 8 | header[3];
+    offset = 4;
+  }
+  else if (length == 127)
+  {
+    length = 0;
+    for (unsigned i = 0; i < 8; i++)
+      length = length << 8 | header[2 + i];
+    offset = 10;
+  }
+
+  // clients must mask, and no extension was negotiated to give the reserved bits a meaning
+  bool valid = (header[1] & 0x80) && !(header[0] & 0x70);
+  if (control)
+    valid = valid && (header[0] & 0x80) && length <= WEBSOCKET_CONTROL_SIZE &&
+            (opcode == WEBSOCKET_CLOSE || opcode == WEBSOCKET_PING || opcode == WEBSOCKET_PONG);
+  else if (opcode == WEBSOCKET_CONTINUATION)
+    valid = valid && ws->_message_opcode != WEBSOCKET_CONTINUATION;
+  else
+    valid = valid && (opcode == WEBSOCKET_TEXT || opcode == WEBSOCKET_BINARY) &&
+            ws->_message_opcode == WEBSOCKET_CONTINUATION;
+  if (!valid)
+  {
+    _fail(ws, WEBSOCKET_PROTOCOL_ERROR);
+    return false;
+  }
+
+  if (!control && length > ws->max_message - ws->_message_length)
+  {
+    _fail(ws, WEBSOCKET_TOO_BIG);
+    return false;
+  }
+
+  memcpy(ws->_mask, header + offset, 4);
+  ws->_mask_offset = 0;
+  ws->_opcode = opcode;
+  ws->_fin = header[0] & 0x80;
+  ws->_remaining = length;
+  ws->_in_payload = true;
+  ws->_header_length = 0;
+  if (opcode == WEBSOCKET_TEXT || opcode == WEBSOCKET_BINARY)
+    ws->_message_opcode = opcode;
+
+  return true;
+}
+
+// payload bytes of the current frame, unmasked; complete is set on its last piece
+static void _frame_data(websocket_t *ws, char const *data, size_t length, bool complete)
+{
+  if (ws->_opcode & 0x8)
+  {
+    if (!complete || ws->_control != NULL)
+    {
+      // split across reads, rare enough to allocate for
+      if (ws->_control == NULL && (ws->_control = mi_malloc_small(WEBSOCKET_CONTROL_SIZE)) == NULL)
+      {
+        _fail(ws, WEBSOCKET_INTERNAL_ERROR);
+        return;
+      }
+      memcpy(ws->_control + ws->_control_length, data, length);
+      ws->_control_length += length;
+      if (!complete)
+        return;
+      data = ws->_control;
+      length = ws->_control_length;
+    }
+
+    _control(ws, data, length);
+    mi_free(ws->_control);
+    ws->_control = NULL;
+    ws->_control_length = 0;
+    return;
+  }
+
+  // a whole unfragmented message in one read is handed over straight from the read buffer
+  if (complete && ws->_fin && ws->_message_length == 0)
+  {
+    _message(ws, data, length);
+    return;
+  }
+
+  if (!_append(ws, data, length))
+  {
+    _fail(ws, WEBSOCKET_INTERNAL_ERROR);
+    return;
+  }
+
+  if (complete && ws->_fin)
+  {
+    _message(ws, ws->_message, ws->_message_length);
+    _release(ws);
+  }
+}
+
+void websocket_read(websocket_t *ws, char *data, size_t length)
+{
+  char *end = data + length;
+
+  while (data < end && !ws->_closed)
+  {
+    if (!ws->_in_payload)
+    {
+      size_t needed = ws->_header_length < 2 ? 2 : _header_size(ws->_header);
+      size_t take = needed - ws->_header_length;
+      take = take < (size_t)(end - data) ? take : (size_t)(end - data);
+      memcpy(ws->_header + ws->_header_length, data, take);
+      ws->_header_length += take;
+      data += take;
+
+      if (ws->_header_length < needed || (needed == 2 && _header_size(ws->_header) > 2))
+        continue;
+      if (!_frame_begin(ws))
+        return;
+      if (ws->_remaining > 0)
+        continue;
+
+      ws->_in_payload = false;
+      _frame_data(ws, data, 0, true);
+      continue;
+    }
+
+    size_t take = ws->_remaining < (uint64_t)(end - data) ? ws->_remaining : (size_t)(end - data);
+    websocket_unmask(data, take, ws->_mask, ws->_mask_offset);
+    ws->_mask_offset = (ws->_mask_offset + take) & 3;
+    ws->_remaining -= take;
+
+    bool complete = ws->_remaining == 0;
+    if (complete)
+      ws->_in_payload = false;
+    _frame_data(ws, data, take, complete);
+    data += take;
+  }
+}
+
+void websocket_delete(websocket_t *ws)
+{
+  if (ws == NULL)
+    return;
+
+  _notify_close(ws, WEBSOCKET_ABNORMAL);
+  mi_free(ws->_message);
+  mi_free(ws->_control);
+  mi_free(ws);
+}
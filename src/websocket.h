@@ -0,0 +1,102 @@
+#if !defined(_WEBSOCKET_H_)
+#define _WEBSOCKET_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "request.h"
+
+#define WEBSOCKET_DEFAULT_MAX_MESSAGE (16 * 1024 * 1024)
+// control frames carry at most this much
+#define WEBSOCKET_CONTROL_SIZE 125
+// two bytes, up to 8 of extended length and the mask
+#define WEBSOCKET_HEADER_SIZE 14
+
+typedef enum websocket_opcode
+{
+  WEBSOCKET_CONTINUATION = 0x0,
+  WEBSOCKET_TEXT = 0x1,
+  WEBSOCKET_BINARY = 0x2,
+  WEBSOCKET_CLOSE = 0x8,
+  WEBSOCKET_PING = 0x9,
+  WEBSOCKET_PONG = 0xa
+} websocket_opcode_t;
+
+// RFC 6455 7.4.1
+enum websocket_status
+{
+  WEBSOCKET_NORMAL = 1000,
+  WEBSOCKET_GOING_AWAY = 1001,
+  WEBSOCKET_PROTOCOL_ERROR = 1002,
+  WEBSOCKET_NO_STATUS = 1005,
+  WEBSOCKET_ABNORMAL = 1006,
+  WEBSOCKET_INVALID_DATA = 1007,
+  WEBSOCKET_TOO_BIG = 1009,
+  WEBSOCKET_INTERNAL_ERROR = 1011
+};
+
+typedef struct websocket websocket_t;
+
+typedef struct websocket_callbacks
+{
+  // the 101 is queued, sends from here follow it
+  void (*on_open)(websocket_t *ws);
+  // a whole text or binary message with its fragments joined, data is only valid during the call
+  void (*on_message)(websocket_t *ws, websocket_opcode_t opcode, char const *data, size_t length);
+  // once, with the peer's code or WEBSOCKET_ABNORMAL when the connection went without a close; the place to release data
+  void (*on_close)(websocket_t *ws, unsigned code);
+} websocket_callbacks_t;
+
+typedef void (*websocket_sent_cb)(websocket_t *ws, void *data, int status);
+
+// an idle socket keeps the whole upgrade request: about 2.2KB with a browser's handshake, the request_t
+// and its 32 entry query index (872 bytes), the llhttp_t (96), the headers table (512) and the handshake's
+// strings (~200), the connection with its uv_tcp_t (~370) and this (104)
+struct websocket
+{
+  void *data;
+  // larger messages close the connection with WEBSOCKET_TOO_BIG
+  size_t max_message;
+  request_t *_req;
+  websocket_callbacks_t const *_callbacks;
+  // fragments of a message, or a data frame split across reads; only held while one is incomplete
+  char *_message;
+  size_t _message_length, _message_capacity;
+  // a control frame split across reads
+  char *_control;
+  uint64_t _remaining;
+  uint8_t _header[WEBSOCKET_HEADER_SIZE];
+  uint8_t _mask[4];
+  uint8_t _header_length, _control_length, _opcode, _message_opcode, _mask_offset;
+  bool _in_payload, _fin, _close_sent, _closed;
+};
+
+void websocket_init();
+
+// a GET asking to upgrade to websocket
+bool websocket_requested(request_t *req);
+// from the request handler: queues the 101 and takes the connection over once the message is done;
+// NULL when the handshake is invalid, with the error response already sent
+websocket_t *websocket_accept(request_t *req, websocket_callbacks_t const *callbacks, void *data);
+
+// the payload is written straight from data, which must stay valid until sent_cb; without sent_cb it's copied
+bool websocket_send(
+  websocket_t *ws,
+  websocket_opcode_t opcode,
+  char const *data,
+  size_t length,
+  websocket_sent_cb sent_cb,
+  void *cb_data);
+// the connection closes once the peer answers with its own close
+bool websocket_close(websocket_t *ws, unsigned code, char const *reason);
+
+// from the server with the bytes after the upgrade, they are unmasked in place
+void websocket_read(websocket_t *ws, char *data, size_t length);
+// the connection is gone: calls on_close if it hasn't been and frees the websocket
+void websocket_delete(websocket_t *ws);
+
+// XORs with the 4 byte mask starting offset bytes into it
+void websocket_unmask(char *data, size_t length, uint8_t const mask[4], unsigned offset);
+
+#endif // _WEBSOCKET_H_
@@ -0,0 +1,189 @@
+#include "workers.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <mimalloc.h>
+
+#include "listener.h"
+
+unsigned workers_parse_cpus(char const *list, int *cpus, unsigned max)
+{
+  unsigned count = 0;
+  char const *cursor = list;
+  while (*cursor != '\0')
+  {
+    char *end;
+    long first = strtol(cursor, &end, 10);
+    long last = first;
+    if (end == cursor || first < 0)
+      return 0;
+    if (*end == '-')
+    {
+      cursor = end + 1;
+      last = strtol(cursor, &end, 10);
+      if (end == cursor || last < first)
+        return 0;
+    }
+
+    for (long cpu = first; cpu <= last; cpu++)
+    {
+      if (count == max)
+        return 0;
+      cpus[count++] = (int)cpu;
+    }
+
+    if (*end == ',')
+      end++;
+    else if (*end != '\0')
+      return 0;
+    cursor = end;
+  }
+
+  return count;
+}
+
+static bool _pin(worker_t *worker)
+{
+  int size = uv_cpumask_size();
+  if (size <= worker->cpu)
+    return false;
+
+  char *mask = mi_zalloc(size);
+  if (mask == NULL)
+    return false;
+  mask[worker->cpu] = 1;
+
+  uv_thread_t self = uv_thread_self();
+  int err = uv_thread_setaffinity(&self, mask, NULL, size);
+  mi_free(mask);
+  if (err)
+    fprintf(stderr, "Worker %u not pinned to cpu %d: %s\n", worker->index, worker->cpu, uv_strerror(err));
+
+  return err == 0;
+}
+
+static bool _listen(worker_t *worker)
+{
+  workers_t *workers = worker->_workers;
+
+  server_set_cpu(worker->server, worker->cpu);
+  if (!server_listen(worker->server, workers->backlog))
+    return false;
+
+  if (!workers->steer)
+    return true;
+
+  // every worker attaches the same program, the group keeps whichever came last
+  linked_list_it it = ll_iterator(worker->server->listeners);
+  while (lli_next(&it))
+  {
+    listener_t *listener = lli_get(it);
+    uv_os_fd_t fd;
+    if (listener->type == LISTENER_TCP && listener->options.reuseport && uv_fileno(&listener->handle, &fd) == 0)
+      socket_options_steer(fd, workers->cpus, workers->count);
+  }
+
+  return true;
+}
+
+static void _run(void *data)
+{
+  worker_t *worker = data;
+  workers_t *workers = worker->_workers;
+
+  // pinned first, so what the loop allocates lands on the core's own node
+  if (worker->cpu >= 0 && !_pin(worker))
+    worker->cpu = -1;
+
+  if (uv_loop_init(&worker->loop) == 0)
+  {
+    worker->server = workers->setup(worker);
+    worker->_ok = worker->server != NULL && _listen(worker);
+  }
+
+  uv_sem_post(&workers->_ready);
+  if (worker->_ok)
+    uv_run(&worker->loop, UV_RUN_DEFAULT);
+}
+
+workers_t *workers_start(unsigned count, int const *cpus, int backlog, worker_setup_f setup)
+{
+  if (count == 0 || count > WORKERS_MAX)
+    return NULL;
+
+  workers_t *workers = mi_zalloc(sizeof(workers_t));
+  if (workers == NULL)
+    return NULL;
+
+  workers->workers = mi_calloc(count, sizeof(worker_t));
+  if (workers->workers == NULL || uv_sem_init(&workers->_ready, 0) != 0)
+  {
+    mi_free(workers->workers);
+    mi_free(workers);
+    return NULL;
+  }
+
+  workers->count = count;
+  workers->backlog = backlog;
+  workers->setup = setup;
+  workers->steer = cpus != NULL;
+  for (unsigned i = 0; i < count; i++)
+  {
+    workers->cpus[i] = cpus != NULL ? cpus[i] : -1;
+
+    worker_t *worker = &workers->workers[i];
+    worker->index = i;
+    worker->cpu = workers->cpus[i];
+    worker->_workers = workers;
+  }
+
+  for (unsigned i = 0; i < count; i++)
+  {
+    worker_t *worker = &workers->workers[i];
+    if (uv_thread_create(&worker->thread, _run, worker) != 0)
+      return NULL;
+    worker->_started = true;
+
+    // one at a time, a listener's place in a reuseport group is the order it started listening
+    uv_sem_wait(&workers->_ready);
+    if (!worker->_ok)
+    {
+      fprintf(stderr, "Worker %u failed to start\n", i);
+      return NULL;
+    }
+  }
+
+  return workers;
+}
+
+void workers_join(workers_t *workers)
+{
+  for (unsigned i = 0; i < workers->count; i++)
+  {
+    if (workers->workers[i]._started)
+      uv_thread_join(&workers->workers[i].thread);
+  }
+}
+
+size_t workers_format_json(workers_t const *workers, char *buffer, size_t size)
+{
+  int length = snprintf(buffer, size, "[");
+  for (unsigned i = 0; i < workers->count && length >= 0 && (size_t)length < size; i++)
+  {
+    worker_t const *worker = &workers->workers[i];
+    server_t const *server = worker->server;
+    int written = snprintf(buffer + length, size - length, "%s{\"worker\":%u,\"cpu\":%d,\"accepted\":%llu,\"local\":%llu}",
+                           i > 0 ? "," : "", worker->index, worker->cpu,
+                           (unsigned long long)__atomic_load_n(&server->accepted, __ATOMIC_RELAXED),
+                           (unsigned long long)__atomic_load_n(&server->accepted_local, __ATOMIC_RELAXED));
+    length = written < 0 ? written : length + written;
+  }
+  if (length >= 0 && (size_t)length < size)
+  {
+    int written = snprintf(buffer + length, size - length, "]");
+    length = written < 0 ? written : length + written;
+  }
+
+  return length < 0 ? 0 : (size_t)length;
+}
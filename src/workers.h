@@ -0,0 +1,57 @@
+#if !defined(_WORKERS_H_)
+#define _WORKERS_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <uv.h>
+
+#include "server.h"
+#include "socket_options.h"
+
+#define WORKERS_MAX SOCKET_STEER_MAX
+
+typedef struct worker worker_t;
+
+// on the worker's own thread and loop, so everything the loop owns is created there; returns the
+// configured server for workers_start to listen, NULL to fail the start
+typedef server_t *(*worker_setup_f)(worker_t *worker);
+
+struct worker
+{
+  unsigned index;
+  // the core the thread is pinned to, -1 when it isn't
+  int cpu;
+  uv_loop_t loop;
+  uv_thread_t thread;
+  server_t *server;
+  struct workers *_workers;
+  bool _started, _ok;
+};
+
+typedef struct workers
+{
+  unsigned count;
+  int backlog;
+  worker_setup_f setup;
+  // only with every worker pinned, the reuseport groups send a connection to the worker on its core
+  bool steer;
+  int cpus[WORKERS_MAX];
+  uv_sem_t _ready;
+  worker_t *workers;
+} workers_t;
+
+// "0-3,8" into cpus, at most max of them; the number parsed, 0 when list is invalid
+unsigned workers_parse_cpus(char const *list, int *cpus, unsigned max);
+
+// count loops on threads of their own, pinned to cpus when not NULL; each listens before the next
+// starts, so its index is also its place in the port's reuseport groups. NULL when any fails, the
+// ones already running keep running
+workers_t *workers_start(unsigned count, int const *cpus, int backlog, worker_setup_f setup);
+// until every worker's loop has returned
+void workers_join(workers_t *workers);
+
+// accepts per worker and how many arrived on the worker's own core
+size_t workers_format_json(workers_t const *workers, char *buffer, size_t size);
+
+#endif // _WORKERS_H_
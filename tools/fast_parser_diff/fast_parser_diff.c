@@ -0,0 +1,340 @@
+// Runs every request of a corpus through fast_parser_parse and through llhttp, and fails when the fast
+// path takes a head llhttp would refuse or read differently: method, version, target, headers,
+// connection flags and where the message ends. Each request is also tried cut short at every length
+// and with single bytes replaced by ones that tend to matter to a parser.
+//
+//   fast_parser_diff corpus...
+//
+// A corpus has one request per line with \r \n \t \\ and \xHH escapes; lines starting with # and
+// empty lines are skipped. The fast path refusing what llhttp takes is fine, llhttp then parses it.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <llhttp.h>
+
+#include "fast_parser.h"
+
+#define MAX_HEADERS 64
+// mismatches printed in full, the rest are only counted
+#define MAX_REPORTS 20
+#define CONNECTION_FLAGS (F_CONNECTION_KEEP_ALIVE | F_CONNECTION_CLOSE | F_CONNECTION_UPGRADE)
+
+// bytes that separate, end or break the parts of a head
+static unsigned char const _mutations[] = {
+  ' ', '\t', '\r', '\n', '\0', ':', '/', ',', '"', '?', '#', '%', 'a', 'A', '0', 0x7f, 0x80, 0xff};
+
+typedef struct parsed
+{
+  char const *data;
+  bool complete, body, split, overflow;
+  size_t length;
+  fast_span_t url;
+  size_t header_count;
+  fast_header_t headers[MAX_HEADERS];
+} parsed_t;
+
+typedef struct stats
+{
+  size_t runs, fast, fallback, mismatches;
+} stats_t;
+
+static llhttp_settings_t _settings;
+
+// llhttp may hand a field over in pieces, they're contiguous within the one execute
+static void _extend(parsed_t *parsed, fast_span_t *span, char const *at, size_t length)
+{
+  if (span->at == NULL)
+  {
+    span->at = at;
+    span->length = length;
+  }
+  else if (span->at + span->length == at)
+    span->length += length;
+  else
+    parsed->split = true;
+}
+
+static int _url_cb(llhttp_t *parser, char const *at, size_t length)
+{
+  parsed_t *parsed = parser->data;
+  _extend(parsed, &parsed->url, at, length);
+  return 0;
+}
+
+static int _header_field_cb(llhttp_t *parser, char const *at, size_t length)
+{
+  parsed_t *parsed = parser->data;
+  if (parsed->header_count == MAX_HEADERS)
+  {
+    parsed->overflow = true;
+    return 0;
+  }
+  _extend(parsed, &parsed->headers[parsed->header_count].name, at, length);
+  return 0;
+}
+
+static int _header_value_cb(llhttp_t *parser, char const *at, size_t length)
+{
+  parsed_t *parsed = parser->data;
+  if (parsed->header_count < MAX_HEADERS)
+    _extend(parsed, &parsed->headers[parsed->header_count].value, at, length);
+  return 0;
+}
+
+static int _header_value_complete_cb(llhttp_t *parser)
+{
+  parsed_t *parsed = parser->data;
+  if (parsed->header_count < MAX_HEADERS)
+  {
+    // an empty value has no span at all
+    fast_header_t *header = &parsed->headers[parsed->header_count];
+    if (header->value.at == NULL)
+      header->value.at = "";
+    parsed->header_count++;
+  }
+  return 0;
+}
+
+static int _body_cb(llhttp_t *parser, char const *at, size_t length)
+{
+  parsed_t *parsed = parser->data;
+  parsed->body = true;
+  return 0;
+}
+
+// stops at the first message, like the server's fast path takes one head at a time
+static int _complete_cb(llhttp_t *parser)
+{
+  parsed_t *parsed = parser->data;
+  parsed->complete = true;
+  return HPE_PAUSED;
+}
+
+static bool _span_equal(fast_span_t a, fast_span_t b)
+{
+  return a.length == b.length && (a.length == 0 || memcmp(a.at, b.at, a.length) == 0);
+}
+
+static void _print_escaped(FILE *output, char const *data, size_t length)
+{
+  for (size_t i = 0; i < length; i++)
+  {
+    unsigned char c = data[i];
+    if (c == '\r')
+      fputs("\\r", output);
+    else if (c == '\n')
+      fputs("\\n", output);
+    else if (c == '\t')
+      fputs("\\t", output);
+    else if (c == '\\')
+      fputs("\\\\", output);
+    else if (c < 0x20 || c >= 0x7f)
+      fprintf(output, "\\x%02x", c);
+    else
+      fputc(c, output);
+  }
+}
+
+// NULL when both read the head the same, otherwise what differs
+static char const *_compare(fast_request_t const *fast, llhttp_t const *parser, enum llhttp_errno err, parsed_t const *parsed)
+{
+  if (err == HPE_PAUSED_UPGRADE)
+    return "llhttp upgrades";
+  if (err != HPE_PAUSED)
+    return err == HPE_OK ? "llhttp wants more input" : "llhttp refuses it";
+  if (parsed->split || parsed->overflow)
+    return "llhttp result not comparable";
+  if (parsed->length != fast->length)
+    return "message length";
+  if (parsed->body || parser->content_length != 0 || (parser->flags & F_CHUNKED) != 0)
+    return "llhttp reads a body";
+  if (parser->method != fast->method)
+    return "method";
+  if (parser->http_major != 1 || parser->http_minor != fast->http_minor)
+    return "version";
+  if ((parser->flags & CONNECTION_FLAGS) != (fast->flags & CONNECTION_FLAGS))
+    return "connection flags";
+  if (!_span_equal(parsed->url, fast->target))
+    return "target";
+  if (parsed->header_count != fast->header_count)
+    return "header count";
+  for (size_t i = 0; i < fast->header_count; i++)
+  {
+    if (!_span_equal(parsed->headers[i].name, fast->headers[i].name))
+      return "header name";
+    if (!_span_equal(parsed->headers[i].value, fast->headers[i].value))
+      return "header value";
+  }
+
+  return NULL;
+}
+
+static void _run(stats_t *stats, char const *input, size_t length)
+{
+  // an exact copy, so a scanner reading past the end shows up under a sanitizer
+  char *data = malloc(length > 0 ? length : 1);
+  if (data == NULL)
+    return;
+  memcpy(data, input, length);
+
+  stats->runs++;
+  fast_request_t fast;
+  bool taken = fast_parser_parse(data, length, &fast);
+
+  parsed_t parsed;
+  memset(&parsed, 0, sizeof(parsed));
+  parsed.data = data;
+  llhttp_t parser;
+  llhttp_init(&parser, HTTP_REQUEST, &_settings);
+  parser.data = &parsed;
+  enum llhttp_errno err = llhttp_execute(&parser, data, length);
+  if (err == HPE_PAUSED)
+    parsed.length = llhttp_get_error_pos(&parser) - data;
+
+  if (!taken)
+  {
+    if (err == HPE_PAUSED)
+      stats->fallback++;
+    free(data);
+    return;
+  }
+
+  stats->fast++;
+  char const *mismatch = _compare(&fast, &parser, err, &parsed);
+  if (mismatch != NULL && stats->mismatches++ < MAX_REPORTS)
+  {
+    fprintf(stderr, "Mismatch (%s): ", mismatch);
+    _print_escaped(stderr, data, length);
+    fputc('\n', stderr);
+  }
+  free(data);
+}
+
+static void _run_variants(stats_t *stats, char *data, size_t length)
+{
+  _run(stats, data, length);
+
+  for (size_t cut = 0; cut < length; cut++)
+    _run(stats, data, cut);
+
+  for (size_t i = 0; i < length; i++)
+  {
+    char original = data[i];
+    for (size_t m = 0; m < sizeof(_mutations); m++)
+    {
+      if ((char)_mutations[m] == original)
+        continue;
+      data[i] = (char)_mutations[m];
+      _run(stats, data, length);
+    }
+    data[i] = original;
+  }
+}
+
+static int _hex(char c)
+{
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  return -1;
+}
+
+// in place, returns the unescaped length or -1 for a bad escape
+static long _unescape(char *line)
+{
+  char *out = line;
+  for (char *p = line; *p != '\0'; p++)
+  {
+    if (*p != '\\')
+    {
+      *out++ = *p;
+      continue;
+    }
+
+    p++;
+    if (*p == 'r')
+      *out++ = '\r';
+    else if (*p == 'n')
+      *out++ = '\n';
+    else if (*p == 't')
+      *out++ = '\t';
+    else if (*p == '\\')
+      *out++ = '\\';
+    else if (*p == 'x' && _hex(p[1]) >= 0 && _hex(p[2]) >= 0)
+    {
+      *out++ = (char)(_hex(p[1]) << 4 | _hex(p[2]));
+      p += 2;
+    }
+    else
+      return -1;
+  }
+
+  return out - line;
+}
+
+static bool _run_corpus(stats_t *stats, char const *path)
+{
+  FILE *input = fopen(path, "r");
+  if (input == NULL)
+  {
+    fprintf(stderr, "Corpus %s could not be read\n", path);
+    return false;
+  }
+
+  char line[16384];
+  unsigned number = 0;
+  bool ok = true;
+  while (fgets(line, sizeof(line), input) != NULL)
+  {
+    number++;
+    line[strcspn(line, "\n")] = '\0';
+    if (line[0] == '\0' || line[0] == '#')
+      continue;
+
+    long length = _unescape(line);
+    if (length < 0)
+    {
+      fprintf(stderr, "Invalid escape in %s:%u\n", path, number);
+      ok = false;
+      continue;
+    }
+    _run_variants(stats, line, (size_t)length);
+  }
+
+  fclose(input);
+  return ok;
+}
+
+int main(int argc, char const *argv[])
+{
+  if (argc < 2)
+  {
+    fprintf(stderr, "Usage: fast_parser_diff corpus...\n");
+    return 1;
+  }
+
+  fast_parser_init();
+  llhttp_settings_init(&_settings);
+  _settings.on_url = _url_cb;
+  _settings.on_header_field = _header_field_cb;
+  _settings.on_header_value = _header_value_cb;
+  _settings.on_header_value_complete = _header_value_complete_cb;
+  _settings.on_body = _body_cb;
+  _settings.on_message_complete = _complete_cb;
+
+  stats_t stats;
+  memset(&stats, 0, sizeof(stats));
+  bool ok = true;
+  for (int i = 1; i < argc; i++)
+    ok = _run_corpus(&stats, argv[i]) && ok;
+
+  printf("%zu inputs: %zu taken by the fast path, %zu left to llhttp, %zu mismatches\n", stats.runs, stats.fast,
+         stats.fallback, stats.mismatches);
+
+  return ok && stats.mismatches == 0 ? 0 : 1;
+}
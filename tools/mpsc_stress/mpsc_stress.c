@@ -0,0 +1,198 @@
+// Checks the loop mailbox queue: a full queue refuses the push and takes it again once a slot is popped,
+// then producer threads push numbered items through a small queue while this thread pops them. Every
+// item must arrive exactly once, and each producer's items in the order it pushed them.
+//
+//   mpsc_stress [producers [items]]
+
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <uv.h>
+
+#include "collections/mpsc_queue.h"
+
+#define DEFAULT_PRODUCERS 8
+#define DEFAULT_ITEMS 200000
+// small, so producers keep finding it full
+#define STRESS_CAPACITY 64
+#define MAX_PRODUCERS 256
+#define ITEM_BITS 32
+
+typedef struct producer
+{
+  mpsc_queue_t *queue;
+  uv_thread_t thread;
+  uintptr_t index;
+  size_t items;
+  // pushes refused because the queue was full
+  size_t full;
+} producer_t;
+
+// producers done pushing, a lost item then shows as the queue running dry short of the total
+static unsigned _finished;
+
+// the producer in the high bits, its own count from 1 in the low ones, so no item is NULL
+static void *_item(uintptr_t producer, size_t sequence)
+{
+  return (void *)(producer << ITEM_BITS | (uintptr_t)(sequence + 1));
+}
+
+static bool _check(bool condition, char const *what)
+{
+  if (!condition)
+    fprintf(stderr, "Failed: %s\n", what);
+
+  return condition;
+}
+
+static bool _full_queue()
+{
+  bool ok = true;
+  mpsc_queue_t *queue = mpsc_new(5);
+  if (!_check(queue != NULL, "queue allocated"))
+    return false;
+
+  size_t capacity = mpsc_capacity(queue);
+  ok = _check(capacity == 8, "capacity rounded up to a power of two") && ok;
+  ok = _check(mpsc_pop(queue) == NULL, "pop from an empty queue") && ok;
+
+  for (size_t i = 0; i < capacity; i++)
+    ok = _check(mpsc_push(queue, _item(0, i)), "push below capacity") && ok;
+  ok = _check(!mpsc_push(queue, _item(0, capacity)), "push to a full queue refused") && ok;
+
+  // a pop frees exactly one slot
+  ok = _check(mpsc_pop(queue) == _item(0, 0), "pop returns the first push") && ok;
+  ok = _check(mpsc_push(queue, _item(0, capacity)), "push after a pop") && ok;
+  ok = _check(!mpsc_push(queue, _item(0, capacity + 1)), "full again") && ok;
+
+  for (size_t i = 1; i <= capacity; i++)
+    ok = _check(mpsc_pop(queue) == _item(0, i), "pops in push order across the wrap") && ok;
+  ok = _check(mpsc_pop(queue) == NULL, "empty after draining") && ok;
+
+  mpsc_delete(queue);
+
+  return ok;
+}
+
+static void _produce(void *arg)
+{
+  producer_t *producer = arg;
+  for (size_t i = 0; i < producer->items; i++)
+  {
+    while (!mpsc_push(producer->queue, _item(producer->index, i)))
+    {
+      producer->full++;
+      sched_yield();
+    }
+  }
+
+  __atomic_add_fetch(&_finished, 1, __ATOMIC_RELEASE);
+}
+
+static bool _stress(unsigned count, size_t items)
+{
+  mpsc_queue_t *queue = mpsc_new(STRESS_CAPACITY);
+  producer_t *producers = calloc(count, sizeof(producer_t));
+  size_t *next = calloc(count, sizeof(size_t));
+  if (!_check(queue != NULL && producers != NULL && next != NULL, "stress allocated"))
+    return false;
+
+  for (unsigned i = 0; i < count; i++)
+  {
+    producers[i].queue = queue;
+    producers[i].index = i;
+    producers[i].items = items;
+    if (uv_thread_create(&producers[i].thread, _produce, &producers[i]) != 0)
+    {
+      fprintf(stderr, "Producer %u could not be started\n", i);
+      exit(1);
+    }
+  }
+
+  bool ok = true;
+  size_t total = (size_t)count * items, received = 0, empty = 0;
+  while (received < total && ok)
+  {
+    void *data = mpsc_pop(queue);
+    if (data == NULL)
+    {
+      // checked before popping once more, so nothing pushed before the last finish is missed
+      if (__atomic_load_n(&_finished, __ATOMIC_ACQUIRE) == count && (data = mpsc_pop(queue)) == NULL)
+        break;
+    }
+    if (data == NULL)
+    {
+      empty++;
+      sched_yield();
+      continue;
+    }
+
+    uintptr_t value = (uintptr_t)data;
+    uintptr_t index = value >> ITEM_BITS;
+    size_t sequence = (size_t)(value & (((uintptr_t)1 << ITEM_BITS) - 1)) - 1;
+    if (index >= count)
+    {
+      fprintf(stderr, "Failed: item %#lx from no producer\n", (unsigned long)value);
+      ok = false;
+    }
+    else if (sequence != next[index])
+    {
+      // a lost item shows up as a skip, a duplicate as going back
+      fprintf(stderr, "Failed: producer %lu sent %zu next but %zu arrived\n", (unsigned long)index, next[index], sequence);
+      ok = false;
+    }
+    else
+    {
+      next[index]++;
+      received++;
+    }
+  }
+
+  // producers may be waiting on a queue nobody drains anymore
+  if (!ok)
+    exit(1);
+
+  for (unsigned i = 0; i < count; i++)
+  {
+    if (next[i] != items)
+    {
+      fprintf(stderr, "Failed: producer %u sent %zu but %zu arrived\n", i, items, next[i]);
+      ok = false;
+    }
+  }
+
+  for (unsigned i = 0; i < count; i++)
+    uv_thread_join(&producers[i].thread);
+
+  size_t full = 0;
+  for (unsigned i = 0; i < count; i++)
+    full += producers[i].full;
+
+  ok = _check(mpsc_pop(queue) == NULL, "nothing left after every item arrived") && ok;
+  printf("%u producers, %zu items received in order, %zu pushes found it full, %zu pops found it empty\n", count,
+         received, full, empty);
+
+  free(next);
+  free(producers);
+  mpsc_delete(queue);
+
+  return ok;
+}
+
+int main(int argc, char const *argv[])
+{
+  unsigned producers = argc > 1 ? (unsigned)atoi(argv[1]) : DEFAULT_PRODUCERS;
+  size_t items = argc > 2 ? (size_t)atol(argv[2]) : DEFAULT_ITEMS;
+  if (producers == 0 || producers > MAX_PRODUCERS || items == 0 || items >= (size_t)1 << ITEM_BITS)
+  {
+    fprintf(stderr, "Usage: mpsc_stress [producers (1-%u) [items]]\n", MAX_PRODUCERS);
+    return 1;
+  }
+
+  bool ok = _full_queue();
+  ok = _stress(producers, items) && ok;
+
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,72 @@
+// Looks names up in query strings through query_find and checks what it returns, with each name in a
+// buffer of its exact length so a comparison reading past it shows up under a sanitizer.
+//
+//   query_check
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "query.h"
+
+typedef struct query_case
+{
+  char const *url, *name;
+  // the raw value found, NULL when the name must not be found
+  char const *value;
+} query_case_t;
+
+static query_case_t const _cases[] = {
+  {"/?a=1&b=2", "b", "2"},
+  {"/?a=1&a=2", "a", "1"},
+  {"/?a=1", "b", NULL},
+  {"/?a", "a", ""},
+  {"/?&&a=1&", "a", "1"},
+  {"/?a%20b=1", "a b", "1"},
+  {"/?a+b=1", "a b", "1"},
+  {"/?a%2=1", "a%2", "1"},
+  {"/?a=1#b=2", "b", NULL},
+  {"/?ab=1", "abc", NULL},
+  {"/?abc=1", "ab", NULL},
+  // a raw key with a longer plain run than the name before its first escape
+  {"/?abcdefghijklmnopqrstuvwxyz%20=1", "ab", NULL},
+  {"/?abcdefghijklmnopqrstuvwxyz%20=1", "abcdefghijklmnopqrstuvwxyz ", "1"},
+  {"/?abcdefghijklmnopqrstuvwxyz+x=1", "abc", NULL},
+};
+
+static bool _run(query_case_t const *test)
+{
+  size_t length = strlen(test->name);
+  char *name = malloc(length > 0 ? length : 1);
+  if (name == NULL)
+    return false;
+  memcpy(name, test->name, length);
+
+  query_t query;
+  query_reset(&query);
+  query_parse(&query, test->url, strlen(test->url));
+  query_param_t param;
+  bool found = query_find(&query, name, length, &param);
+  free(name);
+
+  bool ok = test->value == NULL ? !found
+                                : found && param.value_length == strlen(test->value) &&
+                                    memcmp(param.value, test->value, param.value_length) == 0;
+  if (!ok)
+    fprintf(stderr, "Failed: %s looking up %s\n", test->url, test->name);
+
+  return ok;
+}
+
+int main()
+{
+  query_init();
+
+  size_t failed = 0, count = sizeof(_cases) / sizeof(_cases[0]);
+  for (size_t i = 0; i < count; i++)
+    failed += !_run(&_cases[i]);
+
+  printf("%zu lookups, %zu failed\n", count, failed);
+
+  return failed == 0 ? 0 : 1;
+}
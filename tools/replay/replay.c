@@ -0,0 +1,1021 @@
+// Replays what CAPTURE_FILE recorded: the bytes each client sent, over loopback to a running server or
+// with --direct into this process's own copy of the request path, with no sockets at all. Reports
+// throughput and the latency of each request, from its last byte sent to its response's last byte.
+//
+//   replay [--direct [--llhttp]] [--target host:port | --unix path] [--fast [--concurrency N]]
+//          [--timeout ms] capture...
+//
+// Without --fast every connection opens and sends at the offsets it was recorded at; with it each
+// connection sends its next bytes once the responses to what it sent have arrived, up to N at a time.
+// The files a server's workers record are replayed together, lined up on the wall clock.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <llhttp.h>
+#include <mimalloc.h>
+#include <uv.h>
+
+#include "capture.h"
+#include "collections/dlist.h"
+#include "connection.h"
+#include "loop.h"
+#include "request.h"
+#include "response.h"
+#include "server.h"
+
+#define DEFAULT_HOST "127.0.0.1"
+#define DEFAULT_PORT 3000
+#define DEFAULT_CONCURRENCY 64
+// nothing heard for this long once everything was sent, what's still open is given up on
+#define DEFAULT_TIMEOUT_MS 5000
+#define STALL_CHECK_MS 100
+#define NS_PER_MS 1000000ULL
+
+typedef struct event
+{
+  // ns since the earliest of the files started recording
+  uint64_t at;
+  size_t sequence;
+  size_t connection;
+  capture_record_t type;
+  char *data;
+  size_t length;
+} event_t;
+
+typedef struct pending
+{
+  uint64_t sent_at;
+  bool head;
+} pending_t;
+
+typedef struct replay replay_t;
+
+typedef struct replay_connection
+{
+  replay_t *replay;
+  // its events in the order they were recorded, released ones are due to be sent
+  size_t *events;
+  size_t event_count, next, released;
+  // the client's socket, or with --direct the server's end of the in-memory connection
+  connection_t *connection;
+  // the requests' ends tell when each was sent, the responses' when each was answered
+  llhttp_t request_parser, response_parser;
+  bool requests_done, responses_done;
+  // sent and waiting for their responses, oldest first
+  pending_t *pending;
+  size_t pending_head, pending_count, pending_capacity;
+  bool started, connected, closing, finished;
+} replay_connection_t;
+
+struct replay
+{
+  uv_loop_t *loop;
+  bool direct, fast;
+  struct sockaddr_storage addr;
+  char const *unix_path;
+  unsigned concurrency;
+  uint64_t timeout_ns;
+
+  event_t *events;
+  size_t event_count, event_capacity;
+  replay_connection_t *connections;
+  size_t connection_count;
+  // each connection's events are a slice of indices
+  size_t *indices;
+  // --fast starts connections in the order they were accepted
+  size_t *order;
+  size_t next_start, active, finished;
+  size_t cursor;
+
+  server_t *server;
+  // in-memory connections with reads to deliver, writes to complete or a close to finish
+  dlist_t woken;
+  uv_idle_t wake_idle;
+  uv_timer_t tick, stall;
+
+  uint64_t started_at, ended_at, last_progress;
+  uint64_t sent, received, completed, failed, errors, invalid;
+  uint64_t statuses[6];
+  uint64_t *latencies;
+  size_t latency_count, latency_capacity;
+};
+
+static llhttp_settings_t _request_settings, _response_settings;
+
+static void _pump(replay_connection_t *conn);
+static void _check_done(replay_t *replay);
+
+// loading
+
+static bool _grow(void **items, size_t *capacity, size_t needed, size_t size)
+{
+  if (needed <= *capacity)
+    return true;
+
+  size_t grown = *capacity > 0 ? *capacity * 2 : 1024;
+  while (grown < needed)
+    grown *= 2;
+
+  void *resized = mi_realloc(*items, grown * size);
+  if (resized == NULL)
+    return false;
+
+  *items = resized;
+  *capacity = grown;
+
+  return true;
+}
+
+static char *_read_file(char const *path, size_t *size)
+{
+  FILE *file = fopen(path, "rb");
+  if (file == NULL)
+    return NULL;
+
+  char *data = NULL;
+  long length;
+  if (fseek(file, 0, SEEK_END) == 0 && (length = ftell(file)) >= 0 && fseek(file, 0, SEEK_SET) == 0 &&
+      (data = mi_malloc(length > 0 ? length : 1)) != NULL && fread(data, 1, length, file) != (size_t)length)
+  {
+    mi_free(data);
+    data = NULL;
+  }
+  fclose(file);
+
+  *size = data != NULL ? (size_t)length : 0;
+  return data;
+}
+
+// the file stays loaded for the run, events point into it; connections are numbered from base on
+static bool _load(replay_t *replay, char *data, size_t size, size_t base, uint64_t offset)
+{
+  uint8_t const *cursor = (uint8_t const *)data + CAPTURE_HEADER_SIZE;
+  uint8_t const *end = (uint8_t const *)data + size;
+  uint64_t at = offset;
+
+  while (cursor < end)
+  {
+    uint8_t type = *cursor++;
+    uint64_t connection, delta, length = 0;
+    size_t read;
+    if ((read = capture_varint_read(cursor, end, &connection)) == 0 || connection == 0)
+      return false;
+    cursor += read;
+    if ((read = capture_varint_read(cursor, end, &delta)) == 0)
+      return false;
+    cursor += read;
+    if (type == CAPTURE_DATA)
+    {
+      if ((read = capture_varint_read(cursor, end, &length)) == 0 || length > (uint64_t)(end - cursor - read))
+        return false;
+      cursor += read;
+    }
+    else if (type < CAPTURE_ACCEPT || type > CAPTURE_CLOSE)
+    {
+      return false;
+    }
+
+    if (!_grow((void **)&replay->events, &replay->event_capacity, replay->event_count + 1, sizeof(event_t)))
+      return false;
+
+    at += delta;
+    event_t *event = &replay->events[replay->event_count];
+    event->at = at;
+    event->sequence = replay->event_count++;
+    event->connection = base + connection - 1;
+    event->type = type;
+    event->data = (char *)cursor;
+    event->length = length;
+    cursor += length;
+
+    if (event->connection >= replay->connection_count)
+      replay->connection_count = event->connection + 1;
+  }
+
+  return true;
+}
+
+static int _compare_events(void const *a, void const *b)
+{
+  event_t const *left = a, *right = b;
+  if (left->at != right->at)
+    return left->at < right->at ? -1 : 1;
+
+  return left->sequence < right->sequence ? -1 : left->sequence > right->sequence;
+}
+
+static bool _index(replay_t *replay)
+{
+  qsort(replay->events, replay->event_count, sizeof(event_t), _compare_events);
+
+  replay->connections = mi_calloc(replay->connection_count > 0 ? replay->connection_count : 1, sizeof(replay_connection_t));
+  replay->indices = mi_mallocn(replay->event_count > 0 ? replay->event_count : 1, sizeof(size_t));
+  replay->order = mi_mallocn(replay->connection_count > 0 ? replay->connection_count : 1, sizeof(size_t));
+  if (replay->connections == NULL || replay->indices == NULL || replay->order == NULL)
+    return false;
+
+  for (size_t i = 0; i < replay->event_count; i++)
+    replay->connections[replay->events[i].connection].event_count++;
+
+  // one array sliced per connection, each slice in the global order; connections in the order they start
+  size_t offset = 0, started = 0;
+  for (size_t i = 0; i < replay->connection_count; i++)
+  {
+    replay_connection_t *conn = &replay->connections[i];
+    conn->replay = replay;
+    conn->events = replay->indices + offset;
+    offset += conn->event_count;
+    conn->event_count = 0;
+  }
+  for (size_t i = 0; i < replay->event_count; i++)
+  {
+    replay_connection_t *conn = &replay->connections[replay->events[i].connection];
+    if (conn->event_count == 0)
+      replay->order[started++] = replay->events[i].connection;
+    conn->events[conn->event_count++] = i;
+  }
+
+  // numbers a partial file never got to have nothing to replay
+  for (size_t i = 0; i < replay->connection_count; i++)
+  {
+    if (replay->connections[i].event_count == 0)
+    {
+      replay->connections[i].finished = true;
+      replay->finished++;
+      replay->order[started++] = i;
+    }
+  }
+
+  return true;
+}
+
+// the in-memory transport of --direct, the server reads what the client sends without a socket
+
+typedef struct inbound
+{
+  struct inbound *next;
+  // NULL for the client's end of stream
+  char *data;
+  size_t length;
+} inbound_t;
+
+typedef struct memory_connection
+{
+  connection_t connection;
+  replay_t *replay;
+  replay_connection_t *client;
+  inbound_t *inbound, *inbound_tail;
+  // written and parsed by the client, their callbacks still to come
+  connection_write_t *written, *written_tail;
+  dlist_node_t wake_node;
+  bool reading, closed;
+} memory_connection_t;
+
+#define MEMORY_CONNECTION(connection) ((memory_connection_t *)(connection))
+
+static void _wake_cb(uv_idle_t *idle);
+static void _client_received(replay_connection_t *conn, char const *data, size_t length);
+static void _client_closed(replay_connection_t *conn);
+
+static void _wake(memory_connection_t *memory)
+{
+  replay_t *replay = memory->replay;
+  if (dl_linked(&memory->wake_node))
+    return;
+
+  if (replay->woken.length == 0)
+    uv_idle_start(&replay->wake_idle, _wake_cb);
+  dl_push_back(&replay->woken, &memory->wake_node);
+}
+
+static int _memory_read_start(connection_t *connection)
+{
+  MEMORY_CONNECTION(connection)->reading = true;
+  _wake(MEMORY_CONNECTION(connection));
+
+  return 0;
+}
+
+static void _memory_read_stop(connection_t *connection)
+{
+  MEMORY_CONNECTION(connection)->reading = false;
+}
+
+static int _memory_write(connection_t *connection, connection_write_t *write, uv_buf_t const bufs[], unsigned nbufs)
+{
+  memory_connection_t *memory = MEMORY_CONNECTION(connection);
+  for (unsigned i = 0; i < nbufs && memory->client != NULL; i++)
+    _client_received(memory->client, bufs[i].base, bufs[i].len);
+
+  // completed from a later loop phase, like a socket's
+  write->_next = NULL;
+  if (memory->written_tail != NULL)
+    memory->written_tail->_next = write;
+  else
+    memory->written = write;
+  memory->written_tail = write;
+  _wake(memory);
+
+  return 0;
+}
+
+static void _memory_close(connection_t *connection)
+{
+  MEMORY_CONNECTION(connection)->closed = true;
+  _wake(MEMORY_CONNECTION(connection));
+}
+
+static int _memory_getpeername(connection_t *connection, struct sockaddr *name, int *namelen)
+{
+  return UV_ENOTSUP;
+}
+
+static int _memory_fileno(connection_t *connection, uv_os_sock_t *fd)
+{
+  return UV_ENOTSUP;
+}
+
+static connection_transport_t const _memory_transport = {
+  .read_start = _memory_read_start,
+  .read_stop = _memory_read_stop,
+  .write = _memory_write,
+  .close = _memory_close,
+  .getpeername = _memory_getpeername,
+  .fileno = _memory_fileno,
+};
+
+static bool _memory_send(memory_connection_t *memory, char *data, size_t length)
+{
+  inbound_t *inbound = mi_malloc(sizeof(inbound_t));
+  if (inbound == NULL)
+    return false;
+
+  inbound->next = NULL;
+  inbound->data = data;
+  inbound->length = length;
+  if (memory->inbound_tail != NULL)
+    memory->inbound_tail->next = inbound;
+  else
+    memory->inbound = inbound;
+  memory->inbound_tail = inbound;
+  _wake(memory);
+
+  return true;
+}
+
+static void _memory_delete(memory_connection_t *memory)
+{
+  // a write callback that closed it woke it again
+  if (dl_linked(&memory->wake_node))
+    dl_remove(&memory->replay->woken, &memory->wake_node);
+  if (memory->connection._close_cb != NULL)
+    memory->connection._close_cb(&memory->connection);
+
+  while (memory->inbound != NULL)
+  {
+    inbound_t *next = memory->inbound->next;
+    mi_free(memory->inbound);
+    memory->inbound = next;
+  }
+
+  replay_connection_t *client = memory->client;
+  mi_free(memory);
+  if (client != NULL)
+  {
+    client->connection = NULL;
+    _client_closed(client);
+  }
+}
+
+static void _memory_run(memory_connection_t *memory)
+{
+  // a completed response may resume reading
+  connection_write_t *write;
+  while ((write = memory->written) != NULL)
+  {
+    memory->written = write->_next;
+    if (memory->written == NULL)
+      memory->written_tail = NULL;
+    write->_cb(write, 0);
+  }
+
+  if (memory->closed)
+  {
+    _memory_delete(memory);
+    return;
+  }
+
+  while (memory->reading && !memory->closed && memory->inbound != NULL)
+  {
+    inbound_t *inbound = memory->inbound;
+    memory->inbound = inbound->next;
+    if (memory->inbound == NULL)
+      memory->inbound_tail = NULL;
+
+    if (inbound->data != NULL)
+      memory->connection._read_cb(&memory->connection, inbound->length, inbound->data);
+    else
+      memory->connection._read_cb(&memory->connection, UV_EOF, NULL);
+    mi_free(inbound);
+  }
+
+  if (memory->written != NULL || memory->closed || (memory->reading && memory->inbound != NULL))
+    _wake(memory);
+}
+
+// each woken connection once per iteration, the ones woken meanwhile wait for the next
+static void _wake_cb(uv_idle_t *idle)
+{
+  replay_t *replay = idle->data;
+
+  size_t count = replay->woken.length;
+  dlist_node_t *node;
+  while (count-- > 0 && (node = dl_front(&replay->woken)) != NULL)
+  {
+    dl_remove(&replay->woken, node);
+    _memory_run(DLIST_ENTRY(node, memory_connection_t, wake_node));
+  }
+
+  if (replay->woken.length == 0)
+    uv_idle_stop(idle);
+}
+
+static int _handler(request_t *req)
+{
+  static char const body[] = "{\"status\":\"ok\"}";
+
+  response_t res;
+  response_init(&res, req, 200);
+  response_header(&res, "Content-Type", "application/json");
+
+  return response_send(&res, body, sizeof(body) - 1) ? 0 : -1;
+}
+
+// the client side
+
+static void _record_latency(replay_t *replay, uint64_t latency)
+{
+  if (!_grow((void **)&replay->latencies, &replay->latency_capacity, replay->latency_count + 1, sizeof(uint64_t)))
+    return;
+
+  replay->latencies[replay->latency_count++] = latency;
+}
+
+static int _request_complete_cb(llhttp_t *parser)
+{
+  replay_connection_t *conn = parser->data;
+  if (!_grow((void **)&conn->pending, &conn->pending_capacity, conn->pending_count + 1, sizeof(pending_t)))
+    return -1;
+
+  // a ring, unwrapped into the grown space when it had wrapped
+  if (conn->pending_head + conn->pending_count > conn->pending_capacity / 2 && conn->pending_head > 0)
+  {
+    memmove(conn->pending, conn->pending + conn->pending_head, conn->pending_count * sizeof(pending_t));
+    conn->pending_head = 0;
+  }
+
+  pending_t *pending = &conn->pending[conn->pending_head + conn->pending_count++];
+  pending->sent_at = uv_hrtime();
+  pending->head = llhttp_get_method(parser) == HTTP_HEAD;
+
+  return 0;
+}
+
+static int _response_headers_cb(llhttp_t *parser)
+{
+  replay_connection_t *conn = parser->data;
+
+  // a response to HEAD says how long its body would be without sending one
+  return conn->pending_count > 0 && conn->pending[conn->pending_head].head ? 1 : 0;
+}
+
+static int _response_complete_cb(llhttp_t *parser)
+{
+  replay_connection_t *conn = parser->data;
+  replay_t *replay = conn->replay;
+  int status = llhttp_get_status_code(parser);
+
+  // interim responses come ahead of the one that answers
+  if (status >= 100 && status < 200 && status != 101)
+    return 0;
+
+  replay->statuses[status >= 100 && status < 600 ? status / 100 : 0]++;
+  if (conn->pending_count == 0)
+    return 0;
+
+  _record_latency(replay, uv_hrtime() - conn->pending[conn->pending_head].sent_at);
+  conn->pending_head = --conn->pending_count > 0 ? conn->pending_head + 1 : 0;
+  replay->completed++;
+
+  return 0;
+}
+
+static void _client_received(replay_connection_t *conn, char const *data, size_t length)
+{
+  replay_t *replay = conn->replay;
+  replay->received += length;
+  replay->last_progress = uv_hrtime();
+
+  if (!conn->responses_done)
+  {
+    enum llhttp_errno err = llhttp_execute(&conn->response_parser, data, length);
+    // frames after a switch of protocols aren't counted
+    if (err == HPE_PAUSED_UPGRADE)
+    {
+      conn->responses_done = true;
+    }
+    else if (err != HPE_OK)
+    {
+      conn->responses_done = true;
+      replay->invalid++;
+    }
+  }
+
+  _pump(conn);
+}
+
+static void _client_closed(replay_connection_t *conn)
+{
+  replay_t *replay = conn->replay;
+  if (conn->finished)
+    return;
+
+  conn->finished = true;
+  replay->failed += conn->pending_count;
+  conn->pending_count = 0;
+  mi_free(conn->pending);
+  conn->pending = NULL;
+  replay->active--;
+  replay->finished++;
+  replay->last_progress = uv_hrtime();
+
+  _check_done(replay);
+}
+
+static void _client_close_cb(connection_t *connection)
+{
+  replay_connection_t *conn = connection->data;
+
+  conn->connection = NULL;
+  _client_closed(conn);
+}
+
+static void _client_read_cb(connection_t *connection, ssize_t nread, char const *data)
+{
+  if (nread > 0)
+    _client_received(connection->data, data, nread);
+  else if (nread < 0)
+    connection_close(connection, _client_close_cb);
+}
+
+static void _client_write_cb(connection_write_t *write, int status)
+{
+  mi_free(write);
+}
+
+static void _connect_cb(connection_t *connection, int status)
+{
+  replay_connection_t *conn = connection->data;
+
+  if (status < 0)
+  {
+    if (status != UV_ECANCELED)
+    {
+      fprintf(stderr, "Connect error %s\n", uv_strerror(status));
+      conn->replay->errors++;
+    }
+    connection_close(connection, _client_close_cb);
+    return;
+  }
+
+  conn->connected = true;
+  connection_read_start(connection, _client_read_cb);
+  _pump(conn);
+}
+
+static void _start(replay_connection_t *conn)
+{
+  replay_t *replay = conn->replay;
+
+  conn->started = true;
+  replay->active++;
+  replay->last_progress = uv_hrtime();
+  llhttp_init(&conn->request_parser, HTTP_REQUEST, &_request_settings);
+  conn->request_parser.data = conn;
+  llhttp_init(&conn->response_parser, HTTP_RESPONSE, &_response_settings);
+  conn->response_parser.data = conn;
+
+  if (replay->direct)
+  {
+    memory_connection_t *memory = mi_zalloc(sizeof(memory_connection_t));
+    if (memory == NULL)
+    {
+      replay->errors++;
+      _client_closed(conn);
+      return;
+    }
+
+    connection_init(&memory->connection, &_memory_transport, replay->loop);
+    memory->replay = replay;
+    memory->client = conn;
+    conn->connection = &memory->connection;
+    conn->connected = true;
+    server_connection_open(replay->server, &memory->connection);
+    return;
+  }
+
+  conn->connection = replay->unix_path != NULL
+                       ? connection_connect_pipe(replay->loop, replay->unix_path, conn, _connect_cb)
+                       : connection_connect_tcp(replay->loop, (struct sockaddr const *)&replay->addr, conn, _connect_cb);
+  if (conn->connection == NULL)
+  {
+    replay->errors++;
+    _client_closed(conn);
+  }
+}
+
+static void _send(replay_connection_t *conn, event_t const *event)
+{
+  replay_t *replay = conn->replay;
+
+  // after an upgrade or a request it can't parse the rest can't be told apart, it's sent uncounted
+  if (!conn->requests_done)
+  {
+    enum llhttp_errno err = llhttp_execute(&conn->request_parser, event->data, event->length);
+    if (err != HPE_OK)
+      conn->requests_done = true;
+  }
+
+  replay->sent += event->length;
+  replay->last_progress = uv_hrtime();
+
+  if (replay->direct)
+  {
+    if (!_memory_send(MEMORY_CONNECTION(conn->connection), event->data, event->length))
+      replay->errors++;
+    return;
+  }
+
+  connection_write_t *write = mi_malloc(sizeof(connection_write_t));
+  uv_buf_t buf = uv_buf_init(event->data, event->length);
+  if (write == NULL || connection_write(conn->connection, write, &buf, 1, _client_write_cb) != 0)
+  {
+    mi_free(write);
+    replay->errors++;
+    connection_close(conn->connection, _client_close_cb);
+  }
+}
+
+static void _close(replay_connection_t *conn)
+{
+  if (conn->closing || conn->connection == NULL)
+    return;
+
+  conn->closing = true;
+  if (!conn->replay->direct)
+  {
+    connection_close(conn->connection, _client_close_cb);
+    return;
+  }
+
+  // the server sees the end of the stream and closes its end, which finishes the client
+  memory_connection_t *memory = MEMORY_CONNECTION(conn->connection);
+  if (!memory->closed && !_memory_send(memory, NULL, 0))
+    conn->replay->errors++;
+}
+
+static void _pump(replay_connection_t *conn)
+{
+  replay_t *replay = conn->replay;
+
+  while (!conn->finished && conn->next < conn->released)
+  {
+    event_t const *event = &replay->events[conn->events[conn->next]];
+    if (event->type == CAPTURE_ACCEPT)
+    {
+      conn->next++;
+      if (!conn->started)
+        _start(conn);
+      continue;
+    }
+
+    // --fast waits for the answers to what was sent, the way the client must have
+    if (!conn->connected || conn->closing || (replay->fast && conn->pending_count > 0))
+      return;
+
+    if (event->type == CAPTURE_DATA)
+    {
+      conn->next++;
+      _send(conn, event);
+      continue;
+    }
+
+    // the client was done, it still reads what it's owed
+    if (conn->pending_count > 0)
+      return;
+    conn->next = conn->event_count;
+  }
+
+  // what the capture doesn't see ending goes once it has its answers
+  if (!conn->finished && conn->connected && conn->next == conn->event_count && conn->pending_count == 0)
+    _close(conn);
+}
+
+// pacing
+
+static void _start_more(replay_t *replay)
+{
+  while (replay->active < replay->concurrency && replay->next_start < replay->connection_count)
+  {
+    replay_connection_t *conn = &replay->connections[replay->order[replay->next_start++]];
+    conn->released = conn->event_count;
+    _pump(conn);
+  }
+}
+
+static void _tick_cb(uv_timer_t *timer)
+{
+  replay_t *replay = timer->data;
+  uint64_t elapsed = uv_hrtime() - replay->started_at;
+
+  while (replay->cursor < replay->event_count && replay->events[replay->cursor].at <= elapsed)
+  {
+    replay_connection_t *conn = &replay->connections[replay->events[replay->cursor++].connection];
+    conn->released++;
+    _pump(conn);
+  }
+
+  if (replay->cursor < replay->event_count)
+  {
+    uint64_t wait = replay->events[replay->cursor].at - elapsed;
+    uv_timer_start(timer, _tick_cb, (wait + NS_PER_MS - 1) / NS_PER_MS, 0);
+  }
+}
+
+// what never gets its answer, an event stream say, is closed once nothing has moved for the timeout;
+// paced, not before the last event is due, --fast moves only on answers
+static void _stall_cb(uv_timer_t *timer)
+{
+  replay_t *replay = timer->data;
+  if ((!replay->fast && replay->cursor < replay->event_count) ||
+      uv_hrtime() - replay->last_progress < replay->timeout_ns)
+    return;
+
+  for (size_t i = 0; i < replay->connection_count; i++)
+  {
+    replay_connection_t *conn = &replay->connections[i];
+    if (conn->started && !conn->finished && !replay->direct)
+      connection_close(conn->connection, _client_close_cb);
+  }
+  if (replay->direct)
+    server_close_connections(replay->server);
+  replay->last_progress = uv_hrtime();
+}
+
+static void _check_done(replay_t *replay)
+{
+  if (replay->fast)
+    _start_more(replay);
+
+  if (replay->finished < replay->connection_count || replay->ended_at != 0)
+    return;
+
+  replay->ended_at = uv_hrtime();
+  uv_close((uv_handle_t *)&replay->tick, NULL);
+  uv_close((uv_handle_t *)&replay->stall, NULL);
+  uv_close((uv_handle_t *)&replay->wake_idle, NULL);
+}
+
+// reporting
+
+static int _compare_latencies(void const *a, void const *b)
+{
+  uint64_t left = *(uint64_t const *)a, right = *(uint64_t const *)b;
+
+  return left < right ? -1 : left > right;
+}
+
+static double _percentile_us(replay_t const *replay, double percentile)
+{
+  if (replay->latency_count == 0)
+    return 0;
+
+  size_t index = (size_t)(percentile * (replay->latency_count - 1) + 0.5);
+  return replay->latencies[index] / 1000.0;
+}
+
+static void _report(replay_t *replay)
+{
+  qsort(replay->latencies, replay->latency_count, sizeof(uint64_t), _compare_latencies);
+
+  double seconds = (replay->ended_at - replay->started_at) / 1e9;
+  if (seconds <= 0)
+    seconds = 1e-9;
+
+  printf("mode: %s, %s\n", replay->direct ? "direct" : "network", replay->fast ? "fast" : "paced");
+  printf("connections: %zu, errors: %llu\n", replay->connection_count, (unsigned long long)replay->errors);
+  printf("duration: %.3f s\n", seconds);
+  printf("requests: %llu completed, %llu unanswered, %.1f/s\n", (unsigned long long)replay->completed,
+         (unsigned long long)replay->failed, replay->completed / seconds);
+  printf("responses: 1xx %llu, 2xx %llu, 3xx %llu, 4xx %llu, 5xx %llu, unparsable %llu\n",
+         (unsigned long long)replay->statuses[1], (unsigned long long)replay->statuses[2],
+         (unsigned long long)replay->statuses[3], (unsigned long long)replay->statuses[4],
+         (unsigned long long)replay->statuses[5], (unsigned long long)replay->invalid);
+  printf("bytes: %llu sent (%.2f MiB/s), %llu received (%.2f MiB/s)\n", (unsigned long long)replay->sent,
+         replay->sent / seconds / (1024 * 1024), (unsigned long long)replay->received,
+         replay->received / seconds / (1024 * 1024));
+  printf("latency (us): p50 %.1f, p90 %.1f, p99 %.1f, p99.9 %.1f, max %.1f\n", _percentile_us(replay, 0.5),
+         _percentile_us(replay, 0.9), _percentile_us(replay, 0.99), _percentile_us(replay, 0.999),
+         _percentile_us(replay, 1.0));
+}
+
+// setup
+
+static bool _parse_target(replay_t *replay, char const *target)
+{
+  char host[256];
+  char const *port = strrchr(target, ':');
+  if (port == NULL || (size_t)(port - target) >= sizeof(host))
+    return false;
+
+  // [::1]:3000
+  size_t length = port - target;
+  char const *start = target;
+  if (*start == '[' && length >= 2 && port[-1] == ']')
+  {
+    start++;
+    length -= 2;
+  }
+  snprintf(host, sizeof(host), "%.*s", (int)length, start);
+
+  return uv_ip4_addr(host, atoi(port + 1), (struct sockaddr_in *)&replay->addr) == 0 ||
+         uv_ip6_addr(host, atoi(port + 1), (struct sockaddr_in6 *)&replay->addr) == 0;
+}
+
+static void _usage(void)
+{
+  fprintf(stderr, "usage: replay [--direct [--llhttp]] [--target host:port | --unix path] [--fast [--concurrency N]]\n"
+                  "              [--timeout ms] capture...\n");
+}
+
+static bool _setup_direct(replay_t *replay, bool llhttp_only)
+{
+  init_request();
+  if (llhttp_only)
+    request_set_fast_path(false);
+
+  replay->server = server_new(_handler, replay->loop);
+  if (replay->server == NULL)
+    return false;
+
+  // what's measured is the request path, a busy replay shouldn't be shed like an overloaded server
+  overload_options_t overload = {.retry_after = OVERLOAD_DEFAULT_RETRY_AFTER};
+  server_set_overload(replay->server, 0, &overload);
+
+  return true;
+}
+
+int main(int argc, char const *argv[])
+{
+  uv_replace_allocator(mi_malloc, mi_realloc, mi_calloc, mi_free);
+
+  replay_t replay;
+  memset(&replay, 0, sizeof(replay));
+  replay.loop = uv_default_loop();
+  replay.concurrency = DEFAULT_CONCURRENCY;
+  replay.timeout_ns = DEFAULT_TIMEOUT_MS * NS_PER_MS;
+  uv_ip4_addr(DEFAULT_HOST, DEFAULT_PORT, (struct sockaddr_in *)&replay.addr);
+
+  bool llhttp_only = false;
+  int first_file = argc;
+  for (int i = 1; i < argc; i++)
+  {
+    bool has_value = i + 1 < argc;
+    if (strcmp(argv[i], "--direct") == 0)
+      replay.direct = true;
+    else if (strcmp(argv[i], "--llhttp") == 0)
+      llhttp_only = true;
+    else if (strcmp(argv[i], "--fast") == 0)
+      replay.fast = true;
+    else if (strcmp(argv[i], "--target") == 0 && has_value)
+    {
+      if (!_parse_target(&replay, argv[++i]))
+      {
+        fprintf(stderr, "Invalid target %s\n", argv[i]);
+        return 1;
+      }
+    }
+    else if (strcmp(argv[i], "--unix") == 0 && has_value)
+      replay.unix_path = argv[++i];
+    else if (strcmp(argv[i], "--concurrency") == 0 && has_value)
+      replay.concurrency = (unsigned)atoi(argv[++i]);
+    else if (strcmp(argv[i], "--timeout") == 0 && has_value)
+      replay.timeout_ns = (uint64_t)atol(argv[++i]) * NS_PER_MS;
+    else if (argv[i][0] == '-')
+    {
+      _usage();
+      return 1;
+    }
+    else
+    {
+      first_file = i;
+      break;
+    }
+  }
+  if (first_file == argc || replay.concurrency == 0)
+  {
+    _usage();
+    return 1;
+  }
+
+  // the wall clock each file started at puts the workers' files on one timeline
+  size_t file_count = argc - first_file;
+  char **files = mi_calloc(file_count, sizeof(char *));
+  size_t *sizes = mi_calloc(file_count, sizeof(size_t));
+  uint64_t *started = mi_calloc(file_count, sizeof(uint64_t));
+  uint64_t earliest = UINT64_MAX;
+  for (size_t i = 0; i < file_count; i++)
+  {
+    char const *path = argv[first_file + i];
+    uint32_t version = 0;
+    files[i] = _read_file(path, &sizes[i]);
+    if (files[i] != NULL && sizes[i] >= CAPTURE_HEADER_SIZE)
+    {
+      memcpy(&version, files[i] + 4, sizeof(uint32_t));
+      memcpy(&started[i], files[i] + 8, sizeof(uint64_t));
+    }
+    if (files[i] == NULL || sizes[i] < CAPTURE_HEADER_SIZE || memcmp(files[i], CAPTURE_MAGIC, 4) != 0 ||
+        version != CAPTURE_VERSION)
+    {
+      fprintf(stderr, "Not a capture file %s\n", path);
+      return 1;
+    }
+    if (started[i] < earliest)
+      earliest = started[i];
+  }
+  for (size_t i = 0; i < file_count; i++)
+  {
+    if (!_load(&replay, files[i], sizes[i], replay.connection_count, started[i] - earliest))
+      fprintf(stderr, "Capture %s ends in a partial record, replaying what came before\n", argv[first_file + i]);
+  }
+
+  if (!_index(&replay))
+  {
+    fprintf(stderr, "Allocation error\n");
+    return 1;
+  }
+  printf("replaying %zu connections, %zu events from %zu files\n", replay.connection_count, replay.event_count, file_count);
+
+  _request_settings.on_message_complete = _request_complete_cb;
+  _response_settings.on_headers_complete = _response_headers_cb;
+  _response_settings.on_message_complete = _response_complete_cb;
+
+  if (replay.direct && !_setup_direct(&replay, llhttp_only))
+  {
+    fprintf(stderr, "Allocation error\n");
+    return 1;
+  }
+
+  dl_init(&replay.woken);
+  uv_idle_init(replay.loop, &replay.wake_idle);
+  replay.wake_idle.data = &replay;
+  uv_timer_init(replay.loop, &replay.tick);
+  replay.tick.data = &replay;
+  uv_timer_init(replay.loop, &replay.stall);
+  replay.stall.data = &replay;
+  uv_timer_start(&replay.stall, _stall_cb, STALL_CHECK_MS, STALL_CHECK_MS);
+
+  replay.started_at = uv_hrtime();
+  replay.last_progress = replay.started_at;
+  if (replay.fast)
+    _start_more(&replay);
+  else
+    _tick_cb(&replay.tick);
+  _check_done(&replay);
+
+  uv_run(replay.loop, UV_RUN_DEFAULT);
+
+  if (replay.direct)
+  {
+    server_destroy(replay.server);
+    loop_context_delete(replay.loop);
+    uv_run(replay.loop, UV_RUN_DEFAULT);
+  }
+
+  _report(&replay);
+
+  mi_free(replay.latencies);
+  mi_free(replay.indices);
+  mi_free(replay.connections);
+  mi_free(replay.order);
+  mi_free(replay.events);
+  for (size_t i = 0; i < file_count; i++)
+    mi_free(files[i]);
+  mi_free(files);
+  mi_free(sizes);
+  mi_free(started);
+
+  return replay.failed > 0 || replay.errors > 0 ? 2 : 0;
+}